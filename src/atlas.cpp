@@ -0,0 +1,81 @@
+//
+// Created by Grant on 2019-08-27.
+//
+
+#include "atlas.h"
+
+bool packShelves(std::vector<AtlasRect> &rects, int pageWidth, int pageHeight, int padding, int maxPages) {
+    std::vector<size_t> order(rects.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+        rects[i].page = -1;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return rects[a].height > rects[b].height;
+    });
+
+    int page = 0;
+    int shelfX = 0, shelfY = 0, shelfHeight = 0;
+    for (size_t i : order) {
+        AtlasRect &rect = rects[i];
+        int w = rect.width + padding * 2;
+        int h = rect.height + padding * 2;
+        if (w > pageWidth || h > pageHeight) {
+            return false;
+        }
+
+        if (shelfX + w > pageWidth) { // Start a new shelf
+            shelfY += shelfHeight;
+            shelfX = 0;
+            shelfHeight = 0;
+        }
+        if (shelfY + h > pageHeight) { // Start a new page
+            if (++page >= maxPages) {
+                return false;
+            }
+            shelfX = shelfY = shelfHeight = 0;
+        }
+
+        rect.page = page;
+        rect.x = shelfX + padding;
+        rect.y = shelfY + padding;
+        shelfX += w;
+        shelfHeight = std::max(shelfHeight, h);
+    }
+    return true;
+}
+
+void blitPadded(unsigned char *page, int pageWidth, int pageHeight, const unsigned char *rgba, int width,
+                int height, int x, int y, int padding) {
+    int top = std::max(0, y - padding), bottom = std::min(pageHeight, y + height + padding);
+    int left = std::max(0, x - padding), right = std::min(pageWidth, x + width + padding);
+
+    for (int dy = top; dy < bottom; dy++) {
+        int sy = std::min(std::max(dy - y, 0), height - 1);
+        const unsigned char *srcRow = rgba + size_t(sy) * width * 4;
+        unsigned char *dstRow = page + (size_t(dy) * pageWidth) * 4;
+
+        if (left < x) { // Left padding repeats the first texel
+            for (int dx = left; dx < x; dx++) {
+                std::memcpy(dstRow + dx * 4, srcRow, 4);
+            }
+        }
+        std::memcpy(dstRow + x * 4, srcRow, size_t(std::min(width, pageWidth - x)) * 4);
+        for (int dx = x + width; dx < right; dx++) {
+            std::memcpy(dstRow + dx * 4, srcRow + (width - 1) * 4, 4);
+        }
+    }
+}
+
+std::vector<unsigned char> resampleNearest(const unsigned char *rgba, int width, int height, int newWidth,
+                                           int newHeight) {
+    std::vector<unsigned char> out(size_t(newWidth) * newHeight * 4);
+    for (int y = 0; y < newHeight; y++) {
+        int sy = int(int64_t(y) * height / newHeight);
+        for (int x = 0; x < newWidth; x++) {
+            int sx = int(int64_t(x) * width / newWidth);
+            std::memcpy(&out[(size_t(y) * newWidth + x) * 4], rgba + (size_t(sy) * width + sx) * 4, 4);
+        }
+    }
+    return out;
+}
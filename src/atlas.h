@@ -0,0 +1,42 @@
+//
+// Created by Grant on 2019-08-27.
+//
+#pragma once
+
+#ifndef GRANT_ATLAS_H_DEFINED
+#define GRANT_ATLAS_H_DEFINED
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/*
+ * CPU side of the texture atlas: rectangle packing and copying images into pages. Pages become either one
+ * GL_TEXTURE_2D (a single page) or the layers of a GL_TEXTURE_2D_ARRAY, see TextureAtlas in renderer.h.
+ */
+struct AtlasRect {
+public:
+    int width, height; // Size of the image, without padding
+    int page = -1;     // -1 if it didn't fit
+    int x = 0, y = 0;  // Position of the image inside the page (the padding is around it)
+};
+
+/*
+ * Shelf packing: rects are placed tallest first in rows ("shelves") left to right. Every rect gets `padding`
+ * texels on each side. Returns false if something didn't fit into maxPages pages.
+ */
+bool packShelves(std::vector<AtlasRect> &rects, int pageWidth, int pageHeight, int padding, int maxPages = 1);
+
+/*
+ * Copies an RGBA8 image into a page at (x, y) and extends its edge texels `padding` texels outwards,
+ * so that filtering (and the smaller mip levels) don't bleed the neighbouring images in.
+ */
+void blitPadded(unsigned char *page, int pageWidth, int pageHeight, const unsigned char *rgba, int width,
+                int height, int x, int y, int padding);
+
+// Nearest neighbour resize of RGBA8 pixels.
+std::vector<unsigned char> resampleNearest(const unsigned char *rgba, int width, int height, int newWidth,
+                                           int newHeight);
+
+#endif
@@ -0,0 +1,401 @@
+//
+// Created by Grant on 2019-08-26.
+//
+
+#include "bcn.h"
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+#if defined(__SSE2__) || defined(_M_X64)
+
+#include <emmintrin.h>
+
+#define BCN_SSE2
+
+#endif
+
+bool isCompressedFormat(uint32_t format) {
+    return format == BC1_FORMAT || format == BC3_FORMAT;
+}
+
+uint32_t blockBytes(uint32_t format) {
+    return format == BC1_FORMAT ? 8 : 16;
+}
+
+size_t compressedSize(uint32_t format, int width, int height) {
+    return size_t((width + 3) / 4) * ((height + 3) / 4) * blockBytes(format);
+}
+
+uint32_t chooseCompressedFormat(const unsigned char *rgba, int width, int height) {
+    for (size_t i = 0; i < size_t(width) * height; i++) {
+        if (rgba[i * 4 + 3] != 255) {
+            return BC3_FORMAT;
+        }
+    }
+    return BC1_FORMAT;
+}
+
+static uint16_t packRGB565(const unsigned char *c) {
+    return uint16_t(((c[0] * 31 + 127) / 255) << 11u | ((c[1] * 63 + 127) / 255) << 5u | ((c[2] * 31 + 127) / 255));
+}
+
+static void unpackRGB565(uint16_t v, unsigned char *c) {
+    unsigned r = (v >> 11u) & 31u, g = (v >> 5u) & 63u, b = v & 31u;
+    c[0] = (unsigned char) ((r << 3u) | (r >> 2u));
+    c[1] = (unsigned char) ((g << 2u) | (g >> 4u));
+    c[2] = (unsigned char) ((b << 3u) | (b >> 2u));
+    c[3] = 255;
+}
+
+// Per-channel min and max of the 16 pixels of a block.
+static void blockBounds(const unsigned char *block, unsigned char *lo, unsigned char *hi) {
+#ifdef BCN_SSE2
+    __m128i p0 = _mm_loadu_si128((const __m128i *) block);
+    __m128i p1 = _mm_loadu_si128((const __m128i *) (block + 16));
+    __m128i p2 = _mm_loadu_si128((const __m128i *) (block + 32));
+    __m128i p3 = _mm_loadu_si128((const __m128i *) (block + 48));
+
+    __m128i mn = _mm_min_epu8(_mm_min_epu8(p0, p1), _mm_min_epu8(p2, p3));
+    __m128i mx = _mm_max_epu8(_mm_max_epu8(p0, p1), _mm_max_epu8(p2, p3));
+
+    // Fold the 4 pixels in each register down to 1.
+    mn = _mm_min_epu8(mn, _mm_srli_si128(mn, 8));
+    mn = _mm_min_epu8(mn, _mm_srli_si128(mn, 4));
+    mx = _mm_max_epu8(mx, _mm_srli_si128(mx, 8));
+    mx = _mm_max_epu8(mx, _mm_srli_si128(mx, 4));
+
+    uint32_t mnBits = _mm_cvtsi128_si32(mn), mxBits = _mm_cvtsi128_si32(mx);
+    std::memcpy(lo, &mnBits, 4);
+    std::memcpy(hi, &mxBits, 4);
+#else
+    for (int c = 0; c < 4; c++) {
+        lo[c] = 255;
+        hi[c] = 0;
+    }
+    for (int i = 0; i < 16; i++) {
+        for (int c = 0; c < 4; c++) {
+            lo[c] = std::min(lo[c], block[i * 4 + c]);
+            hi[c] = std::max(hi[c], block[i * 4 + c]);
+        }
+    }
+#endif
+}
+
+// Index of the closest of the 4 palette colors (by squared RGB distance, first one on ties) for every pixel.
+static uint32_t colorIndices(const unsigned char *block, const unsigned char palette[4][4]) {
+    uint32_t indices = 0;
+#ifdef BCN_SSE2
+    // 4 pixels at a time. Channels are widened to 16 bits so _mm_madd_epi16 can square and add them in pairs:
+    // (dr, dg) and (db, 0) per pixel, with alpha masked out of both sides.
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rgbMask = _mm_set1_epi32(0x00FFFFFF);
+    __m128i colors[4];
+    for (int p = 0; p < 4; p++) {
+        uint32_t rgb = uint32_t(palette[p][0]) | uint32_t(palette[p][1]) << 8u | uint32_t(palette[p][2]) << 16u;
+        colors[p] = _mm_unpacklo_epi8(_mm_set1_epi32(int(rgb)), zero);
+    }
+
+    for (int i = 0; i < 16; i += 4) {
+        __m128i pixels = _mm_and_si128(_mm_loadu_si128((const __m128i *) (block + i * 4)), rgbMask);
+        __m128i lo = _mm_unpacklo_epi8(pixels, zero); // Pixels 0 and 1
+        __m128i hi = _mm_unpackhi_epi8(pixels, zero); // Pixels 2 and 3
+
+        __m128i bestDist = _mm_set1_epi32(0x7FFFFFFF), best = zero;
+        for (int p = 0; p < 4; p++) {
+            __m128i dLo = _mm_sub_epi16(lo, colors[p]), dHi = _mm_sub_epi16(hi, colors[p]);
+            __m128 sqLo = _mm_castsi128_ps(_mm_madd_epi16(dLo, dLo));
+            __m128 sqHi = _mm_castsi128_ps(_mm_madd_epi16(dHi, dHi));
+            // Add the two halves of each pixel: even lanes + odd lanes
+            __m128i dist = _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(sqLo, sqHi, _MM_SHUFFLE(2, 0, 2, 0))),
+                                         _mm_castps_si128(_mm_shuffle_ps(sqLo, sqHi, _MM_SHUFFLE(3, 1, 3, 1))));
+
+            __m128i closer = _mm_cmplt_epi32(dist, bestDist);
+            bestDist = _mm_or_si128(_mm_and_si128(closer, dist), _mm_andnot_si128(closer, bestDist));
+            best = _mm_or_si128(_mm_and_si128(closer, _mm_set1_epi32(p)), _mm_andnot_si128(closer, best));
+        }
+
+        alignas(16) uint32_t lanes[4];
+        _mm_store_si128((__m128i *) lanes, best);
+        for (int j = 0; j < 4; j++) {
+            indices |= lanes[j] << ((i + j) * 2u);
+        }
+    }
+#else
+    for (int i = 0; i < 16; i++) {
+        const unsigned char *px = block + i * 4;
+        int best = 0, bestDist = 1 << 30;
+        for (int p = 0; p < 4; p++) {
+            int dr = px[0] - palette[p][0], dg = px[1] - palette[p][1], db = px[2] - palette[p][2];
+            int dist = dr * dr + dg * dg + db * db;
+            if (dist < bestDist) {
+                bestDist = dist;
+                best = p;
+            }
+        }
+        indices |= uint32_t(best) << (i * 2u);
+    }
+#endif
+    return indices;
+}
+
+// Same for the alpha of every pixel against the 8 entry alpha palette, 3 bits each.
+static uint64_t alphaIndices(const unsigned char *block, const unsigned char *palette) {
+    uint64_t indices = 0;
+#ifdef BCN_SSE2
+    // All 16 alphas in one register: shift each pixel's alpha down, then pack 32 -> 16 -> 8 bits.
+    __m128i a0 = _mm_srli_epi32(_mm_loadu_si128((const __m128i *) block), 24);
+    __m128i a1 = _mm_srli_epi32(_mm_loadu_si128((const __m128i *) (block + 16)), 24);
+    __m128i a2 = _mm_srli_epi32(_mm_loadu_si128((const __m128i *) (block + 32)), 24);
+    __m128i a3 = _mm_srli_epi32(_mm_loadu_si128((const __m128i *) (block + 48)), 24);
+    __m128i alpha = _mm_packus_epi16(_mm_packs_epi32(a0, a1), _mm_packs_epi32(a2, a3));
+
+    __m128i bestDist = _mm_set1_epi8(char(0xFF)), best = _mm_setzero_si128();
+    for (int p = 0; p < 8; p++) {
+        __m128i value = _mm_set1_epi8(char(palette[p]));
+        __m128i dist = _mm_or_si128(_mm_subs_epu8(alpha, value), _mm_subs_epu8(value, alpha)); // |alpha - value|
+
+        // No unsigned byte compare in SSE2: dist < bestDist exactly when min(dist, bestDist) != bestDist.
+        __m128i notCloser = _mm_cmpeq_epi8(_mm_min_epu8(dist, bestDist), bestDist);
+        bestDist = _mm_min_epu8(dist, bestDist);
+        best = _mm_or_si128(_mm_and_si128(notCloser, best), _mm_andnot_si128(notCloser, _mm_set1_epi8(char(p))));
+    }
+
+    alignas(16) unsigned char lanes[16];
+    _mm_store_si128((__m128i *) lanes, best);
+    for (int i = 0; i < 16; i++) {
+        indices |= uint64_t(lanes[i]) << (i * 3u);
+    }
+#else
+    for (int i = 0; i < 16; i++) {
+        int alpha = block[i * 4 + 3];
+        int best = 0, bestDist = 256;
+        for (int p = 0; p < 8; p++) {
+            int dist = std::abs(alpha - palette[p]);
+            if (dist < bestDist) {
+                bestDist = dist;
+                best = p;
+            }
+        }
+        indices |= uint64_t(best) << (i * 3u);
+    }
+#endif
+    return indices;
+}
+
+static void encodeColorBlock(const unsigned char *block, unsigned char *out) {
+    unsigned char lo[4], hi[4];
+    blockBounds(block, lo, hi);
+
+    // Pull the endpoints in a bit. They're rarely hit exactly, and it gives the middle colors more range.
+    for (int c = 0; c < 3; c++) {
+        int inset = (hi[c] - lo[c]) >> 4;
+        lo[c] = (unsigned char) std::min(255, lo[c] + inset);
+        hi[c] = (unsigned char) std::max(0, hi[c] - inset);
+    }
+
+    uint16_t c0 = packRGB565(hi), c1 = packRGB565(lo);
+    uint32_t indices = 0;
+
+    if (c0 != c1) {
+        if (c0 < c1) { // color0 > color1 selects the 4 color mode
+            std::swap(c0, c1);
+        }
+
+        unsigned char palette[4][4];
+        unpackRGB565(c0, palette[0]);
+        unpackRGB565(c1, palette[1]);
+        for (int c = 0; c < 3; c++) {
+            palette[2][c] = (unsigned char) ((2 * palette[0][c] + palette[1][c]) / 3);
+            palette[3][c] = (unsigned char) ((palette[0][c] + 2 * palette[1][c]) / 3);
+        }
+
+        indices = colorIndices(block, palette);
+    }
+
+    out[0] = c0 & 0xFFu;
+    out[1] = c0 >> 8u;
+    out[2] = c1 & 0xFFu;
+    out[3] = c1 >> 8u;
+    std::memcpy(out + 4, &indices, 4);
+}
+
+void encodeBC1Block(const unsigned char *block, unsigned char *out) {
+    encodeColorBlock(block, out);
+}
+
+void encodeBC3Block(const unsigned char *block, unsigned char *out) {
+    unsigned char a0 = 0, a1 = 255;
+    for (int i = 0; i < 16; i++) {
+        a0 = std::max(a0, block[i * 4 + 3]);
+        a1 = std::min(a1, block[i * 4 + 3]);
+    }
+
+    // a0 > a1 selects the 8 value mode
+    unsigned char palette[8] = {a0, a1};
+    for (int p = 1; p < 7; p++) {
+        palette[p + 1] = (unsigned char) (((7 - p) * a0 + p * a1) / 7);
+    }
+
+    uint64_t indices = 0;
+    if (a0 != a1) {
+        indices = alphaIndices(block, palette);
+    }
+
+    out[0] = a0;
+    out[1] = a1;
+    for (int i = 0; i < 6; i++) {
+        out[2 + i] = (unsigned char) (indices >> (i * 8u));
+    }
+    encodeColorBlock(block, out + 8);
+}
+
+void decodeBC1Block(const unsigned char *in, unsigned char *block) {
+    uint16_t c0 = uint16_t(in[0] | in[1] << 8u), c1 = uint16_t(in[2] | in[3] << 8u);
+    unsigned char palette[4][4];
+    unpackRGB565(c0, palette[0]);
+    unpackRGB565(c1, palette[1]);
+
+    for (int c = 0; c < 3; c++) {
+        if (c0 > c1) {
+            palette[2][c] = (unsigned char) ((2 * palette[0][c] + palette[1][c]) / 3);
+            palette[3][c] = (unsigned char) ((palette[0][c] + 2 * palette[1][c]) / 3);
+        } else {
+            palette[2][c] = (unsigned char) ((palette[0][c] + palette[1][c]) / 2);
+            palette[3][c] = 0;
+        }
+    }
+    palette[2][3] = 255;
+    palette[3][3] = c0 > c1 ? 255 : 0;
+
+    uint32_t indices;
+    std::memcpy(&indices, in + 4, 4);
+    for (int i = 0; i < 16; i++) {
+        std::memcpy(block + i * 4, palette[(indices >> (i * 2u)) & 3u], 4);
+    }
+}
+
+void decodeBC3Block(const unsigned char *in, unsigned char *block) {
+    decodeBC1Block(in + 8, block);
+    // The color block of BC3 is always in 4 color mode.
+    uint16_t c0 = uint16_t(in[8] | in[9] << 8u), c1 = uint16_t(in[10] | in[11] << 8u);
+    if (c0 <= c1) {
+        unsigned char palette[4][4];
+        unpackRGB565(c0, palette[0]);
+        unpackRGB565(c1, palette[1]);
+        for (int c = 0; c < 3; c++) {
+            palette[2][c] = (unsigned char) ((2 * palette[0][c] + palette[1][c]) / 3);
+            palette[3][c] = (unsigned char) ((palette[0][c] + 2 * palette[1][c]) / 3);
+        }
+        uint32_t indices;
+        std::memcpy(&indices, in + 12, 4);
+        for (int i = 0; i < 16; i++) {
+            std::memcpy(block + i * 4, palette[(indices >> (i * 2u)) & 3u], 3);
+        }
+    }
+
+    unsigned a0 = in[0], a1 = in[1];
+    unsigned char palette[8] = {(unsigned char) a0, (unsigned char) a1};
+    if (a0 > a1) {
+        for (int p = 1; p < 7; p++) {
+            palette[p + 1] = (unsigned char) (((7 - p) * a0 + p * a1) / 7);
+        }
+    } else {
+        for (int p = 1; p < 5; p++) {
+            palette[p + 1] = (unsigned char) (((5 - p) * a0 + p * a1) / 5);
+        }
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+
+    uint64_t indices = 0;
+    for (int i = 0; i < 6; i++) {
+        indices |= uint64_t(in[2 + i]) << (i * 8u);
+    }
+    for (int i = 0; i < 16; i++) {
+        block[i * 4 + 3] = palette[(indices >> (i * 3u)) & 7u];
+    }
+}
+
+/*
+ * Encodes the block rows [firstRow, lastRow). Partial blocks at the edges repeat the last pixel.
+ */
+static void compressRows(const unsigned char *rgba, int width, int height, uint32_t format, int firstRow,
+                         int lastRow, unsigned char *out) {
+    int blocksWide = (width + 3) / 4;
+    uint32_t bytes = blockBytes(format);
+    unsigned char block[64];
+
+    for (int by = firstRow; by < lastRow; by++) {
+        for (int bx = 0; bx < blocksWide; bx++) {
+            for (int y = 0; y < 4; y++) {
+                int py = std::min(by * 4 + y, height - 1);
+                for (int x = 0; x < 4; x++) {
+                    int px = std::min(bx * 4 + x, width - 1);
+                    std::memcpy(block + (y * 4 + x) * 4, rgba + (size_t(py) * width + px) * 4, 4);
+                }
+            }
+
+            unsigned char *dst = out + (size_t(by) * blocksWide + bx) * bytes;
+            if (format == BC1_FORMAT) {
+                encodeBC1Block(block, dst);
+            } else {
+                encodeBC3Block(block, dst);
+            }
+        }
+    }
+}
+
+std::vector<unsigned char> compressImage(const unsigned char *rgba, int width, int height, uint32_t format,
+                                         unsigned threads) {
+    std::vector<unsigned char> out(compressedSize(format, width, height));
+    int blocksHigh = (height + 3) / 4;
+
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::min<unsigned>(threads, blocksHigh);
+
+    if (threads <= 1) {
+        compressRows(rgba, width, height, format, 0, blocksHigh, out.data());
+        return out;
+    }
+
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; t++) {
+        int first = blocksHigh * t / threads, last = blocksHigh * (t + 1) / threads;
+        workers.emplace_back(compressRows, rgba, width, height, format, first, last, out.data());
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+
+    return out;
+}
+
+std::vector<unsigned char> decompressImage(const unsigned char *blocks, int width, int height, uint32_t format) {
+    std::vector<unsigned char> out(size_t(width) * height * 4);
+    int blocksWide = (width + 3) / 4, blocksHigh = (height + 3) / 4;
+    uint32_t bytes = blockBytes(format);
+    unsigned char block[64];
+
+    for (int by = 0; by < blocksHigh; by++) {
+        for (int bx = 0; bx < blocksWide; bx++) {
+            const unsigned char *src = blocks + (size_t(by) * blocksWide + bx) * bytes;
+            if (format == BC1_FORMAT) {
+                decodeBC1Block(src, block);
+            } else {
+                decodeBC3Block(src, block);
+            }
+
+            for (int y = 0; y < 4 && by * 4 + y < height; y++) {
+                for (int x = 0; x < 4 && bx * 4 + x < width; x++) {
+                    std::memcpy(out.data() + (size_t(by * 4 + y) * width + bx * 4 + x) * 4, block + (y * 4 + x) * 4, 4);
+                }
+            }
+        }
+    }
+
+    return out;
+}
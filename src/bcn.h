@@ -0,0 +1,47 @@
+//
+// Created by Grant on 2019-08-26.
+//
+#pragma once
+
+#ifndef GRANT_BCN_H_DEFINED
+#define GRANT_BCN_H_DEFINED
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+ * CPU block compression for S3TC / BCn. Every 4x4 block of RGBA8 pixels is encoded on its own, so a level
+ * can be split between threads. The encoder does a bounding box fit (SSE2 for the min/max when available)
+ * instead of an exhaustive search: it's meant to be fast enough to run at load time too.
+ *
+ * BC1 is used for opaque images (4 bpp), BC3 for anything with alpha (8 bpp).
+ */
+const uint32_t BC1_FORMAT = 0x83F0; // GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+const uint32_t BC3_FORMAT = 0x83F3; // GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+
+bool isCompressedFormat(uint32_t format);
+
+uint32_t blockBytes(uint32_t format);
+
+// Size in bytes of a compressed width x height image (partial blocks are padded).
+size_t compressedSize(uint32_t format, int width, int height);
+
+// BC1 if every pixel is opaque, BC3 otherwise.
+uint32_t chooseCompressedFormat(const unsigned char *rgba, int width, int height);
+
+// threads = 0 uses every core.
+std::vector<unsigned char> compressImage(const unsigned char *rgba, int width, int height, uint32_t format,
+                                         unsigned threads = 0);
+
+std::vector<unsigned char> decompressImage(const unsigned char *blocks, int width, int height, uint32_t format);
+
+void encodeBC1Block(const unsigned char *block, unsigned char *out);
+
+void encodeBC3Block(const unsigned char *block, unsigned char *out);
+
+void decodeBC1Block(const unsigned char *in, unsigned char *block);
+
+void decodeBC3Block(const unsigned char *in, unsigned char *block);
+
+#endif
@@ -0,0 +1,699 @@
+//
+// Created by Grant on 2019-08-31.
+//
+
+#include "bvh.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+
+const unsigned BVH_BINS = 12;
+
+AABB transformAABB(const float *boundsMin, const float *boundsMax, const float *m) {
+    AABB out = {};
+    for (int r = 0; r < 3; r++) {
+        float center = m[12 + r];
+        float extent = 0;
+        for (int c = 0; c < 3; c++) {
+            center += m[c * 4 + r] * (boundsMin[c] + boundsMax[c]) * 0.5f;
+            extent += std::abs(m[c * 4 + r]) * (boundsMax[c] - boundsMin[c]) * 0.5f;
+        }
+        out.min[r] = center - extent;
+        out.max[r] = center + extent;
+    }
+    return out;
+}
+
+static float surfaceArea(const float *mn, const float *mx) {
+    float dx = mx[0] - mn[0], dy = mx[1] - mn[1], dz = mx[2] - mn[2];
+    return 2 * (dx * dy + dy * dz + dz * dx);
+}
+
+static void growBox(float *mn, float *mx, const float *otherMin, const float *otherMax) {
+    for (int i = 0; i < 3; i++) {
+        mn[i] = std::min(mn[i], otherMin[i]);
+        mx[i] = std::max(mx[i], otherMax[i]);
+    }
+}
+
+static void emptyBox(float *mn, float *mx) {
+    for (int i = 0; i < 3; i++) {
+        mn[i] = std::numeric_limits<float>::max();
+        mx[i] = -std::numeric_limits<float>::max();
+    }
+}
+
+static double msSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static float unionArea(const float *mn, const float *mx, const AABB &box) {
+    float unionMin[3], unionMax[3];
+    for (int i = 0; i < 3; i++) {
+        unionMin[i] = std::min(mn[i], box.min[i]);
+        unionMax[i] = std::max(mx[i], box.max[i]);
+    }
+    return surfaceArea(unionMin, unionMax);
+}
+
+void BVH::insert(uint32_t id, const AABB &box) {
+    if (itemOf.count(id)) {
+        update(id, box);
+        return;
+    }
+
+    itemOf[id] = boxes.size();
+    boxes.push_back(box);
+    ids.push_back(id);
+    leafOf.push_back(BVH_NULL);
+    slotOf.push_back(0);
+    pending.push_back(id);
+}
+
+bool BVH::remove(uint32_t id) {
+    auto it = itemOf.find(id);
+    if (it == itemOf.end()) {
+        return false;
+    }
+
+    uint32_t item = it->second;
+    itemOf.erase(it);
+    if (leafOf[item] != BVH_NULL) {
+        removeFromLeaf(item);
+        stats.incremental++;
+        structureChanged = true;
+    } else {
+        pending.erase(std::find(pending.begin(), pending.end(), id));
+    }
+
+    auto last = uint32_t(boxes.size() - 1);
+    if (item != last) {
+        boxes[item] = boxes[last];
+        ids[item] = ids[last];
+        leafOf[item] = leafOf[last];
+        slotOf[item] = slotOf[last];
+        itemOf[ids[item]] = item;
+        if (leafOf[item] != BVH_NULL) {
+            order[slotOf[item]] = item;
+        }
+    }
+    boxes.pop_back();
+    ids.pop_back();
+    leafOf.pop_back();
+    slotOf.pop_back();
+    return true;
+}
+
+void BVH::update(uint32_t id, const AABB &box) {
+    auto it = itemOf.find(id);
+    if (it != itemOf.end()) {
+        boxes[it->second] = box;
+        moved = true;
+    }
+}
+
+size_t BVH::size() const {
+    return boxes.size();
+}
+
+size_t BVH::nodeCount() const {
+    return nodes.size() - freeNodes.size();
+}
+
+void BVH::commit() {
+    if (pending.empty() && !moved && !structureChanged) {
+        return;
+    }
+
+    // Lots of single inserts make a worse tree than building it, and take longer too (e.g. when loading).
+    if (stats.incremental + pending.size() > rebuildFraction * boxes.size()) {
+        build();
+        return;
+    }
+
+    if (moved) {
+        refit(); // First, so the new leaves are placed against where everything is now
+    }
+    for (uint32_t id : pending) {
+        insertLeaf(itemOf[id]);
+    }
+    stats.incremental += pending.size();
+    pending.clear();
+    structureChanged = false;
+
+    stats.cost = computeCost();
+    if (stats.cost > stats.builtCost * rebuildRatio) {
+        build();
+    }
+}
+
+void BVH::build() {
+    auto start = std::chrono::steady_clock::now();
+
+    nodes.clear();
+    freeNodes.clear();
+    pending.clear();
+    root = BVH_NULL;
+    order.resize(boxes.size());
+    for (uint32_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+
+    stats.depth = 0;
+    if (!boxes.empty()) {
+        std::vector<float> centroids(boxes.size() * 3);
+        for (size_t i = 0; i < boxes.size(); i++) {
+            for (int axis = 0; axis < 3; axis++) {
+                centroids[i * 3 + axis] = (boxes[i].min[axis] + boxes[i].max[axis]) * 0.5f;
+            }
+        }
+
+        nodes.reserve(boxes.size() * 2);
+        root = buildNode(0, boxes.size(), centroids, 1, BVH_NULL);
+    }
+
+    structureChanged = false;
+    moved = false;
+    stats.cost = computeCost();
+    stats.builtCost = stats.cost;
+    stats.incremental = 0;
+    stats.builds++;
+    stats.buildMs = msSince(start);
+}
+
+uint32_t BVH::allocateNode() {
+    if (!freeNodes.empty()) {
+        uint32_t index = freeNodes.back();
+        freeNodes.pop_back();
+        return index;
+    }
+
+    nodes.push_back({});
+    return uint32_t(nodes.size() - 1);
+}
+
+uint32_t BVH::buildNode(uint32_t first, uint32_t count, const std::vector<float> &centroids, unsigned depth,
+                        uint32_t parent) {
+    auto index = uint32_t(nodes.size());
+    nodes.push_back({});
+    BVHNode &node = nodes[index];
+    node.first = first;
+    node.count = count;
+    node.left = node.right = BVH_NULL;
+    node.parent = parent;
+    stats.depth = std::max(stats.depth, depth);
+
+    float centerMin[3], centerMax[3];
+    emptyBox(node.min, node.max);
+    emptyBox(centerMin, centerMax);
+    for (uint32_t i = first; i < first + count; i++) {
+        const float *c = &centroids[order[i] * 3];
+        growBox(node.min, node.max, boxes[order[i]].min, boxes[order[i]].max);
+        growBox(centerMin, centerMax, c, c);
+    }
+
+    auto makeLeaf = [&]() {
+        for (uint32_t i = first; i < first + count; i++) {
+            leafOf[order[i]] = index;
+            slotOf[order[i]] = i;
+        }
+        return index;
+    };
+
+    if (count <= leafSize) {
+        return makeLeaf();
+    }
+
+    // Bin the centroids along every axis and take the split with the lowest SAH cost.
+    int bestAxis = -1;
+    unsigned bestSplit = 0;
+    float bestCost = std::numeric_limits<float>::max();
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = centerMax[axis] - centerMin[axis];
+        if (extent <= 0) {
+            continue;
+        }
+
+        float binMin[BVH_BINS][3], binMax[BVH_BINS][3];
+        uint32_t binCount[BVH_BINS] = {};
+        for (unsigned b = 0; b < BVH_BINS; b++) {
+            emptyBox(binMin[b], binMax[b]);
+        }
+
+        float scale = BVH_BINS / extent;
+        for (uint32_t i = first; i < first + count; i++) {
+            uint32_t item = order[i];
+            auto b = std::min(BVH_BINS - 1, unsigned((centroids[item * 3 + axis] - centerMin[axis]) * scale));
+            binCount[b]++;
+            growBox(binMin[b], binMax[b], boxes[item].min, boxes[item].max);
+        }
+
+        // Sweep from the right first so the left sweep can read off the cost of every split directly.
+        float rightArea[BVH_BINS];
+        uint32_t rightCount[BVH_BINS];
+        float runMin[3], runMax[3];
+        emptyBox(runMin, runMax);
+        uint32_t running = 0;
+        for (unsigned b = BVH_BINS - 1; b > 0; b--) {
+            growBox(runMin, runMax, binMin[b], binMax[b]);
+            running += binCount[b];
+            rightArea[b] = running ? surfaceArea(runMin, runMax) : 0;
+            rightCount[b] = running;
+        }
+
+        emptyBox(runMin, runMax);
+        running = 0;
+        for (unsigned split = 1; split < BVH_BINS; split++) {
+            growBox(runMin, runMax, binMin[split - 1], binMax[split - 1]);
+            running += binCount[split - 1];
+            if (running == 0 || rightCount[split] == 0) {
+                continue;
+            }
+
+            float cost = surfaceArea(runMin, runMax) * running + rightArea[split] * rightCount[split];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = split;
+            }
+        }
+    }
+
+    uint32_t *begin = &order[first];
+    uint32_t *end = begin + count;
+    uint32_t *mid;
+    if (bestAxis < 0) {
+        // Every centroid is in the same place, any split is as good as any other.
+        mid = begin + count / 2;
+    } else {
+        // Big leaves are fine as long as splitting wouldn't pay off. 1 is the cost of traversing a node.
+        float leafCost = surfaceArea(node.min, node.max) * count;
+        if (bestCost + surfaceArea(node.min, node.max) >= leafCost && count <= leafSize * 4) {
+            return makeLeaf();
+        }
+
+        float extent = centerMax[bestAxis] - centerMin[bestAxis];
+        float scale = BVH_BINS / extent;
+        mid = std::partition(begin, end, [&](uint32_t item) {
+            auto b = std::min(BVH_BINS - 1, unsigned((centroids[item * 3 + bestAxis] - centerMin[bestAxis]) * scale));
+            return b < bestSplit;
+        });
+    }
+
+    auto leftCount = uint32_t(mid - begin);
+    uint32_t left = buildNode(first, leftCount, centroids, depth + 1, index);
+    uint32_t right = buildNode(first + leftCount, count - leftCount, centroids, depth + 1, index);
+    nodes[index].left = left; // `node` may have moved
+    nodes[index].right = right;
+    nodes[index].first = nodes[index].count = 0;
+    return index;
+}
+
+void BVH::setNodeBounds(BVHNode &node) const {
+    if (node.left != BVH_NULL) {
+        const BVHNode &left = nodes[node.left];
+        const BVHNode &right = nodes[node.right];
+        for (int axis = 0; axis < 3; axis++) {
+            node.min[axis] = std::min(left.min[axis], right.min[axis]);
+            node.max[axis] = std::max(left.max[axis], right.max[axis]);
+        }
+        return;
+    }
+
+    emptyBox(node.min, node.max);
+    for (uint32_t i = node.first; i < node.first + node.count; i++) {
+        growBox(node.min, node.max, boxes[order[i]].min, boxes[order[i]].max);
+    }
+}
+
+/*
+ * Branch and bound search for the sibling with the lowest cost: the area of the new parent plus how much every
+ * ancestor grows. Below a node, that's at least the new box's own area plus what the node and its ancestors grow,
+ * so subtrees that can't beat the best so far are skipped.
+ */
+void BVH::insertLeaf(uint32_t item) {
+    const AABB &box = boxes[item];
+    uint32_t leaf = allocateNode();
+    BVHNode &node = nodes[leaf];
+    std::copy(box.min, box.min + 3, node.min);
+    std::copy(box.max, box.max + 3, node.max);
+    node.first = uint32_t(order.size());
+    node.count = 1;
+    node.left = node.right = node.parent = BVH_NULL;
+    leafOf[item] = leaf;
+    slotOf[item] = uint32_t(order.size());
+    order.push_back(item);
+
+    if (root == BVH_NULL) {
+        root = leaf;
+        stats.depth = std::max(stats.depth, 1u);
+        return;
+    }
+
+    float boxArea = surfaceArea(box.min, box.max);
+    uint32_t sibling = root;
+    float bestCost = std::numeric_limits<float>::max();
+    std::vector<std::pair<uint32_t, float>> stack = {{root, 0.0f}}; // Node, growth of its ancestors
+    while (!stack.empty()) {
+        uint32_t index = stack.back().first;
+        float inherited = stack.back().second;
+        stack.pop_back();
+
+        const BVHNode &candidate = nodes[index];
+        float area = unionArea(candidate.min, candidate.max, box);
+        if (area + inherited < bestCost) {
+            bestCost = area + inherited;
+            sibling = index;
+        }
+
+        inherited += area - surfaceArea(candidate.min, candidate.max);
+        if (candidate.left != BVH_NULL && boxArea + inherited < bestCost) {
+            stack.emplace_back(candidate.left, inherited);
+            stack.emplace_back(candidate.right, inherited);
+        }
+    }
+
+    uint32_t oldParent = nodes[sibling].parent;
+    uint32_t parent = allocateNode();
+    BVHNode &joined = nodes[parent];
+    joined.first = joined.count = 0;
+    joined.left = sibling;
+    joined.right = leaf;
+    joined.parent = oldParent;
+    nodes[sibling].parent = parent;
+    nodes[leaf].parent = parent;
+    replaceChild(oldParent, sibling, parent);
+    refitUpwards(parent);
+
+    unsigned depth = 1;
+    for (uint32_t index = leaf; nodes[index].parent != BVH_NULL; index = nodes[index].parent) {
+        depth++;
+    }
+    stats.depth = std::max(stats.depth, depth);
+}
+
+// A leaf that becomes empty is removed, and its sibling takes the place of their parent.
+void BVH::removeFromLeaf(uint32_t item) {
+    uint32_t leaf = leafOf[item];
+    BVHNode &node = nodes[leaf];
+    uint32_t slot = slotOf[item];
+    uint32_t last = node.first + node.count - 1;
+    if (slot != last) {
+        order[slot] = order[last];
+        slotOf[order[slot]] = slot;
+    }
+    node.count--;
+    leafOf[item] = BVH_NULL;
+
+    if (node.count > 0) {
+        refitUpwards(leaf);
+        return;
+    }
+
+    uint32_t parent = node.parent;
+    freeNodes.push_back(leaf);
+    if (parent == BVH_NULL) {
+        root = BVH_NULL;
+        return;
+    }
+
+    uint32_t sibling = nodes[parent].left == leaf ? nodes[parent].right : nodes[parent].left;
+    uint32_t grandparent = nodes[parent].parent;
+    nodes[sibling].parent = grandparent;
+    replaceChild(grandparent, parent, sibling);
+    freeNodes.push_back(parent);
+    refitUpwards(grandparent);
+}
+
+void BVH::replaceChild(uint32_t parent, uint32_t child, uint32_t replacement) {
+    if (parent == BVH_NULL) {
+        root = replacement;
+    } else if (nodes[parent].left == child) {
+        nodes[parent].left = replacement;
+    } else {
+        nodes[parent].right = replacement;
+    }
+}
+
+void BVH::refitUpwards(uint32_t index) {
+    for (; index != BVH_NULL; index = nodes[index].parent) {
+        setNodeBounds(nodes[index]);
+    }
+}
+
+void BVH::refit() {
+    auto start = std::chrono::steady_clock::now();
+
+    // Parents before children in `visit`, so walking it backwards does the children first.
+    std::vector<uint32_t> visit;
+    if (root != BVH_NULL) {
+        visit.push_back(root);
+    }
+    for (size_t i = 0; i < visit.size(); i++) {
+        const BVHNode &node = nodes[visit[i]];
+        if (node.left != BVH_NULL) {
+            visit.push_back(node.left);
+            visit.push_back(node.right);
+        }
+    }
+    for (size_t i = visit.size(); i-- > 0;) {
+        setNodeBounds(nodes[visit[i]]);
+    }
+
+    moved = false;
+    stats.cost = computeCost();
+    stats.refits++;
+    stats.refitMs = msSince(start);
+}
+
+// Expected cost of a random ray through the root: 1 per node visited, 1 per item tested.
+float BVH::computeCost() const {
+    if (root == BVH_NULL) {
+        return 0;
+    }
+
+    float rootArea = surfaceArea(nodes[root].min, nodes[root].max);
+    if (rootArea <= 0) {
+        return 0;
+    }
+
+    float cost = 0;
+    std::vector<uint32_t> stack = {root};
+    while (!stack.empty()) {
+        const BVHNode &node = nodes[stack.back()];
+        stack.pop_back();
+
+        float area = surfaceArea(node.min, node.max) / rootArea;
+        if (node.left == BVH_NULL) {
+            cost += area * node.count;
+        } else {
+            cost += area;
+            stack.push_back(node.left);
+            stack.push_back(node.right);
+        }
+    }
+    return cost;
+}
+
+void BVH::collect(uint32_t index, std::vector<uint32_t> &out) const {
+    std::vector<uint32_t> stack = {index};
+    while (!stack.empty()) {
+        const BVHNode &node = nodes[stack.back()];
+        stack.pop_back();
+
+        if (node.left == BVH_NULL) {
+            for (uint32_t i = node.first; i < node.first + node.count; i++) {
+                out.push_back(ids[order[i]]);
+            }
+        } else {
+            stack.push_back(node.right);
+            stack.push_back(node.left);
+        }
+    }
+}
+
+enum FrustumOverlap {
+    FRUSTUM_OUTSIDE,
+    FRUSTUM_INTERSECTS,
+    FRUSTUM_INSIDE
+};
+
+static FrustumOverlap classify(const Frustum &frustum, const float *mn, const float *mx) {
+    FrustumOverlap result = FRUSTUM_INSIDE;
+    for (const float *p : frustum.planes) {
+        float distance = p[3], radius = 0;
+        for (int axis = 0; axis < 3; axis++) {
+            distance += p[axis] * (mn[axis] + mx[axis]) * 0.5f;
+            radius += std::abs(p[axis]) * (mx[axis] - mn[axis]) * 0.5f;
+        }
+
+        if (distance + radius < 0) {
+            return FRUSTUM_OUTSIDE;
+        }
+        if (distance - radius < 0) {
+            result = FRUSTUM_INTERSECTS;
+        }
+    }
+    return result;
+}
+
+void BVH::queryFrustum(const Frustum &frustum, std::vector<uint32_t> &out) const {
+    if (root == BVH_NULL) {
+        return;
+    }
+
+    std::vector<uint32_t> stack = {root};
+    while (!stack.empty()) {
+        uint32_t index = stack.back();
+        const BVHNode &node = nodes[index];
+        stack.pop_back();
+
+        FrustumOverlap overlap = classify(frustum, node.min, node.max);
+        if (overlap == FRUSTUM_OUTSIDE) {
+            continue;
+        }
+
+        // Everything below a node that's completely inside is visible, no need to look any further.
+        if (overlap == FRUSTUM_INSIDE) {
+            collect(index, out);
+        } else if (node.left == BVH_NULL) {
+            for (uint32_t i = node.first; i < node.first + node.count; i++) {
+                const AABB &box = boxes[order[i]];
+                if (classify(frustum, box.min, box.max) != FRUSTUM_OUTSIDE) {
+                    out.push_back(ids[order[i]]);
+                }
+            }
+        } else {
+            stack.push_back(node.right);
+            stack.push_back(node.left);
+        }
+    }
+}
+
+static bool overlaps(const AABB &a, const float *mn, const float *mx) {
+    for (int axis = 0; axis < 3; axis++) {
+        if (a.max[axis] < mn[axis] || a.min[axis] > mx[axis]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool contains(const AABB &a, const float *mn, const float *mx) {
+    for (int axis = 0; axis < 3; axis++) {
+        if (mn[axis] < a.min[axis] || mx[axis] > a.max[axis]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void BVH::queryRange(const AABB &range, std::vector<uint32_t> &out) const {
+    if (root == BVH_NULL) {
+        return;
+    }
+
+    std::vector<uint32_t> stack = {root};
+    while (!stack.empty()) {
+        uint32_t index = stack.back();
+        const BVHNode &node = nodes[index];
+        stack.pop_back();
+
+        if (!overlaps(range, node.min, node.max)) {
+            continue;
+        }
+
+        if (contains(range, node.min, node.max)) {
+            collect(index, out);
+        } else if (node.left == BVH_NULL) {
+            for (uint32_t i = node.first; i < node.first + node.count; i++) {
+                const AABB &box = boxes[order[i]];
+                if (overlaps(range, box.min, box.max)) {
+                    out.push_back(ids[order[i]]);
+                }
+            }
+        } else {
+            stack.push_back(node.right);
+            stack.push_back(node.left);
+        }
+    }
+}
+
+// Slab test. tEnter is negative if the origin is inside the box.
+static bool rayBox(const float *origin, const float *invDir, const float *mn, const float *mx, float maxDistance,
+                   float &tEnter) {
+    float tMin = -std::numeric_limits<float>::max();
+    float tMax = maxDistance;
+    for (int axis = 0; axis < 3; axis++) {
+        float t1 = (mn[axis] - origin[axis]) * invDir[axis];
+        float t2 = (mx[axis] - origin[axis]) * invDir[axis];
+        tMin = std::max(tMin, std::min(t1, t2));
+        tMax = std::min(tMax, std::max(t1, t2));
+    }
+
+    tEnter = tMin;
+    return tMax >= std::max(tMin, 0.0f);
+}
+
+bool BVH::raycast(const float *origin, const float *direction, float maxDistance, uint32_t &hitId,
+                  float &hitDistance) const {
+    if (root == BVH_NULL) {
+        return false;
+    }
+
+    float invDir[3];
+    for (int axis = 0; axis < 3; axis++) {
+        invDir[axis] = 1.0f / direction[axis]; // Infinity for 0 is fine for the slab test
+    }
+
+    bool hit = false;
+    float best = maxDistance;
+    std::vector<uint32_t> stack = {root};
+    while (!stack.empty()) {
+        uint32_t index = stack.back();
+        const BVHNode &node = nodes[index];
+        stack.pop_back();
+
+        float tEnter;
+        if (!rayBox(origin, invDir, node.min, node.max, best, tEnter)) {
+            continue;
+        }
+
+        if (node.left == BVH_NULL) {
+            for (uint32_t i = node.first; i < node.first + node.count; i++) {
+                const AABB &box = boxes[order[i]];
+                if (rayBox(origin, invDir, box.min, box.max, best, tEnter) && tEnter >= 0 && tEnter < best) {
+                    best = tEnter;
+                    hitId = ids[order[i]];
+                    hit = true;
+                }
+            }
+            continue;
+        }
+
+        // Visit the nearer child first so the farther one is more likely to be pruned.
+        float leftEnter = 0, rightEnter = 0;
+        bool left = rayBox(origin, invDir, nodes[node.left].min, nodes[node.left].max, best, leftEnter);
+        bool right = rayBox(origin, invDir, nodes[node.right].min, nodes[node.right].max, best, rightEnter);
+        if (left && right) {
+            if (leftEnter <= rightEnter) {
+                stack.push_back(node.right);
+                stack.push_back(node.left);
+            } else {
+                stack.push_back(node.left);
+                stack.push_back(node.right);
+            }
+        } else if (left) {
+            stack.push_back(node.left);
+        } else if (right) {
+            stack.push_back(node.right);
+        }
+    }
+
+    if (hit) {
+        hitDistance = best;
+    }
+    return hit;
+}
@@ -0,0 +1,133 @@
+//
+// Created by Grant on 2019-08-31.
+//
+#pragma once
+
+#ifndef GRANT_BVH_H_DEFINED
+#define GRANT_BVH_H_DEFINED
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "culling.h"
+
+struct AABB {
+public:
+    float min[3];
+    float max[3];
+};
+
+// World space box around the object space box [boundsMin, boundsMax] transformed by a column-major matrix.
+AABB transformAABB(const float *boundsMin, const float *boundsMax, const float *transform);
+
+const uint32_t BVH_NULL = 0xFFFFFFFFu;
+
+// Leaves have left == BVH_NULL and hold the items order[first, first + count). Nodes are linked by index, so they
+// can be added and removed one at a time.
+struct BVHNode {
+public:
+    float min[3];
+    uint32_t first;
+    float max[3];
+    uint32_t count;
+    uint32_t left, right;
+    uint32_t parent; // BVH_NULL for the root
+};
+
+struct BVHStats {
+public:
+    unsigned builds = 0;
+    unsigned refits = 0;
+    double buildMs = 0; // Last build
+    double refitMs = 0; // Last refit
+    float cost = 0;      // Surface area heuristic cost of the tree as it is now
+    float builtCost = 0; // ...and right after the last build
+    unsigned depth = 0;
+    unsigned incremental = 0; // Items inserted or removed one at a time since the last build
+};
+
+/*
+ * Bounding volume hierarchy over boxes identified by a user id (e.g. a GameObject slot).
+ * Built top-down with a binned surface area heuristic. Boxes that move are refitted (cheap, but the tree
+ * gets worse as things move around). Inserted items get a leaf next to the sibling with the lowest SAH cost
+ * and removed ones take their leaf with them, refitting only the path up to the root. The tree is rebuilt once
+ * too many items came or went that way, or once its SAH cost got too far from what it was built as.
+ * Inserts and moves take effect at commit(), removes right away.
+ */
+class BVH {
+public:
+    std::vector<BVHNode> nodes; // Freed ones too, they're reused
+    uint32_t root = BVH_NULL;
+    BVHStats stats;
+    unsigned leafSize = 4;
+    float rebuildRatio = 1.5f; // Rebuild once the SAH cost got this much worse than after the last build
+    float rebuildFraction = 0.25f; // Rebuild instead once this share of the items was inserted or removed
+
+    void insert(uint32_t id, const AABB &box);
+
+    bool remove(uint32_t id);
+
+    void update(uint32_t id, const AABB &box);
+
+    size_t size() const;
+
+    // Nodes in the tree, without the freed ones
+    size_t nodeCount() const;
+
+    // Rebuilds or refits, whichever the changes since the last commit need.
+    void commit();
+
+    void build();
+
+    void refit();
+
+    // Appends the ids of every box that touches the frustum.
+    void queryFrustum(const Frustum &frustum, std::vector<uint32_t> &out) const;
+
+    // Appends the ids of every box that overlaps `range`.
+    void queryRange(const AABB &range, std::vector<uint32_t> &out) const;
+
+    /*
+     * Closest box hit by the ray within maxDistance. Boxes that contain the origin are skipped, so a camera
+     * inside something (a skybox) can still pick what it's looking at. `direction` doesn't have to be normalized;
+     * distances are in multiples of it.
+     */
+    bool raycast(const float *origin, const float *direction, float maxDistance, uint32_t &hitId,
+                 float &hitDistance) const;
+
+private:
+    std::vector<AABB> boxes; // Per item
+    std::vector<uint32_t> ids;
+    std::vector<uint32_t> leafOf; // Per item, BVH_NULL until it's in the tree
+    std::vector<uint32_t> slotOf; // Per item, where it is in `order`
+    std::unordered_map<uint32_t, uint32_t> itemOf;
+    std::vector<uint32_t> order; // Item indices, in leaf order. Removes leave holes until the next build
+    std::vector<uint32_t> pending; // Ids inserted since the last commit()
+    std::vector<uint32_t> freeNodes;
+    bool structureChanged = false;
+    bool moved = false;
+
+    uint32_t allocateNode();
+
+    uint32_t buildNode(uint32_t first, uint32_t count, const std::vector<float> &centroids, unsigned depth,
+                       uint32_t parent);
+
+    void setNodeBounds(BVHNode &node) const;
+
+    void insertLeaf(uint32_t item);
+
+    void removeFromLeaf(uint32_t item);
+
+    void replaceChild(uint32_t parent, uint32_t child, uint32_t replacement);
+
+    void refitUpwards(uint32_t index);
+
+    // Appends the ids of every item below the node.
+    void collect(uint32_t index, std::vector<uint32_t> &out) const;
+
+    float computeCost() const;
+};
+
+#endif
@@ -0,0 +1,184 @@
+//
+// Created by Grant on 2019-09-04.
+//
+// Headless BVH test. Usage: BVHTest
+// Inserts, removes and moves boxes for a number of rounds, committing after each, and checks queryRange,
+// queryFrustum and raycast against a brute force loop over every box. Exits with 1 if any of them differ, so it can
+// run as a CTest.
+//
+
+#include <iostream>
+#include <map>
+#include <random>
+#include <set>
+
+#include "culling.cpp"
+#include "bvh.cpp"
+
+// Column-major, like glm::perspective. The camera is at the origin looking down -z.
+static void perspective(float fovY, float aspect, float near, float far, float *out) {
+    float f = 1.0f / std::tan(fovY * 0.5f);
+    for (int i = 0; i < 16; i++) {
+        out[i] = 0;
+    }
+    out[0] = f / aspect;
+    out[5] = f;
+    out[10] = (far + near) / (near - far);
+    out[11] = -1;
+    out[14] = 2 * far * near / (near - far);
+}
+
+// The per box tests are the ones the BVH uses, so any difference comes from the tree itself.
+static unsigned checkQueries(const BVH &bvh, const std::map<uint32_t, AABB> &boxes, std::mt19937 &rng) {
+    std::uniform_real_distribution<float> position(-200, 200), size(5, 150), direction(-1, 1);
+    unsigned failed = 0;
+
+    AABB range;
+    for (int axis = 0; axis < 3; axis++) {
+        float center = position(rng), extent = size(rng);
+        range.min[axis] = center - extent;
+        range.max[axis] = center + extent;
+    }
+    std::vector<uint32_t> found;
+    bvh.queryRange(range, found);
+    std::set<uint32_t> rangeIds(found.begin(), found.end());
+    failed += rangeIds.size() != found.size(); // Duplicates
+    for (const auto &entry : boxes) {
+        failed += overlaps(range, entry.second.min, entry.second.max) != bool(rangeIds.count(entry.first));
+    }
+
+    float viewProj[16];
+    perspective(1.2f, 1.5f, 0.1f, size(rng) * 2, viewProj);
+    Frustum frustum = extractFrustum(viewProj);
+    found.clear();
+    bvh.queryFrustum(frustum, found);
+    std::set<uint32_t> frustumIds(found.begin(), found.end());
+    failed += frustumIds.size() != found.size();
+    for (const auto &entry : boxes) {
+        bool visible = classify(frustum, entry.second.min, entry.second.max) != FRUSTUM_OUTSIDE;
+        failed += visible != bool(frustumIds.count(entry.first));
+    }
+
+    float origin[3], dir[3], invDir[3];
+    for (int axis = 0; axis < 3; axis++) {
+        origin[axis] = position(rng);
+        dir[axis] = direction(rng);
+        invDir[axis] = 1.0f / dir[axis];
+    }
+    float maxDistance = 1000;
+    bool expectHit = false;
+    float expectDistance = maxDistance;
+    for (const auto &entry : boxes) {
+        float enter;
+        if (rayBox(origin, invDir, entry.second.min, entry.second.max, expectDistance, enter) && enter >= 0 &&
+            enter < expectDistance) {
+            expectDistance = enter;
+            expectHit = true;
+        }
+    }
+    uint32_t hitId = BVH_NULL;
+    float hitDistance = 0;
+    bool hit = bvh.raycast(origin, dir, maxDistance, hitId, hitDistance);
+    failed += hit != expectHit;
+    if (hit && expectHit) {
+        // Boxes can be hit at exactly the same distance, so only the distance has to match.
+        failed += hitDistance != expectDistance || !boxes.count(hitId);
+    }
+
+    return failed;
+}
+
+int main() {
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> position(-300, 300), size(0.5f, 8), offset(-5, 5);
+    auto randomBox = [&]() {
+        AABB box;
+        for (int axis = 0; axis < 3; axis++) {
+            float center = position(rng), extent = size(rng);
+            box.min[axis] = center - extent;
+            box.max[axis] = center + extent;
+        }
+        return box;
+    };
+    auto randomId = [&](const std::map<uint32_t, AABB> &boxes) {
+        auto it = boxes.begin();
+        std::advance(it, rng() % boxes.size());
+        return it->first;
+    };
+
+    BVH bvh;
+    std::map<uint32_t, AABB> boxes; // What the BVH should hold
+    std::vector<uint32_t> removed;  // Ids to reuse, like GameObject slots
+    uint32_t nextId = 0;
+    for (int i = 0; i < 2000; i++) {
+        boxes[nextId] = randomBox();
+        bvh.insert(nextId, boxes[nextId]);
+        nextId++;
+    }
+    bvh.commit();
+
+    unsigned failed = 0, incremental = 0;
+    const unsigned rounds = 100;
+    for (unsigned round = 0; round < rounds; round++) {
+        // Some rounds change a few items and stay incremental, others change enough to rebuild.
+        unsigned changes = round % 10 == 9 ? 600 : 1 + rng() % 40;
+        for (unsigned i = 0; i < changes; i++) {
+            uint32_t id;
+            if (!removed.empty() && rng() % 2) {
+                id = removed.back();
+                removed.pop_back();
+            } else {
+                id = nextId++;
+            }
+            boxes[id] = randomBox();
+            bvh.insert(id, boxes[id]);
+
+            id = randomId(boxes);
+            failed += !bvh.remove(id);
+            boxes.erase(id);
+            removed.push_back(id);
+        }
+        for (unsigned i = 0; i < changes * 2; i++) {
+            uint32_t id = randomId(boxes);
+            AABB &box = boxes[id];
+            for (int axis = 0; axis < 3; axis++) {
+                float by = offset(rng);
+                box.min[axis] += by;
+                box.max[axis] += by;
+            }
+            bvh.update(id, box);
+        }
+        failed += bvh.remove(nextId + 1); // Was never inserted
+
+        bvh.commit();
+        incremental += bvh.stats.incremental > 0;
+        failed += bvh.size() != boxes.size();
+        for (int query = 0; query < 4; query++) {
+            failed += checkQueries(bvh, boxes, rng);
+        }
+    }
+
+    std::cout << (failed ? "[FAIL] " : "[PASS] ") << rounds << " rounds of inserts, removes and moves: " << failed
+              << " mismatches" << std::endl;
+    std::cout << bvh.stats.builds << " builds, " << incremental << " rounds incremental, " << bvh.nodeCount()
+              << " nodes" << std::endl;
+
+    // Incremental updates that never happen would make the rounds above test nothing but build().
+    bool ok = incremental > 0;
+    std::cout << (ok ? "[PASS] " : "[FAIL] ") << "incremental updates were used" << std::endl;
+    failed += !ok;
+
+    for (const auto &entry : boxes) {
+        bvh.remove(entry.first);
+    }
+    boxes.clear();
+    bvh.commit();
+    float origin[3] = {0, 0, 0}, dir[3] = {1, 0, 0};
+    uint32_t hitId;
+    float hitDistance;
+    ok = bvh.size() == 0 && bvh.nodeCount() == 0 && !bvh.raycast(origin, dir, 1e9f, hitId, hitDistance);
+    std::cout << (ok ? "[PASS] " : "[FAIL] ") << "everything removed" << std::endl;
+    failed += !ok;
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,186 @@
+//
+// Created by Grant on 2019-08-24.
+//
+
+#include "cooked.h"
+#include "bcn.cpp"
+
+#include <fstream>
+#include <iostream>
+
+#ifndef _WIN32
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#endif
+
+bool MappedFile::open(const std::string &path) {
+    close();
+
+#ifndef _WIN32
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+
+    struct stat info = {};
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+
+    void *mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd); // The mapping keeps the file alive
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+
+    data = (const unsigned char *) mapped;
+    size = info.st_size;
+#else
+    std::ifstream stream(path, std::ios::binary | std::ios::ate);
+    if (!stream.is_open()) {
+        return false;
+    }
+
+    fallback.resize(stream.tellg());
+    stream.seekg(0);
+    stream.read((char *) fallback.data(), fallback.size());
+    data = fallback.data();
+    size = fallback.size();
+#endif
+
+    return true;
+}
+
+void MappedFile::close() {
+#ifndef _WIN32
+    if (data) {
+        munmap((void *) data, size);
+    }
+#endif
+    fallback.clear();
+    data = nullptr;
+    size = 0;
+}
+
+bool CookedTexture::open(const MappedFile &file) {
+    if (file.size < sizeof(CookedTextureHeader)) {
+        return false;
+    }
+
+    header = (const CookedTextureHeader *) file.data;
+    mips = (const CookedMip *) (file.data + sizeof(CookedTextureHeader));
+    base = file.data;
+
+    if (std::memcmp(header->magic, COOKED_TEXTURE_MAGIC, 4) != 0 || header->version != COOKED_TEXTURE_VERSION ||
+        header->width == 0 || header->height == 0 || header->mipCount == 0 || header->mipCount > 32 ||
+        (header->format != COOKED_RGBA8 && !isCompressedFormat(header->format)) ||
+        file.size < sizeof(CookedTextureHeader) + header->mipCount * sizeof(CookedMip)) {
+        return false;
+    }
+
+    // Every level has to be exactly what glTexImage2D/glCompressedTexImage2D will read for it, inside the file.
+    uint64_t tableEnd = sizeof(CookedTextureHeader) + header->mipCount * sizeof(CookedMip);
+    for (uint32_t i = 0; i < header->mipCount; i++) {
+        const CookedMip &mip = mips[i];
+        uint32_t width = std::max(1u, header->width >> i), height = std::max(1u, header->height >> i);
+        uint64_t expected = header->format == COOKED_RGBA8 ? uint64_t(width) * height * 4
+                                                            : compressedSize(header->format, int(width), int(height));
+        if (mip.width != width || mip.height != height || mip.size != expected || mip.offset < tableEnd ||
+            mip.offset > file.size || mip.size > file.size - mip.offset) { // Corrupt or truncated
+            return false;
+        }
+    }
+
+    return true;
+}
+
+const unsigned char *CookedTexture::pixels(uint32_t level) const {
+    return base + mips[level].offset;
+}
+
+bool endsWith(const std::string &str, const std::string &suffix) {
+    return str.size() >= suffix.size() && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+std::string cookedTexturePath(const std::string &imagePath) {
+    size_t slash = imagePath.find_last_of("/\\");
+    std::string name = slash == std::string::npos ? imagePath : imagePath.substr(slash + 1);
+    size_t dot = name.find_last_of('.');
+    if (dot != std::string::npos) {
+        name.resize(dot);
+    }
+
+    return COOKED_TEXTURE_DIR + "/" + name + COOKED_TEXTURE_EXT;
+}
+
+std::vector<std::vector<unsigned char>> buildMipChain(const unsigned char *rgba, int width, int height) {
+    std::vector<std::vector<unsigned char>> levels;
+    levels.emplace_back(rgba, rgba + size_t(width) * height * 4);
+
+    while (width > 1 || height > 1) {
+        const std::vector<unsigned char> &src = levels.back();
+        int w = std::max(1, width / 2);
+        int h = std::max(1, height / 2);
+        std::vector<unsigned char> dst(size_t(w) * h * 4);
+
+        for (int y = 0; y < h; y++) {
+            // Clamp for odd sizes (and 1 pixel wide/tall levels)
+            int y0 = std::min(y * 2, height - 1), y1 = std::min(y * 2 + 1, height - 1);
+            for (int x = 0; x < w; x++) {
+                int x0 = std::min(x * 2, width - 1), x1 = std::min(x * 2 + 1, width - 1);
+                for (int c = 0; c < 4; c++) {
+                    unsigned sum = src[(size_t(y0) * width + x0) * 4 + c] + src[(size_t(y0) * width + x1) * 4 + c] +
+                                   src[(size_t(y1) * width + x0) * 4 + c] + src[(size_t(y1) * width + x1) * 4 + c];
+                    dst[(size_t(y) * w + x) * 4 + c] = (unsigned char) ((sum + 2) / 4);
+                }
+            }
+        }
+
+        levels.push_back(dst);
+        width = w;
+        height = h;
+    }
+
+    return levels;
+}
+
+bool writeCookedTexture(const std::string &path, int width, int height, uint32_t format,
+                        const std::vector<std::vector<unsigned char>> &levels) {
+    CookedTextureHeader header = {};
+    std::memcpy(header.magic, COOKED_TEXTURE_MAGIC, 4);
+    header.version = COOKED_TEXTURE_VERSION;
+    header.width = width;
+    header.height = height;
+    header.format = format;
+    header.mipCount = levels.size();
+    header.flags = COOKED_FLIPPED;
+
+    std::vector<CookedMip> mips;
+    uint64_t offset = sizeof(CookedTextureHeader) + levels.size() * sizeof(CookedMip);
+    for (size_t i = 0; i < levels.size(); i++) {
+        offset = (offset + COOKED_ALIGNMENT - 1) / COOKED_ALIGNMENT * COOKED_ALIGNMENT;
+        mips.push_back({uint32_t(std::max(1, width >> i)), uint32_t(std::max(1, height >> i)), offset,
+                        levels[i].size()});
+        offset += levels[i].size();
+    }
+
+    std::ofstream out(path, std::ios::binary);
+    if (!out.is_open()) {
+        return false;
+    }
+
+    out.write((const char *) &header, sizeof(header));
+    out.write((const char *) mips.data(), mips.size() * sizeof(CookedMip));
+    for (size_t i = 0; i < levels.size(); i++) {
+        static const char padding[COOKED_ALIGNMENT] = {};
+        out.write(padding, mips[i].offset - out.tellp());
+        out.write((const char *) levels[i].data(), levels[i].size());
+    }
+
+    return out.good();
+}
@@ -0,0 +1,95 @@
+//
+// Created by Grant on 2019-08-24.
+//
+#pragma once
+
+#ifndef GRANT_COOKED_H_DEFINED
+#define GRANT_COOKED_H_DEFINED
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "bcn.h"
+
+/*
+ * Cooked texture container (.gltx), written by the TextureCooker tool (`make cook_textures`).
+ *
+ * [CookedTextureHeader][CookedMip x mipCount][padding][level 0 pixels][level 1 pixels]...
+ *
+ * Pixels are already flipped for OpenGL and every level is 16-byte aligned, so the file can be memory-mapped
+ * and handed straight to glTexImage2D. Everything is stored in native (little) endian.
+ */
+const char COOKED_TEXTURE_MAGIC[4] = {'G', 'L', 'T', 'X'};
+const uint32_t COOKED_TEXTURE_VERSION = 1;
+const uint32_t COOKED_ALIGNMENT = 16;
+
+const uint32_t COOKED_RGBA8 = 0x8058; // GL_RGBA8, otherwise one of the compressed formats from bcn.h
+
+const uint32_t COOKED_FLIPPED = 1u << 0u;
+
+std::string COOKED_TEXTURE_DIR = "./res/cooked";
+const char *COOKED_TEXTURE_EXT = ".gltx";
+
+struct CookedTextureHeader {
+public:
+    char magic[4];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t format; // OpenGL internal format of every level
+    uint32_t mipCount;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+struct CookedMip {
+public:
+    uint32_t width;
+    uint32_t height;
+    uint64_t offset; // From the start of the file
+    uint64_t size;
+};
+
+/*
+ * Read-only memory-mapped file. Falls back to reading the whole file where mmap isn't available.
+ */
+class MappedFile {
+public:
+    const unsigned char *data = nullptr;
+    size_t size = 0;
+
+    bool open(const std::string &path);
+
+    void close();
+
+private:
+    std::vector<unsigned char> fallback;
+};
+
+// Points into a MappedFile. Only valid as long as the file stays mapped.
+struct CookedTexture {
+public:
+    const CookedTextureHeader *header = nullptr;
+    const CookedMip *mips = nullptr;
+    const unsigned char *base = nullptr;
+
+    bool open(const MappedFile &file);
+
+    const unsigned char *pixels(uint32_t level) const;
+};
+
+bool endsWith(const std::string &str, const std::string &suffix);
+
+// Where `make cook_textures` puts the cooked version of an image, e.g. tex0.png -> ./res/cooked/tex0.gltx
+std::string cookedTexturePath(const std::string &imagePath);
+
+// Box-filters RGBA8 pixels down to 1x1. Level 0 is a copy of the input.
+std::vector<std::vector<unsigned char>> buildMipChain(const unsigned char *rgba, int width, int height);
+
+bool writeCookedTexture(const std::string &path, int width, int height, uint32_t format,
+                        const std::vector<std::vector<unsigned char>> &levels);
+
+#endif
@@ -0,0 +1,79 @@
+//
+// Created by Grant on 2019-08-24.
+//
+// Offline texture cooker. Usage: TextureCooker [--compress] <output dir> <image>...
+// Run through `make cook_textures` to cook everything in res/textures.
+// --compress stores BC1 (opaque) or BC3 (with alpha) instead of RGBA8.
+//
+
+#define STB_IMAGE_IMPLEMENTATION
+
+#include <STB/stb_image.h>
+
+#include <filesystem>
+#include <iostream>
+
+#include "cooked.cpp"
+
+int main(int argc, char **argv) {
+    int arg = 1;
+    bool compress = false;
+    if (arg < argc && std::string(argv[arg]) == "--compress") {
+        compress = true;
+        arg++;
+    }
+
+    if (argc - arg < 2) {
+        std::cerr << "Usage: " << argv[0] << " [--compress] <output dir> <image>..." << std::endl;
+        return 1;
+    }
+
+    COOKED_TEXTURE_DIR = argv[arg++];
+    std::error_code err;
+    std::filesystem::create_directories(COOKED_TEXTURE_DIR, err);
+
+    stbi_set_flip_vertically_on_load(1); // Same as the runtime used to do, so the cooked pixels are GL-ready.
+
+    int failed = 0;
+    for (int i = arg; i < argc; i++) {
+        std::string path = argv[i];
+        int width, height, bits;
+        unsigned char *pixels = stbi_load(path.c_str(), &width, &height, &bits, 4); // 4 channels for RGBA
+        if (!pixels) {
+            std::cerr << "Failed to load " << path << ": " << stbi_failure_reason() << " // Skipping..." << std::endl;
+            failed++;
+            continue;
+        }
+
+        std::vector<std::vector<unsigned char>> levels = buildMipChain(pixels, width, height);
+        uint32_t format = compress ? chooseCompressedFormat(pixels, width, height) : COOKED_RGBA8;
+        stbi_image_free(pixels);
+
+        size_t rawBytes = 0, cookedBytes = 0;
+        for (size_t level = 0; level < levels.size(); level++) {
+            rawBytes += levels[level].size();
+            if (compress) {
+                levels[level] = compressImage(levels[level].data(), std::max(1, width >> level),
+                                              std::max(1, height >> level), format);
+            }
+            cookedBytes += levels[level].size();
+        }
+
+        std::string outPath = cookedTexturePath(path);
+        if (!writeCookedTexture(outPath, width, height, format, levels)) {
+            std::cerr << "Failed to write " << outPath << std::endl;
+            failed++;
+            continue;
+        }
+
+        std::cout << "Cooked " << path << " -> " << outPath << " (" << width << "x" << height << ", "
+                  << levels.size() << " mips";
+        if (compress) {
+            std::cout << ", " << (format == BC1_FORMAT ? "BC1" : "BC3") << ": " << cookedBytes / 1024 << "KB, saved "
+                      << (rawBytes - cookedBytes) / 1024 << "KB";
+        }
+        std::cout << ")" << std::endl;
+    }
+
+    return failed == 0 ? 0 : 1;
+}
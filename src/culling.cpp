@@ -0,0 +1,196 @@
+//
+// Created by Grant on 2019-08-30.
+//
+
+#include "culling.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__AVX__)
+
+#include <immintrin.h>
+
+#define CULLING_AVX
+const char *CULLING_SIMD = "AVX";
+
+#elif defined(__SSE2__) || defined(_M_X64)
+
+#include <emmintrin.h>
+
+#define CULLING_SSE
+const char *CULLING_SIMD = "SSE";
+
+#else
+
+const char *CULLING_SIMD = "scalar";
+
+#endif
+
+Frustum extractFrustum(const float *m) {
+    // Row i of a column-major matrix is m[i], m[4 + i], m[8 + i], m[12 + i].
+    auto row = [m](int i, int j) { return m[j * 4 + i]; };
+
+    Frustum frustum = {};
+    for (int j = 0; j < 4; j++) {
+        frustum.planes[0][j] = row(3, j) + row(0, j); // Left
+        frustum.planes[1][j] = row(3, j) - row(0, j); // Right
+        frustum.planes[2][j] = row(3, j) + row(1, j); // Bottom
+        frustum.planes[3][j] = row(3, j) - row(1, j); // Top
+        frustum.planes[4][j] = row(3, j) + row(2, j); // Near
+        frustum.planes[5][j] = row(3, j) - row(2, j); // Far
+    }
+
+    for (float *plane : frustum.planes) {
+        float length = std::sqrt(plane[0] * plane[0] + plane[1] * plane[1] + plane[2] * plane[2]);
+        if (length > 0) {
+            for (int j = 0; j < 4; j++) {
+                plane[j] /= length;
+            }
+        }
+    }
+    return frustum;
+}
+
+void BoundsSoA::resize(size_t count) {
+    centerX.resize(count);
+    centerY.resize(count);
+    centerZ.resize(count);
+    extentX.resize(count);
+    extentY.resize(count);
+    extentZ.resize(count);
+}
+
+size_t BoundsSoA::size() const {
+    return centerX.size();
+}
+
+void BoundsSoA::set(size_t index, const float *boundsMin, const float *boundsMax, const float *m) {
+    float c[3], e[3];
+    for (int i = 0; i < 3; i++) {
+        c[i] = (boundsMin[i] + boundsMax[i]) * 0.5f;
+        e[i] = (boundsMax[i] - boundsMin[i]) * 0.5f;
+    }
+
+    // The extents of the rotated box are the absolute values of the matrix times the old extents (Arvo 1990).
+    float wc[3], we[3];
+    for (int r = 0; r < 3; r++) {
+        wc[r] = m[r] * c[0] + m[4 + r] * c[1] + m[8 + r] * c[2] + m[12 + r];
+        we[r] = std::abs(m[r]) * e[0] + std::abs(m[4 + r]) * e[1] + std::abs(m[8 + r]) * e[2];
+    }
+
+    centerX[index] = wc[0];
+    centerY[index] = wc[1];
+    centerZ[index] = wc[2];
+    extentX[index] = we[0];
+    extentY[index] = we[1];
+    extentZ[index] = we[2];
+}
+
+bool boxVisible(const Frustum &frustum, float cx, float cy, float cz, float ex, float ey, float ez) {
+    for (const float *p : frustum.planes) {
+        float distance = p[0] * cx + p[1] * cy + p[2] * cz + p[3];
+        float radius = std::abs(p[0]) * ex + std::abs(p[1]) * ey + std::abs(p[2]) * ez;
+        if (distance + radius < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * A box is outside if it's completely behind any plane: distance(center) + projected radius < 0.
+ * The SIMD versions do the same for a whole register of boxes at a time, one plane after another.
+ */
+size_t cullBoxes(const Frustum &frustum, const BoundsSoA &bounds, uint8_t *visible) {
+    return cullBoxes(frustum, bounds, 0, bounds.size(), visible);
+}
+
+size_t cullBoxes(const Frustum &frustum, const BoundsSoA &bounds, size_t begin, size_t end, uint8_t *visible) {
+    size_t count = std::min(end, bounds.size());
+    size_t i = begin;
+    size_t visibleCount = 0;
+
+#ifdef CULLING_AVX
+    __m256 nx[6], ny[6], nz[6], nw[6], ax[6], ay[6], az[6];
+    for (int p = 0; p < 6; p++) {
+        nx[p] = _mm256_set1_ps(frustum.planes[p][0]);
+        ny[p] = _mm256_set1_ps(frustum.planes[p][1]);
+        nz[p] = _mm256_set1_ps(frustum.planes[p][2]);
+        nw[p] = _mm256_set1_ps(frustum.planes[p][3]);
+        ax[p] = _mm256_set1_ps(std::abs(frustum.planes[p][0]));
+        ay[p] = _mm256_set1_ps(std::abs(frustum.planes[p][1]));
+        az[p] = _mm256_set1_ps(std::abs(frustum.planes[p][2]));
+    }
+
+    __m256 zero = _mm256_setzero_ps();
+    for (; i + 8 <= count; i += 8) {
+        __m256 cx = _mm256_loadu_ps(&bounds.centerX[i]);
+        __m256 cy = _mm256_loadu_ps(&bounds.centerY[i]);
+        __m256 cz = _mm256_loadu_ps(&bounds.centerZ[i]);
+        __m256 ex = _mm256_loadu_ps(&bounds.extentX[i]);
+        __m256 ey = _mm256_loadu_ps(&bounds.extentY[i]);
+        __m256 ez = _mm256_loadu_ps(&bounds.extentZ[i]);
+
+        __m256 outside = zero;
+        for (int p = 0; p < 6; p++) {
+            __m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx[p], cx), _mm256_mul_ps(ny[p], cy)),
+                                            _mm256_add_ps(_mm256_mul_ps(nz[p], cz), nw[p]));
+            __m256 radius = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ax[p], ex), _mm256_mul_ps(ay[p], ey)),
+                                          _mm256_mul_ps(az[p], ez));
+            outside = _mm256_or_ps(outside, _mm256_cmp_ps(_mm256_add_ps(distance, radius), zero, _CMP_LT_OQ));
+        }
+
+        int mask = _mm256_movemask_ps(outside);
+        for (int j = 0; j < 8; j++) {
+            visible[i + j] = ((mask >> j) & 1) ^ 1;
+            visibleCount += visible[i + j];
+        }
+    }
+#elif defined(CULLING_SSE)
+    __m128 nx[6], ny[6], nz[6], nw[6], ax[6], ay[6], az[6];
+    for (int p = 0; p < 6; p++) {
+        nx[p] = _mm_set1_ps(frustum.planes[p][0]);
+        ny[p] = _mm_set1_ps(frustum.planes[p][1]);
+        nz[p] = _mm_set1_ps(frustum.planes[p][2]);
+        nw[p] = _mm_set1_ps(frustum.planes[p][3]);
+        ax[p] = _mm_set1_ps(std::abs(frustum.planes[p][0]));
+        ay[p] = _mm_set1_ps(std::abs(frustum.planes[p][1]));
+        az[p] = _mm_set1_ps(std::abs(frustum.planes[p][2]));
+    }
+
+    __m128 zero = _mm_setzero_ps();
+    for (; i + 4 <= count; i += 4) {
+        __m128 cx = _mm_loadu_ps(&bounds.centerX[i]);
+        __m128 cy = _mm_loadu_ps(&bounds.centerY[i]);
+        __m128 cz = _mm_loadu_ps(&bounds.centerZ[i]);
+        __m128 ex = _mm_loadu_ps(&bounds.extentX[i]);
+        __m128 ey = _mm_loadu_ps(&bounds.extentY[i]);
+        __m128 ez = _mm_loadu_ps(&bounds.extentZ[i]);
+
+        __m128 outside = zero;
+        for (int p = 0; p < 6; p++) {
+            __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx[p], cx), _mm_mul_ps(ny[p], cy)),
+                                         _mm_add_ps(_mm_mul_ps(nz[p], cz), nw[p]));
+            __m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax[p], ex), _mm_mul_ps(ay[p], ey)),
+                                       _mm_mul_ps(az[p], ez));
+            outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(distance, radius), zero));
+        }
+
+        int mask = _mm_movemask_ps(outside);
+        for (int j = 0; j < 4; j++) {
+            visible[i + j] = ((mask >> j) & 1) ^ 1;
+            visibleCount += visible[i + j];
+        }
+    }
+#endif
+
+    // Whatever doesn't fill a register
+    for (; i < count; i++) {
+        visible[i] = boxVisible(frustum, bounds.centerX[i], bounds.centerY[i], bounds.centerZ[i],
+                                bounds.extentX[i], bounds.extentY[i], bounds.extentZ[i]);
+        visibleCount += visible[i];
+    }
+
+    return visibleCount;
+}
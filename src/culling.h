@@ -0,0 +1,57 @@
+//
+// Created by Grant on 2019-08-30.
+//
+#pragma once
+
+#ifndef GRANT_CULLING_H_DEFINED
+#define GRANT_CULLING_H_DEFINED
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+ * View-frustum culling on axis-aligned bounding boxes. Matrices are column-major float[16] (glm's layout),
+ * so `&matrix[0][0]` can be passed straight in.
+ */
+
+// Planes are (a, b, c, d) with a*x + b*y + c*z + d >= 0 on the inside, normalized.
+// Order: left, right, bottom, top, near, far.
+struct Frustum {
+public:
+    float planes[6][4];
+};
+
+// Gribb & Hartmann: the planes fall out of the rows of the matrix. Gives world space planes for proj * view.
+Frustum extractFrustum(const float *viewProj);
+
+/*
+ * Boxes as center + half extents, one array per component, so the test can load the same component of
+ * 4 (SSE) or 8 (AVX) boxes with a single instruction.
+ */
+struct BoundsSoA {
+public:
+    std::vector<float> centerX, centerY, centerZ;
+    std::vector<float> extentX, extentY, extentZ;
+
+    void resize(size_t count);
+
+    size_t size() const;
+
+    // World space box around the object space box [boundsMin, boundsMax] transformed by an affine matrix.
+    void set(size_t index, const float *boundsMin, const float *boundsMax, const float *transform);
+};
+
+// Which instruction set cullBoxes() was compiled with: "AVX", "SSE" or "scalar".
+extern const char *CULLING_SIMD;
+
+// visible[i] is set to 1 if box i touches the frustum and 0 if it's completely outside one of the planes.
+// Returns the number of visible boxes.
+size_t cullBoxes(const Frustum &frustum, const BoundsSoA &bounds, uint8_t *visible);
+
+// Only boxes [begin, end), so separate ranges can be culled on separate threads. visible is still indexed from 0.
+size_t cullBoxes(const Frustum &frustum, const BoundsSoA &bounds, size_t begin, size_t end, uint8_t *visible);
+
+bool boxVisible(const Frustum &frustum, float cx, float cy, float cz, float ex, float ey, float ez);
+
+#endif
@@ -0,0 +1,220 @@
+//
+// Created by Grant on 2019-09-03.
+//
+
+#include "jobs.h"
+
+#include <algorithm>
+
+// Which JobSystem the calling thread works for, and as which thread.
+static thread_local const JobSystem *jobThreadSystem = nullptr;
+static thread_local unsigned jobThreadIndex = 0;
+
+bool JobCounter::done() const {
+    return pending.load() == 0;
+}
+
+void JobSystem::init(unsigned threads) {
+    if (threads == 0) {
+        threads = std::max(2u, std::thread::hardware_concurrency()) - 1; // The calling thread makes up the rest
+    }
+
+    stopping = false;
+    queues.clear();
+    for (unsigned i = 0; i <= threads; i++) {
+        queues.emplace_back(new Queue());
+    }
+    stats.assign(threads + 1, {});
+    statsStart = std::chrono::steady_clock::now();
+
+    jobThreadSystem = this;
+    jobThreadIndex = 0;
+    for (unsigned i = 1; i <= threads; i++) {
+        workers.emplace_back(&JobSystem::work, this, i);
+    }
+}
+
+unsigned JobSystem::threadCount() const {
+    return unsigned(queues.size());
+}
+
+unsigned JobSystem::currentThread() const {
+    return jobThreadSystem == this ? jobThreadIndex : 0;
+}
+
+void JobSystem::run(std::function<void()> job, JobCounter *counter, JobCounter *after) {
+    if (counter) {
+        counter->pending++;
+    }
+
+    if (queues.empty()) { // Not initialized, or shut down
+        job();
+        finish(0, counter);
+        return;
+    }
+
+    if (after) {
+        // finish() empties `waiting` under the same lock once pending reaches zero, so the job can't get lost.
+        std::lock_guard<std::mutex> guard(after->lock);
+        if (after->pending.load() > 0) {
+            after->waiting.push_back({std::move(job), counter});
+            return;
+        }
+    }
+
+    push(currentThread(), {std::move(job), counter});
+}
+
+void JobSystem::wait(JobCounter &counter) {
+    unsigned thread = currentThread();
+    while (!counter.done()) {
+        Job job;
+        if (!queues.empty() && pop(thread, job)) {
+            execute(thread, job);
+        } else {
+            std::this_thread::yield(); // The rest is running on other threads
+        }
+    }
+
+    // The last finish() may still be holding the lock, wait for it before the counter can go out of scope.
+    std::lock_guard<std::mutex> guard(counter.lock);
+}
+
+void JobSystem::parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)> &body) {
+    grain = std::max<size_t>(grain, 1);
+    if (count <= grain || workers.empty()) {
+        if (count > 0) {
+            body(0, count);
+        }
+        return;
+    }
+
+    JobCounter counter;
+    for (size_t begin = 0; begin < count; begin += grain) {
+        size_t end = std::min(count, begin + grain);
+        run([&body, begin, end]() { body(begin, end); }, &counter);
+    }
+    wait(counter);
+}
+
+void JobSystem::collectStats() {
+    auto now = std::chrono::steady_clock::now();
+    double wallMs = std::chrono::duration<double, std::milli>(now - statsStart).count();
+    statsStart = now;
+
+    stats.resize(queues.size());
+    for (size_t i = 0; i < queues.size(); i++) {
+        Queue &queue = *queues[i];
+        WorkerStats &worker = stats[i];
+        worker.jobs = queue.ran.exchange(0);
+        worker.steals = queue.steals.exchange(0);
+        worker.busyMs = double(queue.busyNs.exchange(0)) / 1e6;
+        worker.utilization = wallMs > 0 ? std::min(1.0, worker.busyMs / wallMs) : 0;
+    }
+}
+
+void JobSystem::shutdown() {
+    {
+        std::lock_guard<std::mutex> guard(sleepLock);
+        stopping = true;
+    }
+    wake.notify_all();
+
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+    queues.clear();
+}
+
+void JobSystem::push(unsigned thread, Job job) {
+    {
+        std::lock_guard<std::mutex> guard(queues[thread]->lock);
+        queues[thread]->jobs.push_back(std::move(job));
+        queued++;
+    }
+
+    // Taking sleepLock means a worker is either before its check of `queued` or already waiting for the notify.
+    { std::lock_guard<std::mutex> guard(sleepLock); }
+    wake.notify_one();
+}
+
+bool JobSystem::pop(unsigned thread, Job &job) {
+    {
+        Queue &own = *queues[thread];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.jobs.empty()) {
+            job = std::move(own.jobs.back());
+            own.jobs.pop_back();
+            queued--;
+            return true;
+        }
+    }
+
+    // Steal the oldest job of someone else, starting with the next thread so thieves spread out.
+    for (size_t i = 1; i < queues.size(); i++) {
+        Queue &victim = *queues[(thread + i) % queues.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.jobs.empty()) {
+            job = std::move(victim.jobs.front());
+            victim.jobs.pop_front();
+            queued--;
+            queues[thread]->steals++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void JobSystem::execute(unsigned thread, Job &job) {
+    auto start = std::chrono::steady_clock::now();
+    job.run();
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+
+    Queue &queue = *queues[thread];
+    queue.busyNs += uint64_t(ns.count());
+    queue.ran++;
+    finish(thread, job.counter);
+}
+
+void JobSystem::finish(unsigned thread, JobCounter *counter) {
+    if (!counter) {
+        return;
+    }
+
+    std::vector<Job> ready;
+    {
+        std::lock_guard<std::mutex> guard(counter->lock);
+        if (--counter->pending == 0) {
+            ready.swap(counter->waiting);
+        }
+    }
+
+    for (Job &job : ready) {
+        if (queues.empty()) {
+            job.run();
+            finish(thread, job.counter);
+        } else {
+            push(thread, std::move(job));
+        }
+    }
+}
+
+void JobSystem::work(unsigned thread) {
+    jobThreadSystem = this;
+    jobThreadIndex = thread;
+
+    while (true) {
+        Job job;
+        if (pop(thread, job)) {
+            execute(thread, job);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(sleepLock);
+        wake.wait(guard, [this]() { return stopping || queued.load() > 0; });
+        if (stopping && queued.load() == 0) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,116 @@
+//
+// Created by Grant on 2019-09-03.
+//
+#pragma once
+
+#ifndef GRANT_JOBS_H_DEFINED
+#define GRANT_JOBS_H_DEFINED
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class JobCounter;
+
+struct Job {
+public:
+    std::function<void()> run;
+    JobCounter *counter; // Decremented once run() returns, can be null
+};
+
+/*
+ * Counts the jobs that were started with it and haven't finished yet. Jobs can also be held back until a counter
+ * drops to zero (see JobSystem::run), which is how dependencies between frame phases are expressed.
+ */
+class JobCounter {
+public:
+    std::atomic<unsigned> pending{0};
+
+    bool done() const;
+
+private:
+    friend class JobSystem;
+
+    std::mutex lock;
+    std::vector<Job> waiting; // Started as soon as pending drops to zero
+};
+
+struct WorkerStats {
+public:
+    unsigned jobs = 0;
+    unsigned steals = 0; // Jobs taken from another thread's deque
+    double busyMs = 0;
+    double utilization = 0; // busyMs over the time since the previous collectStats()
+};
+
+/*
+ * Work-stealing scheduler. Every thread has its own deque: jobs are pushed to and popped from the back of the
+ * running thread's deque (newest first, so the data is still in cache), and idle threads steal from the front of
+ * the others'. Thread 0 is whoever called init(), usually the GL thread; it has a deque too and runs jobs whenever
+ * it wait()s, so it never just blocks while there's work left.
+ */
+class JobSystem {
+public:
+    std::vector<std::thread> workers;
+    std::vector<WorkerStats> stats; // By thread, 0 first. Filled in by collectStats()
+
+    // threads is the number of workers besides the calling thread, 0 for one per remaining core.
+    void init(unsigned threads = 0);
+
+    // Including the thread that called init()
+    unsigned threadCount() const;
+
+    // Index of the calling thread, 0 for threads that aren't workers.
+    unsigned currentThread() const;
+
+    // counter (if any) goes up now and down once the job is done. The job doesn't start before `after` is done.
+    void run(std::function<void()> job, JobCounter *counter = nullptr, JobCounter *after = nullptr);
+
+    // Runs jobs until the counter is done.
+    void wait(JobCounter &counter);
+
+    // Calls body(begin, end) on ranges of at most `grain` items covering [0, count), then waits for all of them.
+    void parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)> &body);
+
+    // Moves the counts since the last call into `stats`.
+    void collectStats();
+
+    void shutdown();
+
+private:
+    struct Queue {
+    public:
+        std::mutex lock;
+        std::deque<Job> jobs;
+        std::atomic<uint64_t> busyNs{0};
+        std::atomic<unsigned> ran{0};
+        std::atomic<unsigned> steals{0};
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::atomic<unsigned> queued{0}; // In any deque
+    std::mutex sleepLock;
+    std::condition_variable wake;
+    std::atomic<bool> stopping{false};
+    std::chrono::steady_clock::time_point statsStart;
+
+    void push(unsigned thread, Job job);
+
+    bool pop(unsigned thread, Job &job);
+
+    void execute(unsigned thread, Job &job);
+
+    void finish(unsigned thread, JobCounter *counter);
+
+    void work(unsigned thread);
+};
+
+#endif
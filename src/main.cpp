@@ -1,5 +1,9 @@
 #include "renderer.cpp"
 
+constexpr UniformID U_TINT("u_Tint");
+constexpr UniformID U_MULT("u_Mult");
+constexpr UniformID U_TEXTURE("u_Texture");
+
 int main(void) {
 
     Renderer rend;
@@ -8,175 +12,136 @@ int main(void) {
         return 1;
     }
 
-    glFrontFace(GL_CW);
+    glState.setFrontFace(GL_CW);
 
     std::cout << "Successfully initialized OpenGL (with GLFW, GLEW, GLM, IMGUI, and STB) version "
               << glGetString(GL_VERSION) << std::endl;
 
-    float x = 0.5f;
-    float y = 0.0f;
-    float pos[] = {
-            -x, x, x, 0, 0, // 0
-            x, x, x, 1, 0, // 1
-            x, -x, x, 1, 1, //2
-            -x, -x, x, 0, 1, // 3
-
-            -x, x, -x, 0, 0, // 4
-            x, x, -x, 1, 0,// 5
-            x, -x, -x, 1, 1, // 6
-            -x, -x, -x, 0, 1, // 7
-
-            x, -x, x, 0, 1, // 8
-            x, x, x, 0, 0, // 9
-            x, x, x, 1, 1, // 10
-            -x, x, x, 0, 1, // 11
-            -x, x, x, 1, 0, // 12
-            -x, -x, x, 1, 1, // 13
-
-            -x, -x, x, 0, 0, // 14
-            x, -x, x, 1, 0, // 15
-
-    };
-
-    unsigned int index[] = {
-            0, 1, 2, 3,
-            7, 6, 5, 4,
-
-            9, 5, 6, 8, // (x, x; 0, 0), (x, x; 1, 0), (x, -x; 1, 1), (x, -x; 0, 1)
-            4, 5, 10, 11, // (-x, x, -x);(0, 0), (x, x, -x);(1, 0), (x, x, x);(1, 1), (-x, x, x);(0, 1)
-            4, 12, 13, 7, // (-x, x, x);(1, 0), (-x, -x, x);(1, 1);
-            14, 15, 6, 7 // (-x, -x, x);(0, 0), (x, -x, x);(1, 0)
-    };
-
-    unsigned int inwardIndx[] = {
-            3, 2, 1, 0,
-            4, 5, 6, 7,
-
-            8, 6, 5, 9, // (x, x; 0, 0), (x, x; 1, 0), (x, -x; 1, 1), (x, -x; 0, 1)
-            11, 10, 5, 4, // (-x, x, -x);(0, 0), (x, x, -x);(1, 0), (x, x, x);(1, 1), (-x, x, x);(0, 1)
-            7, 13, 12, 4, // (-x, x, x);(1, 0), (-x, -x, x);(1, 1);
-            7, 6, 15, 14 // (-x, -x, x);(0, 0), (x, -x, x);(1, 0)
-    };
-
-    VertexArray va;
-    va.bind();
-
-    VBLayout layout;
-    layout.addAttribute(3, GL_FLOAT, false); // Positions
-    layout.addAttribute(2, GL_FLOAT, false); // Texture coords
-
-    VertexBuffer buf(sizeof(pos), pos, GL_STATIC_DRAW);
-    buf.bind();
-
-    buf.setLayout(layout, va);
-
-    IndexBuffer ibo(24, index, GL_STATIC_DRAW);
-    ibo.bind();
-
-    IndexBuffer inIBO(24, inwardIndx, GL_STATIC_DRAW);
+    // Cooked into res/cooked by `make import_meshes`, or imported (and cooked) here the first time.
+    Model *cube = rend.meshes.load("./res/meshes/cube.obj");
+    Model *inCube = rend.meshes.load("./res/meshes/skybox.obj");
+    Model *sphere = rend.meshes.load("./res/meshes/sphere.obj");
+    if (!cube || !inCube || !sphere) {
+        return 1;
+    }
 
     glm::vec3 skyboxScale = glm::vec3(12, 12, 12);
 
-    ShaderProgram sp("./res/shaders/default");
-    sp.bind();
-
-    ImVec4 tint = ImVec4(0.0f, 0.0f, 0.0f, 0.0f);
-    sp.setUniform4f("u_Tint", 0, 0, 0, 0);
-    sp.setUniform4f("u_Mult", 1, 1, 1, 1);
+    ShaderBatch shaders;
+    ShaderPermutations defaultShaders("./res/shaders/default");
+    const uint32_t GREYSCALE = defaultShaders.feature("GREYSCALE");
+    const uint32_t TEXTURE_ARRAY = defaultShaders.feature("TEXTURE_ARRAY");
 
-    sp.setUniform1i("u_Texture", 0);
-    sp.setUniformMat4f("u_MVP", IDENTITY_MAT4);
+    ShaderProgram *sp = defaultShaders.get(0, &shaders);
 
     stbi_set_flip_vertically_on_load(1); // Loading PNGs requires this or else they're upside-down :(
-    Texture tex("./res/textures/tex0.png", GL_TEXTURE_2D, 0, 0);
-    tex.setRenderHints({{GL_TEXTURE_MIN_FILTER, GL_NEAREST},
-                        {GL_TEXTURE_MAG_FILTER, GL_NEAREST}}); // Don't blur the textures!
-    tex.genMipmaps();
-
-    Texture tex2("./res/textures/tex1.png", GL_TEXTURE_2D, 0, 0);
-    tex2.setRenderHints({{GL_TEXTURE_MIN_FILTER, GL_NEAREST},
-                         {GL_TEXTURE_MAG_FILTER, GL_NEAREST}});
-    tex2.genMipmaps();
-
-    tex.bind(0);
+    Texture tex(GL_TEXTURE_2D);
+    Texture tex2(GL_TEXTURE_2D);
+
+    // Both textures go into one array texture if possible, so the objects can share draw calls.
+    TextureAtlas atlas(ATLAS_ARRAY);
+    atlas.add("./res/textures/tex0.png", &tex);
+    atlas.add("./res/textures/tex1.png", &tex2);
+
+    uint32_t baseFeatures = 0;
+    if (atlas.build(&rend.jobs)) {
+        baseFeatures = TEXTURE_ARRAY;
+        atlas.texture->setRenderHints({{GL_TEXTURE_MIN_FILTER, GL_NEAREST},
+                                       {GL_TEXTURE_MAG_FILTER, GL_NEAREST}}); // Don't blur the textures!
+        rend.streamer.add(*atlas.texture, std::move(atlas.levels), atlas.format, atlas.texture->width,
+                          atlas.texture->height, atlas.pageCount);
+    } else {
+        rend.textures.request(tex, "./res/textures/tex0.png");
+        tex.setRenderHints({{GL_TEXTURE_MIN_FILTER, GL_NEAREST},
+                            {GL_TEXTURE_MAG_FILTER, GL_NEAREST}}); // Don't blur the textures!
+        tex.genMipmaps();
+
+        rend.textures.request(tex2, "./res/textures/tex1.png");
+        tex2.setRenderHints({{GL_TEXTURE_MIN_FILTER, GL_NEAREST},
+                             {GL_TEXTURE_MAG_FILTER, GL_NEAREST}});
+        tex2.genMipmaps();
+    }
 
-    Camera player(glm::vec3(0, 0, 0), glm::vec2(0, 0), rend.window);
+    defaultShaders.get(baseFeatures, &shaders); // The objects are switched over to it by atlas.apply()
+    defaultShaders.get(baseFeatures | GREYSCALE, &shaders); // Build it up front so toggling it doesn't hitch
 
-    Model cube = {&ibo, &va, GL_QUADS, &buf};
-    Model inCube = {&inIBO, &va, GL_QUADS, &buf};
+    shaders.finish(); // Shaders compile while the textures are being requested
 
-    GameObject purpur = {&cube, &sp, &tex2};
-    GameObject skybox = {&inCube, &sp, &tex};
+    ImVec4 tint = ImVec4(0.0f, 0.0f, 0.0f, 0.0f); // Set on every variant each frame
+    for (std::pair<const uint32_t, ShaderProgram *> &variant : defaultShaders.variants) {
+        variant.second->bind();
+        variant.second->setUniform4f(U_MULT, 1, 1, 1, 1);
+        variant.second->setUniform1i(U_TEXTURE, 0); // flush() binds each batch's texture to unit 0
+    }
 
-    rend.addGameObject("skybox", &skybox);
-    rend.addGameObject("purpur", &purpur);
+    Camera player(glm::vec3(0, 0, 0), glm::vec2(0, 0), rend.window);
 
-    float speed = 3;
-    float sensitivity = 3;
+    GameObject purpur = {cube, sp, &tex2};
+    GameObject skybox = {inCube, sp, &tex};
+    skybox.transforms = glm::scale(IDENTITY_MAT4, skyboxScale);
+
+    ObjectHandle skyboxHandle = rend.addGameObject("skybox", skybox);
+    rend.addGameObject("purpur", purpur, OBJECT_VISIBLE | OBJECT_STATIC | OBJECT_OCCLUDER);
+
+    // A row of spinning spheres going off into the distance, to watch the levels of detail switch.
+    GameObject ball = {sphere, sp, &tex2};
+    std::vector<SimBody> bodies;
+    for (int i = 0; i < 6; i++) {
+        SimBody body;
+        body.position = glm::vec3(3, 0, -2.0f - float(i * i) * 2.0f);
+        body.axis = glm::vec3(0.3f, 1, 0);
+        body.spin = 0.5f + float(i) * 0.25f;
+        ball.transforms = glm::translate(IDENTITY_MAT4, body.position);
+        body.handle = rend.addGameObject("sphere" + std::to_string(i), ball);
+        bodies.push_back(body);
+    }
 
-    double lastFrame = glfwGetTime();
+    if (atlas.texture) {
+        atlas.apply(rend, TEXTURE_ARRAY);
+        tex.destroy();
+        tex2.destroy();
+    }
 
-    float deltaTime;
+    // A few chunks of terrain below the camera, drawn with the purpur texture.
+    VoxelRenderer voxels;
+    voxels.material.shader = defaultShaders.get(baseFeatures);
+    voxels.material.texture = atlas.texture ? atlas.texture : &tex2;
+    voxels.material.layer = atlas.texture ? float(atlas.regions[1].layer) : 0;
+    voxels.material.features = baseFeatures;
+    voxels.origin = glm::vec3(-2 * CHUNK_SIZE, -CHUNK_SIZE - 8, -2 * CHUNK_SIZE);
+    voxels.init();
+    voxels.world.generateTerrain(4, 1, 4, 1337);
+    voxels.finish(rend);
+
+    Simulation sim;
+    sim.speed = 3;
+    sim.sensitivity = 3;
+    sim.start(player, bodies);
 
     bool demo = false;
+    bool greyscale = false;
+    bool streaming = false;
+    std::string picked = "nothing";
 
     float fov = 70;
 
     while (!glfwWindowShouldClose(rend.window)) {
-        double now = glfwGetTime();
-        deltaTime = float(now - lastFrame);
-        lastFrame = now;
-
-        if (glfwGetKey(rend.window, GLFW_KEY_W) == GLFW_PRESS) {
-            player.move(speed, 0, deltaTime);
-            skybox.transforms = glm::translate(IDENTITY_MAT4, {0, 0, 0});
-            skybox.transforms *= glm::scale(IDENTITY_MAT4, skyboxScale);
-        }
-// Move backward
-        if (glfwGetKey(rend.window, GLFW_KEY_S) == GLFW_PRESS) {
-            player.move(-speed, 0, deltaTime);
-            skybox.transforms = glm::translate(IDENTITY_MAT4, {0, 0, 0});
-            skybox.transforms *= glm::scale(IDENTITY_MAT4, skyboxScale);
-        }
-// Strafe right
-        if (glfwGetKey(rend.window, GLFW_KEY_D) == GLFW_PRESS) {
-            player.move(0, speed, deltaTime);
-            skybox.transforms = glm::translate(IDENTITY_MAT4, {0, 0, 0});
-            skybox.transforms *= glm::scale(IDENTITY_MAT4, skyboxScale);
-        }
-// Strafe left
-        if (glfwGetKey(rend.window, GLFW_KEY_A) == GLFW_PRESS) {
-            player.move(0, -speed, deltaTime);
-            skybox.transforms = glm::translate(IDENTITY_MAT4, {0, 0, 0});
-            skybox.transforms *= glm::scale(IDENTITY_MAT4, skyboxScale);
-        }
-
-        if (glfwGetKey(rend.window, GLFW_KEY_UP) == GLFW_PRESS) {
-            player.look(glm::vec2(0, sensitivity), deltaTime);
-        }
-// Move backward
-        if (glfwGetKey(rend.window, GLFW_KEY_DOWN) == GLFW_PRESS) {
-            player.look(glm::vec2(0, -sensitivity), deltaTime);
-        }
-// Strafe right
-        if (glfwGetKey(rend.window, GLFW_KEY_RIGHT) == GLFW_PRESS) {
-            player.look(glm::vec2(-sensitivity, 0), deltaTime);
-        }
-// Strafe left
-        if (glfwGetKey(rend.window, GLFW_KEY_LEFT) == GLFW_PRESS) {
-            player.look(glm::vec2(sensitivity, 0), deltaTime);
-        }
-
-        if (glfwGetKey(rend.window, GLFW_KEY_SPACE) == GLFW_PRESS) {
-            player.position.y += (deltaTime * speed);
-            skybox.transforms = glm::translate(IDENTITY_MAT4, {0, 0, 0});
-            skybox.transforms *= glm::scale(IDENTITY_MAT4, skyboxScale);
+        // Movement happens on the simulation thread, this only passes on which keys are held down.
+        const std::pair<int, uint32_t> bindings[] = {
+                {GLFW_KEY_W, SIM_FORWARD}, {GLFW_KEY_S, SIM_BACK}, {GLFW_KEY_D, SIM_RIGHT}, {GLFW_KEY_A, SIM_LEFT},
+                {GLFW_KEY_SPACE, SIM_UP}, {GLFW_KEY_LEFT_SHIFT, SIM_DOWN}, {GLFW_KEY_UP, SIM_LOOK_UP},
+                {GLFW_KEY_DOWN, SIM_LOOK_DOWN}, {GLFW_KEY_RIGHT, SIM_LOOK_RIGHT}, {GLFW_KEY_LEFT, SIM_LOOK_LEFT}};
+        uint32_t keys = 0;
+        for (const std::pair<int, uint32_t> &binding : bindings) {
+            keys |= glfwGetKey(rend.window, binding.first) == GLFW_PRESS ? binding.second : 0;
         }
+        sim.input = keys;
+        sim.apply(player, rend.objects);
 
-        if (glfwGetKey(rend.window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS) {
-            player.position.y += -(deltaTime * speed);
-            skybox.transforms = glm::translate(IDENTITY_MAT4, {0, 0, 0});
-            skybox.transforms *= glm::scale(IDENTITY_MAT4, skyboxScale);
+        // Place a block where the camera is. Only its chunk (and neighbours, on a border) get remeshed.
+        if (glfwGetKey(rend.window, GLFW_KEY_B) == GLFW_PRESS) {
+            glm::vec3 block = glm::floor(player.position - voxels.origin);
+            voxels.world.set(int(block.x), int(block.y), int(block.z), 1);
         }
 
         rend.clear(0.25f, 0.25f, 1, 1);
@@ -184,33 +149,115 @@ int main(void) {
         if (demo) {
             ImGui::ShowDemoWindow(&demo);
         }
+        if (streaming) {
+            rend.streamer.drawDebugView(&streaming);
+        }
 
         {
             ImGui::Begin("Hello, world!");
             ImGui::ColorEdit3("Tint", (float *) &tint);
             ImGui::SliderFloat("FOV", &fov, 10, 100);
             ImGui::Checkbox("Show Demo", &demo);
+            ImGui::Checkbox("Show texture streaming", &streaming);
+            if (ImGui::Checkbox("Greyscale skybox", &greyscale)) {
+                rend.setFeatures(skyboxHandle, baseFeatures | (greyscale ? GREYSCALE : 0));
+            }
+            ImGui::Checkbox("Frustum culling", &rend.culling);
+            ImGui::Checkbox("Cull through the BVH", &rend.hierarchicalCulling);
+            ImGui::Checkbox("Occlusion culling", &rend.occlusionCulling);
+            ImGui::Checkbox("Level of detail", &rend.levelOfDetail);
+            ImGui::Checkbox("Parallel frame phases", &rend.parallel);
+            ImGui::SliderFloat("LOD error (pixels)", &rend.lodThreshold, 0.25f, 8.0f);
+            if (rend.queue.multiDrawSupported) {
+                ImGui::Checkbox("Multi-draw indirect", &rend.queue.multiDraw);
+            }
 
             ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate,
                         ImGui::GetIO().Framerate);
+            ImGui::Text("%u draw calls for %u objects (%u without multi-draw)", rend.queue.drawCalls,
+                        rend.queue.instances, rend.queue.plainDrawCalls);
+            ImGui::Text("Draw list: recorded on %u threads, merged and sorted in %.3fms", rend.queue.recordThreads,
+                        rend.queue.sortMs);
+            ImGui::Text("Culling (%s): %u visible, %u culled (%.3fms)", CULLING_SIMD, rend.cullStats.visible,
+                        rend.cullStats.culled, rend.cullStats.ms);
+            ImGui::Text("BVH: %zu static, %zu dynamic nodes, build %.2fms, refit %.2fms (%.3fms this frame)",
+                        rend.staticTree.nodeCount(), rend.dynamicTree.nodeCount(), rend.dynamicTree.stats.buildMs,
+                        rend.dynamicTree.stats.refitMs, rend.cullStats.treeMs);
+            ImGui::Text("Occlusion: %u occluders (%u triangles), %u of %u tested hidden (%.3fms raster, %.3fms test)",
+                        rend.occlusion.stats.occluders, rend.occlusion.stats.triangles, rend.cullStats.occluded,
+                        rend.occlusion.stats.tested, rend.occlusion.stats.rasterMs, rend.occlusion.stats.testMs);
+            ImGui::Text("LOD: %u objects reduced, %u -> %u triangles", rend.lodStats.reduced,
+                        rend.lodStats.triangles, rend.lodStats.drawn);
+            std::string busy;
+            for (size_t i = 0; i < rend.jobs.stats.size(); i++) {
+                busy += (i > 0 ? ", " : "") + std::to_string(int(rend.jobs.stats[i].utilization * 100)) + "%";
+            }
+            ImGui::Text("Simulation: %.0f Hz, tick %llu (%.3fms), %u skipped, drawn at %.2f between ticks",
+                        sim.tickRate, (unsigned long long) sim.stats.ticks, sim.stats.stepMs, sim.stats.skipped,
+                        sim.stats.alpha);
+            ImGui::Text("Jobs: %u threads, busy %s", rend.jobs.threadCount(), busy.c_str());
+            ImGui::Text("Picked: %s (click to pick)", picked.c_str());
+            if (atlas.texture) {
+                ImGui::Text("Texture atlas: %.1f%% used, %u draw calls saved", atlas.efficiency * 100,
+                            atlas.drawCallsSaved);
+            }
+            ImGui::Text("GL state calls: %u issued, %u skipped", glState.lastIssued, glState.lastSkipped);
+            ImGui::Text("Stream buffers: %s, %.1fKB/frame, %u stalls (%.1fms)", rend.queue.instanceStream.modeName(),
+                        (rend.queue.instanceStream.stats.frameBytes + rend.cameraStream.stats.frameBytes) / 1024.0,
+                        rend.queue.instanceStream.stats.stalls + rend.cameraStream.stats.stalls,
+                        rend.queue.instanceStream.stats.stallMs + rend.cameraStream.stats.stallMs);
+            ImGui::Text("Shader cache: %u hits, %u misses, %u rejected (%.1fms)", shaderCacheStats.hits,
+                        shaderCacheStats.misses, shaderCacheStats.rejected, shaderCacheStats.loadTime);
+            ImGui::Text("Textures: %u loading, %u loaded, %u failed (%zuKB saved by compression)",
+                        rend.textures.pending, rend.textures.loaded, rend.textures.failed,
+                        rend.textures.bytesSaved / 1024);
+            ImGui::Text("Voxels: %u chunks (%.1fKB), %u remeshed, %u faces -> %u quads, %.0f chunks/s (%u pending)",
+                        voxels.stats.chunks, voxels.stats.bytes / 1024.0, voxels.stats.remeshed,
+                        voxels.mesher.stats.faces, voxels.mesher.stats.quads, voxels.mesher.stats.throughput(),
+                        voxels.mesher.pending());
+            ImGui::Text("Meshes: %u loaded (%u imported), %.1f MB/s", rend.meshes.stats.loaded,
+                        rend.meshes.stats.imported, rend.meshes.throughput());
             ImGui::End();
         }
 
         rend.proj = player.getProjection(fov);
         rend.view = player.getView();
 
-        sp.bind();
-        sp.setUniform4f("u_Tint", tint.x, tint.y, tint.z, tint.w);
+        if (glfwGetMouseButton(rend.window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS &&
+            !ImGui::GetIO().WantCaptureMouse) {
+            double cursorX, cursorY;
+            glfwGetCursorPos(rend.window, &cursorX, &cursorY);
+
+            glm::vec3 origin, direction;
+            player.screenRay(glm::vec2(cursorX, cursorY), rend.proj, origin, direction);
+            ObjectHandle hit = rend.pick(origin, direction);
+
+            picked = "nothing";
+            for (const std::pair<const std::string, ObjectHandle> &name : rend.objects.names) {
+                if (rend.objects.valid(hit) && name.second.index == hit.index) {
+                    picked = name.first;
+                }
+            }
+        }
+
+        for (std::pair<const uint32_t, ShaderProgram *> &variant : defaultShaders.variants) {
+            variant.second->bind();
+            variant.second->setUniform4f(U_TINT, tint.x, tint.y, tint.z, tint.w);
+        }
 
-        rend.drawObject("skybox");
-        rend.drawObject("purpur");
+        voxels.update(rend);
+        rend.submitAll();
+        rend.drawQueue();
 
         rend.drawImGui();
 
         rend.flip();
     }
 
-    rend.quit();
+    sim.stop();
+    voxels.shutdown(rend);
+    rend.quit(); // Also destroys and deletes every variant of defaultShaders, since the objects use it
+    atlas.destroy();
 
     std::cout << "App stopped without errors." << std::endl;
     return 0;
@@ -0,0 +1,627 @@
+//
+// Created by Grant on 2019-08-28.
+//
+
+#include "mesh.h"
+
+#include <cmath>
+
+std::vector<uint32_t> triangulate(const uint32_t *indices, size_t count, uint32_t mode) {
+    std::vector<uint32_t> out;
+
+    switch (mode) {
+        case MESH_TRIANGLES:
+            out.assign(indices, indices + count - count % 3);
+            break;
+        case MESH_QUADS: // (a, b, c, d) -> (a, b, c), (a, c, d), which keeps the winding
+            for (size_t i = 0; i + 3 < count; i += 4) {
+                out.insert(out.end(), {indices[i], indices[i + 1], indices[i + 2]});
+                out.insert(out.end(), {indices[i], indices[i + 2], indices[i + 3]});
+            }
+            break;
+        case MESH_TRIANGLE_FAN:
+        case MESH_POLYGON:
+            for (size_t i = 1; i + 1 < count; i++) {
+                out.insert(out.end(), {indices[0], indices[i], indices[i + 1]});
+            }
+            break;
+        case MESH_TRIANGLE_STRIP: // Every other triangle is flipped to keep the winding
+            for (size_t i = 0; i + 2 < count; i++) {
+                uint32_t a = indices[i], b = indices[i + 1], c = indices[i + 2];
+                if (a == b || b == c || a == c) { // Degenerate triangles just stitch strips together
+                    continue;
+                }
+                if (i % 2 == 0) {
+                    out.insert(out.end(), {a, b, c});
+                } else {
+                    out.insert(out.end(), {b, a, c});
+                }
+            }
+            break;
+        default:
+            break;
+    }
+
+    return out;
+}
+
+/*
+ * Tipsify: fan around one vertex at a time, emitting all of its remaining triangles, then move on to the
+ * neighbour that is most likely to still be in the cache. When there's none, back up through the recently
+ * used vertices (the dead-end stack) or take the next vertex that still has triangles.
+ */
+void optimizeVertexCache(std::vector<uint32_t> &indices, size_t vertexCount, unsigned cacheSize) {
+    size_t triangleCount = indices.size() / 3;
+    if (triangleCount == 0 || vertexCount == 0) {
+        return;
+    }
+
+    // Vertex -> triangles adjacency, packed into one array.
+    std::vector<uint32_t> live(vertexCount, 0);
+    for (size_t i = 0; i < triangleCount * 3; i++) {
+        live[indices[i]]++;
+    }
+
+    std::vector<uint32_t> offsets(vertexCount + 1, 0);
+    for (size_t v = 0; v < vertexCount; v++) {
+        offsets[v + 1] = offsets[v] + live[v];
+    }
+
+    std::vector<uint32_t> adjacency(offsets[vertexCount]);
+    std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+    for (size_t t = 0; t < triangleCount; t++) {
+        for (size_t c = 0; c < 3; c++) {
+            adjacency[fill[indices[t * 3 + c]]++] = t;
+        }
+    }
+
+    std::vector<uint32_t> cacheTime(vertexCount, 0);
+    std::vector<bool> emitted(triangleCount, false);
+    std::vector<uint32_t> deadEnd;
+    std::vector<uint32_t> candidates;
+    std::vector<uint32_t> out;
+    out.reserve(triangleCount * 3);
+
+    uint32_t time = cacheSize + 1;
+    size_t cursor = 0;
+    int64_t fanning = indices[0];
+
+    while (fanning >= 0) {
+        candidates.clear();
+
+        for (uint32_t a = offsets[fanning]; a < offsets[fanning + 1]; a++) {
+            uint32_t t = adjacency[a];
+            if (emitted[t]) {
+                continue;
+            }
+            emitted[t] = true;
+
+            for (size_t c = 0; c < 3; c++) {
+                uint32_t v = indices[t * 3 + c];
+                out.push_back(v);
+                deadEnd.push_back(v);
+                candidates.push_back(v);
+                live[v]--;
+
+                if (time - cacheTime[v] > cacheSize) { // Not in the cache anymore
+                    cacheTime[v] = time++;
+                }
+            }
+        }
+
+        // The candidate that will be in the cache longest, as long as all its triangles fit before it drops out.
+        fanning = -1;
+        int64_t best = -1;
+        for (uint32_t v : candidates) {
+            if (live[v] == 0) {
+                continue;
+            }
+
+            int64_t priority = 0;
+            if (time - cacheTime[v] + 2 * live[v] <= cacheSize) {
+                priority = time - cacheTime[v];
+            }
+            if (priority > best) {
+                best = priority;
+                fanning = v;
+            }
+        }
+
+        if (fanning == -1) {
+            while (!deadEnd.empty() && fanning == -1) {
+                uint32_t v = deadEnd.back();
+                deadEnd.pop_back();
+                if (live[v] > 0) {
+                    fanning = v;
+                }
+            }
+            while (cursor < vertexCount && fanning == -1) {
+                if (live[cursor] > 0) {
+                    fanning = cursor;
+                }
+                cursor++;
+            }
+        }
+    }
+
+    std::copy(out.begin(), out.end(), indices.begin());
+}
+
+float averageCacheMissRatio(const std::vector<uint32_t> &indices, size_t vertexCount, unsigned cacheSize) {
+    size_t triangleCount = indices.size() / 3;
+    if (triangleCount == 0) {
+        return 0;
+    }
+
+    // FIFO cache: a vertex is cached if it was loaded fewer than cacheSize misses ago.
+    std::vector<uint64_t> loadedAt(vertexCount, 0);
+    uint64_t misses = 0;
+    for (size_t i = 0; i < triangleCount * 3; i++) {
+        uint32_t v = indices[i];
+        if (loadedAt[v] == 0 || misses + 1 - loadedAt[v] >= cacheSize) {
+            misses++;
+            loadedAt[v] = misses;
+        }
+    }
+
+    return float(misses) / float(triangleCount);
+}
+
+std::vector<uint32_t> buildFetchRemap(const std::vector<uint32_t> &indices, size_t vertexCount) {
+    const uint32_t unused = 0xFFFFFFFFu;
+    std::vector<uint32_t> remap(vertexCount, unused);
+
+    uint32_t next = 0;
+    for (uint32_t v : indices) {
+        if (remap[v] == unused) {
+            remap[v] = next++;
+        }
+    }
+    for (uint32_t &v : remap) {
+        if (v == unused) {
+            v = next++;
+        }
+    }
+
+    return remap;
+}
+
+void remapIndices(std::vector<uint32_t> &indices, const std::vector<uint32_t> &remap) {
+    for (uint32_t &v : indices) {
+        v = remap[v];
+    }
+}
+
+std::vector<unsigned char> remapVertices(const void *vertices, size_t vertexCount, size_t stride,
+                                         const std::vector<uint32_t> &remap) {
+    std::vector<unsigned char> out(vertexCount * stride);
+    const auto *src = (const unsigned char *) vertices;
+    for (size_t v = 0; v < vertexCount; v++) {
+        std::memcpy(&out[remap[v] * stride], src + v * stride, stride);
+    }
+    return out;
+}
+
+// Symmetric 4x4 matrix (the upper triangle) plus the area the planes were weighted with.
+struct Quadric {
+public:
+    double a[10];
+    double weight;
+};
+
+static void addPlane(Quadric &q, double nx, double ny, double nz, double d, double weight) {
+    const double p[4] = {nx, ny, nz, d};
+    int k = 0;
+    for (int i = 0; i < 4; i++) {
+        for (int j = i; j < 4; j++) {
+            q.a[k++] += p[i] * p[j] * weight;
+        }
+    }
+    q.weight += weight;
+}
+
+// Squared distance to the planes, averaged by area
+static double quadricError(const Quadric &q, const Quadric &r, const float *p) {
+    const double v[4] = {p[0], p[1], p[2], 1.0};
+    double sum = 0;
+    int k = 0;
+    for (int i = 0; i < 4; i++) {
+        for (int j = i; j < 4; j++) {
+            sum += (q.a[k] + r.a[k]) * v[i] * v[j] * (i == j ? 1 : 2);
+            k++;
+        }
+    }
+    double weight = q.weight + r.weight;
+    return weight > 0 ? std::max(0.0, sum / weight) : 0;
+}
+
+static void triangleNormal(const float *a, const float *b, const float *c, double *n) {
+    double e1[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+    double e2[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+    n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+    n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+    n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+}
+
+/*
+ * Every pass sorts all possible collapses by error and does the cheapest ones, as long as they don't touch
+ * a vertex that already changed in this pass (its quadric and triangles would be out of date) and don't flip
+ * any triangle around the collapsed vertex. Then degenerate triangles are dropped and the next pass starts over.
+ */
+std::vector<uint32_t> simplifyMesh(const float *vertices, size_t vertexCount, size_t stride,
+                                   const std::vector<uint32_t> &indices, size_t targetIndexCount,
+                                   float maxError, float &error) {
+    std::vector<uint32_t> result(indices.begin(), indices.end() - indices.size() % 3);
+    error = 0;
+    auto position = [&](uint32_t v) { return vertices + size_t(v) * stride; };
+
+    // Seams: vertices that share their position with another one.
+    std::vector<uint8_t> locked(vertexCount, 0);
+    {
+        std::vector<uint32_t> order(vertexCount);
+        for (uint32_t v = 0; v < vertexCount; v++) {
+            order[v] = v;
+        }
+        auto samePosition = [&](uint32_t a, uint32_t b) { return std::memcmp(position(a), position(b), 12) == 0; };
+        std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            return std::lexicographical_compare(position(a), position(a) + 3, position(b), position(b) + 3);
+        });
+        for (size_t i = 1; i < order.size(); i++) {
+            if (samePosition(order[i - 1], order[i])) {
+                locked[order[i - 1]] = locked[order[i]] = 1;
+            }
+        }
+    }
+
+    // Borders: edges that only one triangle uses.
+    {
+        std::vector<std::pair<uint32_t, uint32_t>> edges;
+        for (size_t i = 0; i < result.size(); i += 3) {
+            for (int e = 0; e < 3; e++) {
+                uint32_t a = result[i + e], b = result[i + (e + 1) % 3];
+                edges.emplace_back(std::min(a, b), std::max(a, b));
+            }
+        }
+        std::sort(edges.begin(), edges.end());
+        for (size_t i = 0; i < edges.size();) {
+            size_t j = i + 1;
+            while (j < edges.size() && edges[j] == edges[i]) {
+                j++;
+            }
+            if (j - i == 1) {
+                locked[edges[i].first] = locked[edges[i].second] = 1;
+            }
+            i = j;
+        }
+    }
+
+    std::vector<Quadric> quadrics(vertexCount, Quadric{});
+    for (size_t i = 0; i + 2 < result.size(); i += 3) {
+        const float *a = position(result[i]), *b = position(result[i + 1]), *c = position(result[i + 2]);
+        double n[3];
+        triangleNormal(a, b, c, n);
+        double length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+        if (length <= 0) {
+            continue;
+        }
+
+        double d = -(n[0] * a[0] + n[1] * a[1] + n[2] * a[2]) / length;
+        for (int corner = 0; corner < 3; corner++) {
+            addPlane(quadrics[result[i + corner]], n[0] / length, n[1] / length, n[2] / length, d, length * 0.5);
+        }
+    }
+
+    struct Collapse {
+    public:
+        uint32_t from, to;
+        double cost;
+    };
+
+    double maxCost = double(maxError) * maxError;
+    double worst = 0;
+    std::vector<Collapse> collapses;
+    std::vector<uint32_t> firstTriangle, triangles, remap(vertexCount);
+    std::vector<uint8_t> touched(vertexCount);
+
+    while (result.size() > targetIndexCount) {
+        collapses.clear();
+        for (size_t i = 0; i < result.size(); i += 3) {
+            for (int e = 0; e < 3; e++) {
+                uint32_t a = result[i + e], b = result[i + (e + 1) % 3];
+                if (!locked[a]) {
+                    collapses.push_back({a, b, quadricError(quadrics[a], quadrics[b], position(b))});
+                }
+                if (!locked[b]) {
+                    collapses.push_back({b, a, quadricError(quadrics[b], quadrics[a], position(a))});
+                }
+            }
+        }
+        std::sort(collapses.begin(), collapses.end(), [](const Collapse &x, const Collapse &y) {
+            return x.cost < y.cost;
+        });
+
+        // Vertex -> triangles, packed
+        firstTriangle.assign(vertexCount + 1, 0);
+        for (uint32_t v : result) {
+            firstTriangle[v + 1]++;
+        }
+        for (size_t v = 0; v < vertexCount; v++) {
+            firstTriangle[v + 1] += firstTriangle[v];
+        }
+        triangles.resize(result.size());
+        std::vector<uint32_t> fill(firstTriangle.begin(), firstTriangle.end() - 1);
+        for (size_t i = 0; i < result.size(); i++) {
+            triangles[fill[result[i]]++] = uint32_t(i / 3);
+        }
+
+        for (uint32_t v = 0; v < vertexCount; v++) {
+            remap[v] = v;
+        }
+        std::fill(touched.begin(), touched.end(), 0);
+
+        size_t removed = 0, needed = (result.size() - targetIndexCount + 2) / 3;
+        for (const Collapse &collapse : collapses) {
+            if (removed >= needed || collapse.cost > maxCost) {
+                break;
+            }
+            if (touched[collapse.from] || touched[collapse.to]) {
+                continue;
+            }
+
+            // Moving `from` onto `to` mustn't turn any of the remaining triangles around.
+            bool flips = false;
+            size_t gone = 0;
+            for (uint32_t t = firstTriangle[collapse.from]; t < firstTriangle[collapse.from + 1] && !flips; t++) {
+                const uint32_t *tri = &result[size_t(triangles[t]) * 3];
+                if (tri[0] == collapse.to || tri[1] == collapse.to || tri[2] == collapse.to) {
+                    gone++;
+                    continue;
+                }
+
+                const float *before[3], *after[3];
+                for (int corner = 0; corner < 3; corner++) {
+                    before[corner] = position(tri[corner]);
+                    after[corner] = tri[corner] == collapse.from ? position(collapse.to) : before[corner];
+                }
+                double n0[3], n1[3];
+                triangleNormal(before[0], before[1], before[2], n0);
+                triangleNormal(after[0], after[1], after[2], n1);
+                // Also rejects triangles that would turn more than ~80 degrees (or become slivers).
+                double dot = n0[0] * n1[0] + n0[1] * n1[1] + n0[2] * n1[2];
+                double lengths = std::sqrt((n0[0] * n0[0] + n0[1] * n0[1] + n0[2] * n0[2]) *
+                                           (n1[0] * n1[0] + n1[1] * n1[1] + n1[2] * n1[2]));
+                flips = dot <= 0.2 * lengths;
+            }
+            if (flips || gone == 0) {
+                continue;
+            }
+
+            remap[collapse.from] = collapse.to;
+            for (uint32_t t = firstTriangle[collapse.from]; t < firstTriangle[collapse.from + 1]; t++) {
+                for (int corner = 0; corner < 3; corner++) {
+                    touched[result[size_t(triangles[t]) * 3 + corner]] = 1;
+                }
+            }
+            for (int q = 0; q < 10; q++) {
+                quadrics[collapse.to].a[q] += quadrics[collapse.from].a[q];
+            }
+            quadrics[collapse.to].weight += quadrics[collapse.from].weight;
+
+            worst = std::max(worst, collapse.cost);
+            removed += gone;
+        }
+
+        if (removed == 0) {
+            break;
+        }
+
+        size_t kept = 0;
+        for (size_t i = 0; i < result.size(); i += 3) {
+            uint32_t a = remap[result[i]], b = remap[result[i + 1]], c = remap[result[i + 2]];
+            if (a != b && b != c && a != c) {
+                result[kept++] = a;
+                result[kept++] = b;
+                result[kept++] = c;
+            }
+        }
+        result.resize(kept);
+    }
+
+    error = float(std::sqrt(worst));
+    return result;
+}
+
+/*
+ * Round to nearest even, overflows become infinity and tiny values become denormals (or zero).
+ */
+uint16_t floatToHalf(float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+
+    uint32_t sign = (bits >> 16u) & 0x8000u;
+    uint32_t exponent = (bits >> 23u) & 0xFFu;
+    uint32_t mantissa = bits & 0x7FFFFFu;
+
+    if (exponent == 0xFF) { // Inf or NaN (keep NaNs NaN)
+        return sign | 0x7C00u | (mantissa ? 0x200u : 0u);
+    }
+
+    int halfExponent = int(exponent) - 127 + 15;
+    if (halfExponent >= 31) {
+        return sign | 0x7C00u;
+    }
+
+    if (halfExponent <= 0) { // Denormal or zero
+        if (halfExponent < -10) {
+            return sign;
+        }
+        mantissa |= 0x800000u;
+        uint32_t shift = 14 - halfExponent;
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1u))) {
+            half++;
+        }
+        return sign | half;
+    }
+
+    uint32_t half = (uint32_t(halfExponent) << 10u) | (mantissa >> 13u);
+    uint32_t rest = mantissa & 0x1FFFu;
+    if (rest > 0x1000u || (rest == 0x1000u && (half & 1u))) {
+        half++; // May carry into the exponent, which is still correct (up to infinity)
+    }
+    return sign | half;
+}
+
+float halfToFloat(uint16_t half) {
+    uint32_t sign = uint32_t(half & 0x8000u) << 16u;
+    uint32_t exponent = (half >> 10u) & 0x1Fu;
+    uint32_t mantissa = half & 0x3FFu;
+
+    uint32_t bits;
+    if (exponent == 0) {
+        if (mantissa == 0) {
+            bits = sign;
+        } else { // Denormal: normalize it
+            exponent = 127 - 15 + 1;
+            while (!(mantissa & 0x400u)) {
+                mantissa <<= 1u;
+                exponent--;
+            }
+            bits = sign | (exponent << 23u) | ((mantissa & 0x3FFu) << 13u);
+        }
+    } else if (exponent == 31) {
+        bits = sign | 0x7F800000u | (mantissa << 13u);
+    } else {
+        bits = sign | ((exponent - 15 + 127) << 23u) | (mantissa << 13u);
+    }
+
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static float clampUnit(float value, float low) {
+    return std::min(std::max(value, low), 1.0f);
+}
+
+int8_t packSnorm8(float value) {
+    return int8_t(std::lround(clampUnit(value, -1) * 127.0f));
+}
+
+uint8_t packUnorm8(float value) {
+    return uint8_t(std::lround(clampUnit(value, 0) * 255.0f));
+}
+
+int16_t packSnorm16(float value) {
+    return int16_t(std::lround(clampUnit(value, -1) * 32767.0f));
+}
+
+uint16_t packUnorm16(float value) {
+    return uint16_t(std::lround(clampUnit(value, 0) * 65535.0f));
+}
+
+uint32_t packSnorm2_10_10_10(float x, float y, float z, float w) {
+    auto component = [](float value, float scale, uint32_t mask) {
+        return uint32_t(int32_t(std::lround(clampUnit(value, -1) * scale))) & mask;
+    };
+    return component(x, 511, 0x3FFu) | (component(y, 511, 0x3FFu) << 10u) | (component(z, 511, 0x3FFu) << 20u) |
+           (component(w, 1, 0x3u) << 30u);
+}
+
+uint32_t packUnorm2_10_10_10(float x, float y, float z, float w) {
+    auto component = [](float value, float scale) {
+        return uint32_t(std::lround(clampUnit(value, 0) * scale));
+    };
+    return component(x, 1023) | (component(y, 1023) << 10u) | (component(z, 1023) << 20u) | (component(w, 3) << 30u);
+}
+
+uint32_t vertexTypeSize(uint32_t type) {
+    switch (type) {
+        case VERTEX_BYTE:
+        case VERTEX_UNSIGNED_BYTE:
+            return 1;
+        case VERTEX_SHORT:
+        case VERTEX_UNSIGNED_SHORT:
+        case VERTEX_HALF_FLOAT:
+            return 2;
+        case VERTEX_INT:
+        case VERTEX_UNSIGNED_INT:
+        case VERTEX_FLOAT:
+        case VERTEX_INT_2_10_10_10_REV:
+        case VERTEX_UNSIGNED_INT_2_10_10_10_REV:
+            return 4;
+        default:
+            return 0;
+    }
+}
+
+template<typename T>
+static void store(unsigned char *out, T value) {
+    std::memcpy(out, &value, sizeof(value));
+}
+
+std::vector<std::vector<unsigned char>> quantizeVertices(const float *vertices, size_t vertexCount,
+                                                         size_t floatStride,
+                                                         const std::vector<VertexAttribute> &attributes,
+                                                         const std::vector<uint32_t> &strides) {
+    std::vector<std::vector<unsigned char>> streams;
+    for (uint32_t stride : strides) {
+        streams.emplace_back(vertexCount * stride, 0);
+    }
+
+    for (size_t v = 0; v < vertexCount; v++) {
+        const float *src = vertices + v * floatStride;
+
+        for (const VertexAttribute &attrib : attributes) {
+            unsigned char *dst = &streams[attrib.stream][v * strides[attrib.stream] + attrib.offset];
+            float y = attrib.count > 1 ? src[1] : 0, z = attrib.count > 2 ? src[2] : 0;
+            float w = attrib.count > 3 ? src[3] : 1;
+
+            if (attrib.type == VERTEX_INT_2_10_10_10_REV) {
+                store(dst, packSnorm2_10_10_10(src[0], y, z, w));
+            } else if (attrib.type == VERTEX_UNSIGNED_INT_2_10_10_10_REV) {
+                store(dst, packUnorm2_10_10_10(src[0], y, z, w));
+            } else {
+                for (uint32_t c = 0; c < attrib.count; c++) {
+                    float value = src[c];
+                    unsigned char *out = dst + c * vertexTypeSize(attrib.type);
+
+                    switch (attrib.type) {
+                        case VERTEX_FLOAT:
+                            store(out, value);
+                            break;
+                        case VERTEX_HALF_FLOAT:
+                            store(out, floatToHalf(value));
+                            break;
+                        case VERTEX_BYTE:
+                            store(out, attrib.normalized ? packSnorm8(value) : int8_t(std::lround(value)));
+                            break;
+                        case VERTEX_UNSIGNED_BYTE:
+                            store(out, attrib.normalized ? packUnorm8(value) : uint8_t(std::lround(value)));
+                            break;
+                        case VERTEX_SHORT:
+                            store(out, attrib.normalized ? packSnorm16(value) : int16_t(std::lround(value)));
+                            break;
+                        case VERTEX_UNSIGNED_SHORT:
+                            store(out, attrib.normalized ? packUnorm16(value) : uint16_t(std::lround(value)));
+                            break;
+                        case VERTEX_INT:
+                            store(out, int32_t(std::lround(value)));
+                            break;
+                        case VERTEX_UNSIGNED_INT:
+                            store(out, uint32_t(std::lround(value)));
+                            break;
+                        default:
+                            break;
+                    }
+                }
+            }
+
+            src += attrib.count;
+        }
+    }
+
+    return streams;
+}
@@ -0,0 +1,118 @@
+//
+// Created by Grant on 2019-08-28.
+//
+#pragma once
+
+#ifndef GRANT_MESH_H_DEFINED
+#define GRANT_MESH_H_DEFINED
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/*
+ * Offline-style mesh processing on plain index/vertex arrays:
+ *  - triangulate() turns quads, fans and strips into triangle lists (drivers triangulate GL_QUADS on the fly).
+ *  - optimizeVertexCache() reorders triangles for the post-transform vertex cache (Tipsify, Sander et al. 2007).
+ *  - buildFetchRemap() + remapIndices()/remapVertices() reorder vertices by first use, so fetches are sequential.
+ *  - simplifyMesh() builds lower levels of detail over the same vertices.
+ * Primitive types are the OpenGL enum values, so a GLenum can be passed straight in.
+ */
+const uint32_t MESH_TRIANGLES = 0x0004;      // GL_TRIANGLES
+const uint32_t MESH_TRIANGLE_STRIP = 0x0005; // GL_TRIANGLE_STRIP
+const uint32_t MESH_TRIANGLE_FAN = 0x0006;   // GL_TRIANGLE_FAN
+const uint32_t MESH_QUADS = 0x0007;          // GL_QUADS
+const uint32_t MESH_POLYGON = 0x0009;        // GL_POLYGON
+
+const unsigned VERTEX_CACHE_SIZE = 16; // Conservative, most hardware has at least this many entries
+
+// Empty if the primitive type isn't made of triangles (points, lines).
+std::vector<uint32_t> triangulate(const uint32_t *indices, size_t count, uint32_t mode);
+
+void optimizeVertexCache(std::vector<uint32_t> &indices, size_t vertexCount, unsigned cacheSize = VERTEX_CACHE_SIZE);
+
+// Average cache miss ratio: transformed vertices per triangle with a FIFO cache. 0.5 is the best case, 3 the worst.
+float averageCacheMissRatio(const std::vector<uint32_t> &indices, size_t vertexCount,
+                            unsigned cacheSize = VERTEX_CACHE_SIZE);
+
+/*
+ * remap[old] = new vertex position, in order of first use. Vertices that aren't referenced go to the end (they may
+ * still be used by another index buffer that wasn't passed in).
+ */
+std::vector<uint32_t> buildFetchRemap(const std::vector<uint32_t> &indices, size_t vertexCount);
+
+void remapIndices(std::vector<uint32_t> &indices, const std::vector<uint32_t> &remap);
+
+// stride is in bytes.
+std::vector<unsigned char> remapVertices(const void *vertices, size_t vertexCount, size_t stride,
+                                         const std::vector<uint32_t> &remap);
+
+/*
+ * Quadric error simplification (Garland and Heckbert 1997) that only ever collapses a vertex onto one of its
+ * neighbours, so the result indexes the same vertex buffer and levels of detail are just more index ranges.
+ * Vertices on open borders and UV seams (several vertices at one position) stay where they are, which keeps
+ * the outline and the texture mapping intact. Stops at `targetIndexCount` or when nothing can be collapsed
+ * without going over `maxError`. `error` is set to the deviation from the original surface, in object units.
+ * `stride` is in floats, positions are the first 3 of each vertex.
+ */
+std::vector<uint32_t> simplifyMesh(const float *vertices, size_t vertexCount, size_t stride,
+                                   const std::vector<uint32_t> &indices, size_t targetIndexCount,
+                                   float maxError, float &error);
+
+// Vertex component types, same values as the GL enums.
+const uint32_t VERTEX_BYTE = 0x1400;
+const uint32_t VERTEX_UNSIGNED_BYTE = 0x1401;
+const uint32_t VERTEX_SHORT = 0x1402;
+const uint32_t VERTEX_UNSIGNED_SHORT = 0x1403;
+const uint32_t VERTEX_INT = 0x1404;
+const uint32_t VERTEX_UNSIGNED_INT = 0x1405;
+const uint32_t VERTEX_FLOAT = 0x1406;
+const uint32_t VERTEX_HALF_FLOAT = 0x140B;
+const uint32_t VERTEX_INT_2_10_10_10_REV = 0x8D9F;
+const uint32_t VERTEX_UNSIGNED_INT_2_10_10_10_REV = 0x8368;
+
+// Plain copy of a VBAttribute, so it can be used without GL (and written to mesh files as is).
+struct VertexAttribute {
+public:
+    uint32_t count;
+    uint32_t type;
+    uint32_t normalized;
+    uint32_t offset; // Into its stream
+    uint32_t stream;
+};
+
+// Size of one component, or of the whole attribute for the packed 2_10_10_10 types. 0 if unknown.
+uint32_t vertexTypeSize(uint32_t type);
+
+/*
+ * Converts float vertices (`floatStride` floats each) into one buffer per stream. The float vertices have
+ * the same attributes in the same order, with `count` floats each.
+ */
+std::vector<std::vector<unsigned char>> quantizeVertices(const float *vertices, size_t vertexCount,
+                                                         size_t floatStride,
+                                                         const std::vector<VertexAttribute> &attributes,
+                                                         const std::vector<uint32_t> &strides);
+
+/*
+ * Quantization of vertex attributes. The normalized formats round to nearest and clamp, the packed formats
+ * are the bit layouts of GL_INT_2_10_10_10_REV / GL_UNSIGNED_INT_2_10_10_10_REV (x in the lowest bits).
+ */
+uint16_t floatToHalf(float value);
+
+float halfToFloat(uint16_t half);
+
+int8_t packSnorm8(float value);
+
+uint8_t packUnorm8(float value);
+
+int16_t packSnorm16(float value);
+
+uint16_t packUnorm16(float value);
+
+uint32_t packSnorm2_10_10_10(float x, float y, float z, float w);
+
+uint32_t packUnorm2_10_10_10(float x, float y, float z, float w);
+
+#endif
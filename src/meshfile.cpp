@@ -0,0 +1,205 @@
+//
+// Created by Grant on 2019-08-29.
+//
+
+#include "meshfile.h"
+
+#include <fstream>
+
+bool MeshFile::open(const MappedFile &file) {
+    return open(file.data, file.size);
+}
+
+bool MeshFile::open(const unsigned char *data, size_t size) {
+    if (size < sizeof(MeshFileHeader)) {
+        return false;
+    }
+
+    header = (const MeshFileHeader *) data;
+    base = data;
+
+    if (std::memcmp(header->magic, MESH_FILE_MAGIC, 4) != 0 || header->version != MESH_FILE_VERSION ||
+        header->streamCount == 0 || header->streamCount > MAX_MESH_STREAMS ||
+        header->attributeCount > MAX_MESH_ATTRIBUTES ||
+        (header->indexType != MESH_INDEX_16 && header->indexType != MESH_INDEX_32)) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < header->streamCount; i++) {
+        const MeshStream &stream = header->streams[i];
+        if (stream.offset + stream.size > size ||
+            stream.size < uint64_t(stream.stride) * header->vertexCount) { // Truncated file
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < header->attributeCount; i++) {
+        if (header->attributes[i].stream >= header->streamCount) {
+            return false;
+        }
+    }
+
+    if (header->lodCount == 0 || header->lodCount > MAX_MESH_LODS) {
+        return false;
+    }
+    for (uint32_t i = 0; i < header->lodCount; i++) {
+        const MeshLOD &lod = header->lods[i];
+        if (uint64_t(lod.firstIndex) + lod.indexCount > header->indexCount) {
+            return false;
+        }
+    }
+
+    uint64_t indexBytes = uint64_t(header->indexCount) * (header->indexType == MESH_INDEX_16 ? 2 : 4);
+    return header->indexOffset + header->indexSize <= size && header->indexSize >= indexBytes;
+}
+
+const unsigned char *MeshFile::stream(uint32_t index) const {
+    return base + header->streams[index].offset;
+}
+
+const unsigned char *MeshFile::indices() const {
+    return base + header->indexOffset;
+}
+
+bool MeshFile::readTriangles(std::vector<float> &positions, std::vector<uint32_t> &indices32) const {
+    if (header->attributeCount == 0 || header->drawMode != MESH_TRIANGLES) {
+        return false;
+    }
+
+    const VertexAttribute &attrib = header->attributes[0];
+    if (attrib.count < 3 || (attrib.type != VERTEX_FLOAT && attrib.type != VERTEX_HALF_FLOAT)) {
+        return false;
+    }
+
+    uint32_t stride = header->streams[attrib.stream].stride;
+    const unsigned char *vertices = stream(attrib.stream) + attrib.offset;
+    positions.resize(size_t(header->vertexCount) * 3);
+    for (uint32_t i = 0; i < header->vertexCount; i++) {
+        const unsigned char *vertex = vertices + size_t(i) * stride;
+        for (int j = 0; j < 3; j++) {
+            if (attrib.type == VERTEX_FLOAT) {
+                std::memcpy(&positions[i * 3 + j], vertex + j * 4, 4);
+            } else {
+                uint16_t half;
+                std::memcpy(&half, vertex + j * 2, 2);
+                positions[i * 3 + j] = halfToFloat(half);
+            }
+        }
+    }
+
+    const MeshLOD &lod = header->lods[0];
+    indices32.resize(lod.indexCount);
+    for (uint32_t i = 0; i < lod.indexCount; i++) {
+        uint32_t at = lod.firstIndex + i;
+        if (header->indexType == MESH_INDEX_16) {
+            uint16_t index;
+            std::memcpy(&index, indices() + at * 2, 2);
+            indices32[i] = index;
+        } else {
+            std::memcpy(&indices32[i], indices() + at * 4, 4);
+        }
+    }
+
+    // Don't trust the file with indices past the end
+    for (uint32_t index : indices32) {
+        if (index >= header->vertexCount) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string cookedMeshPath(const std::string &meshPath) {
+    size_t slash = meshPath.find_last_of("/\\");
+    std::string name = slash == std::string::npos ? meshPath : meshPath.substr(slash + 1);
+    size_t dot = name.find_last_of('.');
+    if (dot != std::string::npos) {
+        name.resize(dot);
+    }
+
+    return COOKED_MESH_DIR + "/" + name + COOKED_MESH_EXT;
+}
+
+std::vector<unsigned char> serializeMesh(const MeshData &mesh) {
+    if (mesh.streams.empty() || mesh.streams.size() > MAX_MESH_STREAMS ||
+        mesh.attributes.size() > MAX_MESH_ATTRIBUTES) {
+        return {};
+    }
+
+    MeshFileHeader header = {};
+    std::memcpy(header.magic, MESH_FILE_MAGIC, 4);
+    header.version = MESH_FILE_VERSION;
+    header.vertexCount = mesh.vertexCount;
+    header.indexCount = mesh.indices.size();
+    header.drawMode = mesh.drawMode;
+    header.streamCount = mesh.streams.size();
+    header.attributeCount = mesh.attributes.size();
+    std::memcpy(header.boundsMin, mesh.boundsMin, sizeof(header.boundsMin));
+    std::memcpy(header.boundsMax, mesh.boundsMax, sizeof(header.boundsMax));
+    std::copy(mesh.attributes.begin(), mesh.attributes.end(), header.attributes);
+
+    if (mesh.lods.size() > MAX_MESH_LODS) {
+        return {};
+    }
+    if (mesh.lods.empty()) {
+        header.lodCount = 1;
+        header.lods[0] = {0, header.indexCount, 0, 0};
+    } else {
+        header.lodCount = mesh.lods.size();
+        std::copy(mesh.lods.begin(), mesh.lods.end(), header.lods);
+    }
+
+    uint32_t maxIndex = 0;
+    for (uint32_t index : mesh.indices) {
+        maxIndex = std::max(maxIndex, index);
+    }
+
+    // Same rule as IndexBuffer: 16 bit unless an index needs more (0xFFFF is kept free for primitive restart).
+    bool shortIndices = maxIndex < 0xFFFFu;
+    header.indexType = shortIndices ? MESH_INDEX_16 : MESH_INDEX_32;
+
+    auto align = [](uint64_t offset) {
+        return (offset + MESH_FILE_ALIGNMENT - 1) / MESH_FILE_ALIGNMENT * MESH_FILE_ALIGNMENT;
+    };
+
+    uint64_t offset = sizeof(MeshFileHeader);
+    for (size_t i = 0; i < mesh.streams.size(); i++) {
+        offset = align(offset);
+        header.streams[i] = {mesh.strides[i], 0, offset, mesh.streams[i].size()};
+        offset += mesh.streams[i].size();
+    }
+    header.indexOffset = align(offset);
+    header.indexSize = mesh.indices.size() * (shortIndices ? sizeof(uint16_t) : sizeof(uint32_t));
+
+    std::vector<unsigned char> out(header.indexOffset + header.indexSize, 0);
+    std::memcpy(out.data(), &header, sizeof(header));
+    for (size_t i = 0; i < mesh.streams.size(); i++) {
+        std::memcpy(&out[header.streams[i].offset], mesh.streams[i].data(), mesh.streams[i].size());
+    }
+
+    unsigned char *indices = &out[header.indexOffset];
+    for (size_t i = 0; i < mesh.indices.size(); i++) {
+        if (shortIndices) {
+            auto index = uint16_t(mesh.indices[i]);
+            std::memcpy(indices + i * sizeof(index), &index, sizeof(index));
+        } else {
+            std::memcpy(indices + i * sizeof(uint32_t), &mesh.indices[i], sizeof(uint32_t));
+        }
+    }
+
+    return out;
+}
+
+bool writeMeshFile(const std::string &path, const MeshData &mesh) {
+    std::vector<unsigned char> data = serializeMesh(mesh);
+    if (data.empty()) {
+        return false;
+    }
+
+    std::ofstream out(path, std::ios::binary);
+    if (!out.is_open()) {
+        return false;
+    }
+
+    out.write((const char *) data.data(), data.size());
+    return out.good();
+}
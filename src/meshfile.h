@@ -0,0 +1,115 @@
+//
+// Created by Grant on 2019-08-29.
+//
+#pragma once
+
+#ifndef GRANT_MESHFILE_H_DEFINED
+#define GRANT_MESHFILE_H_DEFINED
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "cooked.h"
+#include "mesh.h"
+
+/*
+ * Cooked mesh container (.glmesh), written by the MeshImporter tool (`make import_meshes`).
+ *
+ * [MeshFileHeader][padding][stream 0][stream 1]...[indices of LOD 0][indices of LOD 1]...
+ *
+ * Every blob is 16-byte aligned and already in its final GL format (quantized vertices, 16 or 32 bit indices),
+ * so the file can be memory-mapped and handed straight to glBufferData. Native (little) endian.
+ */
+const char MESH_FILE_MAGIC[4] = {'G', 'L', 'M', 'S'};
+const uint32_t MESH_FILE_VERSION = 2; // 2: levels of detail
+const uint32_t MESH_FILE_ALIGNMENT = 16;
+const uint32_t MAX_MESH_ATTRIBUTES = 8;
+const uint32_t MAX_MESH_STREAMS = 4;
+const uint32_t MAX_MESH_LODS = 4;
+
+const uint32_t MESH_INDEX_16 = 0x1403; // GL_UNSIGNED_SHORT
+const uint32_t MESH_INDEX_32 = 0x1405; // GL_UNSIGNED_INT
+
+std::string COOKED_MESH_DIR = "./res/cooked";
+const char *COOKED_MESH_EXT = ".glmesh";
+
+struct MeshStream {
+public:
+    uint32_t stride;
+    uint32_t reserved;
+    uint64_t offset; // From the start of the file
+    uint64_t size;
+};
+
+// A level of detail is a range of the indices, over the same vertices as every other level.
+struct MeshLOD {
+public:
+    uint32_t firstIndex;
+    uint32_t indexCount;
+    float error; // How far the surface is from LOD 0, in object units
+    uint32_t reserved;
+};
+
+struct MeshFileHeader {
+public:
+    char magic[4];
+    uint32_t version;
+    uint32_t vertexCount;
+    uint32_t indexCount;
+    uint32_t indexType;      // MESH_INDEX_16 or MESH_INDEX_32
+    uint32_t drawMode;       // GL primitive type, always triangles from the importer
+    uint32_t streamCount;
+    uint32_t attributeCount; // Attribute i goes to location i
+    float boundsMin[3];
+    float boundsMax[3];
+    VertexAttribute attributes[MAX_MESH_ATTRIBUTES];
+    MeshStream streams[MAX_MESH_STREAMS];
+    uint64_t indexOffset;
+    uint64_t indexSize;
+    uint32_t lodCount; // At least 1, LOD 0 being the full mesh
+    uint32_t reserved;
+    MeshLOD lods[MAX_MESH_LODS];
+};
+
+// Points into a MappedFile. Only valid as long as the file stays mapped.
+struct MeshFile {
+public:
+    const MeshFileHeader *header = nullptr;
+    const unsigned char *base = nullptr;
+
+    bool open(const MappedFile &file);
+
+    bool open(const unsigned char *data, size_t size);
+
+    const unsigned char *stream(uint32_t index) const;
+
+    const unsigned char *indices() const;
+
+    // Positions (attribute 0, float or half float) as xyz floats and the indices of LOD 0 widened to 32 bits.
+    bool readTriangles(std::vector<float> &positions, std::vector<uint32_t> &indices32) const;
+};
+
+// The mesh as it's written to disk. The importer fills this in from an ImportedMesh.
+struct MeshData {
+public:
+    uint32_t vertexCount = 0;
+    uint32_t drawMode = MESH_TRIANGLES;
+    std::vector<VertexAttribute> attributes;
+    std::vector<uint32_t> strides;                   // One per stream
+    std::vector<std::vector<unsigned char>> streams; // Quantized vertices
+    std::vector<uint32_t> indices;                   // Stored as 16 bit if they fit
+    std::vector<MeshLOD> lods;                       // Ranges of `indices`. Empty means one level with all of them
+    float boundsMin[3] = {0, 0, 0};
+    float boundsMax[3] = {0, 0, 0};
+};
+
+// Where `make import_meshes` puts the cooked version of a mesh, e.g. cube.obj -> ./res/cooked/cube.glmesh
+std::string cookedMeshPath(const std::string &meshPath);
+
+// The whole file in memory. Empty if the mesh has too many streams or attributes.
+std::vector<unsigned char> serializeMesh(const MeshData &mesh);
+
+bool writeMeshFile(const std::string &path, const MeshData &mesh);
+
+#endif
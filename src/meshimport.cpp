@@ -0,0 +1,568 @@
+//
+// Created by Grant on 2019-08-29.
+//
+
+#include "meshimport.h"
+
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+
+bool importOBJ(const std::string &path, ImportedMesh &out) {
+    std::ifstream in(path);
+    if (!in.is_open()) {
+        return false;
+    }
+
+    std::vector<float> positions, texCoords;
+    std::map<std::pair<int64_t, int64_t>, uint32_t> unique; // (position, texCoord) -> vertex
+    std::vector<uint32_t> face;
+
+    // OBJ indices start at 1, negative ones count back from the latest element.
+    auto resolve = [](int64_t index, size_t count) -> int64_t {
+        return index < 0 ? int64_t(count) + index : index - 1;
+    };
+
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream tokens(line);
+        std::string type;
+        tokens >> type;
+
+        if (type == "v") {
+            float x = 0, y = 0, z = 0;
+            tokens >> x >> y >> z;
+            positions.insert(positions.end(), {x, y, z});
+        } else if (type == "vt") {
+            float u = 0, v = 0;
+            tokens >> u >> v;
+            texCoords.insert(texCoords.end(), {u, v});
+        } else if (type == "f") {
+            face.clear();
+
+            std::string corner;
+            while (tokens >> corner) {
+                // v, v/vt, v//vn or v/vt/vn
+                int64_t position = std::strtoll(corner.c_str(), nullptr, 10), texCoord = 0;
+                size_t slash = corner.find('/');
+                if (slash != std::string::npos && slash + 1 < corner.size() && corner[slash + 1] != '/') {
+                    texCoord = std::strtoll(corner.c_str() + slash + 1, nullptr, 10);
+                }
+
+                int64_t p = resolve(position, positions.size() / 3);
+                int64_t t = texCoord == 0 ? -1 : resolve(texCoord, texCoords.size() / 2);
+                if (p < 0 || size_t(p) >= positions.size() / 3 || (t >= 0 && size_t(t) >= texCoords.size() / 2)) {
+                    std::cerr << "Bad face in " << path << ": " << line << std::endl;
+                    return false;
+                }
+
+                auto found = unique.find({p, t});
+                if (found == unique.end()) {
+                    found = unique.insert({{p, t}, uint32_t(out.vertices.size() / IMPORTED_VERTEX_FLOATS)}).first;
+                    out.vertices.insert(out.vertices.end(), {positions[p * 3], positions[p * 3 + 1],
+                                                             positions[p * 3 + 2], t < 0 ? 0 : texCoords[t * 2],
+                                                             t < 0 ? 0 : texCoords[t * 2 + 1]});
+                }
+                face.push_back(found->second);
+            }
+
+            std::vector<uint32_t> triangles = triangulate(face.data(), face.size(), MESH_POLYGON);
+            out.indices.insert(out.indices.end(), triangles.begin(), triangles.end());
+        }
+    }
+
+    return !out.indices.empty();
+}
+
+/*
+ * Just enough JSON for glTF. Numbers are doubles, objects keep their keys sorted.
+ */
+struct JsonValue {
+public:
+    enum Type {
+        JSON_NULL, JSON_BOOL, JSON_NUMBER, JSON_STRING, JSON_ARRAY, JSON_OBJECT
+    } type = JSON_NULL;
+
+    double number = 0;
+    std::string string;
+    std::vector<JsonValue> array;
+    std::map<std::string, JsonValue> object;
+
+    const JsonValue &operator[](const std::string &key) const {
+        static const JsonValue null;
+        auto found = object.find(key);
+        return found == object.end() ? null : found->second;
+    }
+
+    const JsonValue &operator[](size_t index) const {
+        static const JsonValue null;
+        return index < array.size() ? array[index] : null;
+    }
+
+    bool has(const std::string &key) const {
+        return object.count(key) != 0;
+    }
+
+    int64_t integer(int64_t fallback = -1) const {
+        return type == JSON_NUMBER ? int64_t(number) : fallback;
+    }
+};
+
+class JsonParser {
+public:
+    const char *pos;
+    const char *end;
+
+    bool parse(JsonValue &out) {
+        skipSpace();
+        if (pos >= end) {
+            return false;
+        }
+
+        switch (*pos) {
+            case '{': {
+                out.type = JsonValue::JSON_OBJECT;
+                pos++;
+                skipSpace();
+                if (pos < end && *pos == '}') {
+                    pos++;
+                    return true;
+                }
+                while (true) {
+                    JsonValue key;
+                    skipSpace();
+                    if (pos >= end || *pos != '"' || !parseString(key.string)) {
+                        return false;
+                    }
+                    skipSpace();
+                    if (pos >= end || *pos++ != ':' || !parse(out.object[key.string])) {
+                        return false;
+                    }
+                    skipSpace();
+                    if (pos < end && *pos == ',') {
+                        pos++;
+                    } else {
+                        return pos < end && *pos++ == '}';
+                    }
+                }
+            }
+            case '[': {
+                out.type = JsonValue::JSON_ARRAY;
+                pos++;
+                skipSpace();
+                if (pos < end && *pos == ']') {
+                    pos++;
+                    return true;
+                }
+                while (true) {
+                    out.array.emplace_back();
+                    if (!parse(out.array.back())) {
+                        return false;
+                    }
+                    skipSpace();
+                    if (pos < end && *pos == ',') {
+                        pos++;
+                    } else {
+                        return pos < end && *pos++ == ']';
+                    }
+                }
+            }
+            case '"':
+                out.type = JsonValue::JSON_STRING;
+                return parseString(out.string);
+            case 't':
+            case 'f':
+            case 'n': {
+                const char *words[] = {"true", "false", "null"};
+                for (const char *word : words) {
+                    size_t len = std::strlen(word);
+                    if (size_t(end - pos) >= len && std::strncmp(pos, word, len) == 0) {
+                        out.type = word[0] == 'n' ? JsonValue::JSON_NULL : JsonValue::JSON_BOOL;
+                        out.number = word[0] == 't';
+                        pos += len;
+                        return true;
+                    }
+                }
+                return false;
+            }
+            default: {
+                std::string number;
+                while (pos < end && (std::isdigit(*pos) || std::strchr("+-.eE", *pos))) {
+                    number += *pos++;
+                }
+                if (number.empty()) {
+                    return false;
+                }
+                out.type = JsonValue::JSON_NUMBER;
+                out.number = std::strtod(number.c_str(), nullptr);
+                return true;
+            }
+        }
+    }
+
+private:
+    void skipSpace() {
+        while (pos < end && std::isspace((unsigned char) *pos)) {
+            pos++;
+        }
+    }
+
+    // Escapes are kept simple: \uXXXX only handles ASCII, which is all glTF keys and URIs need here.
+    bool parseString(std::string &out) {
+        pos++; // Opening quote
+        while (pos < end && *pos != '"') {
+            if (*pos == '\\' && pos + 1 < end) {
+                pos++;
+                switch (*pos) {
+                    case 'n':
+                        out += '\n';
+                        break;
+                    case 't':
+                        out += '\t';
+                        break;
+                    case 'u':
+                        if (end - pos < 5) {
+                            return false;
+                        }
+                        out += char(std::strtol(std::string(pos + 1, 4).c_str(), nullptr, 16));
+                        pos += 4;
+                        break;
+                    default:
+                        out += *pos;
+                        break;
+                }
+                pos++;
+            } else {
+                out += *pos++;
+            }
+        }
+        return pos < end && *pos++ == '"';
+    }
+};
+
+static std::vector<unsigned char> decodeBase64(const std::string &text) {
+    std::vector<unsigned char> out;
+    uint32_t bits = 0;
+    int count = 0;
+    for (char c : text) {
+        int value;
+        if (c >= 'A' && c <= 'Z') {
+            value = c - 'A';
+        } else if (c >= 'a' && c <= 'z') {
+            value = c - 'a' + 26;
+        } else if (c >= '0' && c <= '9') {
+            value = c - '0' + 52;
+        } else if (c == '+' || c == '-') {
+            value = 62;
+        } else if (c == '/' || c == '_') {
+            value = 63;
+        } else {
+            continue; // Padding and whitespace
+        }
+
+        bits = (bits << 6u) | uint32_t(value);
+        count += 6;
+        if (count >= 8) {
+            count -= 8;
+            out.push_back((unsigned char) (bits >> uint32_t(count)));
+        }
+    }
+    return out;
+}
+
+static bool readBinaryFile(const std::string &path, std::vector<unsigned char> &out) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in.is_open()) {
+        return false;
+    }
+    out.resize(in.tellg());
+    in.seekg(0);
+    in.read((char *) out.data(), out.size());
+    return in.good();
+}
+
+/*
+ * Reads every element of an accessor as floats (normalized integers are converted like the GL would).
+ * Returns false if the accessor is missing or points outside of its buffer.
+ */
+static bool readAccessor(const JsonValue &gltf, const std::vector<std::vector<unsigned char>> &buffers,
+                         int64_t index, size_t components, std::vector<float> &out) {
+    const JsonValue &accessor = gltf["accessors"][index];
+    const JsonValue &view = gltf["bufferViews"][accessor["bufferView"].integer()];
+    int64_t bufferIndex = view["buffer"].integer();
+    if (accessor.type != JsonValue::JSON_OBJECT || view.type != JsonValue::JSON_OBJECT || bufferIndex < 0 ||
+        size_t(bufferIndex) >= buffers.size()) {
+        return false;
+    }
+
+    uint32_t componentType = accessor["componentType"].integer();
+    size_t componentSize = componentType == 5126 || componentType == 5125 ? 4 :
+                           componentType == 5123 || componentType == 5122 ? 2 : 1;
+    size_t count = accessor["count"].integer(0);
+    size_t stride = view["byteStride"].integer(componentSize * components);
+    size_t offset = view["byteOffset"].integer(0) + accessor["byteOffset"].integer(0);
+    bool normalized = accessor["normalized"].number != 0;
+
+    const std::vector<unsigned char> &buffer = buffers[bufferIndex];
+    if (count > 0 && offset + (count - 1) * stride + componentSize * components > buffer.size()) {
+        return false;
+    }
+
+    out.resize(count * components);
+    for (size_t i = 0; i < count; i++) {
+        const unsigned char *element = buffer.data() + offset + i * stride;
+        for (size_t c = 0; c < components; c++) {
+            const unsigned char *src = element + c * componentSize;
+            float value;
+            switch (componentType) {
+                case 5120: { // BYTE
+                    int8_t v;
+                    std::memcpy(&v, src, 1);
+                    value = normalized ? std::max(v / 127.0f, -1.0f) : v;
+                    break;
+                }
+                case 5121: // UNSIGNED_BYTE
+                    value = normalized ? *src / 255.0f : *src;
+                    break;
+                case 5122: { // SHORT
+                    int16_t v;
+                    std::memcpy(&v, src, 2);
+                    value = normalized ? std::max(v / 32767.0f, -1.0f) : v;
+                    break;
+                }
+                case 5123: { // UNSIGNED_SHORT
+                    uint16_t v;
+                    std::memcpy(&v, src, 2);
+                    value = normalized ? v / 65535.0f : v;
+                    break;
+                }
+                case 5125: { // UNSIGNED_INT (indices only)
+                    uint32_t v;
+                    std::memcpy(&v, src, 4);
+                    value = float(v);
+                    break;
+                }
+                case 5126: // FLOAT
+                    std::memcpy(&value, src, 4);
+                    break;
+                default:
+                    return false;
+            }
+            out[i * components + c] = value;
+        }
+    }
+    return true;
+}
+
+// Indices are read separately, floats can't hold every 32 bit index.
+static bool readIndices(const JsonValue &gltf, const std::vector<std::vector<unsigned char>> &buffers,
+                        int64_t index, std::vector<uint32_t> &out) {
+    const JsonValue &accessor = gltf["accessors"][index];
+    const JsonValue &view = gltf["bufferViews"][accessor["bufferView"].integer()];
+    int64_t bufferIndex = view["buffer"].integer();
+    if (accessor.type != JsonValue::JSON_OBJECT || view.type != JsonValue::JSON_OBJECT || bufferIndex < 0 ||
+        size_t(bufferIndex) >= buffers.size()) {
+        return false;
+    }
+
+    uint32_t componentType = accessor["componentType"].integer();
+    size_t size = componentType == 5125 ? 4 : componentType == 5123 ? 2 : 1;
+    size_t count = accessor["count"].integer(0);
+    size_t stride = view["byteStride"].integer(size);
+    size_t offset = view["byteOffset"].integer(0) + accessor["byteOffset"].integer(0);
+
+    const std::vector<unsigned char> &buffer = buffers[bufferIndex];
+    if (count > 0 && offset + (count - 1) * stride + size > buffer.size()) {
+        return false;
+    }
+
+    out.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        uint32_t value = 0;
+        std::memcpy(&value, buffer.data() + offset + i * stride, size); // Little endian
+        out[i] = value;
+    }
+    return true;
+}
+
+bool importGLTF(const std::string &path, ImportedMesh &out) {
+    std::vector<unsigned char> file;
+    if (!readBinaryFile(path, file)) {
+        return false;
+    }
+
+    std::string directory;
+    size_t slash = path.find_last_of("/\\");
+    if (slash != std::string::npos) {
+        directory = path.substr(0, slash + 1);
+    }
+
+    // .glb: 12 byte header, then a JSON chunk and an optional binary chunk.
+    const char *json = (const char *) file.data();
+    size_t jsonSize = file.size();
+    std::vector<unsigned char> glbBuffer;
+    if (file.size() >= 20 && std::memcmp(file.data(), "glTF", 4) == 0) {
+        uint32_t chunkSize, chunkType;
+        std::memcpy(&chunkSize, &file[12], 4);
+        std::memcpy(&chunkType, &file[16], 4);
+        if (chunkType != 0x4E4F534Au || 20 + size_t(chunkSize) > file.size()) { // "JSON"
+            return false;
+        }
+        json = (const char *) &file[20];
+        jsonSize = chunkSize;
+
+        size_t binary = 20 + size_t(chunkSize);
+        if (binary + 8 <= file.size()) {
+            std::memcpy(&chunkSize, &file[binary], 4);
+            std::memcpy(&chunkType, &file[binary + 4], 4);
+            if (chunkType == 0x004E4942u && binary + 8 + chunkSize <= file.size()) { // "BIN"
+                glbBuffer.assign(file.begin() + binary + 8, file.begin() + binary + 8 + chunkSize);
+            }
+        }
+    }
+
+    JsonValue gltf;
+    JsonParser parser = {json, json + jsonSize};
+    if (!parser.parse(gltf) || gltf.type != JsonValue::JSON_OBJECT) {
+        std::cerr << "Failed to parse " << path << std::endl;
+        return false;
+    }
+
+    std::vector<std::vector<unsigned char>> buffers;
+    for (const JsonValue &buffer : gltf["buffers"].array) {
+        buffers.emplace_back();
+        if (!buffer.has("uri")) {
+            buffers.back() = glbBuffer;
+            continue;
+        }
+
+        const std::string &uri = buffer["uri"].string;
+        size_t comma = uri.find(',');
+        if (uri.compare(0, 5, "data:") == 0 && comma != std::string::npos) {
+            buffers.back() = decodeBase64(uri.substr(comma + 1));
+        } else if (!readBinaryFile(directory + uri, buffers.back())) {
+            std::cerr << "Failed to read buffer " << uri << " of " << path << std::endl;
+            return false;
+        }
+    }
+
+    for (const JsonValue &mesh : gltf["meshes"].array) {
+        for (const JsonValue &primitive : mesh["primitives"].array) {
+            const JsonValue &attributes = primitive["attributes"];
+            std::vector<float> positions, texCoords;
+            if (!readAccessor(gltf, buffers, attributes["POSITION"].integer(), 3, positions)) {
+                std::cerr << "Skipping a primitive without positions in " << path << std::endl;
+                continue;
+            }
+
+            size_t vertexCount = positions.size() / 3;
+            if (!attributes.has("TEXCOORD_0") ||
+                !readAccessor(gltf, buffers, attributes["TEXCOORD_0"].integer(), 2, texCoords) ||
+                texCoords.size() / 2 != vertexCount) {
+                texCoords.assign(vertexCount * 2, 0);
+            }
+
+            std::vector<uint32_t> indices;
+            if (primitive.has("indices")) {
+                if (!readIndices(gltf, buffers, primitive["indices"].integer(), indices)) {
+                    std::cerr << "Skipping a primitive with bad indices in " << path << std::endl;
+                    continue;
+                }
+            } else {
+                for (uint32_t i = 0; i < vertexCount; i++) {
+                    indices.push_back(i);
+                }
+            }
+
+            auto base = uint32_t(out.vertices.size() / IMPORTED_VERTEX_FLOATS);
+            for (uint32_t &index : indices) {
+                if (index >= vertexCount) {
+                    return false;
+                }
+                index += base;
+            }
+
+            // glTF has the texture origin at the top left, OpenGL (and the flipped images) at the bottom left.
+            for (size_t v = 0; v < vertexCount; v++) {
+                out.vertices.insert(out.vertices.end(), {positions[v * 3], positions[v * 3 + 1], positions[v * 3 + 2],
+                                                         texCoords[v * 2], 1.0f - texCoords[v * 2 + 1]});
+            }
+
+            std::vector<uint32_t> triangles = triangulate(indices.data(), indices.size(),
+                                                          uint32_t(primitive["mode"].integer(MESH_TRIANGLES)));
+            out.indices.insert(out.indices.end(), triangles.begin(), triangles.end());
+        }
+    }
+
+    return !out.indices.empty();
+}
+
+bool importMesh(const std::string &path, ImportedMesh &out) {
+    if (endsWith(path, ".obj")) {
+        return importOBJ(path, out);
+    }
+    if (endsWith(path, ".gltf") || endsWith(path, ".glb")) {
+        return importGLTF(path, out);
+    }
+    return false;
+}
+
+MeshData processMesh(const ImportedMesh &mesh, bool compact, unsigned lodCount) {
+    MeshData data;
+    data.vertexCount = mesh.vertices.size() / IMPORTED_VERTEX_FLOATS;
+
+    // Every level is simplified from the full mesh (so its error is against the real surface), to half the
+    // triangles of the level before.
+    std::vector<std::vector<uint32_t>> levels = {mesh.indices};
+    std::vector<float> errors = {0};
+    for (unsigned level = 1; level < std::min(lodCount, MAX_MESH_LODS); level++) {
+        size_t target = levels.back().size() / 6 * 3;
+        float error;
+        std::vector<uint32_t> simplified = simplifyMesh(mesh.vertices.data(), data.vertexCount, IMPORTED_VERTEX_FLOATS,
+                                                        mesh.indices, target, INFINITY, error);
+        if (simplified.empty() || simplified.size() > levels.back().size() * 3 / 4) {
+            break; // Not worth another level, e.g. too few triangles or too many seams
+        }
+        levels.push_back(std::move(simplified));
+        errors.push_back(error);
+    }
+
+    for (std::vector<uint32_t> &level : levels) {
+        optimizeVertexCache(level, data.vertexCount);
+    }
+
+    // Fetch order of the full mesh, the coarser levels use a subset of its vertices anyway.
+    std::vector<uint32_t> remap = buildFetchRemap(levels[0], data.vertexCount);
+    for (size_t level = 0; level < levels.size(); level++) {
+        remapIndices(levels[level], remap);
+        data.lods.push_back({uint32_t(data.indices.size()), uint32_t(levels[level].size()), errors[level], 0});
+        data.indices.insert(data.indices.end(), levels[level].begin(), levels[level].end());
+    }
+    std::vector<unsigned char> vertices = remapVertices(mesh.vertices.data(), data.vertexCount,
+                                                        IMPORTED_VERTEX_FLOATS * sizeof(float), remap);
+    const auto *floats = (const float *) vertices.data();
+
+    for (int axis = 0; axis < 3; axis++) {
+        data.boundsMin[axis] = data.vertexCount ? INFINITY : 0;
+        data.boundsMax[axis] = data.vertexCount ? -INFINITY : 0;
+    }
+    for (size_t v = 0; v < data.vertexCount; v++) {
+        for (int axis = 0; axis < 3; axis++) {
+            data.boundsMin[axis] = std::min(data.boundsMin[axis], floats[v * IMPORTED_VERTEX_FLOATS + axis]);
+            data.boundsMax[axis] = std::max(data.boundsMax[axis], floats[v * IMPORTED_VERTEX_FLOATS + axis]);
+        }
+    }
+
+    // Same layout as VBLayout would make: positions in stream 0, texture coords in stream 1, 4-byte aligned.
+    uint32_t type = compact ? VERTEX_HALF_FLOAT : VERTEX_FLOAT;
+    data.attributes = {{3, type, 0, 0, 0},
+                       {2, type, 0, 0, 1}};
+    data.strides = {(3 * vertexTypeSize(type) + 3) & ~3u, (2 * vertexTypeSize(type) + 3) & ~3u};
+    data.streams = quantizeVertices(floats, data.vertexCount, IMPORTED_VERTEX_FLOATS, data.attributes, data.strides);
+    return data;
+}
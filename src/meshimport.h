@@ -0,0 +1,41 @@
+//
+// Created by Grant on 2019-08-29.
+//
+#pragma once
+
+#ifndef GRANT_MESHIMPORT_H_DEFINED
+#define GRANT_MESHIMPORT_H_DEFINED
+
+#include <string>
+#include <vector>
+
+#include "meshfile.h"
+
+/*
+ * Converts OBJ and glTF 2.0 (.gltf with external or base64 buffers, .glb) into MeshData. Only positions and the
+ * first set of texture coordinates are imported, since that's all the shaders take. Every glTF primitive is
+ * merged into one mesh and node transforms are ignored. The winding order is kept as is.
+ */
+struct ImportedMesh {
+public:
+    std::vector<float> vertices; // x, y, z, u, v
+    std::vector<uint32_t> indices; // Triangle list
+};
+
+const size_t IMPORTED_VERTEX_FLOATS = 5;
+
+bool importOBJ(const std::string &path, ImportedMesh &out);
+
+bool importGLTF(const std::string &path, ImportedMesh &out);
+
+// Picks the importer from the extension.
+bool importMesh(const std::string &path, ImportedMesh &out);
+
+/*
+ * Levels of detail (up to lodCount, see simplifyMesh()), vertex cache and fetch optimization, bounds and
+ * quantization. Positions go in stream 0 and texture coords in stream 1, both as floats, or as half floats if
+ * `compact` (needs ARB_half_float_vertex).
+ */
+MeshData processMesh(const ImportedMesh &mesh, bool compact, unsigned lodCount = MAX_MESH_LODS);
+
+#endif
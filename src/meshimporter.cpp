@@ -0,0 +1,70 @@
+//
+// Created by Grant on 2019-08-29.
+//
+// Offline mesh importer. Usage: MeshImporter [--compact] <output dir> <mesh>...
+// Run through `make import_meshes` to import everything in res/meshes (.obj, .gltf, .glb).
+// --compact stores half float vertices instead of floats. Up to MAX_MESH_LODS levels of detail are generated.
+//
+
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+
+#include "cooked.cpp"
+#include "mesh.cpp"
+#include "meshfile.cpp"
+#include "meshimport.cpp"
+
+int main(int argc, char **argv) {
+    int arg = 1;
+    bool compact = false;
+    if (arg < argc && std::string(argv[arg]) == "--compact") {
+        compact = true;
+        arg++;
+    }
+
+    if (argc - arg < 2) {
+        std::cerr << "Usage: " << argv[0] << " [--compact] <output dir> <mesh>..." << std::endl;
+        return 1;
+    }
+
+    COOKED_MESH_DIR = argv[arg++];
+    std::error_code err;
+    std::filesystem::create_directories(COOKED_MESH_DIR, err);
+
+    int failed = 0;
+    for (int i = arg; i < argc; i++) {
+        std::string path = argv[i];
+        auto start = std::chrono::steady_clock::now();
+
+        ImportedMesh imported;
+        if (!importMesh(path, imported)) {
+            std::cerr << "Failed to import " << path << " // Skipping..." << std::endl;
+            failed++;
+            continue;
+        }
+
+        size_t vertexCount = imported.vertices.size() / IMPORTED_VERTEX_FLOATS;
+        float before = averageCacheMissRatio(imported.indices, vertexCount);
+        MeshData mesh = processMesh(imported, compact);
+
+        std::string outPath = cookedMeshPath(path);
+        if (!writeMeshFile(outPath, mesh)) {
+            std::cerr << "Failed to write " << outPath << std::endl;
+            failed++;
+            continue;
+        }
+
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::vector<uint32_t> full(mesh.indices.begin(), mesh.indices.begin() + mesh.lods[0].indexCount);
+        std::cout << "Imported " << path << " -> " << outPath << " (" << mesh.vertexCount << " vertices, "
+                  << full.size() / 3 << " triangles, ACMR " << before << " -> "
+                  << averageCacheMissRatio(full, mesh.vertexCount) << ", " << ms << "ms)" << std::endl;
+        for (size_t level = 1; level < mesh.lods.size(); level++) {
+            std::cout << "  LOD " << level << ": " << mesh.lods[level].indexCount / 3 << " triangles, error "
+                      << mesh.lods[level].error << std::endl;
+        }
+    }
+
+    return failed == 0 ? 0 : 1;
+}
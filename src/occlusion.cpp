@@ -0,0 +1,316 @@
+//
+// Created by Grant on 2019-09-01.
+//
+
+#include "occlusion.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64)
+
+#include <emmintrin.h>
+
+#define OCCLUSION_SSE
+
+#endif
+
+static double occlusionMsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void multiplyMatrices(const float *a, const float *b, float *out) {
+    for (int c = 0; c < 4; c++) {
+        for (int r = 0; r < 4; r++) {
+            out[c * 4 + r] = a[r] * b[c * 4] + a[4 + r] * b[c * 4 + 1] + a[8 + r] * b[c * 4 + 2] +
+                             a[12 + r] * b[c * 4 + 3];
+        }
+    }
+}
+
+static void transformPoint(const float *m, float x, float y, float z, float *out) {
+    for (int r = 0; r < 4; r++) {
+        out[r] = m[r] * x + m[4 + r] * y + m[8 + r] * z + m[12 + r];
+    }
+}
+
+void OcclusionBuffer::resize(int w, int h) {
+    width = std::max(4, (w + 3) & ~3); // Whole SSE registers per row
+    height = std::max(1, h);
+    depth.assign(size_t(width) * height, 1.0f);
+
+    pyramid.clear();
+    levelWidths.clear();
+    levelHeights.clear();
+    int lw = width, lh = height;
+    while (true) {
+        pyramid.emplace_back(size_t(lw) * lh, 1.0f);
+        levelWidths.push_back(lw);
+        levelHeights.push_back(lh);
+        if (lw == 1 && lh == 1) {
+            break;
+        }
+        lw = std::max(1, (lw + 1) / 2);
+        lh = std::max(1, (lh + 1) / 2);
+    }
+}
+
+void OcclusionBuffer::begin(const float *matrix) {
+    std::memcpy(viewProj, matrix, sizeof(viewProj));
+    std::fill(depth.begin(), depth.end(), 1.0f);
+    stats = {};
+}
+
+void OcclusionBuffer::rasterize(const float *positions, size_t stride, const uint32_t *indices, size_t indexCount,
+                                const float *model) {
+    auto start = std::chrono::steady_clock::now();
+
+    float mvp[16];
+    multiplyMatrices(viewProj, model, mvp);
+
+    for (size_t i = 0; i + 2 < indexCount; i += 3) {
+        float clip[3][4];
+        for (int v = 0; v < 3; v++) {
+            const float *p = positions + indices[i + v] * stride;
+            transformPoint(mvp, p[0], p[1], p[2], clip[v]);
+        }
+
+        // Clip against the near plane (z >= -w), which turns the triangle into up to 4 vertices.
+        float poly[4][4];
+        int count = 0;
+        for (int v = 0; v < 3; v++) {
+            const float *cur = clip[v];
+            const float *next = clip[(v + 1) % 3];
+            float curDist = cur[2] + cur[3];
+            float nextDist = next[2] + next[3];
+
+            if (curDist >= 0) {
+                std::memcpy(poly[count++], cur, sizeof(poly[0]));
+            }
+            if ((curDist >= 0) != (nextDist >= 0)) {
+                float t = curDist / (curDist - nextDist);
+                for (int j = 0; j < 4; j++) {
+                    poly[count][j] = cur[j] + (next[j] - cur[j]) * t;
+                }
+                count++;
+            }
+        }
+
+        if (count < 3) {
+            continue;
+        }
+
+        float screen[4][3];
+        bool valid = true;
+        for (int v = 0; v < count; v++) {
+            float w = poly[v][3];
+            if (w <= 1e-6f) {
+                valid = false;
+                break;
+            }
+            screen[v][0] = (poly[v][0] / w * 0.5f + 0.5f) * width;
+            screen[v][1] = (poly[v][1] / w * 0.5f + 0.5f) * height;
+            screen[v][2] = poly[v][2] / w * 0.5f + 0.5f;
+        }
+
+        if (!valid) {
+            continue;
+        }
+
+        for (int v = 1; v + 1 < count; v++) {
+            rasterizeTriangle(screen[0], screen[v], screen[v + 1]);
+        }
+    }
+
+    stats.occluders++;
+    stats.rasterMs += occlusionMsSince(start);
+}
+
+/*
+ * Edge functions over the bounding box. A pixel (center) is covered if it's on the inside of all three
+ * edges; depth is the plane through the three vertices, which is exact since window z is linear in screen space.
+ */
+void OcclusionBuffer::rasterizeTriangle(const float *a, const float *b, const float *c) {
+    float area = (b[0] - a[0]) * (c[1] - a[1]) - (b[1] - a[1]) * (c[0] - a[0]);
+    if (std::abs(area) < 1e-8f) {
+        return;
+    }
+    if (area < 0) {
+        std::swap(b, c); // Counter-clockwise from here on
+        area = -area;
+    }
+
+    int minX = std::max(0, int(std::floor(std::min({a[0], b[0], c[0]}))));
+    int maxX = std::min(width - 1, int(std::ceil(std::max({a[0], b[0], c[0]}))));
+    int minY = std::max(0, int(std::floor(std::min({a[1], b[1], c[1]}))));
+    int maxY = std::min(height - 1, int(std::ceil(std::max({a[1], b[1], c[1]}))));
+    if (minX > maxX || minY > maxY) {
+        return;
+    }
+    minX &= ~3;
+
+    /*
+     * E(p) = A * (x - ox) + B * (y - oy), >= 0 on the inside. Edge i is opposite vertex i. The origin is the
+     * lower of the edge's two endpoints, so the triangles on both sides of a shared edge compute exactly opposite
+     * values and pixel centers right on it can't fall through the crack between them.
+     */
+    const float *v[3] = {a, b, c};
+    float edgeA[3], edgeB[3], originX[3], originY[3];
+    for (int i = 0; i < 3; i++) {
+        const float *p0 = v[(i + 1) % 3];
+        const float *p1 = v[(i + 2) % 3];
+        float sign = 1;
+        if (p1[1] < p0[1] || (p1[1] == p0[1] && p1[0] < p0[0])) {
+            std::swap(p0, p1);
+            sign = -1;
+        }
+        edgeA[i] = -(p1[1] - p0[1]) * sign;
+        edgeB[i] = (p1[0] - p0[0]) * sign;
+        originX[i] = p0[0];
+        originY[i] = p0[1];
+    }
+
+    // The barycentric weight of vertex i is E_i / area.
+    float zA = 0, zB = 0, zC = 0;
+    for (int i = 0; i < 3; i++) {
+        zA += edgeA[i] * v[i][2] / area;
+        zB += edgeB[i] * v[i][2] / area;
+        zC -= (edgeA[i] * originX[i] + edgeB[i] * originY[i]) * v[i][2] / area;
+    }
+
+    stats.triangles++;
+
+#ifdef OCCLUSION_SSE
+    __m128 zero = _mm_setzero_ps();
+    __m128 offsets = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+    for (int y = minY; y <= maxY; y++) {
+        float py = y + 0.5f;
+        float *row = &depth[size_t(y) * width];
+
+        for (int x = minX; x <= maxX; x += 4) {
+            __m128 px = _mm_add_ps(_mm_set1_ps(float(x)), offsets);
+
+            __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+            for (int i = 0; i < 3; i++) {
+                __m128 e = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(edgeA[i]), _mm_sub_ps(px, _mm_set1_ps(originX[i]))),
+                                      _mm_set1_ps(edgeB[i] * (py - originY[i])));
+                inside = _mm_and_ps(inside, _mm_cmpge_ps(e, zero));
+            }
+
+            if (_mm_movemask_ps(inside) == 0) {
+                continue;
+            }
+
+            __m128 z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(zA), px), _mm_set1_ps(zB * py + zC));
+            __m128 old = _mm_loadu_ps(row + x);
+            __m128 nearest = _mm_min_ps(old, z);
+            _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, old)));
+        }
+    }
+#else
+    for (int y = minY; y <= maxY; y++) {
+        float py = y + 0.5f;
+        float *row = &depth[size_t(y) * width];
+
+        for (int x = minX; x <= maxX; x++) {
+            float px = x + 0.5f;
+            bool inside = true;
+            for (int i = 0; i < 3; i++) {
+                inside = inside && edgeA[i] * (px - originX[i]) + edgeB[i] * (py - originY[i]) >= 0;
+            }
+
+            if (inside) {
+                row[x] = std::min(row[x], zA * px + zB * py + zC);
+            }
+        }
+    }
+#endif
+}
+
+void OcclusionBuffer::buildPyramid() {
+    auto start = std::chrono::steady_clock::now();
+
+    pyramid[0] = depth;
+    for (size_t level = 1; level < pyramid.size(); level++) {
+        const std::vector<float> &src = pyramid[level - 1];
+        std::vector<float> &dst = pyramid[level];
+        int srcW = levelWidths[level - 1], srcH = levelHeights[level - 1];
+        int dstW = levelWidths[level], dstH = levelHeights[level];
+
+        // Farthest of the 2x2 block, so a texel is only "in front" if all of its pixels are.
+        for (int y = 0; y < dstH; y++) {
+            int y0 = std::min(y * 2, srcH - 1), y1 = std::min(y * 2 + 1, srcH - 1);
+            for (int x = 0; x < dstW; x++) {
+                int x0 = std::min(x * 2, srcW - 1), x1 = std::min(x * 2 + 1, srcW - 1);
+                const float *top = &src[size_t(y0) * srcW];
+                const float *bottom = &src[size_t(y1) * srcW];
+                dst[size_t(y) * dstW + x] = std::max(std::max(top[x0], top[x1]), std::max(bottom[x0], bottom[x1]));
+            }
+        }
+    }
+
+    stats.rasterMs += occlusionMsSince(start);
+}
+
+bool OcclusionBuffer::occluded(const AABB &box) {
+    auto start = std::chrono::steady_clock::now();
+    bool hidden = test(box);
+    stats.tested++;
+    stats.occluded += hidden;
+    stats.testMs += occlusionMsSince(start);
+    return hidden;
+}
+
+bool OcclusionBuffer::test(const AABB &box) const {
+    float minX = float(width), maxX = 0, minY = float(height), maxY = 0, minZ = 1;
+    for (int corner = 0; corner < 8; corner++) {
+        float clip[4];
+        transformPoint(viewProj, corner & 1 ? box.max[0] : box.min[0], corner & 2 ? box.max[1] : box.min[1],
+                       corner & 4 ? box.max[2] : box.min[2], clip);
+
+        // In front of the near plane (or behind the camera), can't say anything about it.
+        if (clip[3] <= 1e-6f || clip[2] < -clip[3]) {
+            return false;
+        }
+
+        float x = (clip[0] / clip[3] * 0.5f + 0.5f) * width;
+        float y = (clip[1] / clip[3] * 0.5f + 0.5f) * height;
+        minX = std::min(minX, x);
+        maxX = std::max(maxX, x);
+        minY = std::min(minY, y);
+        maxY = std::max(maxY, y);
+        minZ = std::min(minZ, clip[2] / clip[3] * 0.5f + 0.5f);
+    }
+
+    int x0 = std::max(0, int(std::floor(minX)));
+    int x1 = std::min(width - 1, int(std::floor(maxX)));
+    int y0 = std::max(0, int(std::floor(minY)));
+    int y1 = std::min(height - 1, int(std::floor(maxY)));
+    if (x0 > x1 || y0 > y1) {
+        return false; // Off screen, that's up to frustum culling
+    }
+
+    // Go up until the rectangle covers at most 2x2 texels (3x3 if it straddles texel edges).
+    size_t level = 0;
+    int span = std::max(x1 - x0, y1 - y0) + 1;
+    while (span > 2 && level + 1 < pyramid.size()) {
+        span = (span + 1) / 2;
+        level++;
+    }
+
+    const std::vector<float> &texels = pyramid[level];
+    int levelW = levelWidths[level];
+    bool hidden = true;
+    for (int y = y0 >> level; y <= y1 >> level && hidden; y++) {
+        for (int x = x0 >> level; x <= x1 >> level; x++) {
+            if (minZ <= texels[size_t(y) * levelW + x]) {
+                hidden = false;
+                break;
+            }
+        }
+    }
+
+    return hidden;
+}
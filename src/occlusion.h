@@ -0,0 +1,65 @@
+//
+// Created by Grant on 2019-09-01.
+//
+#pragma once
+
+#ifndef GRANT_OCCLUSION_H_DEFINED
+#define GRANT_OCCLUSION_H_DEFINED
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "bvh.h"
+
+struct OcclusionStats {
+public:
+    unsigned occluders = 0;
+    unsigned triangles = 0; // Rasterized, after clipping
+    unsigned tested = 0;
+    unsigned occluded = 0;
+    double rasterMs = 0;
+    double testMs = 0;
+};
+
+/*
+ * Software occlusion culling, entirely on the CPU:
+ *  1. rasterize() a few big occluders into a small depth buffer (4 pixels at a time with SSE).
+ *  2. buildPyramid() takes the farthest depth of every 2x2 block, level after level (hierarchical Z).
+ *  3. occluded() projects a box and compares its nearest depth against the level where the box covers
+ *     about 2x2 texels. If every texel has an occluder in front of the box, it's hidden.
+ * Depth is window space z in [0, 1] (1 is the far plane). Matrices are column-major float[16].
+ */
+class OcclusionBuffer {
+public:
+    int width = 0; // Always a multiple of 4
+    int height = 0;
+    std::vector<float> depth; // Nearest occluder per pixel, rows from the bottom like GL
+    std::vector<std::vector<float>> pyramid; // Level 0 is a copy of depth
+    std::vector<int> levelWidths, levelHeights;
+    OcclusionStats stats;
+
+    void resize(int w, int h);
+
+    // Clears the depth buffer and sets the matrix for everything after it.
+    void begin(const float *viewProj);
+
+    // Triangles of a mesh (float positions, `stride` floats apart) transformed by `model`. Winding doesn't matter.
+    void rasterize(const float *positions, size_t stride, const uint32_t *indices, size_t indexCount,
+                   const float *model);
+
+    void buildPyramid();
+
+    // True only if the box is certainly hidden. Boxes crossing the near plane never are.
+    bool occluded(const AABB &box);
+
+    // Same test without touching the stats, so it can run on several threads at once.
+    bool test(const AABB &box) const;
+
+private:
+    float viewProj[16];
+
+    void rasterizeTriangle(const float *a, const float *b, const float *c);
+};
+
+#endif
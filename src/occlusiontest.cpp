@@ -0,0 +1,67 @@
+//
+// Created by Grant on 2019-09-01.
+//
+// Headless occlusion culling test. Usage: OcclusionTest
+// Rasterizes a wall in front of a camera at the origin (looking down -z) and checks which boxes around it come
+// out as hidden. Exits with 1 if any of them is wrong, so it can run as a CTest.
+//
+
+#include <cmath>
+#include <iostream>
+
+#include "occlusion.cpp"
+
+// Column-major, like glm::perspective.
+static void perspective(float fovY, float aspect, float near, float far, float *out) {
+    float f = 1.0f / std::tan(fovY * 0.5f);
+    for (int i = 0; i < 16; i++) {
+        out[i] = 0;
+    }
+    out[0] = f / aspect;
+    out[5] = f;
+    out[10] = (far + near) / (near - far);
+    out[11] = -1;
+    out[14] = 2 * far * near / (near - far);
+}
+
+int main() {
+    float viewProj[16]; // The view is the identity
+    perspective(1.2f, 2.0f, 0.1f, 100.0f, viewProj);
+    const float identity[16] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1};
+
+    // A 6x6 wall 5 units in front of the camera
+    const float wall[] = {-3, -3, -5, 3, -3, -5, 3, 3, -5, -3, 3, -5};
+    const uint32_t quad[] = {0, 1, 2, 0, 2, 3};
+
+    OcclusionBuffer buffer;
+    buffer.resize(256, 128);
+    buffer.begin(viewProj);
+    buffer.rasterize(wall, 3, quad, 6, identity);
+    buffer.buildPyramid();
+
+    struct Case {
+        const char *name;
+        AABB box;
+        bool hidden;
+    };
+    const Case cases[] = {
+            {"behind the wall", {{-0.5f, -0.5f, -8}, {0.5f, 0.5f, -7}}, true},
+            {"far behind the wall", {{-2, -2, -60}, {2, 2, -40}}, true},
+            {"beside the wall", {{5, -0.5f, -8}, {6, 0.5f, -7}}, false},
+            {"poking out from behind the wall", {{2.5f, -0.5f, -8}, {6, 0.5f, -7}}, false},
+            {"in front of the wall", {{-0.5f, -0.5f, -4}, {0.5f, 0.5f, -3}}, false},
+            {"crossing the near plane", {{-1, -1, -1}, {1, 1, 1}}, false},
+    };
+
+    int failed = 0;
+    for (const Case &c : cases) {
+        bool hidden = buffer.occluded(c.box);
+        bool ok = hidden == c.hidden && buffer.test(c.box) == hidden;
+        std::cout << (ok ? "[PASS] " : "[FAIL] ") << c.name << ": " << (hidden ? "hidden" : "visible") << std::endl;
+        failed += !ok;
+    }
+
+    std::cout << buffer.stats.triangles << " triangles, " << buffer.stats.occluded << " of " << buffer.stats.tested
+              << " boxes hidden" << std::endl;
+    return failed ? 1 : 0;
+}
@@ -3,6 +3,16 @@
 //
 
 #include "renderer.h"
+#include "cooked.cpp"
+#include "atlas.cpp"
+#include "mesh.cpp"
+#include "meshfile.cpp"
+#include "meshimport.cpp"
+#include "culling.cpp"
+#include "bvh.cpp"
+#include "occlusion.cpp"
+#include "voxel.cpp"
+#include "jobs.cpp"
 
 void flushGLErrors() {
     GLenum err = glGetError();
@@ -65,34 +75,99 @@ bool Renderer::init(const char *title, int x, int y, GLFWmonitor *monitor, GLFWw
     ImGui_ImplOpenGL2_Init();
 
 
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    glBlendEquation(GL_ADD);
+    glState.invalidate();
 
-    glEnable(GL_DEPTH_TEST);
-    glDepthFunc(GL_LESS);
+    glState.setCapability(GL_BLEND, true);
+    glState.setBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glState.setBlendEquation(GL_ADD);
 
-    glCullFace(GL_BACK);
-    glEnable(GL_CULL_FACE);
+    glState.setCapability(GL_DEPTH_TEST, true);
+    glState.setDepthFunc(GL_LESS);
+
+    glState.setCullFace(GL_BACK);
+    glState.setCapability(GL_CULL_FACE, true);
+
+    if (GLEW_KHR_parallel_shader_compile) {
+        glMaxShaderCompilerThreadsKHR(0xFFFFFFFFu); // Let the driver decide how many threads to use
+    }
+
+    jobs.init();
+    queue.init(jobs.threadCount());
+    textures.init();
+    meshes.init();
+    occlusion.resize(256, 128); // Plenty for a handful of big occluders, and fast to clear
+
+    uniformBuffers = GLEW_ARB_uniform_buffer_object;
+    if (uniformBuffers) {
+        GLint uniformAlignment = 256;
+        glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &uniformAlignment);
+        cameraStream.init(GL_UNIFORM_BUFFER, 16 * uniformAlignment, uniformAlignment);
+    } else {
+        std::cerr << "[WARNING]: ARB_uniform_buffer_object not supported! Camera matrices will be set per program."
+                  << std::endl;
+    }
 
     return true;
 }
 
 void Renderer::flip() {
+    queue.instanceStream.endFrame();
+    queue.indirectStream.endFrame();
+    cameraStream.endFrame();
+    glState.endFrame();
     glfwSwapBuffers(window);
     glfwPollEvents();
 }
 
 void Renderer::quit() {
+    jobs.shutdown();
+    textures.shutdown();
+    streamer.shutdown();
+
+    // Resources are usually shared between objects, so make sure each one is only destroyed once.
+    std::unordered_set<void *> destroyed;
+    auto destroyModel = [&](Model *model) {
+        if (destroyed.insert(model->ibo).second) {
+            model->ibo->destroy();
+        }
+        if (destroyed.insert(model->vbo).second) {
+            model->vbo->destroy();
+        }
+        for (VertexBuffer *stream : model->extraStreams) {
+            if (destroyed.insert(stream).second) {
+                stream->destroy();
+            }
+        }
+        if (destroyed.insert(model->vao).second) {
+            model->vao->destroy();
+        }
+    };
 
-    for (std::pair<std::string, GameObject *> object : gameObjects) {
-        object.second->texture->destroy();
-        object.second->shader->destroy();
+    // Variants belong to their ShaderPermutations, which destroys and deletes every one of them (used or not).
+    std::unordered_set<ShaderPermutations *> permutations;
+    for (size_t i = 0; i < objects.size(); i++) {
+        if (destroyed.insert(objects.textures[i]).second) {
+            objects.textures[i]->destroy();
+        }
+        if (objects.shaders[i]->permutations) {
+            permutations.insert(objects.shaders[i]->permutations);
+        } else if (destroyed.insert(objects.shaders[i]).second) {
+            objects.shaders[i]->destroy();
+        }
+        destroyModel(objects.models[i]);
+    }
+    for (ShaderPermutations *shaders : permutations) {
+        shaders->destroy();
+    }
 
-        object.second->model->ibo->destroy();
-        object.second->model->vbo->destroy();
-        object.second->model->vao->destroy();
+    // Loaded meshes that no object is using anymore
+    for (Model *model : meshes.models) {
+        destroyModel(model);
     }
+    meshes.release();
+
+    queue.destroy();
+    cameraStream.destroy();
 
     ImGui_ImplOpenGL2_Shutdown();
     ImGui_ImplGlfw_Shutdown();
@@ -107,347 +182,3599 @@ void Renderer::drawImGui() {
 
     ImGui::Render();
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glUseProgram(0);
-    glBindVertexArray(0);
+    glState.bindVertexArray(0);
+    glState.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glState.bindBuffer(GL_ARRAY_BUFFER, 0);
+    glState.useProgram(0);
 
     ImGui_ImplOpenGL2_RenderDrawData(ImGui::GetDrawData());
+
+    // ImGui sets up its own state behind our back.
+    glState.invalidate();
 }
 
-void Renderer::addGameObject(const std::string &name, GameObject *obj) {
-    gameObjects[name] = obj;
+ObjectHandle Renderer::addGameObject(const std::string &name, const GameObject &obj, uint32_t flags) {
+    ObjectHandle handle = objects.add(obj, flags, name);
+    BVH &tree = flags & OBJECT_STATIC ? staticTree : dynamicTree;
+    tree.insert(handle.index, worldBounds(objects.indexOf(handle)));
+    return handle;
 }
 
-void Renderer::drawObject(const std::string &name) {
-    if (gameObjects.find(name) != gameObjects.end()) {
-        GameObject *obj = gameObjects[name];
-        obj->texture->bind(0);
-        obj->shader->bind();
-        obj->model->vao->bind();
-        obj->model->ibo->bind();
+void Renderer::removeGameObject(ObjectHandle handle) {
+    if (!objects.valid(handle)) {
+        std::cerr << "[WARNING]: Tried to remove a GameObject with a stale handle!" << std::endl;
+        return;
+    }
+
+    staticTree.remove(handle.index);
+    dynamicTree.remove(handle.index);
+    objects.remove(handle);
+}
+
+/*
+ * Switches the object over to the shader variant for the given features. This happens here rather than at
+ * draw time, so submission never has to look up variants.
+ */
+void Renderer::setFeatures(ObjectHandle handle, uint32_t features) {
+    if (!objects.valid(handle)) {
+        return;
+    }
 
-        glm::mat4 mvp = proj * view * obj->transforms;
-        obj->shader->setUniformMat4f("u_MVP", mvp);
+    uint32_t index = objects.indexOf(handle);
+    ShaderProgram *shader = objects.shaders[index];
+    if (shader->permutations && shader->featureMask != features) {
+        objects.shaders[index] = shader->permutations->get(features);
+    }
+}
 
-        glDrawElements(obj->model->drawMode, obj->model->ibo->count, GL_UNSIGNED_INT, nullptr);
+void Renderer::drawObject(const std::string &name) {
+    ObjectHandle handle = objects.find(name);
+    if (objects.valid(handle)) {
+        submit(handle);
     } else {
         std::cerr << "GameObject '" << name << "' doesn't exist! Skipping draw call..." << std::endl;
     }
 }
 
-void Renderer::clear(GLclampf r, GLclampf g, GLclampf b, GLclampf a) {
-    flushGLErrors();
+void Renderer::submit(ObjectHandle handle) {
+    if (!objects.valid(handle)) {
+        std::cerr << "[WARNING]: Tried to draw a GameObject with a stale handle! Skipping draw call..." << std::endl;
+        return;
+    }
 
-    glClearColor(r, g, b, a);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    uint32_t index = objects.indexOf(handle);
+    if (culling) {
+        BoundsSoA single;
+        single.resize(1);
+        setBounds(single, 0, index);
 
-    ImGui_ImplOpenGL2_NewFrame();
-    ImGui_ImplGlfw_NewFrame();
-    ImGui::NewFrame();
-}
+        uint8_t visible;
+        glm::mat4 viewProj = proj * view;
+        cullBoxes(extractFrustum(&viewProj[0][0]), single, &visible);
 
-VertexBuffer::VertexBuffer(GLsizeiptr size, const GLvoid *data, GLenum usage) : id(0) {
-    glGenBuffers(1, &id);
-    glBindBuffer(GL_ARRAY_BUFFER, id);
-    glBufferData(GL_ARRAY_BUFFER, size, data, usage);
-}
+        frameCull.tested++;
+        if (!visible) {
+            frameCull.culled++;
+            return;
+        }
+        frameCull.visible++;
+    }
 
-void VertexBuffer::bind() const {
-    glBindBuffer(GL_ARRAY_BUFFER, id);
+    prepareLOD();
+    enqueue(index);
 }
 
-void VertexBuffer::unbind() const {
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+void Renderer::setBounds(BoundsSoA &soa, size_t slot, uint32_t index) const {
+    const Model *model = objects.models[index];
+    soa.set(slot, &model->boundsMin[0], &model->boundsMax[0], &objects.transforms[index][0][0]);
 }
 
-/*
- * NOTE: The data type of IndexBuffers is hardcoded to be GLuint (or unsigned int). VertexBuffers can have varying types.
- */
-IndexBuffer::IndexBuffer(GLsizei count, const GLuint *data, GLenum usage) : id(0) {
-    glGenBuffers(1, &id);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, id);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, count * sizeof(GLuint), data, usage);
+AABB Renderer::worldBounds(uint32_t index) const {
+    const Model *model = objects.models[index];
+    return transformAABB(&model->boundsMin[0], &model->boundsMax[0], &objects.transforms[index][0][0]);
+}
 
-    this->count = count;
+void Renderer::runJob(std::function<void()> job, JobCounter &counter) {
+    if (parallel) {
+        jobs.run(std::move(job), &counter);
+    } else {
+        job();
+    }
 }
 
-void IndexBuffer::bind() const {
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, id);
+void Renderer::forEach(size_t count, size_t grain, const std::function<void(size_t, size_t)> &body) {
+    if (parallel) {
+        jobs.parallelFor(count, grain, body);
+    } else if (count > 0) {
+        body(0, count);
+    }
 }
 
-void IndexBuffer::unbind() const {
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+void Renderer::updateTrees() {
+    double start = glfwGetTime();
+
+    // The static tree only needs work after objects were added or removed, which can overlap the refit.
+    JobCounter staticCommit;
+    runJob([this]() { staticTree.commit(); }, staticCommit);
+
+    frameBounds.resize(objects.size());
+    forEach(objects.size(), 1024, [this](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            if (!(objects.flags[i] & OBJECT_STATIC)) {
+                frameBounds[i] = worldBounds(uint32_t(i));
+            }
+        }
+    });
+
+    for (uint32_t i = 0; i < objects.size(); i++) {
+        if (!(objects.flags[i] & OBJECT_STATIC)) {
+            dynamicTree.update(objects.denseToSlot[i], frameBounds[i]);
+        }
+    }
+    dynamicTree.commit();
+
+    jobs.wait(staticCommit);
+    frameCull.treeMs += (glfwGetTime() - start) * 1000.0;
 }
 
-ShaderProgram::ShaderProgram(const std::string &path) {
-    std::string profilePath = path + "/shaders.meta";
-    std::ifstream metadat(profilePath);
+ObjectHandle Renderer::pick(const glm::vec3 &origin, const glm::vec3 &direction, float maxDistance) const {
+    uint32_t staticHit = 0, dynamicHit = 0;
+    float staticDistance = maxDistance, dynamicDistance = maxDistance;
+    bool hitStatic = staticTree.raycast(&origin[0], &direction[0], maxDistance, staticHit, staticDistance);
+    bool hitDynamic = dynamicTree.raycast(&origin[0], &direction[0], maxDistance, dynamicHit, dynamicDistance);
+    if (!hitStatic && !hitDynamic) {
+        return {};
+    }
 
-    std::string line;
-    id = glCreateProgram();
-    std::vector<GLuint> shaders;
+    uint32_t slot = hitStatic && (!hitDynamic || staticDistance <= dynamicDistance) ? staticHit : dynamicHit;
+    return {slot, objects.generations[slot]};
+}
 
-    if (!metadat.is_open()) {
-        std::cerr << "Failed to load shaders: cannot read " << profilePath << std::endl;
-        id = 0;
-        return;
+std::vector<ObjectHandle> Renderer::queryRange(const glm::vec3 &min, const glm::vec3 &max) const {
+    AABB range = {{min.x, min.y, min.z}, {max.x, max.y, max.z}};
+    std::vector<uint32_t> slots;
+    staticTree.queryRange(range, slots);
+    dynamicTree.queryRange(range, slots);
+
+    std::vector<ObjectHandle> handles;
+    for (uint32_t slot : slots) {
+        handles.push_back({slot, objects.generations[slot]});
     }
+    return handles;
+}
 
-    while (getline(metadat, line)) {
-        int indx = line.find(": ");
-        if (line[0] == '#' ||
-            indx == std::string::npos) { // comments. Skip lines that don't have colons or contain the # character.
-            continue;
+void Renderer::submitAll() {
+    updateTrees(); // Also needed for picking, even if nothing's culled
+    prepareLOD();
+    candidates.clear();
+
+    if (!culling) {
+        for (uint32_t i = 0; i < objects.size(); i++) {
+            if (objects.flags[i] & OBJECT_VISIBLE) {
+                candidates.push_back(i);
+            }
         }
-        std::string shaderStrType = line.substr(0, indx);
-        std::string filename = line.substr(indx + 2);
-        std::string fullPath = path + "/" + filename;
+        enqueueCandidates();
+        return;
+    }
 
-        std::string shaderSrc;
-        std::string shaderln;
+    double start = glfwGetTime();
+    glm::mat4 viewProj = proj * view;
+    if (hierarchicalCulling) {
+        Frustum frustum = extractFrustum(&viewProj[0][0]);
 
-        std::ifstream shaderStream(fullPath);
+        treeResults.clear();
+        dynamicResults.clear();
+        JobCounter queries;
+        runJob([this, &frustum]() { staticTree.queryFrustum(frustum, treeResults); }, queries);
+        runJob([this, &frustum]() { dynamicTree.queryFrustum(frustum, dynamicResults); }, queries);
 
-        if (!shaderStream.is_open()) {
-            std::cerr << "Failed to load " << shaderStrType << ": cannot read " << fullPath << " // Skipping.."
-                      << std::endl;
-            continue;
+        unsigned tested = 0;
+        for (uint32_t i = 0; i < objects.size(); i++) {
+            tested += (objects.flags[i] & OBJECT_VISIBLE) != 0;
         }
-        while (getline(shaderStream, shaderln)) {
-            shaderSrc.append(shaderln + "\n");
+
+        jobs.wait(queries);
+        for (const std::vector<uint32_t> *results : {&treeResults, &dynamicResults}) {
+            for (uint32_t slot : *results) {
+                uint32_t i = objects.slotToDense[slot];
+                if (objects.flags[i] & OBJECT_VISIBLE) {
+                    candidates.push_back(i);
+                }
+            }
         }
 
-        // Shader compilation code.
-        GLuint shader = compileShader(shaderStrType, shaderSrc, fullPath);
-        if (shader != 0) {
-            glAttachShader(id, shader);
-            shaders.push_back(shader);
-            std::cout << "Successfully loaded " << shaderStrType << " from " << fullPath << std::endl;
+        frameCull.tested += tested;
+        frameCull.culled += tested - unsigned(candidates.size());
+    } else {
+        // Every object is tested (hidden ones too) so the SIMD loop doesn't have to deal with gaps.
+        bounds.resize(objects.size());
+        visibility.resize(objects.size());
+        Frustum frustum = extractFrustum(&viewProj[0][0]);
+        forEach(objects.size(), 1024, [this, &frustum](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                setBounds(bounds, i, uint32_t(i));
+            }
+            cullBoxes(frustum, bounds, begin, end, visibility.data());
+        });
+
+        for (uint32_t i = 0; i < objects.size(); i++) {
+            if (!(objects.flags[i] & OBJECT_VISIBLE)) {
+                continue;
+            }
+
+            frameCull.tested++;
+            if (!visibility[i]) {
+                frameCull.culled++;
+                continue;
+            }
+            candidates.push_back(i);
         }
     }
-    glLinkProgram(id);
-    glValidateProgram(id);
+    frameCull.ms += (glfwGetTime() - start) * 1000.0;
 
-    for (GLuint s : shaders) {
-        glDeleteShader(s);
+    if (occlusionCulling) {
+        cullOccluded();
     }
 
-    std::cout << "Successfully loaded shader program from " << profilePath << std::endl;
+    frameCull.visible += unsigned(candidates.size());
+    enqueueCandidates();
 }
 
-
-GLuint ShaderProgram::compileShader(const std::string &type, const std::string &src, const std::string &fullpath) {
-    GLenum shadertype;
-    if (SHADER_TYPES.find(type) != SHADER_TYPES.end()) {
-        shadertype = SHADER_TYPES[type];
-    } else {
-        std::cerr << "Invalid shader type: " << type << " // Skipping..." << std::endl;
-        return 0;
+void Renderer::prepareLOD() {
+    lodLevels.resize(objects.generations.size(), 0); // Sized up front, selectLOD() runs on several threads
+    if (lodPrepared) { // The camera doesn't change within a frame
+        return;
     }
+    lodPrepared = true;
 
-    GLuint shader = glCreateShader(shadertype);
-    const char *rsrc = src.c_str();
+    int width, height;
+    glfwGetFramebufferSize(window, &width, &height);
 
-    glShaderSource(shader, 1, &rsrc, nullptr);
-    glCompileShader(shader);
+    // proj[1][1] is 1 / tan(fov / 2) for the projections Camera::getProjection() makes.
+    lodPixels = proj[1][1] * float(height) * 0.5f;
+    lodEye = glm::vec3(glm::inverse(view)[3]);
+}
 
-    GLint result;
-    glGetShaderiv(shader, GL_COMPILE_STATUS, &result);
-    if (result == GL_FALSE) {
-        std::cerr << "Error compiling " << type << " from " << fullpath << std::endl;
-        GLint len;
-        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &len);
-        char msg[len];
-        glGetShaderInfoLog(shader, len, &len, msg);
-        std::cerr << msg << std::endl;
-        glDeleteShader(shader);
-        return 0;
+/*
+ * The error of a level, in pixels, is its object space error scaled by the transform, divided by the distance
+ * to the closest point of the bounding sphere and multiplied by lodPixels. Going to a finer level happens as soon
+ * as the current one is over the threshold; a coarser one is only taken once it's comfortably under it.
+ */
+const Model *Renderer::selectLOD(uint32_t index) {
+    const Model *model = objects.models[index];
+    if (!levelOfDetail || model->lods.empty()) {
+        return model;
     }
 
-    return shader;
+    const glm::mat4 &transform = objects.transforms[index];
+    float scale = std::max({glm::length(glm::vec3(transform[0])), glm::length(glm::vec3(transform[1])),
+                            glm::length(glm::vec3(transform[2]))});
+    glm::vec3 center = glm::vec3(transform * glm::vec4((model->boundsMin + model->boundsMax) * 0.5f, 1.0f));
+    float radius = glm::length(model->boundsMax - model->boundsMin) * 0.5f * scale;
+    float distance = std::max(glm::length(center - lodEye) - radius, 1e-3f);
+    float pixels = scale * lodPixels / distance;
+
+    uint32_t slot = objects.denseToSlot[index];
+
+    auto levels = size_t(model->lods.size());
+    auto errorOf = [&](size_t level) {
+        return (level == 0 ? model->lodError : model->lods[level - 1]->lodError) * pixels;
+    };
+    size_t level = std::min(size_t(lodLevels[slot]), levels);
+    while (level > 0 && errorOf(level) > lodThreshold) {
+        level--;
+    }
+    while (level < levels && errorOf(level + 1) <= lodThreshold * lodHysteresis) {
+        level++;
+    }
+    lodLevels[slot] = uint8_t(level);
+
+    return level == 0 ? model : model->lods[level - 1];
 }
 
-void ShaderProgram::bind() const {
-    glUseProgram(id);
+DrawCommand Renderer::makeCommand(uint32_t index, LODStats &lod) {
+    const Model *model = selectLOD(index);
+    lod.triangles += objects.models[index]->count() / 3;
+    lod.drawn += model->count() / 3;
+    lod.reduced += model != objects.models[index];
+
+    // Distance along the view direction, used to sort front-to-back within a state bucket.
+    float depth = -(view * objects.transforms[index][3]).z;
+    return {RenderQueue::makeKey(objects.shaders[index], objects.textures[index], model, depth), index, model};
 }
 
-void ShaderProgram::unbind() const {
-    glUseProgram(0);
+void Renderer::enqueue(uint32_t index) {
+    queue.record(jobs.currentThread(), makeCommand(index, frameLod), queue.reserveOrders(1));
+}
+
+void Renderer::enqueueCandidates() {
+    // One order per range, so the merged list comes out the same whichever thread ran which range.
+    uint64_t firstOrder = queue.reserveOrders(candidates.size());
+    forEach(candidates.size(), 512, [this, firstOrder](size_t begin, size_t end) {
+        LODStats lod;
+        unsigned thread = jobs.currentThread();
+        for (size_t i = begin; i < end; i++) {
+            queue.record(thread, makeCommand(candidates[i], lod), firstOrder + begin);
+        }
+
+        std::lock_guard<std::mutex> guard(statsLock);
+        frameLod.reduced += lod.reduced;
+        frameLod.triangles += lod.triangles;
+        frameLod.drawn += lod.drawn;
+    });
 }
 
-GLint ShaderProgram::getUniformLoc(const std::string &name) {
-    auto loc = uniforms.find(name);
-    if (loc != uniforms.end()) {  // It's already cached. No need to access GPU again.
-        return loc->second;
+/*
+ * Occluders are drawn into the occlusion buffer first (only those in the frustum, anything else can't hide
+ * something that is), then every other candidate's bounds are tested against it. Occluders themselves are
+ * never culled, so two of them can't hide each other and both vanish.
+ */
+void Renderer::cullOccluded() {
+    glm::mat4 viewProj = proj * view;
+    occlusion.begin(&viewProj[0][0]);
+
+    bool anyOccluders = false;
+    for (uint32_t i : candidates) {
+        const Model *model = objects.models[i];
+        if ((objects.flags[i] & OBJECT_OCCLUDER) && !model->triangles.empty()) {
+            occlusion.rasterize(model->positions.data(), 3, model->triangles.data(), model->triangles.size(),
+                                &objects.transforms[i][0][0]);
+            anyOccluders = true;
+        }
     }
 
-    GLint uni = glGetUniformLocation(id, name.c_str());
-    if (uni == -1) {
-        std::cerr << "[WARNING]: Uniform " << name << " doesn't exist!" << std::endl;
-        return -1;
+    if (!anyOccluders) {
+        return;
     }
-    uniforms[name] = uni;
-    return uni;
-}
+    occlusion.buildPyramid();
+
+    // Rasterizing goes into one buffer, but the tests only read it.
+    double start = glfwGetTime();
+    hidden.assign(candidates.size(), 0);
+    forEach(candidates.size(), 256, [this](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            uint32_t index = candidates[i];
+            hidden[i] = !(objects.flags[index] & OBJECT_OCCLUDER) && occlusion.test(worldBounds(index));
+        }
+    });
 
-void ShaderProgram::setUniform4f(const std::string &name, float f0, float f1, float f2, float f3) {
-    GLint loc = getUniformLoc(name);
-    if (loc != -1) {
-        glUniform4f(loc, f0, f1, f2, f3);
+    size_t kept = 0;
+    for (size_t i = 0; i < candidates.size(); i++) {
+        occlusion.stats.tested += !(objects.flags[candidates[i]] & OBJECT_OCCLUDER);
+        if (!hidden[i]) {
+            candidates[kept++] = candidates[i];
+        }
     }
+
+    unsigned occluded = unsigned(candidates.size() - kept);
+    occlusion.stats.occluded += occluded;
+    occlusion.stats.testMs += (glfwGetTime() - start) * 1000.0;
+    candidates.resize(kept);
+    frameCull.occluded += occluded;
+    frameCull.culled += occluded;
+    frameCull.ms += occlusion.stats.rasterMs + occlusion.stats.testMs;
 }
 
-void ShaderProgram::setUniform1i(const std::string &name, int v) {
-    GLint loc = getUniformLoc(name);
-    if (loc != -1) {
-        glUniform1i(loc, v);
+void Renderer::uploadCamera() {
+    if (!uniformBuffers) {
+        return;
     }
+
+    CameraBlock block = {view, proj, proj * view};
+    GLintptr offset = cameraStream.write(&block, sizeof(CameraBlock));
+    glState.bindBuffer(GL_UNIFORM_BUFFER, cameraStream.id); // glBindBufferRange binds it here too
+    glBindBufferRange(GL_UNIFORM_BUFFER, CAMERA_BLOCK_BINDING, cameraStream.id, offset, sizeof(CameraBlock));
 }
 
-void ShaderProgram::setUniformMat4f(const std::string &name, glm::mat4 &mat4, GLboolean transpose) {
-    GLint loc = getUniformLoc(name);
-    if (loc != -1) {
-        glUniformMatrix4fv(loc, 1, transpose, &mat4[0][0]);
-    }
+void Renderer::drawQueue() {
+    int width, height;
+    glfwGetFramebufferSize(window, &width, &height);
+    streamer.update(objects, queue, view, proj, height);
+
+    uploadCamera();
+    meshes.update();
+    queue.jobs = parallel ? &jobs : nullptr;
+    queue.flush(objects, proj * view);
+
+    cullStats = frameCull;
+    frameCull = {};
+    lodStats = frameLod;
+    frameLod = {};
+    lodPrepared = false;
+    jobs.collectStats();
 }
 
-VertexArray::VertexArray() : id(0) {
-    glGenVertexArrays(1, &id);
-    glBindVertexArray(id);
+void RenderQueue::init(unsigned threads) {
+    packets.resize(std::max(1u, threads));
+    packetRuns.resize(packets.size());
+
+    instancing = GLEW_ARB_instanced_arrays;
+    if (!instancing) {
+        std::cerr << "[WARNING]: ARB_instanced_arrays not supported! Falling back to one draw call per object."
+                  << std::endl;
+        return;
+    }
+
+    // Room for 1024 instances per frame to begin with. It grows if needed.
+    instanceStream.init(GL_ARRAY_BUFFER, 1024 * (sizeof(glm::mat4) + sizeof(float)));
+
+    // baseInstance is what points each sub-draw at its transforms.
+    multiDrawSupported = GLEW_ARB_multi_draw_indirect && GLEW_ARB_base_instance;
+    multiDraw = multiDrawSupported;
+    if (multiDrawSupported) {
+        indirectStream.init(GL_DRAW_INDIRECT_BUFFER, 256 * sizeof(DrawIndirectCommand));
+    } else {
+        std::cerr << "[WARNING]: ARB_multi_draw_indirect not supported! Falling back to one draw call per model."
+                  << std::endl;
+    }
 }
 
-void VertexArray::bind() const {
-    glBindVertexArray(id);
+/*
+ * Key layout (most significant first): shader (12 bits), texture (12 bits), VAO (8 bits), IBO (8 bits),
+ * model (8 bits), depth (16 bits). Everything above KEY_STATE_SHIFT is GL state. Models in a MeshPool and levels of
+ * detail share their VAO and IBO, so the model field (a hash of firstIndex) keeps each model's commands together
+ * within the state, which is what lets them go out as one instanced draw, or one sub-draw with multi-draw.
+ * Bigger GL names wrap around and hashes collide, so equal keys only group commands together; flush() still
+ * compares the actual shader, texture, buffers and models before drawing them as one batch.
+ */
+uint64_t RenderQueue::makeKey(const ShaderProgram *shader, const Texture *texture, const Model *model, float depth) {
+    uint32_t depthBits = 0;
+    if (depth > 0) {
+        // Positive IEEE floats sort the same way as their bit patterns.
+        std::memcpy(&depthBits, &depth, sizeof(depthBits));
+        depthBits >>= 15u; // Drop the sign bit (always 0) and the lowest mantissa bits.
+    }
+    uint32_t modelBits = (model->firstIndex * 2654435761u) >> 24u; // Spreads out nearby offsets
+
+    return (uint64_t(shader->id & 0xFFFu) << 52u) |
+           (uint64_t(texture->id & 0xFFFu) << 40u) |
+           (uint64_t(model->vao->id & 0xFFu) << 32u) |
+           (uint64_t(model->ibo->id & 0xFFu) << 24u) |
+           (uint64_t(modelBits & 0xFFu) << 16u) |
+           uint64_t(depthBits & 0xFFFFu);
 }
 
-void VertexArray::unbind() const {
-    glBindVertexArray(0);
+void RenderQueue::submit(const GameObjectRegistry &objects, uint32_t index, const Model *model, float depth) {
+    record(0, {makeKey(objects.shaders[index], objects.textures[index], model, depth), index, model},
+           reserveOrders(1));
 }
 
-void VBLayout::addAttribute(GLint count, GLenum type, GLboolean normalized) {
-    attribs.push_back({count, type, normalized, stride});
-    stride += SIZES[type] * count;
+uint64_t RenderQueue::reserveOrders(uint64_t count) {
+    uint64_t first = nextOrder;
+    nextOrder += count;
+    return first;
 }
 
-void VertexBuffer::setLayout(VBLayout layout, VertexArray vertArr) {
-    vertArr.bind();
+void RenderQueue::record(unsigned thread, const DrawCommand &command, uint64_t order) {
+    std::vector<DrawCommand> &packet = packets[thread];
+    std::vector<PacketRun> &runs = packetRuns[thread];
 
-    for (int i = 0; i < layout.attribs.size(); i++) {
-        VBAttribute attrib = layout.attribs.at(i);
-        glEnableVertexAttribArray(i);
-        glVertexAttribPointer(i, attrib.count, attrib.type, attrib.normalized, layout.stride,
-                              (const void *) attrib.pointer);
+    // Consecutive orders can't have anything from another thread in between, so they share a run.
+    if (runs.empty() || (order != runs.back().lastOrder && order != runs.back().lastOrder + 1)) {
+        runs.push_back({order, order, packet.size(), packet.size(), thread});
     }
+    packet.push_back(command);
+    runs.back().lastOrder = order;
+    runs.back().end = packet.size();
 }
 
-void ShaderProgram::destroy() {
-    glDeleteProgram(id);
+void RenderQueue::forEach(size_t count, size_t grain, const std::function<void(size_t, size_t)> &body) {
+    if (jobs) {
+        jobs->parallelFor(count, grain, body);
+    } else if (count > 0) {
+        body(0, count);
+    }
 }
 
-void VertexBuffer::destroy() {
-    glDeleteBuffers(1, &id);
-}
+/*
+ * Runs go in by order, whichever thread recorded them. Orders of different runs never overlap, so sorting by the
+ * first one is enough.
+ */
+void RenderQueue::merge() {
+    mergeRuns.clear();
+    for (const std::vector<PacketRun> &runs : packetRuns) {
+        mergeRuns.insert(mergeRuns.end(), runs.begin(), runs.end());
+    }
+    std::sort(mergeRuns.begin(), mergeRuns.end(),
+              [](const PacketRun &a, const PacketRun &b) { return a.firstOrder < b.firstOrder; });
+
+    size_t total = commands.size();
+    std::vector<size_t> offsets;
+    for (const PacketRun &run : mergeRuns) {
+        offsets.push_back(total);
+        total += run.end - run.begin;
+    }
 
-void IndexBuffer::destroy() {
-    glDeleteBuffers(1, &id);
+    commands.resize(total);
+    recordThreads = 0;
+    forEach(mergeRuns.size(), 16, [this, &offsets](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            const PacketRun &run = mergeRuns[i];
+            const std::vector<DrawCommand> &packet = packets[run.thread];
+            std::copy(packet.begin() + run.begin, packet.begin() + run.end, commands.begin() + offsets[i]);
+        }
+    });
+    for (size_t thread = 0; thread < packets.size(); thread++) {
+        recordThreads += !packets[thread].empty();
+        packets[thread].clear(); // Keeps its capacity, so recording doesn't allocate once it's warmed up
+        packetRuns[thread].clear();
+    }
+    nextOrder = 0;
 }
 
-void VertexArray::destroy() {
-    glDeleteVertexArrays(1, &id);
+/*
+ * LSD radix sort on the 64 bit keys, a byte per pass. The commands are split into one range per thread; every pass
+ * histograms the ranges in parallel, turns the histograms into an output offset per range and digit, then scatters
+ * the ranges in parallel. That's stable, so the result is the same as sorting on one thread. Bytes that are the
+ * same in every key (only one shader, nothing far away...) are skipped.
+ */
+void RenderQueue::sort() {
+    const size_t minRange = 4096; // Below that, the jobs cost more than they save
+
+    size_t count = commands.size();
+    size_t threads = jobs ? jobs->threadCount() : 1;
+    size_t rangeSize = std::max(minRange, (count + threads - 1) / threads);
+    size_t ranges = (count + rangeSize - 1) / rangeSize;
+    histograms.resize(ranges);
+    keyBits.assign(ranges, 0);
+    sortScratch.resize(count);
+
+    auto eachRange = [&](const std::function<void(size_t, size_t, size_t)> &body) {
+        forEach(ranges, 1, [&](size_t first, size_t last) {
+            for (size_t range = first; range < last; range++) {
+                body(range, range * rangeSize, std::min(count, (range + 1) * rangeSize));
+            }
+        });
+    };
+
+    uint64_t firstKey = commands[0].key;
+    eachRange([&](size_t range, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            keyBits[range] |= commands[i].key ^ firstKey;
+        }
+    });
+    uint64_t differs = 0;
+    for (uint64_t bits : keyBits) {
+        differs |= bits;
+    }
+
+    DrawCommand *src = commands.data();
+    DrawCommand *dst = sortScratch.data();
+    for (unsigned shift = 0; shift < 64; shift += 8) {
+        if (((differs >> shift) & 0xFFu) == 0) {
+            continue;
+        }
+
+        eachRange([&](size_t range, size_t begin, size_t end) {
+            std::array<uint32_t, 256> &histogram = histograms[range];
+            histogram.fill(0);
+            for (size_t i = begin; i < end; i++) {
+                histogram[(src[i].key >> shift) & 0xFFu]++;
+            }
+        });
+
+        uint32_t offset = 0;
+        for (unsigned digit = 0; digit < 256; digit++) {
+            for (size_t range = 0; range < ranges; range++) {
+                uint32_t n = histograms[range][digit];
+                histograms[range][digit] = offset;
+                offset += n;
+            }
+        }
+
+        eachRange([&](size_t range, size_t begin, size_t end) {
+            std::array<uint32_t, 256> &offsets = histograms[range];
+            for (size_t i = begin; i < end; i++) {
+                dst[offsets[(src[i].key >> shift) & 0xFFu]++] = src[i];
+            }
+        });
+        std::swap(src, dst);
+    }
+
+    if (src != commands.data()) {
+        commands.swap(sortScratch);
+    }
 }
 
-Texture::Texture(const std::string &path, GLenum type, GLint lod, GLint border) : localBuf(nullptr), width(0),
-                                                                                  height(0), bits(0), id(0) {
-    this->fp = path;
-    this->textureType = type;
+void RenderQueue::flush(const GameObjectRegistry &objects, const glm::mat4 &viewProj) {
+    drawCalls = 0;
 
-    localBuf = stbi_load(path.c_str(), &width, &height, &bits, 4); // 4 channels for RGBA
+    auto sortStart = std::chrono::steady_clock::now();
+    merge();
+    instances = commands.size();
+    if (commands.empty()) {
+        sortMs = 0;
+        return;
+    }
+    sort();
+    sortMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - sortStart).count();
+
+    // Upload every transform for this frame at once. Batches then just point into the buffer at an offset.
+    GLintptr transformOffset = 0;
+    GLintptr layerOffset = 0;
+    if (instancing) {
+        instanceTransforms.resize(commands.size());
+        instanceLayers.resize(commands.size());
+        forEach(commands.size(), 4096, [this, &objects](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                instanceTransforms[i] = objects.transforms[commands[i].index];
+                instanceLayers[i] = objects.layers[commands[i].index];
+            }
+        });
+
+        GLsizeiptr transformBytes = instanceTransforms.size() * sizeof(glm::mat4);
+        GLsizeiptr layerBytes = instanceLayers.size() * sizeof(float);
+        instanceStream.reserve(transformBytes + layerBytes + instanceStream.alignment);
+        transformOffset = instanceStream.write(instanceTransforms.data(), transformBytes);
+        layerOffset = instanceStream.write(instanceLayers.data(), layerBytes);
+    }
 
-    glGenTextures(1, &id);
-    bind();
+    // The attribute pointers are VAO state, so they're re-specified for every VAO that's drawn with.
+    auto setInstancePointers = [&](size_t first) {
+        glState.bindBuffer(GL_ARRAY_BUFFER, instanceStream.id);
+        for (GLuint col = 0; col < 4; col++) {
+            GLuint loc = INSTANCE_ATTRIB + col;
+            glEnableVertexAttribArray(loc);
+            glVertexAttribPointer(loc, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4),
+                                  (const void *) (transformOffset + first * sizeof(glm::mat4) +
+                                                  col * sizeof(glm::vec4)));
+            glVertexAttribDivisorARB(loc, 1);
+        }
+        glEnableVertexAttribArray(LAYER_ATTRIB);
+        glVertexAttribPointer(LAYER_ATTRIB, 1, GL_FLOAT, GL_FALSE, sizeof(float),
+                              (const void *) (layerOffset + first * sizeof(float)));
+        glVertexAttribDivisorARB(LAYER_ATTRIB, 1);
+    };
+
+    if (multiDraw) {
+        indirectStream.reserve(commands.size() * sizeof(DrawIndirectCommand) + indirectStream.alignment);
+    }
 
-    setRenderHints({{GL_TEXTURE_MIN_FILTER, GL_LINEAR},
-                    {GL_TEXTURE_MAG_FILTER, GL_LINEAR}}); // DEFAULT VALUES
-    // {GL_TEXTURE_WARP_S, GL_CLAMP}, {GL_TEXTURE_WARP_T, GL_CLAMP}}); // These for some reason don't work :(
+    ShaderProgram *lastShader = nullptr;
+    plainDrawCalls = 0;
+
+    size_t i = 0;
+    while (i < commands.size()) {
+        uint32_t first = commands[i].index;
+        uint64_t state = commands[i].key >> KEY_STATE_SHIFT;
+        ShaderProgram *shader = objects.shaders[first];
+        Texture *texture = objects.textures[first];
+        const Model *model = commands[i].model;
+
+        // The bucket is every following command with the same state. Without multi-draw, it also has to be
+        // the same model.
+        size_t end = i + 1;
+        while (end < commands.size() && (commands[end].key >> KEY_STATE_SHIFT) == state) {
+            // The key only keeps the low bits of each GL name, so two different states can share one.
+            uint32_t index = commands[end].index;
+            if (objects.shaders[index] != shader || objects.textures[index] != texture) {
+                break;
+            }
+
+            const Model *next = commands[end].model;
+            if (next != model && (!multiDraw || next->vao != model->vao || next->ibo != model->ibo ||
+                                  next->drawMode != model->drawMode)) {
+                break;
+            }
+            end++;
+        }
 
-    glTexImage2D(type, lod, GL_RGBA8, width, height, border, GL_RGBA, GL_UNSIGNED_BYTE, localBuf);
+        // Redundant binds between batches are filtered out by glState.
+        shader->bind();
+        if (shader != lastShader && shader->cameraBlock == GL_INVALID_INDEX) {
+            shader->setUniformMat4f(U_VIEW_PROJ, viewProj); // Program doesn't use the shared Camera block
+        }
+        lastShader = shader;
+        texture->bind(0);
+        model->vao->bind();
+        model->ibo->bind();
+
+        if (multiDraw) {
+            // One sub-draw per run of the same model. baseInstance points it at the run's transforms.
+            indirectCommands.clear();
+            for (size_t run = i; run < end;) {
+                const Model *runModel = commands[run].model;
+                size_t runEnd = run + 1;
+                while (runEnd < end && commands[runEnd].model == runModel) {
+                    runEnd++;
+                }
+
+                indirectCommands.push_back({GLuint(runModel->count()), GLuint(runEnd - run), runModel->firstIndex,
+                                            0, GLuint(run)});
+                run = runEnd;
+            }
+
+            setInstancePointers(0);
+            GLintptr offset = indirectStream.write(indirectCommands.data(),
+                                                   indirectCommands.size() * sizeof(DrawIndirectCommand));
+            glState.bindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectStream.id);
+            glMultiDrawElementsIndirect(model->drawMode, model->ibo->type, (const void *) offset,
+                                        GLsizei(indirectCommands.size()), 0);
+            drawCalls++;
+            plainDrawCalls += indirectCommands.size();
+        } else if (instancing) {
+            setInstancePointers(i);
+            glDrawElementsInstancedARB(model->drawMode, model->count(), model->ibo->type, model->indexOffset(),
+                                       GLsizei(end - i));
+            drawCalls++;
+            plainDrawCalls++;
+        } else {
+            // Without instanced arrays, the transform is passed as a constant vertex attribute instead.
+            for (GLuint col = 0; col < 4; col++) {
+                glDisableVertexAttribArray(INSTANCE_ATTRIB + col);
+            }
+            glDisableVertexAttribArray(LAYER_ATTRIB);
+
+            for (size_t j = i; j < end; j++) {
+                const glm::mat4 &transform = objects.transforms[commands[j].index];
+                for (GLuint col = 0; col < 4; col++) {
+                    glVertexAttrib4fv(INSTANCE_ATTRIB + col, &transform[col][0]);
+                }
+                glVertexAttrib1f(LAYER_ATTRIB, objects.layers[commands[j].index]);
+
+                glDrawElements(model->drawMode, model->count(), model->ibo->type, model->indexOffset());
+                drawCalls++;
+                plainDrawCalls++;
+            }
+        }
 
-    if (localBuf) {
-        stbi_image_free(localBuf);
+        i = end;
     }
-}
 
-void Texture::bind(GLuint texSlot) {
-    this->slot = texSlot;
-    glActiveTexture(GL_TEXTURE0 + texSlot);
-    glBindTexture(textureType, id);
+    commands.clear();
 }
 
-void Texture::unbind() const {
-    glActiveTexture(GL_TEXTURE0 + slot);
-    glBindTexture(textureType, id);
+unsigned RenderQueue::countBatches(const GameObjectRegistry &objects) const {
+    unsigned visible = 0;
+    // The actual objects rather than the sort key, which can alias once GL names get big.
+    std::set<std::tuple<const ShaderProgram *, const Texture *, const VertexArray *, const IndexBuffer *,
+                        const Model *>> batches;
+    for (size_t i = 0; i < objects.size(); i++) {
+        if (objects.flags[i] & OBJECT_VISIBLE) {
+            visible++;
+            // Models that share buffers only share a draw call with multi-draw.
+            const Model *model = objects.models[i];
+            batches.insert({objects.shaders[i], objects.textures[i], model->vao, model->ibo,
+                            multiDraw ? nullptr : model});
+        }
+    }
+    return instancing ? batches.size() : visible;
 }
 
-void Texture::destroy() {
-    glDeleteTextures(1, &id);
+void RenderQueue::destroy() {
+    instanceStream.destroy();
+    indirectStream.destroy();
 }
 
-void Texture::genMipmaps() {
-    bind();
-    glGenerateMipmap(textureType);
+void StreamBuffer::init(GLenum bufferTarget, GLsizeiptr size, GLsizeiptr writeAlignment) {
+    target = bufferTarget;
+    alignment = writeAlignment;
+    regionSize = (size + alignment - 1) / alignment * alignment;
+
+    // Growing mid-frame copies the frame's data over on the GPU, see reserve().
+    if (GLEW_ARB_buffer_storage && GLEW_ARB_sync && GLEW_ARB_copy_buffer) {
+        mode = STREAM_PERSISTENT;
+    } else if (GLEW_ARB_map_buffer_range && GLEW_ARB_sync && GLEW_ARB_copy_buffer) {
+        mode = STREAM_MAPPED;
+    } else {
+        mode = STREAM_ORPHANED;
+        std::cerr << "[WARNING]: ARB_map_buffer_range, ARB_sync or ARB_copy_buffer not supported! Streamed buffers "
+                     "will be orphaned every frame instead." << std::endl;
+    }
+
+    allocate();
+    frame = 0;
+    base = 0;
+    head = 0;
+    waited = true; // Nothing can be using a new buffer
 }
 
-void Texture::setRenderHints(std::unordered_map<GLenum, GLint> hints) {
-    bind();
+void StreamBuffer::allocate() {
+    glGenBuffers(1, &id);
+    glState.bindBuffer(target, id);
+
+    // Orphaning doesn't need regions of its own, the driver hands out fresh memory every frame anyway.
+    GLsizeiptr total = mode == STREAM_ORPHANED ? regionSize : regionSize * STREAM_BUFFER_FRAMES;
+    if (mode == STREAM_PERSISTENT) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(target, total, nullptr, flags);
+        mapped = (unsigned char *) glMapBufferRange(target, 0, total, flags);
+        if (!mapped) {
+            std::cerr << "[WARNING]: Failed to persistently map a stream buffer! Mapping per write instead."
+                      << std::endl;
+            // Immutable storage without GL_DYNAMIC_STORAGE_BIT would rule out the glBufferSubData fallback in
+            // write(), so start over with a mutable buffer.
+            mode = STREAM_MAPPED;
+            glState.deleteBuffer(id);
+            glGenBuffers(1, &id);
+            glState.bindBuffer(target, id);
+            glBufferData(target, total, nullptr, GL_STREAM_DRAW);
+        }
+    } else {
+        glBufferData(target, total, nullptr, GL_STREAM_DRAW);
+    }
 
-    for (std::pair<GLenum, GLint> hint : hints) {
-        glTexParameteri(textureType, hint.first, hint.second);
+    if (mode == STREAM_ORPHANED) {
+        shadow.resize(regionSize);
     }
 }
 
-Camera::Camera(glm::vec3 pos, glm::vec2 look, GLFWwindow *window) {
-    win = window;
-    lookAngle = look;
-    position = pos;
+void StreamBuffer::reserve(GLsizeiptr size) {
+    if (head + size <= regionSize) {
+        return;
+    }
 
-    lookDirection = glm::vec3(cos(lookAngle.y) * sin(lookAngle.x), sin(lookAngle.y),
-                              cos(lookAngle.y) * cos(lookAngle.x));
+    GLsizeiptr grown = std::max(regionSize * 2, (head + size + alignment - 1) / alignment * alignment);
+    stats.grows++;
+
+    if (head == 0) {
+        // Nothing was handed out this frame yet, so the buffer can simply be replaced. Deleting it is fine even
+        // if the GPU still uses it, GL keeps it alive until it's done.
+        destroy();
+        regionSize = grown;
+        allocate();
+        frame = 0;
+        base = 0;
+        waited = true;
+        return;
+    }
 
-    right = glm::vec3(sin(lookAngle.x - pi / 2.0f), 0, cos(lookAngle.x - pi / 2.0f));
-    forward = glm::vec3(sin(lookAngle.x), 0, cos(lookAngle.x));
-    up = glm::cross(right, lookDirection);
-}
+    // Offsets into this frame's region were already handed out and may not have been drawn with yet. The new
+    // buffer gets the frame's data at the same offsets and the frame carries on from there, so they stay valid
+    // (as long as `id` is bound after writing, like with any write). base + grown still fits into the new buffer.
+    if (mode == STREAM_ORPHANED) {
+        regionSize = grown;
+        shadow.resize(regionSize);
+        glState.bindBuffer(target, id);
+        glBufferData(target, regionSize, nullptr, GL_STREAM_DRAW);
+        glBufferSubData(target, 0, head, shadow.data());
+        return;
+    }
 
-void Camera::move(float forwardAmount, float rightAmount, float deltaTime) {
-    position += forward * forwardAmount * deltaTime;
-    position += right * rightAmount * deltaTime;
+    GLuint previous = id;
+    if (mapped) {
+        glState.bindBuffer(target, previous);
+        glUnmapBuffer(target);
+        mapped = nullptr;
+    }
+    for (GLsync &fence : fences) { // Only the old buffer is in use
+        if (fence) {
+            glDeleteSync(fence);
+            fence = nullptr;
+        }
+    }
+
+    regionSize = grown;
+    allocate();
+    glState.bindBuffer(GL_COPY_READ_BUFFER, previous);
+    glState.bindBuffer(GL_COPY_WRITE_BUFFER, id);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, base, base, head);
+    glState.deleteBuffer(previous);
+    waited = true;
 }
 
-void Camera::look(glm::vec2 amount, float deltaTime) {
-    lookAngle += amount * deltaTime;
+void StreamBuffer::waitForRegion() {
+    if (waited) {
+        return;
+    }
+    waited = true;
 
-    if (lookAngle.y > pi / 2) {
+    GLsync &fence = fences[frame];
+    if (!fence) {
+        return;
+    }
+
+    if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+        double start = glfwGetTime();
+        GLenum result;
+        do {
+            result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000); // 1ms
+        } while (result == GL_TIMEOUT_EXPIRED);
+
+        stats.stalls++;
+        stats.stallMs += (glfwGetTime() - start) * 1000.0;
+    }
+
+    glDeleteSync(fence);
+    fence = nullptr;
+}
+
+GLintptr StreamBuffer::write(const GLvoid *data, GLsizeiptr size) {
+    head = (head + alignment - 1) / alignment * alignment;
+    reserve(size);
+    waitForRegion();
+
+    GLintptr offset = base + head;
+    head += size;
+    written += size;
+
+    if (mode == STREAM_PERSISTENT) {
+        std::memcpy(mapped + offset, data, size);
+        return offset;
+    }
+
+    glState.bindBuffer(target, id);
+    if (mode == STREAM_MAPPED) {
+        // Unsynchronized since the fence already guarantees the GPU is done with this region.
+        void *dst = glMapBufferRange(target, offset, size,
+                                     GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+        if (dst) {
+            std::memcpy(dst, data, size);
+            glUnmapBuffer(target);
+            return offset;
+        }
+    } else {
+        if (offset == 0) {
+            glBufferData(target, regionSize, nullptr, GL_STREAM_DRAW); // Orphan last frame's data
+        }
+        std::memcpy(shadow.data() + offset, data, size);
+    }
+
+    glBufferSubData(target, offset, size, data);
+    return offset;
+}
+
+void StreamBuffer::endFrame() {
+    if (id == 0) {
+        return;
+    }
+
+    if (mode != STREAM_ORPHANED) {
+        // Normally just this frame's region, but after growing mid-frame the data can straddle two.
+        for (unsigned region = 0; region < STREAM_BUFFER_FRAMES && head > 0; region++) {
+            GLintptr start = GLintptr(region) * regionSize;
+            if (start < base + head && start + regionSize > base) {
+                if (fences[region]) {
+                    glDeleteSync(fences[region]);
+                }
+                fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            }
+        }
+        frame = (frame + 1) % STREAM_BUFFER_FRAMES;
+        base = GLintptr(frame) * regionSize;
+    }
+
+    head = 0;
+    waited = false;
+    stats.frameBytes = written;
+    written = 0;
+}
+
+const char *StreamBuffer::modeName() const {
+    switch (mode) {
+        case STREAM_PERSISTENT:
+            return "persistent";
+        case STREAM_MAPPED:
+            return "mapped";
+        default:
+            return "orphaned";
+    }
+}
+
+void StreamBuffer::destroy() {
+    for (GLsync &fence : fences) {
+        if (fence) {
+            glDeleteSync(fence);
+            fence = nullptr;
+        }
+    }
+
+    if (id != 0) {
+        if (mapped) {
+            glState.bindBuffer(target, id);
+            glUnmapBuffer(target);
+            mapped = nullptr;
+        }
+        glState.deleteBuffer(id);
+        id = 0;
+    }
+}
+
+ObjectHandle GameObjectRegistry::add(const GameObject &obj, uint32_t objFlags, const std::string &name) {
+    uint32_t slot;
+    if (!freeSlots.empty()) {
+        slot = freeSlots.back();
+        freeSlots.pop_back();
+    } else {
+        slot = slotToDense.size();
+        slotToDense.push_back(0);
+        generations.push_back(1);
+        slotNames.emplace_back();
+    }
+
+    ShaderProgram *shader = obj.shader;
+    if (shader->permutations && shader->featureMask != obj.features) {
+        shader = shader->permutations->get(obj.features);
+    }
+
+    slotToDense[slot] = transforms.size();
+    denseToSlot.push_back(slot);
+    transforms.push_back(obj.transforms);
+    models.push_back(obj.model);
+    shaders.push_back(shader);
+    textures.push_back(obj.texture);
+    layers.push_back(obj.layer);
+    flags.push_back(objFlags);
+
+    ObjectHandle handle = {slot, generations[slot]};
+    if (!name.empty()) {
+        names[name] = handle;
+        slotNames[slot] = name;
+    }
+    return handle;
+}
+
+bool GameObjectRegistry::remove(ObjectHandle handle) {
+    if (!valid(handle)) {
+        return false;
+    }
+
+    // Move the last object into the hole so the dense arrays stay packed.
+    uint32_t index = slotToDense[handle.index];
+    uint32_t last = transforms.size() - 1;
+    if (index != last) {
+        transforms[index] = transforms[last];
+        models[index] = models[last];
+        shaders[index] = shaders[last];
+        textures[index] = textures[last];
+        layers[index] = layers[last];
+        flags[index] = flags[last];
+        denseToSlot[index] = denseToSlot[last];
+        slotToDense[denseToSlot[index]] = index;
+    }
+
+    transforms.pop_back();
+    models.pop_back();
+    shaders.pop_back();
+    textures.pop_back();
+    layers.pop_back();
+    flags.pop_back();
+    denseToSlot.pop_back();
+
+    // Unless the name has been given to another object since
+    std::string &name = slotNames[handle.index];
+    auto named = names.find(name);
+    if (!name.empty() && named != names.end() && named->second.index == handle.index &&
+        named->second.generation == handle.generation) {
+        names.erase(named);
+    }
+    name.clear();
+
+    generations[handle.index]++;
+    freeSlots.push_back(handle.index);
+    return true;
+}
+
+bool GameObjectRegistry::valid(ObjectHandle handle) const {
+    return handle.index < generations.size() && generations[handle.index] == handle.generation;
+}
+
+uint32_t GameObjectRegistry::indexOf(ObjectHandle handle) const {
+    assert(valid(handle) && "stale or invalid ObjectHandle");
+    return slotToDense[handle.index];
+}
+
+glm::mat4 &GameObjectRegistry::transform(ObjectHandle handle) {
+    assert(valid(handle) && "stale or invalid ObjectHandle");
+    return transforms[slotToDense[handle.index]];
+}
+
+ObjectHandle GameObjectRegistry::find(const std::string &name) const {
+    auto it = names.find(name);
+    if (it != names.end()) {
+        return it->second;
+    }
+    return {};
+}
+
+size_t GameObjectRegistry::size() const {
+    return transforms.size();
+}
+
+void Renderer::clear(GLclampf r, GLclampf g, GLclampf b, GLclampf a) {
+    flushGLErrors();
+
+    glClearColor(r, g, b, a);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    textures.update();
+
+    ImGui_ImplOpenGL2_NewFrame();
+    ImGui_ImplGlfw_NewFrame();
+    ImGui::NewFrame();
+}
+
+VertexBuffer::VertexBuffer(GLsizeiptr size, const GLvoid *data, GLenum usage) : id(0) {
+    glGenBuffers(1, &id);
+    glState.bindBuffer(GL_ARRAY_BUFFER, id);
+    glBufferData(GL_ARRAY_BUFFER, size, data, usage);
+}
+
+void VertexBuffer::bind() const {
+    glState.bindBuffer(GL_ARRAY_BUFFER, id);
+}
+
+void VertexBuffer::unbind() const {
+    glState.bindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+/*
+ * Indices are always passed in as GLuint, but are stored as GLushort if every index fits, which halves the
+ * index bandwidth. 0xFFFF is left out since it's the usual primitive restart index.
+ */
+IndexBuffer::IndexBuffer(GLsizei count, const GLuint *data, GLenum usage) : id(0) {
+    GLuint maxIndex = 0;
+    for (GLsizei i = 0; i < count; i++) {
+        maxIndex = std::max(maxIndex, data[i]);
+    }
+
+    glGenBuffers(1, &id);
+    glState.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, id);
+    if (maxIndex < 0xFFFFu) {
+        std::vector<GLushort> shorts(data, data + count);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, count * sizeof(GLushort), shorts.data(), usage);
+        type = GL_UNSIGNED_SHORT;
+    } else {
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, count * sizeof(GLuint), data, usage);
+        type = GL_UNSIGNED_INT;
+    }
+
+    this->count = count;
+}
+
+IndexBuffer::IndexBuffer(GLsizei count, GLenum type, const GLvoid *data, GLenum usage) : id(0), count(count),
+                                                                                         type(type) {
+    glGenBuffers(1, &id);
+    glState.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, id);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, count * (type == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint)),
+                 data, usage);
+}
+
+void IndexBuffer::bind() const {
+    glState.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, id);
+}
+
+void IndexBuffer::unbind() const {
+    glState.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+uint64_t hashBytes(const void *data, size_t len, uint64_t hash) {
+    const auto *bytes = (const unsigned char *) data;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+bool readFile(const std::string &path, std::string &out) {
+    std::ifstream stream(path, std::ios::binary);
+    if (!stream.is_open()) {
+        return false;
+    }
+
+    std::stringstream buf;
+    buf << stream.rdbuf();
+    out = buf.str();
+    return true;
+}
+
+std::vector<std::pair<std::string, std::string>> parseShaderMeta(const std::string &meta) {
+    std::vector<std::pair<std::string, std::string>> entries;
+
+    std::istringstream metadat(meta);
+    std::string line;
+    while (getline(metadat, line)) {
+        size_t indx = line.find(": ");
+        if (line[0] == '#' ||
+            indx == std::string::npos) { // comments. Skip lines that don't have colons or contain the # character.
+            continue;
+        }
+        entries.emplace_back(line.substr(0, indx), line.substr(indx + 2));
+    }
+
+    return entries;
+}
+
+std::string injectDefines(const std::string &src, const std::vector<std::string> &defines) {
+    if (defines.empty()) {
+        return src;
+    }
+
+    std::string block;
+    for (const std::string &define : defines) {
+        block += "#define " + define + " 1\n";
+    }
+
+    size_t insertAt = 0;
+    if (src.compare(0, 8, "#version") == 0) {
+        size_t eol = src.find('\n');
+        insertAt = eol == std::string::npos ? src.size() : eol + 1;
+    }
+
+    std::string out = src;
+    out.insert(insertAt, block);
+    return out;
+}
+
+ShaderProgram::ShaderProgram(const std::string &path) {
+    begin(path);
+    finish();
+}
+
+/*
+ * Loads the program from the binary cache if possible. Otherwise starts compiling every stage, without waiting
+ * for the results. Call poll() until it returns true, or finish() to block.
+ */
+void ShaderProgram::begin(const std::string &path, uint32_t mask) {
+    profilePath = path + "/shaders.meta";
+    startTime = glfwGetTime();
+
+    if (!loadSources(path, mask)) {
+        std::cerr << "Failed to load shaders: cannot read " << profilePath << std::endl;
+        state = SHADER_FAILED;
+        return;
+    }
+
+    std::stringstream cachePath;
+    cachePath << SHADER_CACHE_DIR << "/" << std::hex << std::setw(16) << std::setfill('0') << sourceHash << ".bin";
+    cacheFile = cachePath.str();
+
+    id = glCreateProgram();
+    fromCache = loadBinary(cacheFile);
+    if (fromCache) {
+        shaderCacheStats.hits++;
+        done(true);
+        return;
+    }
+
+    shaderCacheStats.misses++;
+    pendingShaders.clear();
+    for (const ShaderStage &stage : stages) {
+        pendingShaders.push_back(startShader(stage));
+    }
+    state = SHADER_COMPILING;
+}
+
+/*
+ * Returns true once the program is either READY or FAILED.
+ */
+bool ShaderProgram::poll() {
+    if (state == SHADER_COMPILING) {
+        for (GLuint shader : pendingShaders) {
+            if (shader != 0 && !isComplete(shader, false)) {
+                return false;
+            }
+        }
+        link();
+    }
+
+    if (state == SHADER_LINKING) {
+        if (!isComplete(id, true)) {
+            return false;
+        }
+
+        GLint result;
+        glGetProgramiv(id, GL_LINK_STATUS, &result);
+        if (result == GL_FALSE) {
+            GLint len;
+            glGetProgramiv(id, GL_INFO_LOG_LENGTH, &len);
+            std::vector<char> msg(len + 1);
+            glGetProgramInfoLog(id, len, &len, msg.data());
+            std::cerr << "Error linking shader program from " << profilePath << std::endl << msg.data() << std::endl;
+        }
+        done(result != GL_FALSE);
+    }
+
+    return state == SHADER_READY || state == SHADER_FAILED;
+}
+
+void ShaderProgram::finish() {
+    // Without KHR_parallel_shader_compile the status queries just block, so this doesn't spin.
+    while (!poll()) {
+        std::this_thread::yield();
+    }
+}
+
+/*
+ * Without KHR_parallel_shader_compile there's no way to ask without blocking, so it always reports done
+ * (the following status query will wait for the driver instead).
+ */
+bool ShaderProgram::isComplete(GLuint object, bool program) const {
+    if (!GLEW_KHR_parallel_shader_compile) {
+        return true;
+    }
+
+    GLint complete = GL_TRUE;
+    if (program) {
+        glGetProgramiv(object, GL_COMPLETION_STATUS_KHR, &complete);
+    } else {
+        glGetShaderiv(object, GL_COMPLETION_STATUS_KHR, &complete);
+    }
+    return complete == GL_TRUE;
+}
+
+void ShaderProgram::link() {
+    for (size_t i = 0; i < stages.size(); i++) {
+        GLuint shader = pendingShaders[i];
+        if (shader == 0) {
+            continue;
+        }
+
+        if (checkShader(shader, stages[i])) {
+            glAttachShader(id, shader);
+            std::cout << "Successfully loaded " << stages[i].type << " from " << stages[i].path << std::endl;
+        } else {
+            glDeleteShader(shader);
+            pendingShaders[i] = 0;
+        }
+    }
+
+    for (std::pair<std::string, GLuint> attrib : ATTRIB_LOCATIONS) {
+        glBindAttribLocation(id, attrib.second, attrib.first.c_str());
+    }
+
+    if (GLEW_ARB_get_program_binary) {
+        glProgramParameteri(id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+
+    glLinkProgram(id);
+    state = SHADER_LINKING;
+}
+
+void ShaderProgram::done(bool success) {
+    for (GLuint shader : pendingShaders) {
+        if (shader != 0) {
+            glDetachShader(id, shader);
+            glDeleteShader(shader);
+        }
+    }
+    pendingShaders.clear();
+
+    loadTime = (glfwGetTime() - startTime) * 1000;
+    shaderCacheStats.loadTime += loadTime;
+
+    if (!success) {
+        state = SHADER_FAILED;
+        return;
+    }
+
+    glValidateProgram(id);
+    if (!fromCache) {
+        saveBinary(cacheFile);
+    }
+    enumerateUniforms();
+
+    state = SHADER_READY;
+    std::cout << "Successfully loaded shader program from " << profilePath << (fromCache ? " (cached)" : "")
+              << " in " << loadTime << "ms" << std::endl;
+}
+
+/*
+ * Reads shaders.meta and every stage it lists, and hashes everything that affects the linked program.
+ */
+bool ShaderProgram::loadSources(const std::string &path, uint32_t mask) {
+    std::string meta;
+    if (!readFile(path + "/shaders.meta", meta)) {
+        return false;
+    }
+
+    std::vector<std::pair<std::string, std::string>> entries = parseShaderMeta(meta);
+
+    features.clear();
+    for (std::pair<std::string, std::string> &entry : entries) {
+        if (entry.first == "feature" && features.size() < MAX_SHADER_FEATURES) {
+            features.push_back(entry.second);
+        }
+    }
+
+    featureMask = mask;
+    std::vector<std::string> defines;
+    for (uint32_t i = 0; i < features.size(); i++) {
+        if (mask & (1u << i)) {
+            defines.push_back(features[i]);
+        }
+    }
+    if (features.size() < MAX_SHADER_FEATURES && mask >> features.size() != 0) {
+        std::cerr << "[WARNING]: Feature mask 0x" << std::hex << mask << std::dec << " has bits that " << path
+                  << "/shaders.meta doesn't declare!" << std::endl;
+    }
+
+    stages.clear();
+    sourceHash = hashBytes(meta.data(), meta.size());
+
+    for (std::pair<std::string, std::string> &entry : entries) {
+        if (entry.first == "feature") {
+            continue;
+        }
+
+        ShaderStage stage = {entry.first, path + "/" + entry.second, ""};
+        if (!readFile(stage.path, stage.src)) {
+            std::cerr << "Failed to load " << stage.type << ": cannot read " << stage.path << " // Skipping.."
+                      << std::endl;
+            continue;
+        }
+
+        stage.src = injectDefines(stage.src, defines);
+        sourceHash = hashBytes(stage.src.data(), stage.src.size(), sourceHash);
+        stages.push_back(stage);
+    }
+
+    // Attribute locations are baked into the binary, and binaries are only valid for the driver that made them.
+    for (std::pair<std::string, GLuint> attrib : ATTRIB_LOCATIONS) {
+        sourceHash = hashBytes(attrib.first.data(), attrib.first.size(), sourceHash);
+        sourceHash = hashBytes(&attrib.second, sizeof(attrib.second), sourceHash);
+    }
+    for (GLenum name : {GL_VENDOR, GL_RENDERER, GL_VERSION}) {
+        const char *str = (const char *) glGetString(name);
+        if (str) {
+            sourceHash = hashBytes(str, std::strlen(str), sourceHash);
+        }
+    }
+
+    return true;
+}
+
+bool ShaderProgram::loadBinary(const std::string &cacheFile) {
+    std::string data;
+    if (!GLEW_ARB_get_program_binary || !readFile(cacheFile, data) || data.size() <= sizeof(GLenum)) {
+        return false;
+    }
+
+    // File layout: binary format (GLenum), followed by the blob from glGetProgramBinary.
+    GLenum format;
+    std::memcpy(&format, data.data(), sizeof(format));
+    glProgramBinary(id, format, data.data() + sizeof(format), GLsizei(data.size() - sizeof(format)));
+
+    GLint result;
+    glGetProgramiv(id, GL_LINK_STATUS, &result);
+    if (result == GL_FALSE) { // Driver update or similar. Start over with a fresh program.
+        std::cerr << "[WARNING]: Cached shader program " << cacheFile << " was rejected, rebuilding..." << std::endl;
+        shaderCacheStats.rejected++;
+        glState.deleteProgram(id);
+        id = glCreateProgram();
+        return false;
+    }
+
+    return true;
+}
+
+void ShaderProgram::saveBinary(const std::string &cacheFile) {
+    if (!GLEW_ARB_get_program_binary) {
+        return;
+    }
+
+    GLint len = 0;
+    glGetProgramiv(id, GL_PROGRAM_BINARY_LENGTH, &len);
+    if (len <= 0) {
+        return;
+    }
+
+    std::vector<char> data(sizeof(GLenum) + len);
+    GLenum format = 0;
+    glGetProgramBinary(id, len, &len, &format, data.data() + sizeof(GLenum));
+    std::memcpy(data.data(), &format, sizeof(format));
+
+    std::error_code err;
+    std::filesystem::create_directories(SHADER_CACHE_DIR, err);
+    std::ofstream out(cacheFile, std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "[WARNING]: Cannot write shader cache " << cacheFile << std::endl;
+        return;
+    }
+    out.write(data.data(), sizeof(GLenum) + len);
+}
+
+
+/*
+ * Only starts compiling. The result is checked by checkShader() once the driver is done with it.
+ */
+GLuint ShaderProgram::startShader(const ShaderStage &stage) {
+    auto type = SHADER_TYPES.find(stage.type);
+    if (type == SHADER_TYPES.end()) {
+        std::cerr << "Invalid shader type: " << stage.type << " // Skipping..." << std::endl;
+        return 0;
+    }
+
+    GLuint shader = glCreateShader(type->second);
+    const char *rsrc = stage.src.c_str();
+
+    glShaderSource(shader, 1, &rsrc, nullptr);
+    glCompileShader(shader);
+
+    return shader;
+}
+
+bool ShaderProgram::checkShader(GLuint shader, const ShaderStage &stage) {
+    GLint result;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &result);
+    if (result == GL_FALSE) {
+        std::cerr << "Error compiling " << stage.type << " from " << stage.path << std::endl;
+        GLint len;
+        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &len);
+        std::vector<char> msg(len + 1);
+        glGetShaderInfoLog(shader, len, &len, msg.data());
+        std::cerr << msg.data() << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+void ShaderBatch::add(ShaderProgram &program, const std::string &path, uint32_t featureMask) {
+    if (programs.empty()) {
+        startTime = glfwGetTime();
+    }
+
+    program.begin(path, featureMask);
+    programs.push_back(&program);
+}
+
+/*
+ * Returns true once every program in the batch is done. Never blocks with KHR_parallel_shader_compile.
+ */
+bool ShaderBatch::poll() {
+    ready = 0;
+    failed = 0;
+
+    for (ShaderProgram *program : programs) {
+        if (program->poll()) {
+            program->state == SHADER_READY ? ready++ : failed++;
+        }
+    }
+
+    if (ready + failed == programs.size()) {
+        time = (glfwGetTime() - startTime) * 1000;
+        return true;
+    }
+    return false;
+}
+
+void ShaderBatch::finish() {
+    while (!poll()) {
+        std::this_thread::yield();
+    }
+
+    std::cout << "Built " << ready << " shader programs (" << failed << " failed) in " << time << "ms" << std::endl;
+}
+
+ShaderPermutations::ShaderPermutations(const std::string &path) : path(path) {
+    std::string meta;
+    if (!readFile(path + "/shaders.meta", meta)) {
+        std::cerr << "Failed to load shader permutations: cannot read " << path << "/shaders.meta" << std::endl;
+        return;
+    }
+
+    for (std::pair<std::string, std::string> &entry : parseShaderMeta(meta)) {
+        if (entry.first == "feature" && features.size() < MAX_SHADER_FEATURES) {
+            features.push_back(entry.second);
+        }
+    }
+}
+
+uint32_t ShaderPermutations::feature(const std::string &name) const {
+    for (uint32_t i = 0; i < features.size(); i++) {
+        if (features[i] == name) {
+            return 1u << i;
+        }
+    }
+
+    std::cerr << "[WARNING]: Shader feature " << name << " isn't declared in " << path << "/shaders.meta!"
+              << std::endl;
+    return 0;
+}
+
+/*
+ * Returns the variant for a feature mask, building it if needed. If a batch is given, the new variant is only
+ * started and added to it (so it isn't usable until the batch is done), otherwise this blocks.
+ */
+ShaderProgram *ShaderPermutations::get(uint32_t mask, ShaderBatch *batch) {
+    auto variant = variants.find(mask);
+    if (variant != variants.end()) {
+        return variant->second;
+    }
+
+    auto *program = new ShaderProgram();
+    program->permutations = this;
+    if (batch) {
+        batch->add(*program, path, mask);
+    } else {
+        program->begin(path, mask);
+        program->finish();
+    }
+
+    variants[mask] = program;
+    return program;
+}
+
+void ShaderPermutations::destroy() {
+    for (std::pair<const uint32_t, ShaderProgram *> &variant : variants) {
+        variant.second->destroy();
+        delete variant.second;
+    }
+    variants.clear();
+}
+
+void ShaderProgram::bind() const {
+    glState.useProgram(id);
+}
+
+void ShaderProgram::unbind() const {
+    glState.useProgram(0);
+}
+
+/*
+ * Looks up every active uniform once, so setting a uniform never has to ask the driver (or hash a string).
+ */
+void ShaderProgram::enumerateUniforms() {
+    uniforms.clear();
+
+    GLint count = 0, maxLength = 0;
+    glGetProgramiv(id, GL_ACTIVE_UNIFORMS, &count);
+    glGetProgramiv(id, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+
+    std::vector<char> name(maxLength + 1);
+    for (GLint i = 0; i < count; i++) {
+        GLsizei len = 0;
+        GLint size = 0;
+        GLenum type = 0;
+        glGetActiveUniform(id, i, name.size(), &len, &size, &type, name.data());
+
+        std::string uniformName(name.data(), len);
+        GLint loc = glGetUniformLocation(id, uniformName.c_str());
+        if (loc == -1) { // Part of a uniform block
+            continue;
+        }
+
+        // Arrays are reported as "name[0]", but they're set by their plain name.
+        if (uniformName.size() > 3 && uniformName.compare(uniformName.size() - 3, 3, "[0]") == 0) {
+            uniformName.resize(uniformName.size() - 3);
+        }
+        uniforms.push_back({hashString(uniformName.c_str()), loc, type, size});
+    }
+
+    std::sort(uniforms.begin(), uniforms.end(), [](const UniformSlot &a, const UniformSlot &b) {
+        return a.hash < b.hash;
+    });
+
+    cameraBlock = GL_INVALID_INDEX;
+    if (GLEW_ARB_uniform_buffer_object) {
+        cameraBlock = glGetUniformBlockIndex(id, CAMERA_BLOCK);
+        if (cameraBlock != GL_INVALID_INDEX) {
+            glUniformBlockBinding(id, cameraBlock, CAMERA_BLOCK_BINDING);
+        }
+    }
+}
+
+GLint ShaderProgram::getUniformLoc(UniformID name) {
+    auto slot = std::lower_bound(uniforms.begin(), uniforms.end(), name.hash, [](const UniformSlot &a, uint32_t h) {
+        return a.hash < h;
+    });
+    if (slot != uniforms.end() && slot->hash == name.hash) {
+        return slot->location;
+    }
+
+    // Remember missing uniforms too so the warning is only printed once.
+    std::cerr << "[WARNING]: Uniform " << name.name << " doesn't exist!" << std::endl;
+    uniforms.insert(slot, {name.hash, -1, 0, 0});
+    return -1;
+}
+
+void ShaderProgram::setUniform4f(UniformID name, float f0, float f1, float f2, float f3) {
+    GLint loc = getUniformLoc(name);
+    if (loc != -1) {
+        glUniform4f(loc, f0, f1, f2, f3);
+    }
+}
+
+void ShaderProgram::setUniform1i(UniformID name, int v) {
+    GLint loc = getUniformLoc(name);
+    if (loc != -1) {
+        glUniform1i(loc, v);
+    }
+}
+
+void ShaderProgram::setUniformMat4f(UniformID name, const glm::mat4 &mat4, GLboolean transpose) {
+    GLint loc = getUniformLoc(name);
+    if (loc != -1) {
+        glUniformMatrix4fv(loc, 1, transpose, &mat4[0][0]);
+    }
+}
+
+VertexArray::VertexArray() : id(0) {
+    glGenVertexArrays(1, &id);
+    glState.bindVertexArray(id);
+}
+
+void VertexArray::bind() const {
+    glState.bindVertexArray(id);
+}
+
+void VertexArray::unbind() const {
+    glState.bindVertexArray(0);
+}
+
+bool isPackedVertexType(GLenum type) {
+    return type == GL_INT_2_10_10_10_REV || type == GL_UNSIGNED_INT_2_10_10_10_REV;
+}
+
+void VBLayout::addAttribute(GLint count, GLenum type, GLboolean normalized, GLuint stream) {
+    if (stream >= strides.size()) {
+        strides.resize(stream + 1, 0);
+    }
+
+    // Unaligned attributes are slow (or unsupported) on a lot of hardware, so pad to 4 bytes.
+    GLsizei &stride = strides[stream];
+    attribs.push_back({count, type, normalized, stride, stream});
+    stride += isPackedVertexType(type) ? 4 : SIZES[type] * count;
+    stride = (stride + 3) & ~3;
+}
+
+GLsizei VBLayout::vertexSize() const {
+    GLsizei size = 0;
+    for (GLsizei stride : strides) {
+        size += stride;
+    }
+    return size;
+}
+
+std::vector<VertexAttribute> VBLayout::attributes() const {
+    std::vector<VertexAttribute> out;
+    for (const VBAttribute &attrib : attribs) {
+        out.push_back({uint32_t(attrib.count), attrib.type, attrib.normalized, uint32_t(attrib.pointer), attrib.stream});
+    }
+    return out;
+}
+
+std::vector<std::vector<unsigned char>> VBLayout::quantize(const float *vertices, size_t vertexCount,
+                                                           size_t floatStride) const {
+    return quantizeVertices(vertices, vertexCount, floatStride, attributes(),
+                            std::vector<uint32_t>(strides.begin(), strides.end()));
+}
+
+void VertexBuffer::setLayout(VBLayout layout, VertexArray vertArr) {
+    setLayout(layout, vertArr, {this});
+}
+
+void VertexBuffer::setLayout(const VBLayout &layout, VertexArray vertArr,
+                             const std::vector<const VertexBuffer *> &streams) {
+    vertArr.bind();
+
+    for (GLuint i = 0; i < layout.attribs.size(); i++) {
+        const VBAttribute &attrib = layout.attribs[i];
+        if (attrib.stream >= streams.size() || !streams[attrib.stream]) {
+            glDisableVertexAttribArray(i);
+            continue;
+        }
+
+        streams[attrib.stream]->bind(); // The pointer is taken from whatever is bound to GL_ARRAY_BUFFER
+        glEnableVertexAttribArray(i);
+        glVertexAttribPointer(i, attrib.count, attrib.type, attrib.normalized, layout.strides[attrib.stream],
+                              (const void *) intptr_t(attrib.pointer));
+    }
+}
+
+void ShaderProgram::destroy() {
+    glState.deleteProgram(id);
+}
+
+void VertexBuffer::destroy() {
+    glState.deleteBuffer(id);
+}
+
+void IndexBuffer::destroy() {
+    glState.deleteBuffer(id);
+}
+
+void VertexArray::destroy() {
+    glState.deleteVertexArray(id);
+}
+
+Texture::Texture(const std::string &path, GLenum type, GLint lod, GLint border) : localBuf(nullptr), width(0),
+                                                                                  height(0), bits(0), id(0) {
+    this->fp = path;
+    this->textureType = type;
+
+    if (endsWith(path, COOKED_TEXTURE_EXT)) {
+        if (!loadCooked(path, border)) {
+            std::cerr << "Failed to load cooked texture from " << path << std::endl;
+            state = TEXTURE_FAILED;
+        }
+        return;
+    }
+
+    localBuf = stbi_load(path.c_str(), &width, &height, &bits, 4); // 4 channels for RGBA
+
+    glGenTextures(1, &id);
+    bind();
+
+    setRenderHints({{GL_TEXTURE_MIN_FILTER, GL_LINEAR},
+                    {GL_TEXTURE_MAG_FILTER, GL_LINEAR}}); // DEFAULT VALUES
+    // {GL_TEXTURE_WARP_S, GL_CLAMP}, {GL_TEXTURE_WARP_T, GL_CLAMP}}); // These for some reason don't work :(
+
+    glTexImage2D(type, lod, GL_RGBA8, width, height, border, GL_RGBA, GL_UNSIGNED_BYTE, localBuf);
+    gpuBytes = rawBytes = size_t(width) * height * 4;
+
+    if (localBuf) {
+        stbi_image_free(localBuf);
+        localBuf = nullptr;
+    } else {
+        std::cerr << "Failed to load texture from " << path << ": " << stbi_failure_reason() << std::endl;
+        state = TEXTURE_FAILED;
+    }
+}
+
+Texture::Texture(GLenum type) : textureType(type), id(0), localBuf(nullptr), width(2), height(2), bits(4) {
+    // Magenta/black checkerboard, so textures that are still loading are easy to spot.
+    const unsigned char placeholder[] = {255, 0, 255, 255, 0, 0, 0, 255,
+                                         0, 0, 0, 255, 255, 0, 255, 255};
+
+    glGenTextures(1, &id);
+    bind();
+
+    setRenderHints({{GL_TEXTURE_MIN_FILTER, GL_NEAREST},
+                    {GL_TEXTURE_MAG_FILTER, GL_NEAREST}});
+
+    if (type == GL_TEXTURE_2D_ARRAY_EXT) {
+        glTexImage3D(type, 0, GL_RGBA8, width, height, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, placeholder);
+    } else {
+        glTexImage2D(type, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, placeholder);
+    }
+}
+
+/*
+ * The file is mapped and every level goes straight to the driver, nothing is decoded or copied on our side.
+ */
+bool Texture::loadCooked(const std::string &path, GLint border) {
+    MappedFile file;
+    CookedTexture cooked;
+    if (!file.open(path) || !cooked.open(file) ||
+        (cooked.header->format != COOKED_RGBA8 && !isCompressedFormat(cooked.header->format))) {
+        file.close();
+        return false;
+    }
+
+    glGenTextures(1, &id);
+    bind();
+
+    setRenderHints({{GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR},
+                    {GL_TEXTURE_MAG_FILTER, GL_LINEAR}});
+
+    width = cooked.header->width;
+    height = cooked.header->height;
+    bits = 4;
+    mipLevels = cooked.header->mipCount;
+
+    // Compressed textures get decompressed here if the driver can't take them.
+    bool compressed = isCompressedFormat(cooked.header->format);
+    bool upload = compressed && GLEW_EXT_texture_compression_s3tc;
+    internalFormat = upload ? cooked.header->format : GL_RGBA8;
+    gpuBytes = rawBytes = 0;
+
+    glTexParameteri(textureType, GL_TEXTURE_MAX_LEVEL, mipLevels - 1);
+    for (GLint level = 0; level < mipLevels; level++) {
+        const CookedMip &mip = cooked.mips[level];
+        rawBytes += size_t(mip.width) * mip.height * 4;
+
+        if (upload) {
+            glCompressedTexImage2D(textureType, level, internalFormat, mip.width, mip.height, border, mip.size,
+                                   cooked.pixels(level));
+            gpuBytes += mip.size;
+        } else if (compressed) {
+            std::vector<unsigned char> pixels = decompressImage(cooked.pixels(level), mip.width, mip.height,
+                                                                cooked.header->format);
+            glTexImage2D(textureType, level, GL_RGBA8, mip.width, mip.height, border, GL_RGBA, GL_UNSIGNED_BYTE,
+                         pixels.data());
+            gpuBytes += pixels.size();
+        } else {
+            glTexImage2D(textureType, level, GL_RGBA8, mip.width, mip.height, border, GL_RGBA, GL_UNSIGNED_BYTE,
+                         cooked.pixels(level));
+            gpuBytes += mip.size;
+        }
+    }
+
+    file.close();
+    return true;
+}
+
+void Texture::bind(GLuint texSlot) {
+    this->slot = texSlot;
+    glState.bindTexture(texSlot, textureType, id);
+}
+
+void Texture::unbind() const {
+    glState.bindTexture(slot, textureType, 0);
+}
+
+void Texture::destroy() {
+    glState.deleteTexture(id);
+}
+
+void Texture::genMipmaps() {
+    if (state != TEXTURE_READY) { // Done by the TextureLoader once the real image is in.
+        mipmapsRequested = true;
+        return;
+    }
+
+    if (mipLevels > 1) { // Already loaded the whole chain
+        return;
+    }
+
+    bind();
+    glGenerateMipmap(textureType);
+}
+
+void Texture::setRenderHints(std::unordered_map<GLenum, GLint> hints) {
+    bool bound = false;
+
+    for (std::pair<GLenum, GLint> hint : hints) {
+        auto param = params.find(hint.first);
+        if (param != params.end() && param->second == hint.second) {
+            glState.skipped++;
+            continue;
+        }
+
+        if (!bound) { // Only bind if there's actually something to change.
+            bind(slot);
+            bound = true;
+        }
+        glTexParameteri(textureType, hint.first, hint.second);
+        params[hint.first] = hint.second;
+        glState.issued++;
+    }
+}
+
+void TextureLoader::init(unsigned threads) {
+    if (threads == 0) {
+        threads = std::max(2u, std::thread::hardware_concurrency()) - 1; // Leave a core for the GL thread
+    }
+
+    compression = GLEW_EXT_texture_compression_s3tc; // Before the workers start, they read it
+
+    stopping = false;
+    for (unsigned i = 0; i < threads; i++) {
+        workers.emplace_back(&TextureLoader::work, this);
+    }
+
+    if (GLEW_ARB_pixel_buffer_object) {
+        glGenBuffers(1, &pixelBuffer);
+    } else {
+        std::cerr << "[WARNING]: ARB_pixel_buffer_object not supported! Textures will be uploaded directly."
+                  << std::endl;
+    }
+}
+
+void TextureLoader::request(Texture &tex, const std::string &imagePath) {
+    std::string path = imagePath;
+    if (preferCooked && !endsWith(path, COOKED_TEXTURE_EXT) && std::filesystem::exists(cookedTexturePath(path))) {
+        path = cookedTexturePath(path);
+    }
+
+    tex.fp = path;
+    tex.state = TEXTURE_PENDING;
+    tex.requestTime = glfwGetTime();
+    pending++;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        requests.emplace_back(&tex, path);
+    }
+    wake.notify_one();
+}
+
+void TextureLoader::work() {
+    while (true) {
+        std::pair<Texture *, std::string> req;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [this]() { return stopping || !requests.empty(); });
+            if (stopping) {
+                return;
+            }
+
+            req = requests.front();
+            requests.pop_front();
+        }
+
+        double start = glfwGetTime();
+        DecodedImage image = {req.first, nullptr, nullptr, {}, {}, COOKED_RGBA8, 0, 0, 1, 0, 0, 0};
+
+        if (endsWith(req.second, COOKED_TEXTURE_EXT)) {
+            image.file = new MappedFile();
+            if (image.file->open(req.second) && image.cooked.open(*image.file) &&
+                (image.cooked.header->format == COOKED_RGBA8 || isCompressedFormat(image.cooked.header->format))) {
+                image.width = image.cooked.header->width;
+                image.height = image.cooked.header->height;
+                image.mipCount = image.cooked.header->mipCount;
+                image.format = image.cooked.header->format;
+
+                if (isCompressedFormat(image.format) && !compression) { // Fall back to plain RGBA8
+                    for (int level = 0; level < image.mipCount; level++) {
+                        const CookedMip &mip = image.cooked.mips[level];
+                        image.levels.push_back(decompressImage(image.cooked.pixels(level), mip.width, mip.height,
+                                                               image.format));
+                    }
+                    image.format = COOKED_RGBA8;
+                    image.file->close();
+                    delete image.file;
+                    image.file = nullptr;
+                }
+            } else {
+                std::cerr << "Failed to load cooked texture from " << req.second << std::endl;
+                image.release();
+            }
+        } else {
+            int bits;
+            image.pixels = stbi_load(req.second.c_str(), &image.width, &image.height, &bits, 4); // 4 channels: RGBA
+            if (!image.pixels) {
+                std::cerr << "Failed to load texture from " << req.second << ": " << stbi_failure_reason()
+                          << std::endl;
+            } else if (compressOnLoad && compression) {
+                image.format = chooseCompressedFormat(image.pixels, image.width, image.height);
+                image.levels = buildMipChain(image.pixels, image.width, image.height);
+                for (size_t level = 0; level < image.levels.size(); level++) {
+                    // This already runs on a worker, so don't spawn more threads.
+                    image.levels[level] = compressImage(image.levels[level].data(), std::max(1, image.width >> level),
+                                                        std::max(1, image.height >> level), image.format, 1);
+                }
+                image.mipCount = image.levels.size();
+                stbi_image_free(image.pixels);
+                image.pixels = nullptr;
+            }
+        }
+        image.decodeTime = (glfwGetTime() - start) * 1000;
+
+        std::lock_guard<std::mutex> guard(lock);
+        decoded.push_back(image);
+    }
+}
+
+void TextureLoader::update() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        while (!decoded.empty()) {
+            uploads.push_back(decoded.front());
+            decoded.pop_front();
+        }
+    }
+
+    GLsizeiptr budget = uploadBudget;
+    while (!uploads.empty() && budget > 0) {
+        DecodedImage &image = uploads.front();
+        Texture *tex = image.texture;
+        double start = glfwGetTime();
+
+        if (!image.pixels && !image.file && image.levels.empty()) {
+            tex->state = TEXTURE_FAILED;
+            pending--;
+            failed++;
+            uploads.pop_front();
+            continue;
+        }
+
+        bool compressed = isCompressedFormat(image.format);
+
+        tex->bind(tex->slot);
+        if (tex->state == TEXTURE_PENDING) { // First chunk: allocate every level at full size.
+            tex->width = image.width;
+            tex->height = image.height;
+            tex->bits = 4;
+            tex->mipLevels = image.mipCount;
+            tex->internalFormat = compressed ? image.format : GL_RGBA8;
+            tex->gpuBytes = tex->rawBytes = 0;
+            tex->decodeTime = image.decodeTime;
+            tex->uploadTime = 0;
+            tex->state = TEXTURE_UPLOADING;
+
+            for (int level = 0; level < image.mipCount; level++) {
+                int w, h;
+                image.levelSize(level, w, h);
+                size_t size = compressed ? compressedSize(image.format, w, h) : size_t(w) * h * 4;
+                if (compressed) {
+                    glCompressedTexImage2D(tex->textureType, level, image.format, w, h, 0, size, nullptr);
+                } else {
+                    glTexImage2D(tex->textureType, level, GL_RGBA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+                }
+                tex->gpuBytes += size;
+                tex->rawBytes += size_t(w) * h * 4;
+            }
+            if (image.mipCount > 1) {
+                glTexParameteri(tex->textureType, GL_TEXTURE_MAX_LEVEL, image.mipCount - 1);
+            }
+        }
+
+        int levelWidth, levelHeight;
+        image.levelSize(image.uploadedLevels, levelWidth, levelHeight);
+
+        // A "row" is a row of 4x4 blocks for compressed formats. Always upload at least one, even if it's over budget.
+        GLsizeiptr rowSize = compressed ? compressedSize(image.format, levelWidth, 1) : levelWidth * 4;
+        int levelRows = compressed ? (levelHeight + 3) / 4 : levelHeight;
+        int rows = std::max<GLsizeiptr>(1, budget / rowSize);
+        rows = std::min(rows, levelRows - image.uploadedRows);
+        const unsigned char *src = image.levelPixels(image.uploadedLevels) + image.uploadedRows * rowSize;
+
+        uploadRows(tex, image.format, image.uploadedLevels, image.uploadedRows, levelWidth, levelHeight, rows, src);
+
+        image.uploadedRows += rows;
+        budget -= rows * rowSize;
+        tex->uploadTime += (glfwGetTime() - start) * 1000;
+
+        if (image.uploadedRows >= levelRows) {
+            image.uploadedRows = 0;
+            image.uploadedLevels++;
+        }
+        if (image.uploadedLevels >= image.mipCount) {
+            finish(image);
+            uploads.pop_front();
+        }
+    }
+}
+
+/*
+ * Uploads `rows` rows starting at `row` (rows of blocks for compressed formats) of one level.
+ */
+void TextureLoader::uploadRows(Texture *tex, uint32_t format, GLint level, GLint row, GLsizei width,
+                               GLsizei height, GLsizei rows, const unsigned char *src) {
+    bool compressed = isCompressedFormat(format);
+    GLint y = compressed ? row * 4 : row;
+    GLsizei h = compressed ? std::min(rows * 4, height - y) : rows;
+    GLsizeiptr size = compressed ? GLsizeiptr(compressedSize(format, width, 1)) * rows : GLsizeiptr(width) * rows * 4;
+
+    const void *data = src;
+    if (pixelBuffer != 0) {
+        glState.bindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffer);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW); // Orphan the last chunk
+        void *dst = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+        if (dst) {
+            std::memcpy(dst, src, size);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            data = nullptr; // Offset into the pixel buffer
+        } else { // Mapping failed, just upload it directly
+            glState.bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        }
+    }
+
+    if (compressed) {
+        glCompressedTexSubImage2D(tex->textureType, level, 0, y, width, h, format, size, data);
+    } else {
+        glTexSubImage2D(tex->textureType, level, 0, y, width, h, GL_RGBA, GL_UNSIGNED_BYTE, data);
+    }
+
+    if (pixelBuffer != 0) {
+        glState.bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0); // Or else every other texture upload reads from it!
+    }
+}
+
+void TextureLoader::finish(DecodedImage &image) {
+    Texture *tex = image.texture;
+    image.release();
+
+    tex->state = TEXTURE_READY;
+    if (tex->mipmapsRequested) {
+        tex->mipmapsRequested = false;
+        tex->genMipmaps();
+    }
+
+    tex->loadTime = (glfwGetTime() - tex->requestTime) * 1000;
+    pending--;
+    loaded++;
+    bytesSaved += tex->rawBytes - tex->gpuBytes;
+
+    std::cout << "Successfully loaded texture from " << tex->fp << " in " << tex->loadTime << "ms (decode "
+              << tex->decodeTime << "ms, upload " << tex->uploadTime << "ms, " << tex->gpuBytes / 1024 << "KB";
+    if (tex->gpuBytes < tex->rawBytes) {
+        std::cout << ", saved " << (tex->rawBytes - tex->gpuBytes) / 1024 << "KB";
+    }
+    std::cout << ")" << std::endl;
+}
+
+void DecodedImage::levelSize(int level, int &w, int &h) const {
+    if (file) {
+        w = cooked.mips[level].width;
+        h = cooked.mips[level].height;
+    } else {
+        w = std::max(1, width >> level);
+        h = std::max(1, height >> level);
+    }
+}
+
+const unsigned char *DecodedImage::levelPixels(int level) const {
+    if (!levels.empty()) {
+        return levels[level].data();
+    }
+    return file ? cooked.pixels(level) : pixels;
+}
+
+void DecodedImage::release() {
+    if (pixels) {
+        stbi_image_free(pixels);
+        pixels = nullptr;
+    }
+    if (file) {
+        file->close();
+        delete file;
+        file = nullptr;
+    }
+    levels.clear();
+}
+
+void TextureLoader::shutdown() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+
+    for (std::deque<DecodedImage> *images : {&decoded, &uploads}) {
+        for (DecodedImage &image : *images) {
+            image.release();
+        }
+        images->clear();
+    }
+    requests.clear();
+
+    if (pixelBuffer != 0) {
+        glState.deleteBuffer(pixelBuffer);
+        pixelBuffer = 0;
+    }
+}
+
+GLStateCache::GLStateCache() {
+    invalidate();
+}
+
+void GLStateCache::invalidate() {
+    program = UNKNOWN_BINDING;
+    vertexArray = UNKNOWN_BINDING;
+    arrayBuffer = UNKNOWN_BINDING;
+    elementBuffer = UNKNOWN_BINDING;
+    vaoElementBuffers.clear();
+
+    activeUnit = UNKNOWN_BINDING;
+    for (GLuint unit = 0; unit < MAX_TEXTURE_UNITS; unit++) {
+        textureTargets[unit] = 0;
+        textures[unit] = UNKNOWN_BINDING;
+    }
+
+    capabilities.clear();
+    blendSrc = blendDst = blendEquation = 0;
+    depthFunc = cullFace = frontFace = 0;
+}
+
+void GLStateCache::endFrame() {
+    lastIssued = issued;
+    lastSkipped = skipped;
+    issued = 0;
+    skipped = 0;
+}
+
+bool GLStateCache::changed(GLuint &cached, GLuint value) {
+    if (cached == value) {
+        skipped++;
+        return false;
+    }
+
+    cached = value;
+    issued++;
+    return true;
+}
+
+void GLStateCache::useProgram(GLuint id) {
+    if (changed(program, id)) {
+        glUseProgram(id);
+    }
+}
+
+void GLStateCache::bindVertexArray(GLuint id) {
+    if (changed(vertexArray, id)) {
+        glBindVertexArray(id);
+
+        auto ebo = vaoElementBuffers.find(id);
+        elementBuffer = ebo != vaoElementBuffers.end() ? ebo->second : UNKNOWN_BINDING;
+    }
+}
+
+void GLStateCache::bindBuffer(GLenum target, GLuint id) {
+    if (target == GL_ARRAY_BUFFER) {
+        if (changed(arrayBuffer, id)) {
+            glBindBuffer(target, id);
+        }
+    } else if (target == GL_ELEMENT_ARRAY_BUFFER) {
+        if (changed(elementBuffer, id)) {
+            glBindBuffer(target, id);
+            if (vertexArray != UNKNOWN_BINDING) {
+                vaoElementBuffers[vertexArray] = id;
+            }
+        }
+    } else { // Not tracked
+        glBindBuffer(target, id);
+        issued++;
+    }
+}
+
+void GLStateCache::activeTexture(GLuint unit) {
+    if (changed(activeUnit, unit)) {
+        glActiveTexture(GL_TEXTURE0 + unit);
+    }
+}
+
+void GLStateCache::bindTexture(GLuint unit, GLenum target, GLuint id) {
+    if (unit >= MAX_TEXTURE_UNITS) {
+        activeTexture(unit);
+        glBindTexture(target, id);
+        issued++;
+        return;
+    }
+
+    if (textureTargets[unit] == target && textures[unit] == id) {
+        skipped++;
+        return;
+    }
+
+    activeTexture(unit);
+    glBindTexture(target, id);
+    textureTargets[unit] = target;
+    textures[unit] = id;
+    issued++;
+}
+
+void GLStateCache::setCapability(GLenum cap, bool enabled) {
+    auto state = capabilities.find(cap);
+    if (state != capabilities.end() && state->second == enabled) {
+        skipped++;
+        return;
+    }
+
+    if (enabled) {
+        glEnable(cap);
+    } else {
+        glDisable(cap);
+    }
+    capabilities[cap] = enabled;
+    issued++;
+}
+
+void GLStateCache::setBlendFunc(GLenum src, GLenum dst) {
+    if (blendSrc == src && blendDst == dst) {
+        skipped++;
+        return;
+    }
+
+    glBlendFunc(src, dst);
+    blendSrc = src;
+    blendDst = dst;
+    issued++;
+}
+
+void GLStateCache::setBlendEquation(GLenum mode) {
+    if (changed(blendEquation, mode)) {
+        glBlendEquation(mode);
+    }
+}
+
+void GLStateCache::setDepthFunc(GLenum func) {
+    if (changed(depthFunc, func)) {
+        glDepthFunc(func);
+    }
+}
+
+void GLStateCache::setCullFace(GLenum mode) {
+    if (changed(cullFace, mode)) {
+        glCullFace(mode);
+    }
+}
+
+void GLStateCache::setFrontFace(GLenum mode) {
+    if (changed(frontFace, mode)) {
+        glFrontFace(mode);
+    }
+}
+
+/*
+ * Deleting a bound object resets the binding to 0, so the cache has to follow along.
+ */
+void GLStateCache::deleteProgram(GLuint id) {
+    glDeleteProgram(id);
+    if (program == id) {
+        program = 0;
+    }
+}
+
+void GLStateCache::deleteVertexArray(GLuint id) {
+    glDeleteVertexArrays(1, &id);
+    vaoElementBuffers.erase(id);
+    if (vertexArray == id) {
+        vertexArray = 0;
+        elementBuffer = UNKNOWN_BINDING;
+    }
+}
+
+void GLStateCache::deleteBuffer(GLuint id) {
+    glDeleteBuffers(1, &id);
+    if (arrayBuffer == id) {
+        arrayBuffer = 0;
+    }
+    if (elementBuffer == id) {
+        elementBuffer = 0;
+    }
+    for (std::pair<const GLuint, GLuint> &ebo : vaoElementBuffers) {
+        if (ebo.second == id) { // Other VAOs keep referencing it, forget about them to be safe.
+            ebo.second = UNKNOWN_BINDING;
+        }
+    }
+}
+
+void GLStateCache::deleteTexture(GLuint id) {
+    glDeleteTextures(1, &id);
+    for (GLuint unit = 0; unit < MAX_TEXTURE_UNITS; unit++) {
+        if (textures[unit] == id) {
+            textures[unit] = 0;
+        }
+    }
+}
+
+Camera::Camera(glm::vec3 pos, glm::vec2 look, GLFWwindow *window) {
+    win = window;
+    lookAngle = look;
+    position = pos;
+
+    lookDirection = glm::vec3(cos(lookAngle.y) * sin(lookAngle.x), sin(lookAngle.y),
+                              cos(lookAngle.y) * cos(lookAngle.x));
+
+    right = glm::vec3(sin(lookAngle.x - pi / 2.0f), 0, cos(lookAngle.x - pi / 2.0f));
+    forward = glm::vec3(sin(lookAngle.x), 0, cos(lookAngle.x));
+    up = glm::cross(right, lookDirection);
+}
+
+void Camera::move(float forwardAmount, float rightAmount, float deltaTime) {
+    position += forward * forwardAmount * deltaTime;
+    position += right * rightAmount * deltaTime;
+}
+
+void Camera::look(glm::vec2 amount, float deltaTime) {
+    setLook(lookAngle + amount * deltaTime);
+}
+
+void Camera::setLook(glm::vec2 angle) {
+    lookAngle = angle;
+
+    if (lookAngle.y > pi / 2) {
         lookAngle.y = pi / 2;
     } else if (lookAngle.y < -pi / 2) {
         lookAngle.y = -pi / 2;
     }
 
-    lookDirection = glm::vec3(cos(lookAngle.y) * sin(lookAngle.x), sin(lookAngle.y),
-                              cos(lookAngle.y) * cos(lookAngle.x));
+    lookDirection = glm::vec3(cos(lookAngle.y) * sin(lookAngle.x), sin(lookAngle.y),
+                              cos(lookAngle.y) * cos(lookAngle.x));
+
+    right = glm::vec3(sin(lookAngle.x - pi / 2.0f), 0, cos(lookAngle.x - pi / 2.0f));
+    forward = glm::vec3(sin(lookAngle.x), 0, cos(lookAngle.x));
+    up = glm::cross(right, lookDirection);
+}
+
+glm::mat4 Camera::getProjection(float fov, float near, float far) {
+    int width, height;
+    glfwGetWindowSize(win, &width, &height);
+
+    return glm::perspective(glm::radians(fov), (float) width / (float) height, near, far);
+}
+
+glm::mat4 Camera::getView() {
+    return glm::lookAt(position, position + lookDirection, up);
+}
+
+void Camera::screenRay(glm::vec2 cursor, const glm::mat4 &proj, glm::vec3 &origin, glm::vec3 &direction) {
+    int width, height;
+    glfwGetWindowSize(win, &width, &height);
+
+    // Unproject the cursor on the near and far planes.
+    glm::vec2 ndc = glm::vec2(2 * cursor.x / width - 1, 1 - 2 * cursor.y / height);
+    glm::mat4 inverse = glm::inverse(proj * getView());
+    glm::vec4 near = inverse * glm::vec4(ndc.x, ndc.y, -1, 1);
+    glm::vec4 far = inverse * glm::vec4(ndc.x, ndc.y, 1, 1);
+
+    origin = glm::vec3(near) / near.w;
+    direction = glm::normalize(glm::vec3(far) / far.w - origin);
+}
+
+void Simulation::start(const Camera &view, const std::vector<SimBody> &initial) {
+    camera.position = view.position;
+    camera.setLook(view.lookAngle);
+    bodies = initial;
+
+    // Every slot starts out as "nothing has happened yet", so apply() has something to show right away.
+    State state = {camera.position, camera.lookAngle, bodies};
+    for (Snapshot &slot : slots) {
+        slot = {state, state, 0, 0, 0, 0};
+    }
+    latest = 0;
+    back = 1;
+    front = 2;
+    stats = {};
+
+    stopping = false;
+    startTime = std::chrono::steady_clock::now();
+    thread = std::thread(&Simulation::run, this);
+}
+
+void Simulation::apply(Camera &view, GameObjectRegistry &objects) {
+    if (latest.load(std::memory_order_relaxed) & FRESH) {
+        front = latest.exchange(front, std::memory_order_acq_rel) & ~FRESH;
+    }
+    const Snapshot &snapshot = slots[front];
+
+    double now = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    float alpha = glm::clamp(float((now - snapshot.time) * tickRate), 0.0f, 1.0f);
+
+    const State &from = snapshot.previous, &to = snapshot.current;
+    view.position = glm::mix(from.position, to.position, alpha);
+    view.setLook(glm::mix(from.look, to.look, alpha));
+
+    for (size_t i = 0; i < to.bodies.size(); i++) {
+        const SimBody &body = to.bodies[i];
+        if (!objects.valid(body.handle)) {
+            continue;
+        }
+
+        // Angles wrap around, take the short way between them.
+        float angle = from.bodies[i].angle + std::remainder(body.angle - from.bodies[i].angle, float(2 * pi)) * alpha;
+        glm::vec3 position = glm::mix(from.bodies[i].position, body.position, alpha);
+        objects.transform(body.handle) = glm::scale(
+                glm::rotate(glm::translate(IDENTITY_MAT4, position), angle, body.axis), body.scale);
+    }
+
+    stats = {snapshot.tick, snapshot.skipped, snapshot.stepMs, alpha};
+}
+
+void Simulation::stop() {
+    stopping = true;
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+void Simulation::run() {
+    using Clock = std::chrono::steady_clock;
+    auto tick = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / tickRate));
+    auto dt = float(1.0 / tickRate);
+    Clock::time_point next = startTime + tick;
+    uint64_t ticks = 0;
+    unsigned skipped = 0;
+    State previous;
+
+    while (!stopping) {
+        std::this_thread::sleep_until(next);
+
+        // Usually one tick, a few more if the thread woke up late.
+        double time = 0, stepMs = 0;
+        for (int catchUp = 0; catchUp < 4 && next <= Clock::now(); catchUp++) {
+            previous.position = camera.position;
+            previous.look = camera.lookAngle;
+            previous.bodies = bodies;
+
+            Clock::time_point begin = Clock::now();
+            step(dt);
+            stepMs = std::chrono::duration<double, std::milli>(Clock::now() - begin).count();
+
+            time = std::chrono::duration<double>(next - startTime).count();
+            next += tick;
+            ticks++;
+        }
+
+        // Way behind (a breakpoint, the machine sleeping...), drop the ticks rather than fast-forwarding through them.
+        Clock::time_point now = Clock::now();
+        if (next <= now) {
+            auto behind = unsigned((now - next) / tick) + 1;
+            skipped += behind;
+            next += tick * behind;
+        }
+
+        if (time > 0) {
+            publish(previous, time, ticks, skipped, stepMs);
+        }
+    }
+}
+
+void Simulation::step(float dt) {
+    uint32_t keys = input.load(std::memory_order_relaxed);
+
+    glm::vec2 turn = glm::vec2(0.0f);
+    turn.y += keys & SIM_LOOK_UP ? sensitivity : 0;
+    turn.y -= keys & SIM_LOOK_DOWN ? sensitivity : 0;
+    turn.x -= keys & SIM_LOOK_RIGHT ? sensitivity : 0;
+    turn.x += keys & SIM_LOOK_LEFT ? sensitivity : 0;
+    camera.look(turn, dt);
+
+    float forward = (keys & SIM_FORWARD ? speed : 0) - (keys & SIM_BACK ? speed : 0);
+    float right = (keys & SIM_RIGHT ? speed : 0) - (keys & SIM_LEFT ? speed : 0);
+    camera.move(forward, right, dt);
+    camera.position.y += ((keys & SIM_UP ? speed : 0) - (keys & SIM_DOWN ? speed : 0)) * dt;
+
+    for (SimBody &body : bodies) {
+        body.angle = std::fmod(body.angle + body.spin * dt, float(2 * pi));
+    }
+}
+
+void Simulation::publish(const State &previous, double time, uint64_t tick, unsigned skipped, double stepMs) {
+    Snapshot &slot = slots[back];
+    slot.previous = previous;
+    slot.current.position = camera.position;
+    slot.current.look = camera.lookAngle;
+    slot.current.bodies = bodies;
+    slot.time = time;
+    slot.tick = tick;
+    slot.skipped = skipped;
+    slot.stepMs = stepMs;
+
+    back = latest.exchange(back | FRESH, std::memory_order_acq_rel) & ~FRESH;
+}
+
+TextureAtlas::TextureAtlas(AtlasMode atlasMode) : mode(atlasMode) {}
+
+int TextureAtlas::add(const std::string &path, Texture *source) {
+    paths.push_back(path);
+    sources.push_back(source);
+    return int(paths.size()) - 1;
+}
+
+bool TextureAtlas::build(JobSystem *jobs) {
+    if (mode == ATLAS_ARRAY && !GLEW_EXT_texture_array) {
+        std::cerr << "[WARNING]: EXT_texture_array not supported! Can't build an array texture atlas." << std::endl;
+        return false;
+    }
+    if (paths.empty()) {
+        return false;
+    }
+
+    auto parallel = [jobs](size_t count, const std::function<void(size_t)> &body) {
+        auto range = [&body](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                body(i);
+            }
+        };
+        if (jobs) {
+            jobs->parallelFor(count, 1, range);
+        } else {
+            range(0, count);
+        }
+    };
+
+    std::vector<AtlasImage> images(paths.size());
+    parallel(paths.size(), [this, &images](size_t i) { decode(paths[i], images[i]); });
+
+    std::vector<AtlasRect> rects;
+    size_t imageTexels = 0;
+    bool decoded = true;
+    for (const AtlasImage &image : images) {
+        decoded = decoded && !image.levels.empty();
+        rects.push_back({image.width, image.height});
+        imageTexels += size_t(image.width) * image.height;
+    }
+
+    GLint maxTextureSize = 0, maxLayers = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+    int limit = std::min(maxSize, int(maxTextureSize));
+
+    int pageWidth = 0, pageHeight = 0;
+    pageCount = 1;
+    bool packed = decoded;
+    if (packed && mode == ATLAS_ARRAY) {
+        // Every layer has the same size, so smaller images are scaled up to the biggest one.
+        glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS_EXT, &maxLayers);
+        for (const AtlasRect &rect : rects) {
+            pageWidth = std::max(pageWidth, rect.width);
+            pageHeight = std::max(pageHeight, rect.height);
+        }
+        pageCount = rects.size();
+        packed = pageWidth <= limit && pageHeight <= limit && pageCount <= maxLayers;
+    } else if (packed) {
+        // Smallest power of two page that fits, growing the shorter side first.
+        pageWidth = pageHeight = 1;
+        while (size_t(pageWidth) * pageHeight < imageTexels) {
+            pageWidth <= pageHeight ? pageWidth *= 2 : pageHeight *= 2;
+        }
+        while (pageWidth <= limit && pageHeight <= limit && !packShelves(rects, pageWidth, pageHeight, padding)) {
+            pageWidth <= pageHeight ? pageWidth *= 2 : pageHeight *= 2;
+        }
+        packed = pageWidth <= limit && pageHeight <= limit;
+    }
+
+    if (!packed) {
+        if (decoded) {
+            std::cerr << "Failed to build texture atlas: " << paths.size() << " images don't fit into "
+                      << (mode == ATLAS_ARRAY ? "an array texture" : "one texture") << std::endl;
+        }
+        return false;
+    }
 
-    right = glm::vec3(sin(lookAngle.x - pi / 2.0f), 0, cos(lookAngle.x - pi / 2.0f));
-    forward = glm::vec3(sin(lookAngle.x), 0, cos(lookAngle.x));
-    up = glm::cross(right, lookDirection);
+    // Cooked BCn layers can go in as they are if they all match. Anything else (and every ATLAS_2D page, since
+    // blocks can't be padded) is unpacked to RGBA8 and gets a new mip chain.
+    format = COOKED_RGBA8;
+    if (mode == ATLAS_ARRAY && GLEW_EXT_texture_compression_s3tc && isCompressedFormat(images[0].format)) {
+        format = images[0].format;
+        for (const AtlasImage &image : images) {
+            if (image.format != format || image.width != pageWidth || image.height != pageHeight ||
+                image.levels.size() != images[0].levels.size()) {
+                format = COOKED_RGBA8;
+                break;
+            }
+        }
+    }
+
+    regions.clear();
+    levels.clear();
+    std::vector<std::vector<std::vector<unsigned char>>> chains(pageCount); // By layer
+    if (mode == ATLAS_ARRAY) {
+        parallel(pageCount, [&](size_t layer) {
+            AtlasImage &image = images[layer];
+            if (format != COOKED_RGBA8) {
+                chains[layer] = std::move(image.levels);
+                return;
+            }
+
+            std::vector<unsigned char> page = isCompressedFormat(image.format) ?
+                                              decompressImage(image.levels[0].data(), image.width, image.height,
+                                                              image.format) : std::move(image.levels[0]);
+            if (image.width != pageWidth || image.height != pageHeight) {
+                page = resampleNearest(page.data(), image.width, image.height, pageWidth, pageHeight);
+            }
+            chains[layer] = buildMipChain(page.data(), pageWidth, pageHeight);
+        });
+
+        for (int layer = 0; layer < pageCount; layer++) {
+            regions.push_back({layer, glm::vec2(0, 0), glm::vec2(1, 1)});
+        }
+    } else {
+        parallel(images.size(), [&images](size_t i) {
+            AtlasImage &image = images[i];
+            if (isCompressedFormat(image.format)) {
+                image.levels[0] = decompressImage(image.levels[0].data(), image.width, image.height, image.format);
+            }
+        });
+
+        std::vector<unsigned char> page(size_t(pageWidth) * pageHeight * 4, 0);
+        for (size_t i = 0; i < rects.size(); i++) {
+            const AtlasRect &rect = rects[i];
+            blitPadded(page.data(), pageWidth, pageHeight, images[i].levels[0].data(), rect.width, rect.height,
+                       rect.x, rect.y, padding);
+            regions.push_back({0, glm::vec2(float(rect.x) / pageWidth, float(rect.y) / pageHeight),
+                               glm::vec2(float(rect.width) / pageWidth, float(rect.height) / pageHeight)});
+        }
+        chains[0] = buildMipChain(page.data(), pageWidth, pageHeight);
+    }
+    images.clear();
+
+    // Interleave the layers' chains, so each level holds every layer.
+    int mipCount = chains[0].size();
+    levels.resize(mipCount);
+    for (std::vector<std::vector<unsigned char>> &chain : chains) {
+        for (int level = 0; level < mipCount; level++) {
+            levels[level].insert(levels[level].end(), chain[level].begin(), chain[level].end());
+        }
+    }
+
+    bool compressed = isCompressedFormat(format);
+    texture = new Texture(mode == ATLAS_ARRAY ? GL_TEXTURE_2D_ARRAY_EXT : GL_TEXTURE_2D);
+    texture->fp = "atlas:" + std::to_string(paths.size());
+    texture->width = pageWidth;
+    texture->height = pageHeight;
+    texture->bits = 4;
+    texture->mipLevels = mipCount;
+    texture->internalFormat = compressed ? format : GL_RGBA8;
+    texture->state = TEXTURE_READY;
+    texture->gpuBytes = texture->rawBytes = 0;
+    texture->setRenderHints({{GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR},
+                             {GL_TEXTURE_MAG_FILTER, GL_LINEAR}});
+
+    texture->bind(texture->slot);
+    for (int level = 0; level < mipCount; level++) {
+        GLsizei w = std::max(1, pageWidth >> level), h = std::max(1, pageHeight >> level);
+        const unsigned char *data = levels[level].data();
+        if (mode == ATLAS_ARRAY && compressed) {
+            glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY_EXT, level, format, w, h, pageCount, 0, levels[level].size(),
+                                   data);
+        } else if (mode == ATLAS_ARRAY) {
+            glTexImage3D(GL_TEXTURE_2D_ARRAY_EXT, level, GL_RGBA8, w, h, pageCount, 0, GL_RGBA, GL_UNSIGNED_BYTE,
+                         data);
+        } else {
+            glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+        }
+        texture->gpuBytes += levels[level].size();
+        texture->rawBytes += size_t(w) * h * 4 * pageCount;
+    }
+    glTexParameteri(texture->textureType, GL_TEXTURE_MAX_LEVEL, mipCount - 1);
+
+    efficiency = float(imageTexels) / (float(pageWidth) * pageHeight * pageCount);
+
+    std::cout << "Packed " << paths.size() << " textures into a " << pageWidth << "x" << pageHeight
+              << (mode == ATLAS_ARRAY ? "x" + std::to_string(pageCount) + " array texture" : " atlas") << " ("
+              << efficiency * 100 << "% used" << (compressed ? ", compressed" : "") << ")" << std::endl;
+    return true;
 }
 
-glm::mat4 Camera::getProjection(float fov, float near, float far) {
-    int width, height;
-    glfwGetWindowSize(win, &width, &height);
+/*
+ * Runs on a job thread, so no GL in here. Cooked files are copied out of the mapping, they're small enough and
+ * the pages get rearranged anyway.
+ */
+void TextureAtlas::decode(const std::string &imagePath, AtlasImage &image) const {
+    std::string path = imagePath;
+    if (preferCooked && !endsWith(path, COOKED_TEXTURE_EXT) && std::filesystem::exists(cookedTexturePath(path))) {
+        path = cookedTexturePath(path);
+    }
 
-    return glm::perspective(glm::radians(fov), (float) width / (float) height, near, far);
+    if (endsWith(path, COOKED_TEXTURE_EXT)) {
+        MappedFile file;
+        CookedTexture cooked;
+        if (!file.open(path) || !cooked.open(file)) {
+            std::cerr << "Failed to load cooked texture from " << path << std::endl;
+            file.close();
+            return;
+        }
+
+        image.width = cooked.header->width;
+        image.height = cooked.header->height;
+        image.format = cooked.header->format;
+        for (uint32_t level = 0; level < cooked.header->mipCount; level++) {
+            image.levels.emplace_back(cooked.pixels(level), cooked.pixels(level) + cooked.mips[level].size);
+        }
+        file.close();
+        return;
+    }
+
+    int bits;
+    unsigned char *pixels = stbi_load(path.c_str(), &image.width, &image.height, &bits, 4);
+    if (!pixels) {
+        std::cerr << "Failed to load texture from " << path << ": " << stbi_failure_reason() << std::endl;
+        return;
+    }
+    image.levels.emplace_back(pixels, pixels + size_t(image.width) * image.height * 4);
+    stbi_image_free(pixels);
 }
 
-glm::mat4 Camera::getView() {
-    return glm::lookAt(position, position + lookDirection, up);
-}
\ No newline at end of file
+void TextureAtlas::remapUVs(float *vertices, size_t vertexCount, size_t stride, size_t uvOffset, int entry) const {
+    const AtlasRegion &region = regions[entry];
+    for (size_t i = 0; i < vertexCount; i++) {
+        float *uv = vertices + i * stride + uvOffset;
+        uv[0] = region.uvOffset.x + uv[0] * region.uvScale.x;
+        uv[1] = region.uvOffset.y + uv[1] * region.uvScale.y;
+    }
+}
+
+void TextureAtlas::apply(Renderer &rend, uint32_t arrayFeature) {
+    if (!texture) {
+        return;
+    }
+    if (mode == ATLAS_2D) {
+        // The models still have the UVs of the source textures (and may be shared with objects that don't use
+        // one of them), so switching the texture alone would sample the wrong part of the page.
+        std::cerr << "[WARNING]: TextureAtlas::apply() can't retarget objects to an ATLAS_2D atlas, their UVs have "
+                     "to be remapped with remapUVs() when the models are built." << std::endl;
+        return;
+    }
+
+    unsigned before = rend.queue.countBatches(rend.objects);
+
+    GameObjectRegistry &objects = rend.objects;
+    for (size_t i = 0; i < objects.size(); i++) {
+        auto source = std::find(sources.begin(), sources.end(), objects.textures[i]);
+        if (objects.textures[i] == nullptr || source == sources.end()) {
+            continue;
+        }
+
+        const AtlasRegion &region = regions[source - sources.begin()];
+        objects.textures[i] = texture;
+        objects.layers[i] = float(region.layer);
+
+        ShaderProgram *shader = objects.shaders[i];
+        if (mode == ATLAS_ARRAY && shader->permutations) {
+            objects.shaders[i] = shader->permutations->get(shader->featureMask | arrayFeature);
+        }
+    }
+
+    unsigned after = rend.queue.countBatches(objects);
+    drawCallsSaved = before > after ? before - after : 0;
+    std::cout << "Texture atlas: " << before << " draw calls before, " << after << " after (" << drawCallsSaved
+              << " saved)" << std::endl;
+}
+
+// The GL texture is destroyed by Renderer::quit() along with everything else the objects use.
+void TextureAtlas::destroy() {
+    delete texture;
+    texture = nullptr;
+    levels.clear();
+}
+
+const unsigned char *StreamedTexture::levelData(int level) const {
+    return file ? cooked.pixels(level) : levels[level].data();
+}
+
+size_t StreamedTexture::levelBytes(int level) const {
+    int w = std::max(1, width >> level), h = std::max(1, height >> level);
+    return (isCompressedFormat(format) ? compressedSize(format, w, h) : size_t(w) * h * 4) * layers;
+}
+
+size_t StreamedTexture::residentBytes(int mip) const {
+    size_t size = 0;
+    for (int level = mip; level < mipCount; level++) {
+        size += levelBytes(level);
+    }
+    return size;
+}
+
+bool TextureStreamer::add(Texture &tex, const std::string &path) {
+    StreamedTexture streamed;
+    streamed.texture = &tex;
+    streamed.layers = 1;
+
+    if (endsWith(path, COOKED_TEXTURE_EXT)) {
+        streamed.file = new MappedFile();
+        if (!streamed.file->open(path) || !streamed.cooked.open(*streamed.file) ||
+            (streamed.cooked.header->format != COOKED_RGBA8 && !isCompressedFormat(streamed.cooked.header->format))) {
+            std::cerr << "Failed to stream cooked texture from " << path << std::endl;
+            streamed.file->close();
+            delete streamed.file;
+            return false;
+        }
+
+        streamed.width = streamed.cooked.header->width;
+        streamed.height = streamed.cooked.header->height;
+        streamed.mipCount = streamed.cooked.header->mipCount;
+        streamed.format = streamed.cooked.header->format;
+
+        if (isCompressedFormat(streamed.format) && !GLEW_EXT_texture_compression_s3tc) {
+            for (int level = 0; level < streamed.mipCount; level++) {
+                const CookedMip &mip = streamed.cooked.mips[level];
+                streamed.levels.push_back(decompressImage(streamed.cooked.pixels(level), mip.width, mip.height,
+                                                          streamed.format));
+            }
+            streamed.format = COOKED_RGBA8;
+            streamed.file->close();
+            delete streamed.file;
+            streamed.file = nullptr;
+        }
+    } else {
+        int bits;
+        unsigned char *pixels = stbi_load(path.c_str(), &streamed.width, &streamed.height, &bits, 4);
+        if (!pixels) {
+            std::cerr << "Failed to stream texture from " << path << ": " << stbi_failure_reason() << std::endl;
+            return false;
+        }
+
+        streamed.levels = buildMipChain(pixels, streamed.width, streamed.height);
+        streamed.mipCount = streamed.levels.size();
+        stbi_image_free(pixels);
+    }
+
+    tex.fp = path;
+    track(std::move(streamed));
+    return true;
+}
+
+void TextureStreamer::add(Texture &tex, std::vector<std::vector<unsigned char>> levels, uint32_t format, int width,
+                          int height, int layers) {
+    StreamedTexture streamed;
+    streamed.texture = &tex;
+    streamed.levels = std::move(levels);
+    streamed.format = format;
+    streamed.width = width;
+    streamed.height = height;
+    streamed.layers = layers;
+    streamed.mipCount = streamed.levels.size();
+
+    track(std::move(streamed));
+}
+
+void TextureStreamer::track(StreamedTexture &&streamed) {
+    streamed.residentMip = streamed.mipCount;
+    streamed.wantedMip = streamed.mipCount - 1;
+    streamed.texture->state = TEXTURE_READY;
+    streamed.texture->width = streamed.width;
+    streamed.texture->height = streamed.height;
+    streamed.texture->bits = 4;
+    streamed.texture->rawBytes = size_t(streamed.width) * streamed.height * 4 * streamed.layers;
+
+    lookup[streamed.texture] = textures.size();
+    textures.push_back(std::move(streamed));
+    setResidency(textures.back(), textures.back().mipCount - 1);
+}
+
+void TextureStreamer::update(const GameObjectRegistry &objects, const RenderQueue &queue, const glm::mat4 &view,
+                             const glm::mat4 &proj, int viewportHeight) {
+    lastEvictions = lastStreamedIn = 0;
+    if (textures.empty()) {
+        return;
+    }
+
+    for (StreamedTexture &streamed : textures) {
+        streamed.coverage = 0;
+    }
+
+    // proj[1][1] is 1 / tan(fov / 2), so this is how many pixels one unit covers at a distance of one unit.
+    glm::vec3 eye = glm::vec3(glm::inverse(view)[3]);
+    float focal = proj[1][1] * float(viewportHeight) * 0.5f;
+
+    // Everything that got past culling this frame, so hidden and off-screen objects don't keep mips resident.
+    for (const std::vector<DrawCommand> &packet : queue.packets) {
+        for (const DrawCommand &command : packet) {
+            auto found = lookup.find(objects.textures[command.index]);
+            if (found == lookup.end()) {
+                continue;
+            }
+
+            // Bounding sphere of the model in world space, like Renderer::selectLOD().
+            const Model *model = objects.models[command.index];
+            const glm::mat4 &transform = objects.transforms[command.index];
+            float scale = std::max({glm::length(glm::vec3(transform[0])), glm::length(glm::vec3(transform[1])),
+                                    glm::length(glm::vec3(transform[2]))});
+            glm::vec3 center = glm::vec3(transform * glm::vec4((model->boundsMin + model->boundsMax) * 0.5f, 1.0f));
+            float radius = glm::length(model->boundsMax - model->boundsMin) * 0.5f * scale;
+            float distance = glm::length(center - eye) - radius;
+
+            StreamedTexture &streamed = textures[found->second];
+            if (distance <= 0.1f) { // The camera is (almost) inside it
+                streamed.coverage = INFINITY;
+            } else {
+                streamed.coverage = std::max(streamed.coverage, 2.0f * radius * focal / distance);
+            }
+        }
+    }
+
+    // Pick the mip whose texels are closest to one per pixel. Unused textures only keep their coarsest mip.
+    size_t total = 0;
+    for (StreamedTexture &streamed : textures) {
+        streamed.wantedMip = streamed.mipCount - 1;
+        if (std::isinf(streamed.coverage)) {
+            streamed.wantedMip = 0;
+        } else if (streamed.coverage > 0) {
+            float texels = float(std::max(streamed.width, streamed.height));
+            int mip = int(std::floor(std::log2(texels / streamed.coverage) + mipBias));
+            streamed.wantedMip = std::min(std::max(mip, 0), streamed.mipCount - 1);
+        }
+        total += streamed.residentBytes(streamed.wantedMip);
+    }
+
+    // Over budget: the texture with the most texels per pixel loses a level until it fits.
+    while (total > budget) {
+        StreamedTexture *victim = nullptr;
+        float worst = 0;
+        for (StreamedTexture &streamed : textures) {
+            if (streamed.wantedMip >= streamed.mipCount - 1) {
+                continue;
+            }
+
+            float texels = float(std::max(streamed.width, streamed.height) >> streamed.wantedMip);
+            float oversampling = streamed.coverage > 0 ? texels / streamed.coverage : INFINITY;
+            if (!victim || oversampling > worst) {
+                victim = &streamed;
+                worst = oversampling;
+            }
+        }
+        if (!victim) {
+            break;
+        }
+
+        total -= victim->levelBytes(victim->wantedMip);
+        victim->wantedMip++;
+    }
+
+    // Evict first, so the memory is free before anything gets streamed in.
+    for (StreamedTexture &streamed : textures) {
+        if (streamed.residentMip < streamed.wantedMip) {
+            setResidency(streamed, streamed.wantedMip);
+            evictions++;
+            lastEvictions++;
+        }
+    }
+
+    size_t uploaded = 0;
+    for (StreamedTexture &streamed : textures) {
+        if (streamed.residentMip > streamed.wantedMip && (uploaded == 0 || uploaded < uploadBudget)) {
+            setResidency(streamed, streamed.residentMip - 1);
+            uploaded += streamed.levelBytes(streamed.residentMip);
+            streamedIn++;
+            lastStreamedIn++;
+        }
+    }
+}
+
+/*
+ * Streaming in uploads only the new levels and then lowers GL_TEXTURE_BASE_LEVEL to them. Evicting raises it first
+ * and then shrinks the dropped levels to 0x0, which frees them. The levels in between are left alone, and the ones
+ * outside BASE_LEVEL..MAX_LEVEL don't count for completeness, so the texture is usable the whole time.
+ */
+void TextureStreamer::setResidency(StreamedTexture &streamed, int mip) {
+    Texture *tex = streamed.texture;
+    bool array = tex->textureType == GL_TEXTURE_2D_ARRAY_EXT;
+    bool compressed = isCompressedFormat(streamed.format);
+
+    tex->bind(tex->slot);
+    for (int level = mip; level < streamed.residentMip; level++) {
+        GLsizei w = std::max(1, streamed.width >> level), h = std::max(1, streamed.height >> level);
+        const unsigned char *data = streamed.levelData(level);
+
+        if (array && compressed) {
+            glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY_EXT, level, streamed.format, w, h, streamed.layers, 0,
+                                   streamed.levelBytes(level), data);
+        } else if (array) {
+            glTexImage3D(GL_TEXTURE_2D_ARRAY_EXT, level, GL_RGBA8, w, h, streamed.layers, 0, GL_RGBA,
+                         GL_UNSIGNED_BYTE, data);
+        } else if (compressed) {
+            glCompressedTexImage2D(tex->textureType, level, streamed.format, w, h, 0, streamed.levelBytes(level),
+                                   data);
+        } else {
+            glTexImage2D(tex->textureType, level, GL_RGBA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+        }
+    }
+
+    // The first time, the texture may still have levels from before it was streamed (e.g. a TextureAtlas's).
+    bool first = streamed.residentMip == streamed.mipCount;
+    if (first) {
+        glTexParameteri(tex->textureType, GL_TEXTURE_MAX_LEVEL, streamed.mipCount - 1);
+    }
+    glTexParameteri(tex->textureType, GL_TEXTURE_BASE_LEVEL, mip);
+
+    for (int level = first ? 0 : streamed.residentMip; level < mip; level++) {
+        if (array) {
+            glTexImage3D(GL_TEXTURE_2D_ARRAY_EXT, level, GL_RGBA8, 0, 0, 0, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        } else {
+            glTexImage2D(tex->textureType, level, GL_RGBA8, 0, 0, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        }
+    }
+
+    residentBytes -= streamed.residentBytes(streamed.residentMip);
+    residentBytes += streamed.residentBytes(mip);
+
+    streamed.residentMip = mip;
+    tex->mipLevels = streamed.mipCount - mip;
+    tex->internalFormat = compressed ? streamed.format : GL_RGBA8;
+    tex->gpuBytes = streamed.residentBytes(mip);
+}
+
+void TextureStreamer::drawDebugView(bool *open) {
+    if (!ImGui::Begin("Texture streaming", open)) {
+        ImGui::End();
+        return;
+    }
+
+    int budgetKB = int(budget / 1024);
+    if (ImGui::SliderInt("Budget (KB)", &budgetKB, 16, 256 * 1024)) {
+        budget = size_t(budgetKB) * 1024;
+    }
+    ImGui::SliderFloat("Mip bias", &mipBias, -2, 4);
+
+    ImGui::Text("Resident: %zuKB of %zuKB", residentBytes / 1024, budget / 1024);
+    ImGui::Text("Evictions: %u (%u this frame)", evictions, lastEvictions);
+    ImGui::Text("Streamed in: %u (%u this frame)", streamedIn, lastStreamedIn);
+    ImGui::Separator();
+
+    for (const StreamedTexture &streamed : textures) {
+        ImGui::Text("%s: mip %d of %d (wants %d), %dx%d, %zuKB, %.0fpx on screen", streamed.texture->fp.c_str(),
+                    streamed.residentMip, streamed.mipCount - 1, streamed.wantedMip,
+                    std::max(1, streamed.width >> streamed.residentMip),
+                    std::max(1, streamed.height >> streamed.residentMip), streamed.texture->gpuBytes / 1024,
+                    std::isinf(streamed.coverage) ? 0.0f : streamed.coverage);
+    }
+
+    ImGui::End();
+}
+
+void TextureStreamer::shutdown() {
+    for (StreamedTexture &streamed : textures) {
+        if (streamed.file) {
+            streamed.file->close();
+            delete streamed.file;
+            streamed.file = nullptr;
+        }
+    }
+    textures.clear();
+    lookup.clear();
+    residentBytes = 0;
+}
+
+void MeshLoader::init() {
+    halfFloats = GLEW_ARB_half_float_vertex || GLEW_VERSION_3_0;
+}
+
+Model *MeshLoader::load(const std::string &path) {
+    double start = glfwGetTime();
+
+    // The cooked version is only used if it's newer than the source.
+    std::string cooked = path;
+    if (!endsWith(path, COOKED_MESH_EXT) && preferCooked) {
+        std::error_code cookedErr, sourceErr;
+        auto cookedTime = std::filesystem::last_write_time(cookedMeshPath(path), cookedErr);
+        auto sourceTime = std::filesystem::last_write_time(path, sourceErr);
+        if (!cookedErr && (sourceErr || cookedTime >= sourceTime)) {
+            cooked = cookedMeshPath(path);
+        }
+    }
+
+    Model *model = nullptr;
+    size_t bytes = 0;
+    MeshFile file;
+    if (endsWith(cooked, COOKED_MESH_EXT)) {
+        MappedFile mapped;
+        if (mapped.open(cooked) && file.open(mapped)) {
+            model = upload(file);
+            bytes = mapped.size;
+            if (model && keepTriangles) {
+                file.readTriangles(model->positions, model->triangles); // While it's still mapped
+            }
+        } else {
+            std::cerr << "[ERROR]: Failed to load cooked mesh " << cooked << std::endl;
+        }
+        mapped.close();
+    }
+
+    // Also when the cooked version can't be used here (e.g. half floats on a driver without them).
+    if (!model && !endsWith(path, COOKED_MESH_EXT)) {
+        cooked = path;
+        ImportedMesh imported;
+        if (!importMesh(path, imported)) {
+            std::cerr << "[ERROR]: Failed to import mesh " << path << std::endl;
+            return nullptr;
+        }
+
+        // Goes through the exact same path as a cooked file, just from memory.
+        MeshData data = processMesh(imported, halfFloats);
+        std::vector<unsigned char> serialized = serializeMesh(data);
+        if (serialized.empty() || !file.open(serialized.data(), serialized.size())) {
+            std::cerr << "[ERROR]: Failed to import mesh " << path << std::endl;
+            return nullptr;
+        }
+
+        model = upload(file);
+        bytes = serialized.size();
+        stats.imported++;
+        if (model && keepTriangles) {
+            file.readTriangles(model->positions, model->triangles);
+        }
+
+        if (model && cacheImports) {
+            std::error_code err;
+            std::filesystem::create_directories(COOKED_MESH_DIR, err);
+            std::ofstream out(cookedMeshPath(path), std::ios::binary);
+            out.write((const char *) serialized.data(), serialized.size());
+        }
+    }
+
+    if (!model) {
+        std::cerr << "[ERROR]: Mesh " << cooked << " can't be used on this driver" << std::endl;
+        return nullptr;
+    }
+
+    double ms = (glfwGetTime() - start) * 1000.0;
+    stats.loaded++;
+    stats.bytes += bytes;
+    stats.ms += ms;
+    models.push_back(model);
+
+    std::cout << "Loaded mesh " << cooked << " (" << model->count() / 3 << " triangles, " << bytes / 1024.0
+              << " KB, " << ms << "ms)" << std::endl;
+    return model;
+}
+
+Model *MeshLoader::upload(const MeshFile &file) {
+    const MeshFileHeader &header = *file.header;
+
+    // Locations from INSTANCE_ATTRIB on are taken by the per-instance attributes.
+    if (header.attributeCount > INSTANCE_ATTRIB) {
+        return nullptr;
+    }
+
+    VBLayout layout;
+    layout.strides.assign(header.streamCount, 0);
+    for (uint32_t i = 0; i < header.attributeCount; i++) {
+        const VertexAttribute &attrib = header.attributes[i];
+        if (attrib.type == GL_HALF_FLOAT && !halfFloats) {
+            return nullptr; // Cooked with --compact, re-import without it
+        }
+
+        layout.attribs.push_back({GLint(attrib.count), attrib.type, GLboolean(attrib.normalized),
+                                  GLsizei(attrib.offset), attrib.stream});
+    }
+
+    if (pooled) {
+        return addToPool(file, layout);
+    }
+
+    auto *model = new Model();
+    std::vector<const VertexBuffer *> streams;
+    for (uint32_t i = 0; i < header.streamCount; i++) {
+        layout.strides[i] = header.streams[i].stride;
+
+        // Straight from the mapping, no copies on our side.
+        auto *stream = new VertexBuffer(header.streams[i].size, file.stream(i), GL_STATIC_DRAW);
+        if (i == 0) {
+            model->vbo = stream;
+        } else {
+            model->extraStreams.push_back(stream);
+        }
+        streams.push_back(stream);
+    }
+
+    model->ibo = new IndexBuffer(header.indexCount, header.indexType, file.indices(), GL_STATIC_DRAW);
+    model->vao = new VertexArray();
+    model->drawMode = header.drawMode;
+    model->boundsMin = glm::vec3(header.boundsMin[0], header.boundsMin[1], header.boundsMin[2]);
+    model->boundsMax = glm::vec3(header.boundsMax[0], header.boundsMax[1], header.boundsMax[2]);
+
+    VertexBuffer::setLayout(layout, *model->vao, streams);
+    model->vao->unbind();
+    addLODs(model, header, 0);
+    return model;
+}
+
+Model *MeshLoader::addToPool(const MeshFile &file, const VBLayout &layout) {
+    const MeshFileHeader &header = *file.header;
+
+    MeshPool *pool = nullptr;
+    for (MeshPool *candidate : pools) {
+        if (candidate->accepts(layout, header.drawMode)) {
+            pool = candidate;
+            break;
+        }
+    }
+    if (!pool) {
+        pool = new MeshPool(layout, header.drawMode);
+        pools.push_back(pool);
+    }
+
+    auto *model = new Model();
+    model->ibo = pool->ibo;
+    model->vao = pool->vao;
+    model->drawMode = header.drawMode;
+    model->vbo = pool->streams[0];
+    model->extraStreams.assign(pool->streams.begin() + 1, pool->streams.end());
+    model->boundsMin = glm::vec3(header.boundsMin[0], header.boundsMin[1], header.boundsMin[2]);
+    model->boundsMax = glm::vec3(header.boundsMax[0], header.boundsMax[1], header.boundsMax[2]);
+    model->pool = pool;
+    addLODs(model, header, pool->add(file));
+    return model;
+}
+
+void MeshLoader::addLODs(Model *model, const MeshFileHeader &header, GLuint base) {
+    model->firstIndex = base + header.lods[0].firstIndex;
+    model->indexCount = GLsizei(header.lods[0].indexCount);
+    model->lodError = header.lods[0].error;
+
+    for (uint32_t level = 1; level < header.lodCount; level++) {
+        auto *lod = new Model(*model); // Same buffers, bounds and pool
+        lod->lods.clear();             // Only the full model has the chain
+        lod->firstIndex = base + header.lods[level].firstIndex;
+        lod->indexCount = GLsizei(header.lods[level].indexCount);
+        lod->lodError = header.lods[level].error;
+        model->lods.push_back(lod);
+    }
+}
+
+void MeshLoader::update() {
+    for (MeshPool *pool : pools) {
+        if (pool->dirty) {
+            pool->upload();
+        }
+    }
+}
+
+double MeshLoader::throughput() const {
+    return stats.ms > 0 ? stats.bytes / (1024.0 * 1024.0) / (stats.ms / 1000.0) : 0;
+}
+
+void MeshLoader::release() {
+    for (Model *model : models) {
+        for (Model *lod : model->lods) {
+            delete lod; // Only the struct, the buffers are the model's
+        }
+
+        if (model->pool) {
+            delete model; // The buffers belong to the pool
+            continue;
+        }
+
+        delete model->ibo;
+        delete model->vao;
+        delete model->vbo;
+        for (VertexBuffer *stream : model->extraStreams) {
+            delete stream;
+        }
+        delete model;
+    }
+    models.clear();
+
+    for (MeshPool *pool : pools) {
+        delete pool->ibo;
+        delete pool->vao;
+        for (VertexBuffer *stream : pool->streams) {
+            delete stream;
+        }
+        delete pool;
+    }
+    pools.clear();
+}
+
+GLsizei Model::count() const {
+    return indexCount > 0 ? indexCount : ibo->count;
+}
+
+const GLvoid *Model::indexOffset() const {
+    size_t indexSize = ibo->type == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+    return (const GLvoid *) (uintptr_t(firstIndex) * indexSize);
+}
+
+MeshPool::MeshPool(const VBLayout &vertexLayout, GLenum mode) : layout(vertexLayout), drawMode(mode) {
+    vao = new VertexArray();
+    std::vector<const VertexBuffer *> bound;
+    for (size_t i = 0; i < layout.strides.size(); i++) {
+        streams.push_back(new VertexBuffer(0, nullptr, GL_STATIC_DRAW));
+        bound.push_back(streams.back());
+    }
+    vertices.resize(streams.size());
+
+    ibo = new IndexBuffer(0, GL_UNSIGNED_SHORT, nullptr, GL_STATIC_DRAW);
+    VertexBuffer::setLayout(layout, *vao, bound);
+    vao->unbind();
+}
+
+bool MeshPool::accepts(const VBLayout &vertexLayout, GLenum mode) const {
+    if (mode != drawMode || vertexLayout.strides != layout.strides ||
+        vertexLayout.attribs.size() != layout.attribs.size()) {
+        return false;
+    }
+
+    for (size_t i = 0; i < layout.attribs.size(); i++) {
+        const VBAttribute &a = layout.attribs[i];
+        const VBAttribute &b = vertexLayout.attribs[i];
+        if (a.count != b.count || a.type != b.type || a.normalized != b.normalized || a.pointer != b.pointer ||
+            a.stream != b.stream) {
+            return false;
+        }
+    }
+    return true;
+}
+
+GLuint MeshPool::add(const MeshFile &file) {
+    const MeshFileHeader &header = *file.header;
+    for (size_t i = 0; i < streams.size(); i++) {
+        const unsigned char *data = file.stream(i);
+        vertices[i].insert(vertices[i].end(), data, data + size_t(header.streams[i].stride) * header.vertexCount);
+    }
+
+    auto first = GLuint(indices.size());
+    const unsigned char *src = file.indices();
+    for (uint32_t i = 0; i < header.indexCount; i++) {
+        GLuint index;
+        if (header.indexType == MESH_INDEX_16) {
+            GLushort shortIndex;
+            std::memcpy(&shortIndex, src + i * sizeof(GLushort), sizeof(GLushort));
+            index = shortIndex;
+        } else {
+            std::memcpy(&index, src + i * sizeof(GLuint), sizeof(GLuint));
+        }
+        indices.push_back(vertexCount + index);
+    }
+
+    vertexCount += header.vertexCount;
+    dirty = true;
+    return first;
+}
+
+void MeshPool::upload() {
+    for (size_t i = 0; i < streams.size(); i++) {
+        streams[i]->bind();
+        glBufferData(GL_ARRAY_BUFFER, vertices[i].size(), vertices[i].data(), GL_STATIC_DRAW);
+    }
+
+    // Same rule as the IndexBuffer constructor, over the whole pool.
+    ibo->bind();
+    if (vertexCount <= 0xFFFFu) {
+        std::vector<GLushort> shorts(indices.begin(), indices.end());
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, shorts.size() * sizeof(GLushort), shorts.data(), GL_STATIC_DRAW);
+        ibo->type = GL_UNSIGNED_SHORT;
+    } else {
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+        ibo->type = GL_UNSIGNED_INT;
+    }
+    ibo->count = indices.size();
+
+    dirty = false;
+}
+
+static_assert(sizeof(ChunkVertex) == 8, "ChunkVertex has to match the layout in VoxelRenderer::init()");
+
+void VoxelRenderer::init(unsigned threads) {
+    layout = VBLayout();
+    layout.addAttribute(3, GL_UNSIGNED_BYTE, GL_FALSE); // Position in the chunk
+    layout.addAttribute(2, GL_UNSIGNED_BYTE, GL_FALSE); // Texture coordinates, repeating every block
+    mesher.init(threads);
+}
+
+void VoxelRenderer::update(Renderer &rend) {
+    for (const ChunkCoord &coord : world.dirty) {
+        mesher.submit(world, coord);
+    }
+    world.dirty.clear();
+
+    mesher.collect(results);
+    for (const ChunkMeshResult &result : results) {
+        upload(rend, result);
+    }
+    results.clear();
+}
+
+void VoxelRenderer::finish(Renderer &rend) {
+    update(rend);
+    while (mesher.pending() > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        update(rend);
+    }
+}
+
+void VoxelRenderer::shutdown(Renderer &rend) {
+    mesher.shutdown();
+    while (!meshed.empty()) {
+        release(rend, meshed.begin()->first);
+    }
+}
+
+void VoxelRenderer::upload(Renderer &rend, const ChunkMeshResult &result) {
+    const Chunk *chunk = world.find(result.coord);
+    if (!chunk || chunk->version != result.version) {
+        stats.stale++; // The newer version is already queued
+        return;
+    }
+
+    release(rend, result.coord);
+    stats.remeshed++;
+    if (result.mesh.indices.empty()) {
+        return; // All air, or buried
+    }
+
+    const ChunkMeshData &mesh = result.mesh;
+    auto *model = new Model();
+    model->vbo = new VertexBuffer(mesh.vertices.size() * sizeof(ChunkVertex), mesh.vertices.data(), GL_STATIC_DRAW);
+    model->ibo = new IndexBuffer(GLsizei(mesh.indices.size()), mesh.indices.data(), GL_STATIC_DRAW);
+    model->vao = new VertexArray();
+    model->drawMode = GL_TRIANGLES;
+    model->boundsMin = glm::vec3(mesh.boundsMin[0], mesh.boundsMin[1], mesh.boundsMin[2]);
+    model->boundsMax = glm::vec3(mesh.boundsMax[0], mesh.boundsMax[1], mesh.boundsMax[2]);
+
+    VertexBuffer::setLayout(layout, *model->vao, {model->vbo});
+    model->vao->unbind();
+
+    GameObject obj = material;
+    obj.model = model;
+    obj.transforms = glm::translate(glm::mat4(1.0f), origin + glm::vec3(result.coord.x, result.coord.y,
+                                                                        result.coord.z) * float(CHUNK_SIZE));
+
+    size_t bytes = mesh.vertices.size() * sizeof(ChunkVertex) +
+                   mesh.indices.size() * (model->ibo->type == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint));
+    meshed[result.coord] = {rend.addGameObject("", obj, flags), model, bytes};
+    stats.chunks++;
+    stats.bytes += bytes;
+}
+
+void VoxelRenderer::release(Renderer &rend, const ChunkCoord &coord) {
+    auto it = meshed.find(coord);
+    if (it == meshed.end()) {
+        return;
+    }
+
+    Model *model = it->second.model;
+    stats.chunks--;
+    stats.bytes -= it->second.bytes;
+
+    rend.removeGameObject(it->second.handle);
+    model->vbo->destroy();
+    model->ibo->destroy();
+    model->vao->destroy();
+    delete model->vbo;
+    delete model->ibo;
+    delete model->vao;
+    delete model;
+    meshed.erase(it);
+}
@@ -19,9 +19,37 @@
 #include <fstream>
 #include <vector>
 #include <string>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <unordered_set>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <sstream>
+#include <iomanip>
+#include <filesystem>
+#include <set>
+#include <array>
+#include <tuple>
+#include <cassert>
 
 #include <stdio.h>
 
+#include "cooked.h"
+#include "atlas.h"
+#include "mesh.h"
+#include "meshfile.h"
+#include "meshimport.h"
+#include "culling.h"
+#include "bvh.h"
+#include "occlusion.h"
+#include "voxel.h"
+#include "jobs.h"
+
 #include "glm/glm.hpp"
 #include "glm/gtc/matrix_transform.hpp"
 
@@ -52,11 +80,127 @@ std::unordered_map<std::string, GLuint> SHADER_TYPES = {
         {"geometry-shader", GL_GEOMETRY_SHADER}
 };
 
+/*
+ * Attribute locations are bound before linking so that every program agrees on them.
+ * i_Model is a mat4 and takes up 4 consecutive locations (2, 3, 4, 5).
+ */
+std::unordered_map<std::string, GLuint> ATTRIB_LOCATIONS = {
+        {"coord",    0},
+        {"texCoord", 1},
+        {"i_Model",  2},
+        {"i_Layer",  6}
+};
+
+const GLuint INSTANCE_ATTRIB = 2;
+const GLuint LAYER_ATTRIB = 6;
+
+/*
+ * Every program's "Camera" uniform block is bound to this binding point. The block is updated once per frame
+ * by Renderer::uploadCamera().
+ */
+const char *CAMERA_BLOCK = "Camera";
+const GLuint CAMERA_BLOCK_BINDING = 0;
+
+// Matches the std140 layout of the Camera block in the shaders.
+struct CameraBlock {
+public:
+    glm::mat4 view;
+    glm::mat4 proj;
+    glm::mat4 viewProj;
+};
+
+// FNV-1a, usable at compile time.
+constexpr uint32_t hashString(const char *str) {
+    uint32_t hash = 2166136261u;
+    while (*str) {
+        hash = (hash ^ uint32_t(uint8_t(*str++))) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Uniform names are hashed at compile time, e.g. `constexpr UniformID U_TINT("u_Tint");`
+ * String literals convert implicitly, so there's never a temporary std::string.
+ */
+struct UniformID {
+public:
+    uint32_t hash;
+    const char *name;
+
+    constexpr UniformID(const char *str) : hash(hashString(str)), name(str) {}
+};
+
+constexpr UniformID U_VIEW_PROJ("u_ViewProj");
+
+// 64 bit FNV-1a for runtime data (file contents etc.)
+uint64_t hashBytes(const void *data, size_t len, uint64_t hash = 14695981039346656037ull);
+
+bool readFile(const std::string &path, std::string &out);
+
+// Splits shaders.meta into (key, value) pairs, skipping comments.
+std::vector<std::pair<std::string, std::string>> parseShaderMeta(const std::string &meta);
+
+/*
+ * Inserts `#define NAME 1` for every name right after the #version line (which has to stay first).
+ */
+std::string injectDefines(const std::string &src, const std::vector<std::string> &defines);
+
+const uint32_t MAX_SHADER_FEATURES = 32;
+
+/*
+ * Linked programs are stored here with glGetProgramBinary, keyed by a hash of shaders.meta, the stage sources
+ * and the driver. If the driver rejects a cached binary, the program is silently rebuilt from source.
+ */
+std::string SHADER_CACHE_DIR = "./shadercache";
+
+struct ShaderCacheStats {
+public:
+    unsigned hits = 0;
+    unsigned misses = 0;
+    unsigned rejected = 0; // Cached binaries the driver didn't accept
+    double loadTime = 0;   // Total time spent building programs, in milliseconds
+};
+
+ShaderCacheStats shaderCacheStats;
+
+struct ShaderStage {
+public:
+    std::string type;
+    std::string path;
+    std::string src;
+};
+
+enum ShaderState {
+    SHADER_COMPILING,
+    SHADER_LINKING,
+    SHADER_READY,
+    SHADER_FAILED
+};
+
+class ShaderPermutations;
+
+struct UniformSlot {
+public:
+    uint32_t hash;
+    GLint location;
+    GLenum type;
+    GLint size;
+};
+
 std::unordered_map<GLenum, GLsizei> SIZES = {
-        {GL_FLOAT,        sizeof(GLfloat)},
-        {GL_UNSIGNED_INT, sizeof(GLuint)}
+        {GL_FLOAT,          sizeof(GLfloat)},
+        {GL_HALF_FLOAT,     sizeof(GLhalf)},
+        {GL_BYTE,           sizeof(GLbyte)},
+        {GL_UNSIGNED_BYTE,  sizeof(GLubyte)},
+        {GL_SHORT,          sizeof(GLshort)},
+        {GL_UNSIGNED_SHORT, sizeof(GLushort)},
+        {GL_INT,            sizeof(GLint)},
+        {GL_UNSIGNED_INT,   sizeof(GLuint)}
 };
 
+// These pack all 4 components into one 32 bit word, so they aren't in SIZES.
+bool isPackedVertexType(GLenum type);
+
 glm::mat4 IDENTITY_MAT4 = glm::mat4(1.0f);
 
 double pi = atan(1) * 4;
@@ -66,30 +210,182 @@ public:
     GLint count;
     GLenum type;
     GLboolean normalized;
-    GLsizei pointer;
+    GLsizei pointer; // Offset into its stream
+    GLuint stream = 0;
 };
 
-class ShaderProgram {
+const GLuint UNKNOWN_BINDING = 0xFFFFFFFFu;
+const GLuint MAX_TEXTURE_UNITS = 32;
+
+/*
+ * Mirror of the GL state we touch. Every bind/enable goes through here and is only forwarded to GL if it
+ * actually changes something. invalidate() forgets everything (use it after code that touches GL directly).
+ */
+class GLStateCache {
 public:
+    GLuint program = UNKNOWN_BINDING;
+    GLuint vertexArray = UNKNOWN_BINDING;
+    GLuint arrayBuffer = UNKNOWN_BINDING;
+    GLuint elementBuffer = UNKNOWN_BINDING; // Part of the VAO state, so it's also remembered per VAO.
+    std::unordered_map<GLuint, GLuint> vaoElementBuffers;
 
-    std::unordered_map<std::string, GLint> uniforms = {};
-    GLuint id;
+    GLuint activeUnit = UNKNOWN_BINDING;
+    GLenum textureTargets[MAX_TEXTURE_UNITS] = {};
+    GLuint textures[MAX_TEXTURE_UNITS] = {};
+
+    std::unordered_map<GLenum, bool> capabilities;
+    GLenum blendSrc = 0, blendDst = 0, blendEquation = 0;
+    GLenum depthFunc = 0, cullFace = 0, frontFace = 0;
+
+    // Counters for the current frame, and the totals of the last finished one.
+    unsigned issued = 0;
+    unsigned skipped = 0;
+    unsigned lastIssued = 0;
+    unsigned lastSkipped = 0;
 
+    GLStateCache();
+
+    void invalidate();
+
+    void endFrame();
+
+    void useProgram(GLuint id);
+
+    void bindVertexArray(GLuint id);
+
+    void bindBuffer(GLenum target, GLuint id);
+
+    void activeTexture(GLuint unit);
+
+    void bindTexture(GLuint unit, GLenum target, GLuint id);
+
+    void setCapability(GLenum cap, bool enabled);
+
+    void setBlendFunc(GLenum src, GLenum dst);
+
+    void setBlendEquation(GLenum mode);
+
+    void setDepthFunc(GLenum func);
+
+    void setCullFace(GLenum mode);
+
+    void setFrontFace(GLenum mode);
+
+    void deleteProgram(GLuint id);
+
+    void deleteVertexArray(GLuint id);
+
+    void deleteBuffer(GLuint id);
+
+    void deleteTexture(GLuint id);
+
+private:
+    bool changed(GLuint &cached, GLuint value);
+};
+
+GLStateCache glState;
+
+class ShaderProgram {
+public:
+
+    std::vector<UniformSlot> uniforms; // Sorted by hash, filled in right after linking.
+    GLuint id = 0;
+    GLuint cameraBlock = GL_INVALID_INDEX;
+
+    std::vector<ShaderStage> stages;
+    std::vector<std::string> features; // Feature keywords declared in shaders.meta, bit i is features[i]
+    uint32_t featureMask = 0;
+    ShaderPermutations *permutations = nullptr; // Set if this program is a variant owned by a ShaderPermutations
+    std::vector<GLuint> pendingShaders; // One per stage (0 if it couldn't be created) until linking is done.
+    ShaderState state = SHADER_FAILED;
+    std::string profilePath;
+    std::string cacheFile;
+    uint64_t sourceHash = 0;
+    bool fromCache = false;
+    double startTime = 0;
+    double loadTime = 0; // In milliseconds
+
+    ShaderProgram() = default;
+
+    // Blocks until the program is linked. Use a ShaderBatch to build several programs at once.
     explicit ShaderProgram(const std::string &path);
 
+    void begin(const std::string &path, uint32_t featureMask = 0);
+
+    bool poll();
+
+    void finish();
+
+    bool loadSources(const std::string &path, uint32_t mask);
+
+    bool isComplete(GLuint object, bool program) const;
+
+    void link();
+
+    void done(bool success);
+
+    bool loadBinary(const std::string &cacheFile);
+
+    void saveBinary(const std::string &cacheFile);
+
     void bind() const;
 
     void unbind() const;
 
-    GLint getUniformLoc(const std::string &name);
+    void enumerateUniforms();
+
+    GLint getUniformLoc(UniformID name);
 
-    void setUniform1i(const std::string &name, int v);
+    void setUniform1i(UniformID name, int v);
 
-    void setUniform4f(const std::string &name, float f0, float f1, float f2, float f3);
+    void setUniform4f(UniformID name, float f0, float f1, float f2, float f3);
 
-    void setUniformMat4f(const std::string &name, glm::mat4 &mat4, GLboolean transpose = GL_FALSE);
+    void setUniformMat4f(UniformID name, const glm::mat4 &mat4, GLboolean transpose = GL_FALSE);
 
-    GLuint compileShader(const std::string &type, const std::string &src, const std::string &fullpath);
+    GLuint startShader(const ShaderStage &stage);
+
+    bool checkShader(GLuint shader, const ShaderStage &stage);
+
+    void destroy();
+};
+
+/*
+ * Starts compiling every added program right away without waiting on any of them, so the driver can work on
+ * all of them at the same time (especially with KHR_parallel_shader_compile). poll() never blocks in that case.
+ */
+class ShaderBatch {
+public:
+    std::vector<ShaderProgram *> programs;
+    unsigned ready = 0;
+    unsigned failed = 0;
+    double startTime = 0;
+    double time = 0; // Milliseconds until the whole batch was done
+
+    void add(ShaderProgram &program, const std::string &path, uint32_t featureMask = 0);
+
+    bool poll();
+
+    void finish();
+};
+
+/*
+ * Builds specialized variants of a shader directory. shaders.meta declares feature keywords
+ * (`feature: GREYSCALE`), and each variant is compiled with `#define`s for the features in its bitmask,
+ * so there's no branching on uniforms at runtime. Variants are built on demand and cached by bitmask.
+ * The variants are owned here: Renderer::quit() destroys every ShaderPermutations its objects use, ones that no
+ * object uses have to be destroy()ed before that.
+ */
+class ShaderPermutations {
+public:
+    std::string path;
+    std::vector<std::string> features;
+    std::unordered_map<uint32_t, ShaderProgram *> variants;
+
+    explicit ShaderPermutations(const std::string &path);
+
+    uint32_t feature(const std::string &name) const;
+
+    ShaderProgram *get(uint32_t mask, ShaderBatch *batch = nullptr);
 
     void destroy();
 };
@@ -98,9 +394,13 @@ class IndexBuffer {
 public:
     GLuint id;
     GLsizei count;
+    GLenum type = GL_UNSIGNED_INT; // GL_UNSIGNED_SHORT if every index fits
 
     IndexBuffer(GLsizei count, const GLuint *data, GLenum usage);
 
+    // Uploads data as-is, e.g. straight out of a mapped mesh file. type is GL_UNSIGNED_SHORT or GL_UNSIGNED_INT.
+    IndexBuffer(GLsizei count, GLenum type, const GLvoid *data, GLenum usage);
+
     void bind() const;
 
     void unbind() const;
@@ -108,14 +408,30 @@ public:
     void destroy();
 };
 
+/*
+ * Attribute i of the layout goes to location i. Attributes can be split over several vertex streams (buffers),
+ * e.g. positions in stream 0 and everything else in stream 1, so passes that only need positions read less.
+ * Every attribute starts 4-byte aligned.
+ */
 class VBLayout {
 public:
     std::vector<VBAttribute> attribs;
-    GLsizei stride = 0;
+    std::vector<GLsizei> strides = {0}; // One per stream
 
     VBLayout() = default;
 
-    void addAttribute(GLint count, GLenum type, GLboolean normalized);
+    void addAttribute(GLint count, GLenum type, GLboolean normalized, GLuint stream = 0);
+
+    GLsizei vertexSize() const; // Of all streams together
+
+    /*
+     * Converts float vertices (`floatStride` floats each) into this layout, one buffer per stream. The float
+     * vertices have the same attributes in the same order, with `count` floats each.
+     */
+    std::vector<std::vector<unsigned char>> quantize(const float *vertices, size_t vertexCount,
+                                                     size_t floatStride) const;
+
+    std::vector<VertexAttribute> attributes() const;
 };
 
 class VertexArray {
@@ -131,17 +447,43 @@ public:
     void destroy();
 };
 
+enum TextureState {
+    TEXTURE_PENDING,   // Waiting for (or being decoded by) a TextureLoader worker. The placeholder is bound.
+    TEXTURE_UPLOADING, // Decoded, being uploaded a few rows per frame.
+    TEXTURE_READY,
+    TEXTURE_FAILED
+};
+
 class Texture {
 public:
     GLenum textureType;
     GLuint id;
-    GLuint slot;
+    GLuint slot = 0;
     std::string fp;
+    std::unordered_map<GLenum, GLint> params;
     unsigned char *localBuf;
     int width, height, bits;
 
+    TextureState state = TEXTURE_READY;
+    bool mipmapsRequested = false;
+    GLint mipLevels = 1; // More than 1 if a full mip chain was loaded (cooked textures)
+    GLenum internalFormat = GL_RGBA8;
+    size_t gpuBytes = 0; // Size of every level as stored on the GPU
+    size_t rawBytes = 0; // What it would have been as RGBA8
+
+    // Timings of the last load in milliseconds (requestTime is in seconds). Only filled in by the TextureLoader.
+    double requestTime = 0;
+    double decodeTime = 0;
+    double uploadTime = 0;
+    double loadTime = 0;
+
     explicit Texture(const std::string &path, GLenum type, GLint lod, GLint border);
 
+    // Creates a texture with just the placeholder image. Used by the TextureLoader.
+    explicit Texture(GLenum type);
+
+    bool loadCooked(const std::string &path, GLint border);
+
     void genMipmaps();
 
     void setRenderHints(std::unordered_map<GLenum, GLint> hints);
@@ -153,6 +495,70 @@ public:
     void unbind() const;
 };
 
+struct DecodedImage {
+public:
+    Texture *texture;
+    unsigned char *pixels; // From stbi_load
+    MappedFile *file;      // Cooked textures are mapped instead of decoded
+    CookedTexture cooked;
+    std::vector<std::vector<unsigned char>> levels; // Compressed (or decompressed) on the worker
+    uint32_t format;
+    int width, height;
+    int mipCount;
+    double decodeTime;
+    int uploadedLevels;
+    int uploadedRows;
+
+    void levelSize(int level, int &w, int &h) const;
+
+    const unsigned char *levelPixels(int level) const;
+
+    void release();
+};
+
+/*
+ * Decodes textures on a pool of worker threads. update() has to be called on the GL thread once per frame;
+ * it uploads at most uploadBudget bytes through a pixel buffer object, so a big texture is spread across frames.
+ * Textures show a placeholder until they're READY.
+ */
+class TextureLoader {
+public:
+    std::vector<std::thread> workers;
+    std::deque<std::pair<Texture *, std::string>> requests;
+    std::deque<DecodedImage> decoded; // Finished by the workers, not uploaded yet
+    std::deque<DecodedImage> uploads; // Only touched by the GL thread
+    std::mutex lock;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    GLuint pixelBuffer = 0;
+    GLsizeiptr uploadBudget = 1024 * 1024;
+    bool preferCooked = true; // Load from COOKED_TEXTURE_DIR instead if there's a cooked version of the image
+    bool compressOnLoad = false; // Build mips and block-compress plain images on the workers
+    bool compression = false;    // EXT_texture_compression_s3tc, compressed textures are decompressed without it
+
+    size_t bytesSaved = 0;
+    unsigned pending = 0; // Requested but not READY/FAILED yet
+    unsigned loaded = 0;
+    unsigned failed = 0;
+
+    void init(unsigned threads = 0);
+
+    void request(Texture &tex, const std::string &path);
+
+    void update();
+
+    void shutdown();
+
+private:
+    void work();
+
+    void uploadRows(Texture *tex, uint32_t format, GLint level, GLint row, GLsizei width, GLsizei height,
+                    GLsizei rows, const unsigned char *src);
+
+    void finish(DecodedImage &image);
+};
+
 class VertexBuffer {
 public:
     GLuint id;
@@ -165,6 +571,9 @@ public:
 
     void setLayout(VBLayout layout, VertexArray vertArr);
 
+    // One buffer per stream of the layout. Streams that are null are left disabled (e.g. for a depth-only VAO).
+    static void setLayout(const VBLayout &layout, VertexArray vertArr, const std::vector<const VertexBuffer *> &streams);
+
     void destroy();
 };
 
@@ -185,11 +594,19 @@ public:
 
     glm::mat4 getView();
 
+    // World space ray through a point on the window (in window coordinates, like glfwGetCursorPos).
+    void screenRay(glm::vec2 cursor, const glm::mat4 &proj, glm::vec3 &origin, glm::vec3 &direction);
+
     void look(glm::vec2 amount, float deltaTime);
 
+    // Sets lookAngle (clamped to straight up/down) and the direction vectors that go with it.
+    void setLook(glm::vec2 angle);
+
     void move(float forward, float right, float deltaTime);
 };
 
+class MeshPool;
+
 struct Model {
 public:
     IndexBuffer *ibo;
@@ -198,6 +615,28 @@ public:
 
     // This is just for destroyin'
     VertexBuffer *vbo;
+    std::vector<VertexBuffer *> extraStreams; // If the layout has more than one stream
+
+    // Object space bounds
+    glm::vec3 boundsMin = glm::vec3(-0.5f);
+    glm::vec3 boundsMax = glm::vec3(0.5f);
+
+    // The part of the IBO this model draws. Models in a MeshPool share their buffers.
+    GLuint firstIndex = 0;
+    GLsizei indexCount = 0; // 0 for the whole IBO
+    MeshPool *pool = nullptr;
+
+    // Coarser levels of detail over the same buffers (lods[0] is level 1), each a Model of its own.
+    std::vector<Model *> lods;
+    float lodError = 0; // How far this level is from the full mesh, in object units
+
+    // CPU copy of the triangles (xyz positions), for models drawn as occluders. Empty if not kept.
+    std::vector<float> positions;
+    std::vector<uint32_t> triangles;
+
+    GLsizei count() const;
+
+    const GLvoid *indexOffset() const; // For glDrawElements
 };
 
 struct GameObject {
@@ -207,6 +646,402 @@ public:
     Texture *texture;
 
     glm::mat4 transforms = glm::mat4(1.0f);
+    uint32_t features = 0; // Shader variant to use, if the shader comes from a ShaderPermutations
+    float layer = 0;       // Layer to sample if the texture is an array texture
+};
+
+enum ObjectFlags : uint32_t {
+    OBJECT_VISIBLE = 1u << 0u,
+    OBJECT_STATIC = 1u << 1u, // Never moves after it's added, so its bounds are never refitted
+    OBJECT_OCCLUDER = 1u << 2u // Rasterized into the occlusion buffer, should be big and have few triangles
+};
+
+/*
+ * Handles stay valid until the object is removed. A removed slot gets its generation bumped so stale
+ * handles can be detected. Generations start at 1, so a zeroed handle is always invalid.
+ */
+struct ObjectHandle {
+public:
+    uint32_t index = 0;
+    uint32_t generation = 0;
+};
+
+/*
+ * Slot map over GameObjects. The per-object data lives in tightly packed parallel arrays (dense storage)
+ * that can be walked linearly; handles map to dense indices through the slot arrays.
+ * Dense indices are only stable until the next remove() (which swaps the last object into the hole).
+ */
+class GameObjectRegistry {
+public:
+    // Dense storage
+    std::vector<glm::mat4> transforms;
+    std::vector<Model *> models;
+    std::vector<ShaderProgram *> shaders;
+    std::vector<Texture *> textures;
+    std::vector<float> layers;
+    std::vector<uint32_t> flags;
+    std::vector<uint32_t> denseToSlot;
+
+    // Sparse slots
+    std::vector<uint32_t> slotToDense;
+    std::vector<uint32_t> generations;
+    std::vector<uint32_t> freeSlots;
+
+    // Optional names, only for debugging.
+    std::unordered_map<std::string, ObjectHandle> names;
+    std::vector<std::string> slotNames; // By slot, so remove() can drop the name too
+
+
+    ObjectHandle add(const GameObject &obj, uint32_t objFlags = OBJECT_VISIBLE, const std::string &name = "");
+
+    bool remove(ObjectHandle handle);
+
+    bool valid(ObjectHandle handle) const;
+
+    // The handle has to be valid().
+    uint32_t indexOf(ObjectHandle handle) const;
+
+    // The handle has to be valid().
+    glm::mat4 &transform(ObjectHandle handle);
+
+    ObjectHandle find(const std::string &name) const;
+
+    size_t size() const;
+};
+
+const unsigned STREAM_BUFFER_FRAMES = 3;
+
+enum StreamBufferMode {
+    STREAM_PERSISTENT, // ARB_buffer_storage: mapped once, persistent and coherent
+    STREAM_MAPPED,     // ARB_map_buffer_range: an unsynchronized glMapBufferRange per write
+    STREAM_ORPHANED    // Neither (or no ARB_sync): glBufferData(nullptr) every frame, then glBufferSubData
+};
+
+struct StreamBufferStats {
+public:
+    unsigned stalls = 0; // Times the CPU had to wait for the GPU to be done with a region
+    double stallMs = 0;
+    GLsizeiptr frameBytes = 0; // Written during the last frame
+    unsigned grows = 0;
+};
+
+/*
+ * Ring buffer for data that's rewritten every frame (instance transforms, uniforms, particles, UI vertices).
+ * It is split into STREAM_BUFFER_FRAMES regions and each frame writes into the next one. A region is fenced
+ * at endFrame() and only waited on when the ring comes back around to it, so writes never block unless the
+ * CPU gets STREAM_BUFFER_FRAMES frames ahead of the GPU.
+ */
+class StreamBuffer {
+public:
+    GLuint id = 0;
+    GLenum target = GL_ARRAY_BUFFER;
+    StreamBufferMode mode = STREAM_ORPHANED;
+    GLsizeiptr regionSize = 0;
+    GLsizeiptr alignment = 16; // Of every write
+    StreamBufferStats stats;
+
+    void init(GLenum bufferTarget, GLsizeiptr size, GLsizeiptr writeAlignment = 16);
+
+    /*
+     * Makes sure `size` more bytes fit in this frame's region. If they don't, the buffer is replaced with a bigger
+     * one. Offsets handed out earlier in the frame stay valid, but `id` changes, so bind it after writing. Reserving
+     * everything before the first write of the frame avoids copying the frame's data over.
+     */
+    void reserve(GLsizeiptr size);
+
+    // Copies data into this frame's region and returns its offset into the buffer.
+    GLintptr write(const GLvoid *data, GLsizeiptr size);
+
+    // Fences this frame's writes and moves on to the next region. Call after the last draw that reads them.
+    void endFrame();
+
+    const char *modeName() const;
+
+    void destroy();
+
+private:
+    unsigned char *mapped = nullptr; // STREAM_PERSISTENT
+    GLsync fences[STREAM_BUFFER_FRAMES] = {};
+    unsigned frame = 0;
+    GLintptr base = 0; // Start of the current region. Stays where it was if the buffer grows mid-frame
+    GLsizeiptr head = 0; // Into the current region
+    std::vector<unsigned char> shadow; // STREAM_ORPHANED: this frame's writes, to fill the buffer again if it grows
+    GLsizeiptr written = 0; // This frame
+    bool waited = false; // For the current region
+
+    void allocate();
+
+    void waitForRegion();
+};
+
+// A sort key shifted right by this much is just the GL state (see RenderQueue::makeKey).
+const unsigned KEY_STATE_SHIFT = 24;
+
+// GL-free, so any thread can record them.
+struct DrawCommand {
+public:
+    uint64_t key;
+    uint32_t index; // Dense index into the GameObjectRegistry
+    const Model *model; // The object's model, or one of its levels of detail
+};
+
+// Commands [begin, end) of one thread's packet, recorded with orders firstOrder to lastOrder.
+struct PacketRun {
+public:
+    uint64_t firstOrder, lastOrder;
+    size_t begin, end;
+    unsigned thread;
+};
+
+// Layout fixed by ARB_draw_indirect
+struct DrawIndirectCommand {
+public:
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
+};
+
+/*
+ * Objects are submitted every frame and drawn in one go by flush(). Commands are sorted by a packed
+ * state key so that state changes are minimized, and consecutive objects that share a Model are merged
+ * into a single instanced draw call (if ARB_instanced_arrays is available).
+ *
+ * With ARB_multi_draw_indirect, everything with the same state key (e.g. different models in one MeshPool)
+ * goes out in a single glMultiDrawElementsIndirect. Each sub-draw finds its transforms through baseInstance.
+ *
+ * Commands can be recorded from any job thread into that thread's own buffer in `packets`. flush() merges the
+ * buffers and radix sorts them by key, both on the job threads if `jobs` is set, then replays them on the GL thread.
+ * Every command is recorded with an order (e.g. the index of the range of a parallel loop it came from), and the
+ * buffers are merged by it, so which thread recorded what never changes the order of commands with equal keys.
+ */
+class RenderQueue {
+public:
+    std::vector<DrawCommand> commands; // Merged and sorted by flush()
+    std::vector<std::vector<DrawCommand>> packets; // By JobSystem::currentThread()
+    std::vector<std::vector<PacketRun>> packetRuns; // Same, where each order went in the packet
+    JobSystem *jobs = nullptr;
+    std::vector<glm::mat4> instanceTransforms;
+    std::vector<float> instanceLayers; // Stored after the transforms in the instance buffer
+
+    std::vector<DrawIndirectCommand> indirectCommands;
+
+    StreamBuffer instanceStream;
+    StreamBuffer indirectStream;
+    bool instancing = false;
+    bool multiDrawSupported = false;
+    bool multiDraw = false; // Can be switched off to compare against plain draws
+
+    // Statistics from the last flush()
+    unsigned drawCalls = 0;
+    unsigned instances = 0;
+    unsigned plainDrawCalls = 0; // What flush() would have needed without multi-draw
+    unsigned recordThreads = 0;  // Threads that recorded commands
+    double sortMs = 0;           // Merging and sorting them
+
+    // threads is how many threads can record commands.
+    void init(unsigned threads = 1);
+
+    static uint64_t makeKey(const ShaderProgram *shader, const Texture *texture, const Model *model, float depth);
+
+    // From the GL thread.
+    void submit(const GameObjectRegistry &objects, uint32_t index, const Model *model, float depth);
+
+    // From the GL thread. The orders from `first` to `first + count - 1` are free for record().
+    uint64_t reserveOrders(uint64_t count);
+
+    // From any thread, as long as `thread` is the calling thread's JobSystem index. Commands with the same key
+    // are drawn by order, then in the order they were recorded. An order must only be used by one thread.
+    void record(unsigned thread, const DrawCommand &command, uint64_t order);
+
+    void flush(const GameObjectRegistry &objects, const glm::mat4 &viewProj);
+
+    // How many draw calls flush() would need if every visible object was submitted.
+    unsigned countBatches(const GameObjectRegistry &objects) const;
+
+    void destroy();
+
+private:
+    std::vector<DrawCommand> sortScratch;
+    std::vector<std::array<uint32_t, 256>> histograms; // Per range of commands during a radix sort pass
+    std::vector<uint64_t> keyBits;
+    std::vector<PacketRun> mergeRuns;
+    uint64_t nextOrder = 0;
+
+    void forEach(size_t count, size_t grain, const std::function<void(size_t, size_t)> &body);
+
+    void merge();
+
+    void sort();
+};
+
+/*
+ * A texture whose finest mips are uploaded and dropped on demand. Every level stays available on the CPU,
+ * either in the mapped cooked file or in `levels`, so residency can change without touching the disk.
+ */
+struct StreamedTexture {
+public:
+    Texture *texture = nullptr;
+    MappedFile *file = nullptr; // Cooked textures
+    CookedTexture cooked;
+    std::vector<std::vector<unsigned char>> levels; // Everything else. All layers of a level are back to back.
+    uint32_t format = COOKED_RGBA8;
+    int width = 0, height = 0;
+    int layers = 1; // More than 1 for array textures
+    int mipCount = 0;
+
+    int residentMip = 0; // Finest level on the GPU, mipCount if nothing is resident yet
+    int wantedMip = 0;
+    float coverage = 0; // Biggest on-screen size in pixels during the last update
+
+    const unsigned char *levelData(int level) const;
+
+    size_t levelBytes(int level) const;
+
+    // Size on the GPU with every level from `mip` down resident.
+    size_t residentBytes(int mip) const;
+};
+
+/*
+ * Keeps only the mips that are actually visible on the GPU. Every frame, update() estimates how big each
+ * streamed texture gets on screen (from the bounding spheres of the objects queued with it this frame and the FOV
+ * of the projection), then drops the finer mips of textures that don't need them and streams finer mips in, one
+ * level per texture per frame, until everything fits in `budget` bytes. If it doesn't fit, the textures that are
+ * the most oversampled lose a level first.
+ *
+ * Levels keep their numbers and GL_TEXTURE_BASE_LEVEL points at the finest resident one, so a change only
+ * uploads or frees the levels in question. The texture object and the objects' sort keys don't change.
+ */
+class TextureStreamer {
+public:
+    std::vector<StreamedTexture> textures;
+    std::unordered_map<const Texture *, size_t> lookup;
+
+    size_t budget = 64 * 1024 * 1024;
+    size_t uploadBudget = 2 * 1024 * 1024; // Per frame. At least one level is always streamed in.
+    float mipBias = 0; // Positive values pick coarser mips
+
+    // Statistics
+    size_t residentBytes = 0;
+    unsigned evictions = 0;
+    unsigned streamedIn = 0;
+    unsigned lastEvictions = 0; // During the last update()
+    unsigned lastStreamedIn = 0;
+
+    // A cooked texture (.gltx) or an image. Only the coarsest mip is uploaded straight away.
+    bool add(Texture &tex, const std::string &path);
+
+    // A whole mip chain with all layers of a level back to back (like TextureAtlas::levels).
+    void add(Texture &tex, std::vector<std::vector<unsigned char>> levels, uint32_t format, int width, int height,
+             int layers);
+
+    // Before queue.flush(), the commands recorded this frame are what's visible.
+    void update(const GameObjectRegistry &objects, const RenderQueue &queue, const glm::mat4 &view,
+                const glm::mat4 &proj, int viewportHeight);
+
+    void drawDebugView(bool *open = nullptr);
+
+    void shutdown();
+
+private:
+    void track(StreamedTexture &&streamed);
+
+    void setResidency(StreamedTexture &streamed, int mip);
+};
+
+struct MeshLoadStats {
+    unsigned loaded = 0;
+    unsigned imported = 0; // Had no cooked version and went through the importer
+    size_t bytes = 0; // Vertex and index data uploaded
+    double ms = 0;
+};
+
+/*
+ * Static meshes with the same vertex layout packed into one set of buffers, so they share a VAO and an IBO
+ * and the render queue can draw all of them with one multi-draw. Indices are rebased onto the pool's vertices
+ * when a mesh is added, so pooled models draw with a plain glDrawElements too.
+ *
+ * The pool keeps a CPU copy of its contents and uploads all of it again if it changed, so meshes are cheap
+ * to add at load time but shouldn't be added every frame.
+ */
+class MeshPool {
+public:
+    VBLayout layout;
+    VertexArray *vao;
+    IndexBuffer *ibo;
+    std::vector<VertexBuffer *> streams;
+    GLuint vertexCount = 0;
+    bool dirty = false;
+
+    explicit MeshPool(const VBLayout &vertexLayout, GLenum mode);
+
+    bool accepts(const VBLayout &vertexLayout, GLenum drawMode) const;
+
+    // Returns the index of the mesh's first index in the pool.
+    GLuint add(const MeshFile &file);
+
+    void upload();
+
+private:
+    GLenum drawMode = GL_TRIANGLES;
+    std::vector<std::vector<unsigned char>> vertices; // One per stream
+    std::vector<GLuint> indices;
+};
+
+/*
+ * Loads meshes into Models. Cooked meshes (.glmesh, see meshfile.h) are memory-mapped and their streams go
+ * straight to glBufferData with no parsing or copying. For an .obj/.gltf/.glb the cooked version in COOKED_MESH_DIR
+ * is used if there is one (`make import_meshes`); otherwise it is imported on the spot and cached there.
+ */
+class MeshLoader {
+public:
+    std::vector<Model *> models;
+    bool preferCooked = true;
+    bool cacheImports = true;
+    bool halfFloats = false; // Import with half float positions. Set by init() if the driver has them.
+    bool pooled = true; // Put meshes in MeshPools instead of buffers of their own
+    bool keepTriangles = true; // Fill in Model::positions/triangles, so the model can be an occluder
+    std::vector<MeshPool *> pools;
+    MeshLoadStats stats;
+
+    void init();
+
+    Model *load(const std::string &path);
+
+    // Uploads pools that changed since the last call.
+    void update();
+
+    // MB/s over everything loaded so far
+    double throughput() const;
+
+    // Only deletes the Model structs; Renderer::quit() destroys the GL objects.
+    void release();
+
+private:
+    Model *upload(const MeshFile &file);
+
+    Model *addToPool(const MeshFile &file, const VBLayout &layout);
+
+    // Sets the model's range to LOD 0 and adds the coarser levels. `base` is where the file's indices start.
+    void addLODs(Model *model, const MeshFileHeader &header, GLuint base);
+};
+
+struct LODStats {
+public:
+    unsigned reduced = 0;   // Objects drawn with a coarser level than LOD 0
+    unsigned triangles = 0; // Of everything submitted, at full detail
+    unsigned drawn = 0;     // ...and with the levels that were picked
+};
+
+struct CullStats {
+public:
+    unsigned tested = 0;
+    unsigned visible = 0;
+    unsigned culled = 0;
+    unsigned occluded = 0; // Part of culled
+    double ms = 0;
+    double treeMs = 0; // Refitting/rebuilding the BVHs
 };
 
 class Renderer {
@@ -214,7 +1049,39 @@ public:
     glm::mat4 view = glm::mat4(1.0f);
     glm::mat4 proj = glm::mat4(1.0f);
     GLFWwindow *window;
-    std::unordered_map<std::string, GameObject *> gameObjects;
+    GameObjectRegistry objects;
+    RenderQueue queue;
+    TextureLoader textures;
+    TextureStreamer streamer;
+    MeshLoader meshes;
+
+    StreamBuffer cameraStream;
+    bool uniformBuffers = false;
+
+    // Objects outside the view frustum (of proj * view) aren't submitted.
+    bool culling = true;
+    bool hierarchicalCulling = true; // Through the BVHs rather than testing every object
+    CullStats cullStats; // Last frame
+
+    // Bounds of every object by slot. OBJECT_STATIC objects live in staticTree, which only changes when objects
+    // are added or removed; the rest are refitted every frame.
+    BVH staticTree;
+    BVH dynamicTree;
+
+    // Objects that passed frustum culling but are hidden behind OBJECT_OCCLUDERs aren't submitted either.
+    bool occlusionCulling = true;
+    OcclusionBuffer occlusion;
+
+    // Models with levels of detail are drawn with the coarsest one whose error is at most lodThreshold pixels.
+    bool levelOfDetail = true;
+    float lodThreshold = 1.0f;
+    float lodHysteresis = 0.75f; // Only go coarser once the error is this far below the threshold, so it doesn't pop
+    LODStats lodStats; // Last frame
+
+    // Bounds, culling, occlusion tests and building the draw list are split into jobs over every core. Only the
+    // GL calls (and the parts that share one structure, like refitting a BVH) stay on the calling thread.
+    JobSystem jobs;
+    bool parallel = true; // Off runs every phase on the calling thread, for comparison
 
     bool init(const char *title, int x, int y, GLFWmonitor *monitor = nullptr, GLFWwindow *share = nullptr);
 
@@ -222,14 +1089,295 @@ public:
 
     void clear(GLclampf r, GLclampf g, GLclampf b, GLclampf a);
 
-    void addGameObject(const std::string &name, GameObject *obj);
+    ObjectHandle addGameObject(const std::string &name, const GameObject &obj, uint32_t flags = OBJECT_VISIBLE);
+
+    void removeGameObject(ObjectHandle handle);
+
+    void setFeatures(ObjectHandle handle, uint32_t features);
 
     void drawObject(const std::string &obj);
 
+    void submit(ObjectHandle handle);
+
+    void submitAll();
+
+    // Closest object whose bounds the ray hits, or an invalid handle.
+    ObjectHandle pick(const glm::vec3 &origin, const glm::vec3 &direction, float maxDistance = 1000.0f) const;
+
+    // Every object whose bounds overlap the box.
+    std::vector<ObjectHandle> queryRange(const glm::vec3 &min, const glm::vec3 &max) const;
+
+    void uploadCamera();
+
+    void drawQueue();
+
     void drawImGui();
 
     void flip();
 
+private:
+    BoundsSoA bounds; // World space, same order as `objects`
+    std::vector<uint8_t> visibility;
+    CullStats frameCull; // This frame so far
+
+    std::vector<AABB> frameBounds; // World space by dense index, only filled in for dynamic objects
+    std::vector<uint32_t> treeResults;
+    std::vector<uint32_t> dynamicResults;
+    std::vector<uint32_t> candidates; // Dense indices that survived frustum culling
+    std::vector<uint8_t> hidden;      // By candidate, behind an occluder
+    std::mutex statsLock;             // Jobs merging their stats into frameCull/frameLod
+
+    std::vector<uint8_t> lodLevels; // By slot, what each object was drawn with last
+    glm::vec3 lodEye = glm::vec3(0.0f);
+    float lodPixels = 0; // Pixels per unit of error at a distance of 1
+    bool lodPrepared = false; // lodEye and lodPixels are up to date for this frame
+    LODStats frameLod;
+
+    void setBounds(BoundsSoA &soa, size_t slot, uint32_t index) const;
+
+    AABB worldBounds(uint32_t index) const;
+
+    // On the job threads if `parallel`, otherwise right away on this one.
+    void runJob(std::function<void()> job, JobCounter &counter);
+
+    void forEach(size_t count, size_t grain, const std::function<void(size_t, size_t)> &body);
+
+    void updateTrees();
+
+    void cullOccluded();
+
+    void prepareLOD();
+
+    // Thread safe, as long as no two threads pick for the same object.
+    const Model *selectLOD(uint32_t index);
+
+    // Picks the level of detail and makes the command that sorts the object into the queue.
+    DrawCommand makeCommand(uint32_t index, LODStats &lod);
+
+    void enqueue(uint32_t index);
+
+    // Every candidate, recording the commands on the job threads.
+    void enqueueCandidates();
+};
+
+// Held-down inputs the simulation reads every tick.
+enum SimInput : uint32_t {
+    SIM_FORWARD = 1u << 0u,
+    SIM_BACK = 1u << 1u,
+    SIM_RIGHT = 1u << 2u,
+    SIM_LEFT = 1u << 3u,
+    SIM_UP = 1u << 4u,
+    SIM_DOWN = 1u << 5u,
+    SIM_LOOK_UP = 1u << 6u,
+    SIM_LOOK_DOWN = 1u << 7u,
+    SIM_LOOK_RIGHT = 1u << 8u,
+    SIM_LOOK_LEFT = 1u << 9u
+};
+
+// A GameObject the simulation moves. Its transform is translate(position) * rotate(angle, axis) * scale(scale).
+struct SimBody {
+public:
+    ObjectHandle handle;
+    glm::vec3 position = glm::vec3(0.0f);
+    glm::vec3 scale = glm::vec3(1.0f);
+    glm::vec3 axis = glm::vec3(0, 1, 0);
+    float angle = 0;
+    float spin = 0; // Radians per second around axis
+};
+
+struct SimStats {
+public:
+    uint64_t ticks = 0;   // Since start()
+    unsigned skipped = 0; // Ticks given up on after falling too far behind
+    double stepMs = 0;    // Of the latest tick
+    float alpha = 0;      // How far between the last two ticks the last apply() was
+};
+
+/*
+ * Fixed timestep simulation on its own thread. Every tick it reads `input`, moves the camera and spins the
+ * bodies, then publishes the state before and after the tick through a triple buffer: the simulation fills the
+ * back slot and swaps it with the latest one, and apply() swaps the latest one with its front slot, both with a
+ * single atomic exchange. Neither thread ever waits for the other.
+ *
+ * apply() draws one tick behind real time, blending the two states by how far the current time is past the newest
+ * tick, so motion stays smooth whatever the frame rate.
+ */
+class Simulation {
+public:
+    double tickRate = 60; // Ticks per second, set before start()
+    float speed = 3;
+    float sensitivity = 3;
+    std::atomic<uint32_t> input{0}; // SimInputs, written by the GL thread (GLFW can only be polled there)
+    SimStats stats;                 // As of the last apply()
+
+    // Starts ticking from the camera's position and angles. The bodies can't change after this.
+    void start(const Camera &camera, const std::vector<SimBody> &bodies);
+
+    // Interpolated camera position and angles, and the bodies' transforms.
+    void apply(Camera &camera, GameObjectRegistry &objects);
+
+    void stop();
+
+private:
+    struct State {
+    public:
+        glm::vec3 position;
+        glm::vec2 look;
+        std::vector<SimBody> bodies;
+    };
+
+    struct Snapshot {
+    public:
+        State previous;
+        State current;
+        double time; // Of current, in seconds since start()
+        uint64_t tick;
+        unsigned skipped;
+        double stepMs;
+    };
+
+    static const uint32_t FRESH = 4; // Set on `latest` when it holds a snapshot apply() hasn't seen
+
+    Snapshot slots[3];
+    std::atomic<uint32_t> latest{0};
+    uint32_t back = 1;  // Only touched by the simulation
+    uint32_t front = 2; // Only touched by apply()
+
+    std::thread thread;
+    std::atomic<bool> stopping{false};
+    std::chrono::steady_clock::time_point startTime;
+
+    // The simulation thread's own copy. Camera's math is reused, its window isn't.
+    Camera camera = Camera(glm::vec3(0.0f), glm::vec2(0.0f), nullptr);
+    std::vector<SimBody> bodies;
+
+    void run();
+
+    void step(float dt);
+
+    void publish(const State &previous, double time, uint64_t tick, unsigned skipped, double stepMs);
+};
+
+struct VoxelStats {
+public:
+    unsigned chunks = 0; // With a mesh
+    unsigned remeshed = 0;
+    unsigned stale = 0; // Meshes thrown away because the chunk changed again while it was being meshed
+    size_t bytes = 0;   // Vertex and index data of every chunk
+};
+
+/*
+ * Draws a VoxelWorld as one GameObject per chunk, each with a VertexBuffer and IndexBuffer of its own.
+ * Dirty chunks are meshed on the ChunkMesher's workers; a chunk keeps drawing its old mesh until the new one
+ * has been uploaded.
+ */
+class VoxelRenderer {
+public:
+    VoxelWorld world;
+    ChunkMesher mesher;
+    GameObject material = {nullptr, nullptr, nullptr}; // Shader, texture, layer and features of every chunk
+    glm::vec3 origin = glm::vec3(0.0f); // Where block (0, 0, 0) is
+    uint32_t flags = OBJECT_VISIBLE | OBJECT_STATIC;
+    VoxelStats stats;
+
+    void init(unsigned threads = 0);
+
+    // Sends the dirty chunks to the mesher and swaps in the meshes that are done. Once per frame, before submitAll().
+    void update(Renderer &rend);
+
+    // Blocks until every chunk that was sent off is meshed and uploaded, e.g. right after generating a world.
+    void finish(Renderer &rend);
+
+    // Removes the chunk objects and destroys their buffers. Has to happen before Renderer::quit().
+    void shutdown(Renderer &rend);
+
+private:
+    struct ChunkObject {
+    public:
+        ObjectHandle handle;
+        Model *model;
+        size_t bytes;
+    };
+
+    std::unordered_map<ChunkCoord, ChunkObject, ChunkCoordHash> meshed;
+    std::vector<ChunkMeshResult> results;
+    VBLayout layout;
+
+    void upload(Renderer &rend, const ChunkMeshResult &result);
+
+    void release(Renderer &rend, const ChunkCoord &coord);
+};
+
+enum AtlasMode {
+    ATLAS_2D,   // One padded GL_TEXTURE_2D. The models' texture coordinates have to be remapped with remapUVs().
+    ATLAS_ARRAY // One GL_TEXTURE_2D_ARRAY layer per image, picked per instance. Needs EXT_texture_array.
+};
+
+// Where an image ended up. Texture coordinates map to uvOffset + uv * uvScale.
+struct AtlasRegion {
+public:
+    int layer;
+    glm::vec2 uvOffset;
+    glm::vec2 uvScale;
+};
+
+// One input of TextureAtlas::build(), as it came out of the image or the cooked file.
+struct AtlasImage {
+public:
+    int width = 0, height = 0;
+    uint32_t format = COOKED_RGBA8;
+    std::vector<std::vector<unsigned char>> levels; // Empty if it failed to load
+};
+
+/*
+ * Packs many small textures into one, so that objects with different textures can share a draw call.
+ * build() decodes the images (or maps their cooked versions, like TextureLoader) on the job threads and uploads
+ * the result on the calling thread, after which apply() points every object that used one of the source textures
+ * at the atlas instead.
+ */
+class TextureAtlas {
+public:
+    AtlasMode mode;
+    Texture *texture = nullptr; // Created by build()
+    int padding = 2; // Only for ATLAS_2D
+    int maxSize = 2048;
+    bool preferCooked = true; // Like TextureLoader::preferCooked
+
+    std::vector<std::string> paths;
+    std::vector<Texture *> sources; // The textures the images would have been loaded into, may be null
+    std::vector<AtlasRegion> regions;
+
+    // Full mip chain of the texture with all layers of a level back to back, e.g. for a TextureStreamer.
+    // A BCn format if every layer was cooked with the same format and size (ATLAS_ARRAY only), RGBA8 otherwise.
+    std::vector<std::vector<unsigned char>> levels;
+    uint32_t format = COOKED_RGBA8;
+    int pageCount = 0; // Layers of the array texture, 1 for ATLAS_2D
+
+    // Statistics from build() and apply()
+    float efficiency = 0; // Image texels / allocated texels
+    unsigned drawCallsSaved = 0;
+
+    explicit TextureAtlas(AtlasMode atlasMode);
+
+    int add(const std::string &path, Texture *source = nullptr);
+
+    // Decodes on `jobs` if it's set, on the calling (GL) thread otherwise.
+    bool build(JobSystem *jobs = nullptr);
+
+    // Only needed for ATLAS_2D. stride and uvOffset are in floats, like the vertex arrays in main.cpp.
+    void remapUVs(float *vertices, size_t vertexCount, size_t stride, size_t uvOffset, int entry) const;
+
+    /*
+     * ATLAS_ARRAY only. arrayFeature is the shader feature that samples an array texture. An ATLAS_2D atlas
+     * needs different texture coordinates, so its models have to be built from vertices that went through
+     * remapUVs() and the objects pointed at `texture` by whoever built them.
+     */
+    void apply(Renderer &rend, uint32_t arrayFeature = 0);
+
+    void destroy();
+
+private:
+    void decode(const std::string &imagePath, AtlasImage &image) const;
 };
 
 void flushGLErrors();
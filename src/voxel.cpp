@@ -0,0 +1,385 @@
+//
+// Created by Grant on 2019-09-02.
+//
+
+#include "voxel.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+bool ChunkCoord::operator==(const ChunkCoord &other) const {
+    return x == other.x && y == other.y && z == other.z;
+}
+
+size_t ChunkCoordHash::operator()(const ChunkCoord &coord) const {
+    // Large primes, good enough to spread neighbouring chunks over the buckets.
+    return size_t(coord.x) * 73856093u ^ size_t(coord.y) * 19349663u ^ size_t(coord.z) * 83492791u;
+}
+
+static int chunkIndex(int x, int y, int z) {
+    return x + z * CHUNK_SIZE + y * CHUNK_SIZE * CHUNK_SIZE;
+}
+
+static int paddedIndex(int x, int y, int z) {
+    return (x + 1) + (z + 1) * PADDED_CHUNK_SIZE + (y + 1) * PADDED_CHUNK_SIZE * PADDED_CHUNK_SIZE;
+}
+
+static ChunkCoord offsetCoord(const ChunkCoord &coord, int axis, int by) {
+    int c[3] = {coord.x, coord.y, coord.z};
+    c[axis] += by;
+    return {c[0], c[1], c[2]};
+}
+
+// Rounds towards negative infinity, so block -1 is in chunk -1.
+static int floorDiv(int a, int b) {
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+Block Chunk::get(int x, int y, int z) const {
+    return blocks[chunkIndex(x, y, z)];
+}
+
+void Chunk::set(int x, int y, int z, Block block) {
+    Block &old = blocks[chunkIndex(x, y, z)];
+    if (old == block) {
+        return;
+    }
+
+    solid += (block != BLOCK_AIR) - (old != BLOCK_AIR);
+    old = block;
+    version++;
+}
+
+/*
+ * One axis at a time: every plane between two layers of blocks gets a mask of the faces in it (the block type,
+ * negated for faces pointing down the axis), which is then covered with rectangles greedily. Each rectangle grows
+ * along u as far as the face type stays the same, then along v for as long as the whole row matches.
+ */
+void meshChunk(const Block *padded, ChunkMeshData &out) {
+    out = {};
+    const int N = CHUNK_SIZE;
+    const int strides[3] = {1, PADDED_CHUNK_SIZE * PADDED_CHUNK_SIZE, PADDED_CHUNK_SIZE}; // x, y, z
+    int mask[CHUNK_SIZE * CHUNK_SIZE];
+
+    for (int d = 0; d < 3; d++) {
+        int u = (d + 1) % 3, v = (d + 2) % 3; // u x v points along +d
+
+        for (int i = 0; i <= N; i++) {
+            // The plane between layer i - 1 and layer i. Faces on the chunk border only belong to us if the
+            // block is ours; the neighbour meshes the rest.
+            for (int j = 0; j < N; j++) {
+                int pos[3];
+                pos[d] = i;
+                pos[u] = 0;
+                pos[v] = j;
+                const Block *row = padded + paddedIndex(pos[0], pos[1], pos[2]);
+
+                for (int k = 0; k < N; k++) {
+                    Block behind = row[k * strides[u] - strides[d]];
+                    Block front = row[k * strides[u]];
+
+                    int face = 0;
+                    if (behind != BLOCK_AIR && front == BLOCK_AIR && i > 0) {
+                        face = behind;
+                    } else if (front != BLOCK_AIR && behind == BLOCK_AIR && i < N) {
+                        face = -int(front);
+                    }
+                    mask[k + j * N] = face;
+                    out.faces += face != 0;
+                }
+            }
+
+            for (int j = 0; j < N; j++) {
+                for (int k = 0; k < N;) {
+                    int face = mask[k + j * N];
+                    if (face == 0) {
+                        k++;
+                        continue;
+                    }
+
+                    int w = 1;
+                    while (k + w < N && mask[k + w + j * N] == face) {
+                        w++;
+                    }
+
+                    int h = 1;
+                    for (; j + h < N; h++) {
+                        bool rowMatches = true;
+                        for (int x = 0; x < w && rowMatches; x++) {
+                            rowMatches = mask[k + x + (j + h) * N] == face;
+                        }
+                        if (!rowMatches) {
+                            break;
+                        }
+                    }
+
+                    for (int y = 0; y < h; y++) {
+                        std::fill(mask + k + (j + y) * N, mask + k + w + (j + y) * N, 0);
+                    }
+
+                    // Corners counter-clockwise seen from +d
+                    auto base = uint32_t(out.vertices.size());
+                    for (int corner = 0; corner < 4; corner++) {
+                        int du = corner == 1 || corner == 2 ? w : 0;
+                        int dv = corner >= 2 ? h : 0;
+                        int p[3];
+                        p[d] = i;
+                        p[u] = k + du;
+                        p[v] = j + dv;
+
+                        // Keep textures upright on the x faces, where u is the vertical axis.
+                        int tu = d == 0 ? dv : du;
+                        int tv = d == 0 ? du : dv;
+                        out.vertices.push_back({uint8_t(p[0]), uint8_t(p[1]), uint8_t(p[2]), 0, uint8_t(tu),
+                                                uint8_t(tv), 0, 0});
+                    }
+
+                    // Clockwise from outside: reversed for +d faces, as is for -d ones.
+                    static const uint32_t positive[6] = {0, 3, 2, 0, 2, 1};
+                    static const uint32_t negative[6] = {0, 1, 2, 0, 2, 3};
+                    for (uint32_t index : face > 0 ? positive : negative) {
+                        out.indices.push_back(base + index);
+                    }
+
+                    out.quads++;
+                    k += w;
+                }
+            }
+        }
+    }
+
+    if (out.vertices.empty()) {
+        return;
+    }
+
+    uint8_t lo[3] = {255, 255, 255}, hi[3] = {0, 0, 0};
+    for (const ChunkVertex &vertex : out.vertices) {
+        const uint8_t p[3] = {vertex.x, vertex.y, vertex.z};
+        for (int j = 0; j < 3; j++) {
+            lo[j] = std::min(lo[j], p[j]);
+            hi[j] = std::max(hi[j], p[j]);
+        }
+    }
+    for (int j = 0; j < 3; j++) {
+        out.boundsMin[j] = lo[j];
+        out.boundsMax[j] = hi[j];
+    }
+}
+
+Block VoxelWorld::get(int x, int y, int z) const {
+    const Chunk *chunk = find({floorDiv(x, CHUNK_SIZE), floorDiv(y, CHUNK_SIZE), floorDiv(z, CHUNK_SIZE)});
+    if (!chunk) {
+        return BLOCK_AIR;
+    }
+    return chunk->get(x - floorDiv(x, CHUNK_SIZE) * CHUNK_SIZE, y - floorDiv(y, CHUNK_SIZE) * CHUNK_SIZE,
+                      z - floorDiv(z, CHUNK_SIZE) * CHUNK_SIZE);
+}
+
+void VoxelWorld::set(int x, int y, int z, Block block) {
+    ChunkCoord coord = {floorDiv(x, CHUNK_SIZE), floorDiv(y, CHUNK_SIZE), floorDiv(z, CHUNK_SIZE)};
+    auto it = chunks.find(coord);
+    if (it == chunks.end()) {
+        if (block == BLOCK_AIR) {
+            return;
+        }
+        it = chunks.emplace(coord, Chunk()).first;
+    }
+
+    int local[3] = {x - coord.x * CHUNK_SIZE, y - coord.y * CHUNK_SIZE, z - coord.z * CHUNK_SIZE};
+    uint32_t version = it->second.version;
+    it->second.set(local[0], local[1], local[2], block);
+    if (it->second.version == version) {
+        return; // Nothing changed
+    }
+    dirty.insert(coord);
+
+    // A block on the border can hide or reveal a face of the neighbour.
+    for (int axis = 0; axis < 3; axis++) {
+        for (int side : {0, CHUNK_SIZE - 1}) {
+            if (local[axis] != side) {
+                continue;
+            }
+
+            ChunkCoord neighbour = offsetCoord(coord, axis, side == 0 ? -1 : 1);
+            if (chunks.count(neighbour)) {
+                dirty.insert(neighbour);
+            }
+        }
+    }
+}
+
+const Chunk *VoxelWorld::find(const ChunkCoord &coord) const {
+    auto it = chunks.find(coord);
+    return it == chunks.end() ? nullptr : &it->second;
+}
+
+void VoxelWorld::copyPadded(const ChunkCoord &coord, Block *out) const {
+    std::memset(out, BLOCK_AIR, PADDED_CHUNK_VOLUME);
+
+    const Chunk *chunk = find(coord);
+    if (chunk) {
+        for (int y = 0; y < CHUNK_SIZE; y++) {
+            for (int z = 0; z < CHUNK_SIZE; z++) {
+                std::memcpy(out + paddedIndex(0, y, z), &chunk->blocks[chunkIndex(0, y, z)], CHUNK_SIZE);
+            }
+        }
+    }
+
+    // Only the six face neighbours matter, edges and corners never hide a face.
+    for (int axis = 0; axis < 3; axis++) {
+        for (int side : {-1, 1}) {
+            const Chunk *neighbour = find(offsetCoord(coord, axis, side));
+            if (!neighbour) {
+                continue;
+            }
+
+            int from = side < 0 ? CHUNK_SIZE - 1 : 0; // Their layer that touches us
+            int to = side < 0 ? -1 : CHUNK_SIZE;
+            for (int a = 0; a < CHUNK_SIZE; a++) {
+                for (int b = 0; b < CHUNK_SIZE; b++) {
+                    int src[3], dst[3];
+                    src[axis] = from;
+                    dst[axis] = to;
+                    src[(axis + 1) % 3] = dst[(axis + 1) % 3] = a;
+                    src[(axis + 2) % 3] = dst[(axis + 2) % 3] = b;
+                    out[paddedIndex(dst[0], dst[1], dst[2])] = neighbour->get(src[0], src[1], src[2]);
+                }
+            }
+        }
+    }
+}
+
+static float hashNoise(int x, int z, uint32_t seed) {
+    uint32_t h = uint32_t(x) * 374761393u + uint32_t(z) * 668265263u + seed * 2246822519u;
+    h = (h ^ (h >> 13)) * 1274126177u;
+    return float((h ^ (h >> 16)) & 0xFFFFu) / 65535.0f;
+}
+
+// Smoothly interpolated lattice noise in [0, 1]
+static float valueNoise(float x, float z, uint32_t seed) {
+    int x0 = int(std::floor(x)), z0 = int(std::floor(z));
+    float fx = x - x0, fz = z - z0;
+    fx = fx * fx * (3 - 2 * fx);
+    fz = fz * fz * (3 - 2 * fz);
+
+    float a = hashNoise(x0, z0, seed), b = hashNoise(x0 + 1, z0, seed);
+    float c = hashNoise(x0, z0 + 1, seed), d = hashNoise(x0 + 1, z0 + 1, seed);
+    float top = a + (b - a) * fx;
+    float bottom = c + (d - c) * fx;
+    return top + (bottom - top) * fz;
+}
+
+void VoxelWorld::generateTerrain(int sizeX, int sizeY, int sizeZ, uint32_t seed) {
+    int height = sizeY * CHUNK_SIZE;
+    for (int cx = 0; cx < sizeX; cx++) {
+        for (int cz = 0; cz < sizeZ; cz++) {
+            for (int z = 0; z < CHUNK_SIZE; z++) {
+                for (int x = 0; x < CHUNK_SIZE; x++) {
+                    float wx = float(cx * CHUNK_SIZE + x), wz = float(cz * CHUNK_SIZE + z);
+                    float noise = valueNoise(wx / 48, wz / 48, seed) * 0.75f +
+                                  valueNoise(wx / 12, wz / 12, seed + 1) * 0.25f;
+                    int top = std::max(1, int(noise * height * 0.75f));
+
+                    for (int y = 0; y < top; y++) {
+                        Block block = y == top - 1 ? 3 : y >= top - 4 ? 2 : 1; // Grass, dirt, stone
+                        chunks[{cx, y / CHUNK_SIZE, cz}].set(x, y % CHUNK_SIZE, z, block);
+                    }
+                }
+            }
+        }
+    }
+
+    // Chunks that stayed all air were never created
+    for (const auto &chunk : chunks) {
+        dirty.insert(chunk.first);
+    }
+}
+
+double MesherStats::throughput() const {
+    return ms > 0 ? chunks / (ms / 1000.0) : 0;
+}
+
+void ChunkMesher::init(unsigned threads) {
+    if (threads == 0) {
+        threads = std::max(2u, std::thread::hardware_concurrency()) - 1; // Leave a core for the GL thread
+    }
+
+    stopping = false;
+    for (unsigned i = 0; i < threads; i++) {
+        workers.emplace_back(&ChunkMesher::work, this);
+    }
+}
+
+void ChunkMesher::submit(const VoxelWorld &world, const ChunkCoord &coord) {
+    const Chunk *chunk = world.find(coord);
+    Job job = {coord, chunk ? chunk->version : 0, std::vector<Block>(PADDED_CHUNK_VOLUME)};
+    world.copyPadded(coord, job.padded.data());
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        jobs.push_back(std::move(job));
+        inFlight++;
+    }
+    wake.notify_one();
+}
+
+void ChunkMesher::collect(std::vector<ChunkMeshResult> &out) {
+    std::lock_guard<std::mutex> guard(lock);
+    for (ChunkMeshResult &result : done) {
+        stats.chunks++;
+        stats.faces += result.mesh.faces;
+        stats.quads += result.mesh.quads;
+        stats.ms += result.ms;
+        out.push_back(std::move(result));
+    }
+    inFlight -= unsigned(done.size());
+    done.clear();
+}
+
+unsigned ChunkMesher::pending() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return inFlight;
+}
+
+void ChunkMesher::work() {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [this]() { return stopping || !jobs.empty(); });
+            if (stopping) {
+                return;
+            }
+
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        ChunkMeshResult result = {job.coord, job.version, {}, 0};
+        meshChunk(job.padded.data(), result.mesh);
+        result.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        std::lock_guard<std::mutex> guard(lock);
+        done.push_back(std::move(result));
+    }
+}
+
+void ChunkMesher::shutdown() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+
+    jobs.clear();
+    done.clear();
+    inFlight = 0;
+}
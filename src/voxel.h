@@ -0,0 +1,156 @@
+//
+// Created by Grant on 2019-09-02.
+//
+#pragma once
+
+#ifndef GRANT_VOXEL_H_DEFINED
+#define GRANT_VOXEL_H_DEFINED
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+typedef uint8_t Block;
+
+const Block BLOCK_AIR = 0;
+
+const int CHUNK_SIZE = 32; // Blocks along each side. Vertex positions are bytes, so at most 255.
+const int CHUNK_VOLUME = CHUNK_SIZE * CHUNK_SIZE * CHUNK_SIZE;
+const int PADDED_CHUNK_SIZE = CHUNK_SIZE + 2; // With a border of the neighbouring chunks' blocks
+const int PADDED_CHUNK_VOLUME = PADDED_CHUNK_SIZE * PADDED_CHUNK_SIZE * PADDED_CHUNK_SIZE;
+
+struct ChunkCoord {
+public:
+    int x, y, z;
+
+    bool operator==(const ChunkCoord &other) const;
+};
+
+struct ChunkCoordHash {
+public:
+    size_t operator()(const ChunkCoord &coord) const;
+};
+
+// Blocks are stored x fastest, then z, then y (so a horizontal layer is contiguous).
+struct Chunk {
+public:
+    std::vector<Block> blocks = std::vector<Block>(CHUNK_VOLUME, BLOCK_AIR);
+    uint32_t version = 0; // Bumped on every change, so stale meshes can be told apart
+    unsigned solid = 0;   // Non-air blocks
+
+    Block get(int x, int y, int z) const;
+
+    void set(int x, int y, int z, Block block);
+};
+
+// Matches the VBLayout {3 x GL_UNSIGNED_BYTE, 2 x GL_UNSIGNED_BYTE}, each attribute padded to 4 bytes.
+struct ChunkVertex {
+public:
+    uint8_t x, y, z, pad0;
+    uint8_t u, v, pad1, pad2; // In blocks, so textures repeat across merged quads
+};
+
+struct ChunkMeshData {
+public:
+    std::vector<ChunkVertex> vertices; // Chunk space, 0 to CHUNK_SIZE
+    std::vector<uint32_t> indices;
+    unsigned faces = 0; // Visible block faces before merging
+    unsigned quads = 0; // ...and after
+    float boundsMin[3] = {0, 0, 0};
+    float boundsMax[3] = {0, 0, 0};
+};
+
+/*
+ * Greedy meshing over a padded chunk (see VoxelWorld::copyPadded). Faces between two solid blocks are
+ * skipped, including against the neighbouring chunks, and coplanar faces of the same block type are merged
+ * into as few rectangles as possible. Faces are wound clockwise seen from outside, like the meshes in res/meshes.
+ */
+void meshChunk(const Block *padded, ChunkMeshData &out);
+
+/*
+ * Sparse, unbounded grid of chunks. set() marks the chunk (and the neighbours that share the changed face)
+ * dirty, so only those are remeshed.
+ */
+class VoxelWorld {
+public:
+    std::unordered_map<ChunkCoord, Chunk, ChunkCoordHash> chunks;
+    std::unordered_set<ChunkCoord, ChunkCoordHash> dirty;
+
+    Block get(int x, int y, int z) const;
+
+    void set(int x, int y, int z, Block block);
+
+    const Chunk *find(const ChunkCoord &coord) const;
+
+    // The chunk's blocks with a one block border from its neighbours (air where there are none).
+    void copyPadded(const ChunkCoord &coord, Block *out) const;
+
+    // Rolling hills of a few block types over chunks [0, size) on each axis.
+    void generateTerrain(int sizeX, int sizeY, int sizeZ, uint32_t seed);
+};
+
+struct ChunkMeshResult {
+public:
+    ChunkCoord coord;
+    uint32_t version;
+    ChunkMeshData mesh;
+    double ms; // Spent meshing it
+};
+
+struct MesherStats {
+public:
+    unsigned chunks = 0;
+    unsigned faces = 0;
+    unsigned quads = 0;
+    double ms = 0; // Summed over the workers
+
+    // Chunks per second of worker time
+    double throughput() const;
+};
+
+/*
+ * Meshes chunks on worker threads. submit() snapshots the blocks (with their border), so the world can keep
+ * changing while the workers are busy; results come back through collect() on the calling thread.
+ */
+class ChunkMesher {
+public:
+    std::vector<std::thread> workers;
+    MesherStats stats; // Of everything collected so far
+
+    void init(unsigned threads = 0);
+
+    void submit(const VoxelWorld &world, const ChunkCoord &coord);
+
+    // Appends the finished meshes. Never blocks.
+    void collect(std::vector<ChunkMeshResult> &out);
+
+    // Submitted but not collected yet
+    unsigned pending() const;
+
+    void shutdown();
+
+private:
+    struct Job {
+    public:
+        ChunkCoord coord;
+        uint32_t version;
+        std::vector<Block> padded;
+    };
+
+    std::deque<Job> jobs;
+    std::deque<ChunkMeshResult> done;
+    mutable std::mutex lock;
+    std::condition_variable wake;
+    bool stopping = false;
+    unsigned inFlight = 0;
+
+    void work();
+};
+
+#endif
@@ -0,0 +1,97 @@
+//
+// Created by Grant on 2019-09-02.
+//
+// Chunk meshing benchmark. Usage: VoxelBenchmark [chunks per side] [max threads]
+// Meshes a generated terrain on one thread, then through the ChunkMesher with more and more workers,
+// and finally remeshes after single block edits.
+//
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "voxel.cpp"
+
+static double msSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv) {
+    int side = argc > 1 ? std::stoi(argv[1]) : 8;
+    unsigned maxThreads = argc > 2 ? unsigned(std::stoul(argv[2])) : std::max(1u, std::thread::hardware_concurrency());
+
+    VoxelWorld world;
+    auto start = std::chrono::steady_clock::now();
+    world.generateTerrain(side, 2, side, 1337);
+    std::cout << "Generated " << world.chunks.size() << " chunks in " << msSince(start) << "ms" << std::endl;
+
+    std::vector<ChunkCoord> coords(world.dirty.begin(), world.dirty.end());
+    world.dirty.clear();
+
+    // Single threaded, without the copies and queues
+    std::vector<Block> padded(PADDED_CHUNK_VOLUME);
+    ChunkMeshData mesh;
+    size_t faces = 0, quads = 0, bytes = 0;
+    start = std::chrono::steady_clock::now();
+    for (const ChunkCoord &coord : coords) {
+        world.copyPadded(coord, padded.data());
+        meshChunk(padded.data(), mesh);
+        faces += mesh.faces;
+        quads += mesh.quads;
+        bytes += mesh.vertices.size() * sizeof(ChunkVertex) + mesh.indices.size() * sizeof(uint32_t);
+    }
+    double ms = msSince(start);
+    std::cout << "1 thread (direct): " << ms / coords.size() << "ms per chunk, " << coords.size() / (ms / 1000.0)
+              << " chunks/s" << std::endl;
+    std::cout << "  " << faces << " visible faces -> " << quads << " quads ("
+              << 100.0 * quads / std::max<size_t>(1, faces) << "%), " << bytes / 1024 << "KB of vertices and indices"
+              << std::endl;
+
+    for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+        ChunkMesher mesher;
+        mesher.init(threads);
+
+        std::vector<ChunkMeshResult> results;
+        start = std::chrono::steady_clock::now();
+        for (const ChunkCoord &coord : coords) {
+            mesher.submit(world, coord);
+        }
+        while (mesher.pending() > 0) {
+            mesher.collect(results);
+            std::this_thread::yield();
+        }
+        ms = msSince(start);
+        mesher.shutdown();
+
+        std::cout << threads << " worker" << (threads == 1 ? "" : "s") << ": " << ms << "ms wall, "
+                  << coords.size() / (ms / 1000.0) << " chunks/s (" << mesher.stats.throughput()
+                  << " per worker)" << std::endl;
+    }
+
+    // Editing single blocks only remeshes what they touch.
+    ChunkMesher mesher;
+    mesher.init(maxThreads);
+    unsigned edits = 0, remeshed = 0;
+    std::vector<ChunkMeshResult> results;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 100; i++) {
+        int x = (i * 7919) % (side * CHUNK_SIZE), z = (i * 104729) % (side * CHUNK_SIZE);
+        world.set(x, CHUNK_SIZE - 1 + i % 3, z, world.get(x, CHUNK_SIZE - 1 + i % 3, z) == BLOCK_AIR ? 1 : BLOCK_AIR);
+        edits++;
+
+        for (const ChunkCoord &coord : world.dirty) {
+            mesher.submit(world, coord);
+            remeshed++;
+        }
+        world.dirty.clear();
+        while (mesher.pending() > 0) {
+            mesher.collect(results);
+            std::this_thread::yield();
+        }
+    }
+    ms = msSince(start);
+    mesher.shutdown();
+    std::cout << edits << " block edits: " << remeshed << " chunks remeshed, " << ms / edits << "ms per edit"
+              << std::endl;
+    return 0;
+}